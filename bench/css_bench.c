@@ -0,0 +1,447 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "css_alloc.h"
+#include "css_tokenizer.h"
+#include "css_parser.h"
+#include "css_selector.h"
+
+/* ================================================================
+ * css_bench: throughput benchmark
+ *
+ * Runs three phases over each workload:
+ *   tokenize   css_tokenizer_next() until EOF, tokens freed at once
+ *   parse      css_parse_stylesheet_with_options() with eager_selectors,
+ *              so selector parsing is included
+ *   selectors  css_parse_selector_list() over every qualified rule
+ *              prelude of an already parsed sheet (keep_preludes)
+ *
+ * Workloads are synthetic sheets generated in memory plus any files
+ * named on the command line.  Each phase runs -n times and the fastest
+ * run is reported.  Output is a single JSON document with a fixed key
+ * order, so runs can be diffed.
+ *
+ * Allocations are counted by running each phase with a counting
+ * allocator (css_alloc.h) current.
+ * ================================================================ */
+
+#define BENCH_FORMAT 1
+
+/* ================================================================
+ * Growable text buffer for the generators
+ * ================================================================ */
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t cap;
+} text;
+
+static void text_reserve(text *t, size_t extra)
+{
+    if (t->length + extra + 1 <= t->cap) return;
+    size_t cap = t->cap ? t->cap : 4096;
+    while (t->length + extra + 1 > cap) cap *= 2;
+    char *nd = realloc(t->data, cap);
+    if (!nd) {
+        fprintf(stderr, "css_bench: out of memory\n");
+        exit(1);
+    }
+    t->data = nd;
+    t->cap = cap;
+}
+
+static void text_printf(text *t, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    text_reserve(t, (size_t)n);
+    va_start(ap, fmt);
+    vsnprintf(t->data + t->length, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    t->length += (size_t)n;
+}
+
+static void text_putc(text *t, char c)
+{
+    text_reserve(t, 1);
+    t->data[t->length++] = c;
+    t->data[t->length] = '\0';
+}
+
+/* Deterministic xorshift so every run sees the same sheets */
+static uint32_t rng_state = 2463534242u;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+/* ================================================================
+ * Synthetic workloads
+ * ================================================================ */
+
+/* Utility-class flood: thousands of one-declaration rules with escaped
+ * class names, state variants and responsive wrappers */
+static void gen_utility_classes(text *t, size_t scale)
+{
+    static const char *const props[] = {
+        "padding", "margin", "width", "height", "gap", "top", "inset"
+    };
+    static const char *const colors[] = {
+        "red", "blue", "green", "slate", "amber", "violet"
+    };
+    for (size_t i = 0; i < 40000 * scale; i++) {
+        const char *prop = props[i % 7];
+        switch (i % 5) {
+        case 0:
+            text_printf(t, ".%c-%zu{%s:%.2frem}\n", prop[0], i % 96, prop,
+                        (double)(i % 96) * 0.25);
+            break;
+        case 1:
+            text_printf(t, ".hover\\:bg-%s-%zu:hover{background-color:"
+                        "rgb(%u %u %u / .%u)}\n", colors[i % 6],
+                        (i % 9 + 1) * 100, rng() % 256, rng() % 256,
+                        rng() % 256, rng() % 10);
+            break;
+        case 2:
+            text_printf(t, ".md\\:w-%zu\\/%zu{width:calc(%zu%% - "
+                        "var(--gap-%zu, 1rem))}\n", i % 11 + 1, i % 12 + 1,
+                        i % 100, i % 8);
+            break;
+        case 3:
+            text_printf(t, "@media (min-width: %zupx){.lg\\:%s-%zu{%s:%zupx "
+                        "!important}}\n", 640 + (i % 4) * 128, prop, i,
+                        prop, i % 64);
+            break;
+        default:
+            text_printf(t, ".group:hover>.group-hover\\:text-%s,"
+                        "[data-state=\"open\"] .u-%zu~li+li{color:#%06x;"
+                        "font:italic 600 %zupx/1.5 system-ui,sans-serif}\n",
+                        colors[i % 6], i, rng() & 0xffffff, 10 + i % 20);
+            break;
+        }
+    }
+}
+
+/* Deep nesting: at-rules, blocks and functions nested far down */
+static void gen_deep_nesting(text *t, size_t scale)
+{
+    for (size_t i = 0; i < 600 * scale; i++) {
+        size_t depth = 16 + i % 48;
+        for (size_t d = 0; d < depth; d++) {
+            text_printf(t, d % 2 ? "@supports (display:grid){"
+                                 : "@media (min-width:%zupx){", d * 10);
+        }
+        text_printf(t, ".n%zu{width:", i);
+        for (size_t d = 0; d < depth; d++) text_printf(t, "calc(1px + ");
+        text_printf(t, "1px");
+        for (size_t d = 0; d < depth; d++) text_putc(t, ')');
+        text_printf(t, ";grid:");
+        for (size_t d = 0; d < depth; d++) text_printf(t, "[a%zu (", d);
+        for (size_t d = 0; d < depth; d++) text_printf(t, ")]");
+        text_printf(t, "}");
+        for (size_t d = 0; d < depth; d++) text_putc(t, '}');
+        text_putc(t, '\n');
+    }
+}
+
+/* Numeric-heavy keyframe animations */
+static void gen_numeric_animations(text *t, size_t scale)
+{
+    for (size_t i = 0; i < 600 * scale; i++) {
+        text_printf(t, "@keyframes k%zu{", i);
+        for (size_t s = 0; s <= 100; s += 2) {
+            text_printf(t, "%zu%%{transform:translate3d(%.3fpx,%.2epx,0) "
+                        "rotate(%.1fdeg) scale(%.4f);opacity:%.3f;"
+                        "offset-distance:%u.%u%%}", s,
+                        (double)(rng() % 100000) / 997.0,
+                        -(double)(rng() % 1000) / 3.0,
+                        (double)(rng() % 3600) / 10.0,
+                        1.0 + (double)(rng() % 1000) / 10000.0,
+                        (double)(rng() % 1000) / 1000.0,
+                        rng() % 100, rng() % 1000);
+        }
+        text_printf(t, "}\n.a%zu{animation:k%zu %u.%ums cubic-bezier(.17,"
+                    ".67,.83,.67) %ums infinite}\n", i, i, rng() % 900,
+                    rng() % 10, rng() % 500);
+    }
+}
+
+/* Huge data URIs, both url( tokens and quoted url("...") strings */
+static void gen_data_uris(text *t, size_t scale)
+{
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (size_t i = 0; i < 96 * scale; i++) {
+        size_t len = 16384 + (rng() % 4) * 16384;
+        bool quoted = i % 2;
+        text_printf(t, ".icon-%zu{background:url(%sdata:image/png;base64,",
+                    i, quoted ? "\"" : "");
+        text_reserve(t, len);
+        for (size_t k = 0; k < len; k++) {
+            t->data[t->length++] = b64[rng() & 63];
+        }
+        t->data[t->length] = '\0';
+        text_printf(t, "==%s) no-repeat center/contain}\n",
+                    quoted ? "\"" : "");
+    }
+}
+
+/* ================================================================
+ * Phases
+ * ================================================================ */
+
+typedef struct {
+    double seconds;     /* fastest run */
+    size_t allocations; /* per run */
+    size_t alloc_bytes;
+    size_t tokens;
+    size_t rules;
+    size_t selectors;
+} phase_result;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void phase_tokenize(const text *input, phase_result *r)
+{
+    css_tokenizer *tk = css_tokenizer_create(input->data, input->length);
+    if (!tk) return;
+    for (;;) {
+        css_token *tok = css_tokenizer_next(tk);
+        if (!tok) break;
+        bool eof = tok->type == CSS_TOKEN_EOF;
+        css_token_free(tok);
+        r->tokens++;
+        if (eof) break;
+    }
+    css_tokenizer_free(tk);
+}
+
+static void phase_parse(const text *input, phase_result *r)
+{
+    css_parser_options options;
+    memset(&options, 0, sizeof(options));
+    options.eager_selectors = true;
+    css_stylesheet *sheet = css_parse_stylesheet_with_options(
+        input->data, input->length, &options);
+    if (!sheet) return;
+    r->rules = sheet->rule_count;
+    css_stylesheet_free(sheet);
+}
+
+/* Selector parsing runs against a sheet parsed outside the timing */
+static css_stylesheet *selector_sheet;
+
+static void phase_selectors(const text *input, phase_result *r)
+{
+    (void)input;
+    for (size_t i = 0; i < selector_sheet->rule_count; i++) {
+        css_rule *rule = selector_sheet->rules[i];
+        if (rule->type != CSS_NODE_QUALIFIED_RULE) continue;
+        css_qualified_rule *qr = rule->u.qualified_rule;
+        css_selector_list *list =
+            css_parse_selector_list(qr->prelude, qr->prelude_count);
+        if (list) r->selectors += list->count;
+        css_selector_list_free(list);
+    }
+}
+
+static phase_result run_phase(void (*fn)(const text *, phase_result *),
+                              const text *input, int iterations)
+{
+    phase_result best;
+    memset(&best, 0, sizeof(best));
+    for (int it = 0; it < iterations; it++) {
+        phase_result r;
+        memset(&r, 0, sizeof(r));
+        css_counting_allocator counter;
+        css_counting_allocator_init(&counter, NULL);
+        const css_allocator *prev = css_allocator_use(&counter.allocator);
+        double t0 = now_seconds();
+        fn(input, &r);
+        r.seconds = now_seconds() - t0;
+        css_allocator_use(prev);
+        r.allocations = counter.allocations;
+        r.alloc_bytes = counter.bytes;
+        if (it == 0 || r.seconds < best.seconds) best = r;
+    }
+    return best;
+}
+
+static double per_second(double amount, double seconds)
+{
+    return seconds > 0 ? amount / seconds : 0.0;
+}
+
+static void print_phase(const char *name, const phase_result *r,
+                        size_t bytes, bool last)
+{
+    printf("        \"%s\": {\"seconds\": %.6f, \"mb_per_s\": %.2f, "
+           "\"tokens_per_s\": %.0f, \"rules_per_s\": %.0f, "
+           "\"selectors_per_s\": %.0f, \"allocations\": %zu, "
+           "\"alloc_bytes\": %zu}%s\n", name, r->seconds,
+           per_second((double)bytes / 1e6, r->seconds),
+           per_second((double)r->tokens, r->seconds),
+           per_second((double)r->rules, r->seconds),
+           per_second((double)r->selectors, r->seconds),
+           r->allocations, r->alloc_bytes, last ? "" : ",");
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return -1;
+    return ru.ru_maxrss;
+}
+
+static void run_workload(const char *name, const text *input,
+                         int iterations, bool last)
+{
+    phase_result tok = run_phase(phase_tokenize, input, iterations);
+    phase_result parse = run_phase(phase_parse, input, iterations);
+
+    css_parser_options options;
+    memset(&options, 0, sizeof(options));
+    options.keep_preludes = true;
+    selector_sheet = css_parse_stylesheet_with_options(
+        input->data, input->length, &options);
+    phase_result sel;
+    memset(&sel, 0, sizeof(sel));
+    if (selector_sheet) {
+        sel = run_phase(phase_selectors, input, iterations);
+        css_stylesheet_free(selector_sheet);
+        selector_sheet = NULL;
+    }
+
+    /* Counts are properties of the input; report them on every phase */
+    parse.tokens = sel.tokens = tok.tokens;
+    tok.rules = sel.rules = parse.rules;
+
+    printf("    {\n");
+    printf("      \"name\": \"");
+    for (const char *p = name; *p; p++) {
+        if (*p == '"' || *p == '\\') putchar('\\');
+        putchar(*p);
+    }
+    printf("\",\n");
+    printf("      \"bytes\": %zu,\n", input->length);
+    printf("      \"tokens\": %zu,\n", tok.tokens);
+    printf("      \"rules\": %zu,\n", parse.rules);
+    printf("      \"selectors\": %zu,\n", sel.selectors);
+    printf("      \"phases\": {\n");
+    print_phase("tokenize", &tok, input->length, false);
+    print_phase("parse", &parse, input->length, false);
+    print_phase("selectors", &sel, input->length, true);
+    printf("      },\n");
+    printf("      \"peak_rss_kb\": %ld\n", peak_rss_kb());
+    printf("    }%s\n", last ? "" : ",");
+    fflush(stdout);
+}
+
+static bool read_file(const char *path, text *t)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        text_reserve(t, n);
+        memcpy(t->data + t->length, chunk, n);
+        t->length += n;
+        t->data[t->length] = '\0';
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 5;
+    size_t scale = 1;
+    const char **files = calloc((size_t)argc, sizeof(*files));
+    size_t file_count = 0;
+    if (!files) return 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            scale = strtoul(argv[++i], NULL, 10);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [-n iterations] [-s scale] "
+                            "[corpus.css...]\n", argv[0]);
+            free(files);
+            return 1;
+        } else {
+            files[file_count++] = argv[i];
+        }
+    }
+    if (iterations < 1) iterations = 1;
+    if (scale < 1) scale = 1;
+
+    static const struct {
+        const char *name;
+        void (*generate)(text *, size_t);
+    } synthetic[] = {
+        { "synthetic:utility-classes", gen_utility_classes },
+        { "synthetic:deep-nesting", gen_deep_nesting },
+        { "synthetic:numeric-animations", gen_numeric_animations },
+        { "synthetic:data-uris", gen_data_uris }
+    };
+    size_t nsynthetic = sizeof(synthetic) / sizeof(synthetic[0]);
+
+    printf("{\n");
+    printf("  \"format\": %d,\n", BENCH_FORMAT);
+    printf("  \"parser_version\": \"%s\",\n", CSS_PARSER_VERSION);
+    printf("  \"iterations\": %d,\n", iterations);
+    printf("  \"scale\": %zu,\n", scale);
+    printf("  \"workloads\": [\n");
+
+    for (size_t i = 0; i < nsynthetic; i++) {
+        text t = { NULL, 0, 0 };
+        text_reserve(&t, 0);
+        t.data[0] = '\0';
+        synthetic[i].generate(&t, scale);
+        run_workload(synthetic[i].name, &t, iterations,
+                     i + 1 == nsynthetic && file_count == 0);
+        free(t.data);
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        text t = { NULL, 0, 0 };
+        text_reserve(&t, 0);
+        t.data[0] = '\0';
+        if (!read_file(files[i], &t)) {
+            perror(files[i]);
+            status = 1;
+        }
+        run_workload(files[i], &t, iterations, i + 1 == file_count);
+        free(t.data);
+    }
+
+    printf("  ],\n");
+    printf("  \"peak_rss_kb\": %ld\n", peak_rss_kb());
+    printf("}\n");
+
+    free(files);
+    return status;
+}
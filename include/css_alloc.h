@@ -0,0 +1,77 @@
+#ifndef CSS_ALLOC_H
+#define CSS_ALLOC_H
+
+#include <stddef.h>
+
+/* ================================================================
+ * Pluggable allocator
+ *
+ * Everything the library allocates goes through the calling thread's
+ * current allocator (malloc/realloc/free unless changed): tokens, the
+ * parse tree and selectors, and also what is derived from them (rule
+ * and invalidation indexes, selector programs, flat sheets, caches,
+ * buffers).  Parses run with the allocator from their
+ * css_parser_options, so a tree lives entirely in one allocator.
+ * Batch and parallel workers run with their caller's current
+ * allocator, which must then be safe to share between threads.
+ *
+ * Root objects (stylesheet, declaration list, selector list, tokenizer,
+ * parser context, rule index, invalidation index, selector program,
+ * sibling and style sharing caches, buffer) remember the allocator they
+ * were created with and free themselves through it.  Parts detached
+ * from a tree, flat sheets, and caller-owned arrays such as
+ * css_rule_matches must be freed while their allocator is current.
+ * ================================================================ */
+
+typedef struct css_allocator {
+    void *(*malloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t size);  /* ptr may be NULL */
+    void  (*free)(void *ctx, void *ptr);                  /* ptr never NULL */
+    void *ctx;
+} css_allocator;
+
+/* The malloc/realloc/free allocator */
+const css_allocator *css_allocator_default(void);
+
+/* The calling thread's current allocator (never NULL) */
+const css_allocator *css_allocator_current(void);
+
+/* Make a current for the calling thread (NULL = default) and return the
+ * previously current allocator, to be restored afterwards */
+const css_allocator *css_allocator_use(const css_allocator *a);
+
+/* Allocation counters for css_alloc_count() */
+typedef struct {
+    size_t allocations;             /* malloc and realloc calls */
+    size_t bytes;                   /* bytes requested */
+} css_alloc_counts;
+
+/* Add allocations made on the calling thread to *counts (NULL = stop
+ * counting) and return the previous target, to be restored afterwards */
+css_alloc_counts *css_alloc_count(css_alloc_counts *counts);
+
+/* Allocation through the current allocator (library internal) */
+void *css_malloc(size_t size);
+void *css_calloc(size_t count, size_t size);
+void *css_realloc(void *ptr, size_t size);
+char *css_strdup(const char *s);
+void  css_free(void *ptr);
+
+/* ================================================================
+ * Counting allocator: forwards to parent and counts calls.  Counters
+ * are not atomic; use one per thread.
+ * ================================================================ */
+
+typedef struct {
+    css_allocator allocator;        /* pass &c.allocator */
+    const css_allocator *parent;
+    size_t allocations;             /* malloc and realloc calls */
+    size_t frees;
+    size_t bytes;                   /* bytes requested */
+} css_counting_allocator;
+
+/* parent NULL = default allocator */
+void css_counting_allocator_init(css_counting_allocator *c,
+                                 const css_allocator *parent);
+
+#endif /* CSS_ALLOC_H */
@@ -2,8 +2,10 @@
 #define CSS_AST_H
 
 #include "css_token.h"
+#include "css_alloc.h"
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <stdio.h>
 
 /* Node types */
@@ -29,6 +31,7 @@ typedef struct css_at_rule css_at_rule;
 typedef struct css_qualified_rule css_qualified_rule;
 typedef struct css_rule css_rule;
 typedef struct css_stylesheet css_stylesheet;
+typedef struct css_declaration_list css_declaration_list;
 
 /* Component value (§5.3): union of preserved token / simple block / function */
 struct css_component_value {
@@ -40,12 +43,15 @@ struct css_component_value {
     } u;
 };
 
-/* Simple block (§5.4.8): { }, [ ], ( ) with contents */
+/* Simple block (§5.4.8): { }, [ ], ( ) with contents.
+ * A block may be shared between rules (dedup_blocks parser option);
+ * shared blocks are immutable and freed when the last owner frees. */
 struct css_simple_block {
     css_token_type associated_token;  /* opening token: {, [, ( */
     css_component_value **values;
     size_t value_count;
     size_t value_cap;
+    atomic_size_t shares;             /* extra owners (0 = unshared) */
 };
 
 /* Function (§5.4.9): name( ... ) */
@@ -72,15 +78,34 @@ struct css_at_rule {
     size_t prelude_count;
     size_t prelude_cap;
     css_simple_block *block;  /* may be NULL for statement at-rules */
+
+    /* Rules of a rule-list block (@media, @supports, ...), parsed from
+     * the block on the first css_at_rule_rules() call (css_parser.h);
+     * read it through that accessor */
+    _Atomic(css_stylesheet *) rules_cache;
+    const css_allocator *allocator;    /* the tree's, for that parse */
 };
 
-/* Qualified rule (§5.4.3): prelude { block } */
+/* Qualified rule (§5.4.3): prelude { block }.  The parser keeps the
+ * prelude as component values only when asked (keep_preludes in
+ * css_parser.h); otherwise it keeps the prelude's source text, from
+ * its first token up to the '{', and where that token stood. */
 struct css_qualified_rule {
     css_component_value **prelude;
     size_t prelude_count;
     size_t prelude_cap;
+    char *prelude_text;         /* NUL-terminated, or NULL */
+    size_t prelude_length;
+    size_t prelude_line;
+    size_t prelude_column;
     css_simple_block *block;
-    struct css_selector_list *selectors;  /* parsed selector list (may be NULL) */
+
+    /* Selector list, parsed from the prelude on the first
+     * css_qualified_rule_selectors() call (css_selector.h) unless the
+     * parse already did; read it through that accessor */
+    _Atomic(struct css_selector_list *) selectors_cache;
+    atomic_bool selectors_invalid;     /* prelude is no selector list */
+    const css_allocator *allocator;    /* the tree's, for that parse */
 };
 
 /* Rule: union wrapper for at-rule or qualified rule */
@@ -97,6 +122,15 @@ struct css_stylesheet {
     css_rule **rules;
     size_t rule_count;
     size_t rule_cap;
+    const css_allocator *allocator;   /* allocator the tree lives in */
+};
+
+/* Declaration list (§5.4.5): result of parsing a style="" attribute */
+struct css_declaration_list {
+    css_declaration **declarations;
+    size_t declaration_count;
+    size_t declaration_cap;
+    const css_allocator *allocator;
 };
 
 /* === Creation functions === */
@@ -111,6 +145,10 @@ css_function *css_function_create(const char *name);
 css_component_value *css_component_value_create_token(css_token *token);
 css_component_value *css_component_value_create_block(css_simple_block *block);
 css_component_value *css_component_value_create_function(css_function *func);
+css_declaration_list *css_declaration_list_create(void);
+
+/* Take another reference to a block (for sharing); returns block */
+css_simple_block *css_simple_block_ref(css_simple_block *block);
 
 /* === Free functions === */
 void css_stylesheet_free(css_stylesheet *sheet);
@@ -121,6 +159,7 @@ void css_declaration_free(css_declaration *decl);
 void css_simple_block_free(css_simple_block *block);
 void css_function_free(css_function *func);
 void css_component_value_free(css_component_value *cv);
+void css_declaration_list_free(css_declaration_list *list);
 
 /* === Append helpers (dynamic arrays) === */
 void css_stylesheet_append_rule(css_stylesheet *sheet, css_rule *rule);
@@ -129,6 +168,31 @@ void css_qualified_rule_append_prelude(css_qualified_rule *qr, css_component_val
 void css_simple_block_append_value(css_simple_block *block, css_component_value *cv);
 void css_function_append_value(css_function *func, css_component_value *cv);
 void css_declaration_append_value(css_declaration *decl, css_component_value *cv);
+void css_declaration_list_append(css_declaration_list *list,
+                                 css_declaration *decl);
+
+/* === Memory accounting === */
+
+/* Bytes a stylesheet holds, by category.  Sizes are as requested from
+ * the allocator (its own overhead is not included).  A block shared
+ * between rules (dedup_blocks) is counted once. */
+typedef struct {
+    size_t tokens;           /* css_token structs */
+    size_t token_strings;    /* token value / unit strings */
+    size_t values;           /* css_component_value structs */
+    size_t value_arrays;     /* used part of value / prelude arrays */
+    size_t value_slack;      /* unused value_cap / prelude_cap capacity */
+    size_t blocks;           /* simple block and function structs, names */
+    size_t selectors;        /* selector lists parsed so far and
+                                everything under them */
+    size_t rules;            /* stylesheet, rule wrappers, at-rule and
+                                qualified-rule structs, rule array,
+                                prelude texts */
+    size_t total;
+} css_memory_usage;
+
+void css_stylesheet_memory_usage(const css_stylesheet *sheet,
+                                 css_memory_usage *usage);
 
 /* === Dump (debug output) === */
 void css_ast_dump(css_stylesheet *sheet, FILE *out);
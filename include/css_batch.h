@@ -0,0 +1,39 @@
+#ifndef CSS_BATCH_H
+#define CSS_BATCH_H
+
+#include "css_parser.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+/* ================================================================
+ * Multi-file batch parsing
+ *
+ * Files are handed out to a fixed pool of worker threads in order.
+ * Each worker owns one parser context (and with it one tokenizer) and
+ * one read buffer, both reused for every file it parses.  Sheets are
+ * built and freed again; only the per-file results are kept.  Workers
+ * allocate through the caller's current allocator (css_alloc.h) unless
+ * opts->parser.allocator names one; either must be thread-safe.
+ * ================================================================ */
+
+typedef struct {
+    size_t workers;             /* 0 = one per online CPU */
+    css_parser_options parser;
+} css_batch_options;
+
+typedef struct {
+    const char *path;
+    bool ok;
+    int error;                  /* errno value when !ok */
+    size_t bytes;
+    size_t rule_count;          /* top-level rules */
+    double seconds;             /* read + parse */
+} css_batch_result;
+
+/* Parse count files, filling results[i] for paths[i].  opts may be NULL.
+ * Returns true if every file was read and parsed. */
+bool css_batch_parse_files(const char *const *paths, size_t count,
+                           const css_batch_options *opts,
+                           css_batch_result *results);
+
+#endif /* CSS_BATCH_H */
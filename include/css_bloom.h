@@ -0,0 +1,54 @@
+#ifndef CSS_BLOOM_H
+#define CSS_BLOOM_H
+
+#include "css_match.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* ================================================================
+ * Ancestor Bloom filter
+ *
+ * A counting Bloom filter over the tag, id and class hashes of the
+ * ancestors of the element being matched.  During a depth-first walk,
+ * push an element before visiting its children and pop it afterwards.
+ *
+ * Each complex selector carries the hashes of its ancestor compounds
+ * (css_complex_selector.ancestor_hashes).  If any of them is missing
+ * from the filter, the selector cannot match and no ancestor walk is
+ * needed.  A "may match" answer still requires css_match_complex().
+ *
+ * Counters saturate at 255 and then stay put, so a saturated slot
+ * errs towards "may contain".
+ * ================================================================ */
+
+#define CSS_BLOOM_KEY_BITS 12
+#define CSS_BLOOM_SIZE     (1u << CSS_BLOOM_KEY_BITS)
+
+typedef struct {
+    uint8_t counters[CSS_BLOOM_SIZE];
+} css_bloom_filter;
+
+/* Hashes of selector / element keys (never 0) */
+uint32_t css_bloom_hash_tag(const char *name);      /* ASCII case-folded */
+uint32_t css_bloom_hash_id(const char *name);
+uint32_t css_bloom_hash_class(const char *name);
+
+void css_bloom_clear(css_bloom_filter *filter);
+void css_bloom_add(css_bloom_filter *filter, uint32_t hash);
+void css_bloom_remove(css_bloom_filter *filter, uint32_t hash);
+bool css_bloom_may_contain(const css_bloom_filter *filter, uint32_t hash);
+
+/* Add / remove el's tag, id and classes */
+void css_bloom_push_element(css_bloom_filter *filter,
+                            const css_element_adapter *adapter,
+                            const void *el);
+void css_bloom_pop_element(css_bloom_filter *filter,
+                           const css_element_adapter *adapter,
+                           const void *el);
+
+/* False if sel definitely does not match an element whose ancestors
+ * are in filter */
+bool css_bloom_may_match(const css_bloom_filter *filter,
+                         const css_complex_selector *sel);
+
+#endif /* CSS_BLOOM_H */
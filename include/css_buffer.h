@@ -0,0 +1,42 @@
+#ifndef CSS_BUFFER_H
+#define CSS_BUFFER_H
+
+#include "css_alloc.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+/* ================================================================
+ * Growable output buffer
+ *
+ * Collects output in memory.  When bound to a file descriptor the
+ * buffer is written out in large chunks (CSS_BUFFER_FLUSH_SIZE) instead
+ * of growing, so arbitrarily large output uses bounded memory.
+ *
+ * Errors are sticky: after a failed allocation or write, appends are
+ * ignored and css_buffer_flush() returns false.
+ * ================================================================ */
+
+#define CSS_BUFFER_FLUSH_SIZE (64 * 1024)
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t cap;
+    int fd;          /* -1 = memory only */
+    bool failed;
+    const css_allocator *allocator;     /* current at init, holds data */
+} css_buffer;
+
+void css_buffer_init(css_buffer *b);
+void css_buffer_init_fd(css_buffer *b, int fd);
+void css_buffer_free(css_buffer *b);
+
+void css_buffer_append(css_buffer *b, const char *data, size_t length);
+void css_buffer_puts(css_buffer *b, const char *s);
+void css_buffer_putc(css_buffer *b, char c);
+
+/* Write pending bytes to the descriptor (no-op for memory buffers).
+ * Returns false if any append or write has failed. */
+bool css_buffer_flush(css_buffer *b);
+
+#endif /* CSS_BUFFER_H */
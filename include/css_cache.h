@@ -0,0 +1,35 @@
+#ifndef CSS_CACHE_H
+#define CSS_CACHE_H
+
+#include "css_flat.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* ================================================================
+ * On-disk parse cache
+ *
+ * Entries are precompiled stylesheets (css_flat.h) stored as
+ * <dir>/<key as 16 hex digits>.cssb.  The key hashes the input bytes
+ * together with CSS_PARSER_VERSION and CSS_FLAT_VERSION, so upgrading
+ * the parser never serves stale results.
+ *
+ * Stores write a private temporary file in dir and rename() it into
+ * place, so concurrent processes sharing a directory only ever see
+ * complete entries.  A hit skips tokenization and parsing, which also
+ * means parse errors (CSSPARSER_PARSE_ERRORS) are not reported again.
+ * ================================================================ */
+
+/* Cache key for an input buffer */
+uint64_t css_cache_key(const char *input, size_t length);
+
+/* Map the entry for key from dir.  NULL on a miss or an invalid entry.
+ * Release with css_flat_unmap(). */
+const css_flat_sheet *css_cache_load(const char *dir, uint64_t key);
+
+/* Store flat under key in dir (created if missing).  Returns false if
+ * the entry could not be written; the cache is then left unchanged. */
+bool css_cache_store(const char *dir, uint64_t key,
+                     const css_flat_sheet *flat);
+
+#endif /* CSS_CACHE_H */
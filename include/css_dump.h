@@ -0,0 +1,80 @@
+#ifndef CSS_DUMP_H
+#define CSS_DUMP_H
+
+#include "css_ast.h"
+#include "css_buffer.h"
+#include <stdbool.h>
+
+/* ================================================================
+ * Buffered parse-tree dump
+ *
+ * TEXT    the indented css_parse_dump format
+ * JSON    one compact JSON document per call:
+ *           {"type":"stylesheet","rules":[...]}
+ *         rules:   {"type":"at-rule","name":..,"prelude":[..],"block":..}
+ *                  {"type":"qualified-rule","selectors":[..]|null,
+ *                   "prelude":[..],"block":..}
+ *         blocks:  {"type":"block","open":"{","declarations":[..]}
+ *                  when declarations are detected, else "values":[..]
+ *         values:  {"type":"<token type>", "value", "unit", "number",
+ *                   "integer", "id" as applicable} or
+ *                  {"type":"function","name":..,"values":[..]}
+ *         selectors: list of complex selectors, each
+ *                  {"compounds":[[simple..]..],"combinators":[" ",">"..]}
+ *                  where pseudo-classes add "nth":{"a":..,"b":..} and
+ *                  "argument":[selectors] as applicable
+ * BINARY  the same tree, length-prefixed, little-endian:
+ *           "CSSD" u32 version, then one node
+ *         node   = u8 tag, fields (CSS_DUMP_TAG_*)
+ *         string = u32 byte length (0xFFFFFFFF = null), bytes
+ *         list   = u32 count, items
+ *         number = IEEE-754 double as u64
+ *
+ * Block declarations are detected as in css_parse_dump.
+ * ================================================================ */
+
+typedef enum {
+    CSS_DUMP_TEXT,
+    CSS_DUMP_JSON,
+    CSS_DUMP_BINARY
+} css_dump_format;
+
+#define CSS_DUMP_BINARY_VERSION 2
+
+/* Binary node tags and their fields */
+enum {
+    CSS_DUMP_TAG_STYLESHEET = 1,  /* list<rule> */
+    CSS_DUMP_TAG_AT_RULE,         /* string name, list<value> prelude,
+                                     u8 has_block, [block] */
+    CSS_DUMP_TAG_QUALIFIED_RULE,  /* u8 has_selectors, [selector list],
+                                     list<value> prelude, block */
+    CSS_DUMP_TAG_BLOCK,           /* u8 open token type, u8 declarations,
+                                     list<declaration> or list<value> */
+    CSS_DUMP_TAG_DECLARATION,     /* string name, u8 important,
+                                     list<value> */
+    CSS_DUMP_TAG_FUNCTION,        /* string name, list<value> */
+    CSS_DUMP_TAG_TOKEN,           /* u8 token type, u8 flags (1 = integer,
+                                     2 = id hash), string value,
+                                     string unit, number, u32 delim */
+    CSS_DUMP_TAG_SELECTOR_LIST,   /* list<complex>: list<compound>, where
+                                     each compound after the first is
+                                     preceded by a u8 combinator;
+                                     compound = list<simple>: u8 type,
+                                     string name, u8 match, string attr
+                                     name, string attr value, u8 i flag,
+                                     u8 pseudo-class kind, u32 a, u32 b
+                                     (An+B, two's complement), u8
+                                     has_argument, [selector list] */
+    CSS_DUMP_TAG_DECLARATION_LIST /* list<declaration> */
+};
+
+/* Append a dump of sheet / list to out */
+void css_dump_stylesheet(css_stylesheet *sheet, css_dump_format format,
+                         css_buffer *out);
+void css_dump_declaration_list(css_declaration_list *list,
+                               css_dump_format format, css_buffer *out);
+
+/* Parse a --format argument ("text", "json", "binary") */
+bool css_dump_format_from_name(const char *name, css_dump_format *format);
+
+#endif /* CSS_DUMP_H */
@@ -0,0 +1,138 @@
+#ifndef CSS_FLAT_H
+#define CSS_FLAT_H
+
+#include "css_ast.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/* ================================================================
+ * Flat, index-based stylesheet layout
+ *
+ * The whole sheet lives in ONE contiguous allocation:
+ *
+ *   css_flat_sheet header | css_flat_node[node_count] | string pool
+ *
+ * Nodes are stored in pre-order.  A node's descendants occupy the
+ * index range (i, nodes[i].end): the first child (if any) is i + 1 and
+ * the next sibling of a child c is nodes[c].end.  Strings are byte
+ * offsets into a shared, de-duplicated pool of NUL-terminated strings.
+ * There are no pointers inside the block, so it can be relocated or
+ * copied with memcpy(sheet, css_flat_size(sheet)).
+ *
+ * {} blocks hold DECLARATION children when declarations are detected
+ * (as in css_parse_dump), raw component values otherwise.
+ * ================================================================ */
+
+typedef enum {
+    CSS_FLAT_STYLESHEET,
+    CSS_FLAT_AT_RULE,            /* str = name */
+    CSS_FLAT_QUALIFIED_RULE,
+    CSS_FLAT_PRELUDE,            /* children: component values */
+    CSS_FLAT_BLOCK,              /* subtype = opening css_token_type */
+    CSS_FLAT_FUNCTION,           /* str = name */
+    CSS_FLAT_DECLARATION,        /* str = name, flags & CSS_FLAT_IMPORTANT */
+    CSS_FLAT_TOKEN,              /* subtype = css_token_type */
+    CSS_FLAT_SELECTOR_LIST,
+    CSS_FLAT_COMPLEX_SELECTOR,   /* children: compounds and combinators */
+    CSS_FLAT_COMPOUND_SELECTOR,
+    CSS_FLAT_COMBINATOR,         /* subtype = css_combinator */
+    CSS_FLAT_SIMPLE_SELECTOR     /* subtype = css_simple_selector_type;
+                                    child: SELECTOR_LIST argument of a
+                                    functional pseudo-class */
+} css_flat_kind;
+
+/* Node flags */
+#define CSS_FLAT_IMPORTANT    0x01  /* DECLARATION: !important */
+#define CSS_FLAT_HASH_ID      0x02  /* TOKEN (hash): type flag "id" */
+#define CSS_FLAT_NUM_INTEGER  0x04  /* TOKEN (numeric): integer type */
+#define CSS_FLAT_ATTR_CI      0x08  /* SIMPLE_SELECTOR: [attr=val i] */
+
+#define CSS_FLAT_NO_STRING    UINT32_MAX
+
+typedef struct {
+    uint8_t  kind;        /* css_flat_kind */
+    uint8_t  subtype;     /* token / block / selector / combinator type */
+    uint8_t  flags;       /* CSS_FLAT_* flags */
+    uint8_t  attr_match;  /* SIMPLE_SELECTOR (attribute): css_attr_match,
+                             (pseudo-class): css_pseudo_class_kind */
+    uint32_t end;         /* one past the last descendant */
+    uint32_t str;         /* name / value / attr name (pool offset) */
+    uint32_t str2;        /* unit / attr value (pool offset) */
+    union {
+        double   number;     /* NUMBER, PERCENTAGE, DIMENSION */
+        uint32_t codepoint;  /* DELIM */
+        struct {
+            int32_t a, b;
+        } nth;               /* SIMPLE_SELECTOR (:nth-*): An+B */
+    } u;
+    uint32_t line;        /* TOKEN position */
+    uint32_t column;
+} css_flat_node;
+
+typedef struct {
+    uint32_t node_count;
+    uint32_t string_size;  /* bytes in the string pool */
+    css_flat_node nodes[];
+} css_flat_sheet;
+
+/* Build a flat copy of sheet in the current allocator (css_alloc.h).
+ * Returns NULL on allocation failure or if the sheet does not fit in
+ * 32-bit indices.  The block holds no pointers, so it cannot remember
+ * its allocator: release it with css_flat_free() while the allocator
+ * current for the build is current again. */
+css_flat_sheet *css_flat_build(css_stylesheet *sheet);
+void            css_flat_free(css_flat_sheet *flat);
+
+/* Total size of the contiguous block in bytes */
+size_t css_flat_size(const css_flat_sheet *flat);
+
+/* String at a pool offset (NULL for CSS_FLAT_NO_STRING / out of range) */
+const char *css_flat_string(const css_flat_sheet *flat, uint32_t offset);
+
+/* Tree navigation (indices; CSS_FLAT_NONE when there is no such node) */
+#define CSS_FLAT_NONE UINT32_MAX
+uint32_t css_flat_first_child(const css_flat_sheet *flat, uint32_t index);
+uint32_t css_flat_next_sibling(const css_flat_sheet *flat, uint32_t parent,
+                               uint32_t child);
+
+/* Dump in the same format as css_parse_dump */
+void css_flat_dump(const css_flat_sheet *flat, FILE *out);
+
+/* ================================================================
+ * Precompiled file format (.cssb)
+ *
+ *   css_flat_file_header (32 bytes) | css_flat_sheet block
+ *
+ * The block is stored byte-for-byte, so a loader maps the file and uses
+ * the sheet in place.  The header pins everything the in-memory layout
+ * depends on: format version, byte order and node size.  A file
+ * written on a different ABI is rejected rather than misread.
+ * ================================================================ */
+
+#define CSS_FLAT_MAGIC        "CSSFLAT"        /* 7 chars + NUL */
+#define CSS_FLAT_VERSION      2
+#define CSS_FLAT_BYTE_ORDER   0x01020304u      /* reads back swapped on
+                                                  the other endianness */
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t node_size;      /* sizeof(css_flat_node) */
+    uint32_t reserved;
+    uint64_t payload_size;   /* css_flat_size() of the stored sheet */
+} css_flat_file_header;
+
+/* Write header + block to out.  Returns false on a write error. */
+bool css_flat_write(const css_flat_sheet *flat, FILE *out);
+
+/* Map a file written by css_flat_write and validate it (header, sizes,
+ * node ranges, string offsets).  The returned sheet is read-only and
+ * lives in the mapping; release it with css_flat_unmap().  Returns NULL
+ * if the file cannot be mapped or is not a valid precompiled sheet. */
+const css_flat_sheet *css_flat_map(const char *path);
+void                  css_flat_unmap(const css_flat_sheet *flat);
+
+#endif /* CSS_FLAT_H */
@@ -0,0 +1,132 @@
+#ifndef CSS_INVALIDATION_H
+#define CSS_INVALIDATION_H
+
+#include "css_ast.h"
+#include "css_selector.h"
+#include "css_match.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+/* ================================================================
+ * Invalidation sets
+ *
+ * For every class, id and attribute name that appears in a
+ * stylesheet's selectors, the index records which elements a change
+ * of that feature on an element E can restyle:
+ *
+ *   SELF                 E itself (the feature is in a subject
+ *                        compound, e.g. .a, p:not(.a))
+ *   DESCENDANTS          E's descendants (.a p, .a > p, .a + b p)
+ *   SIBLINGS             E's later siblings (.a + p, .a ~ p)
+ *   SIBLING_DESCENDANTS  descendants of E's later siblings (.a ~ b p)
+ *   PARENT_SUBTREE       every child of E's parent and their
+ *                        descendants (:nth-last-child(An+B of .a))
+ *
+ * Features inside :is() / :where() / :not() / "of S" take the position
+ * of the compound that holds them.
+ *
+ * An element other than E can only be restyled if it matches some
+ * selector's subject compound, so each set also keeps one key (id,
+ * class, attribute name or tag) of the subject compound of every
+ * selector that put a non-SELF flag on it.  Elements reached by the
+ * flags need restyling only if they carry one of those keys, unless
+ * any_element is set (a subject compound had no key, as in ".a *").
+ *
+ * Only class, id and attribute mutations are described; structural
+ * changes (insertions, removals), state pseudo-classes (:hover) and a
+ * group rule's condition starting or ceasing to hold (a media query
+ * after a resize) still need their own invalidation.  Like the rule
+ * index, the index borrows names from the stylesheet, which must
+ * outlive it, and is read-only once built.
+ * ================================================================ */
+
+#define CSS_INVALIDATE_SELF                0x01
+#define CSS_INVALIDATE_DESCENDANTS         0x02
+#define CSS_INVALIDATE_SIBLINGS            0x04
+#define CSS_INVALIDATE_SIBLING_DESCENDANTS 0x08
+#define CSS_INVALIDATE_PARENT_SUBTREE      0x10
+
+typedef enum {
+    CSS_INVALIDATION_ID,
+    CSS_INVALIDATION_CLASS,
+    CSS_INVALIDATION_ATTRIBUTE,   /* attribute name, case-insensitive */
+    CSS_INVALIDATION_TAG          /* case-insensitive */
+} css_invalidation_key_kind;
+
+typedef struct {
+    css_invalidation_key_kind kind;
+    const char *name;
+} css_invalidation_key;
+
+typedef struct {
+    unsigned flags;               /* CSS_INVALIDATE_* */
+    bool any_element;             /* keys do not narrow the candidates */
+    css_invalidation_key *keys;   /* sorted, distinct */
+    size_t key_count;
+    size_t key_cap;
+} css_invalidation_set;
+
+typedef struct css_invalidation_index css_invalidation_index;
+
+/* Sets for the selectors of sheet's style rules, including those nested
+ * in @media, @supports, @layer, ... whether or not their condition
+ * holds (css_stylesheet_walk_style_rules()).  The index lives in the
+ * allocator current at build and frees itself through it. */
+css_invalidation_index *css_invalidation_index_build(
+    const css_stylesheet *sheet);
+void css_invalidation_index_free(css_invalidation_index *index);
+
+/* Set of one feature, NULL if no selector mentions it */
+const css_invalidation_set *css_invalidation_for_class(
+    const css_invalidation_index *index, const char *name);
+const css_invalidation_set *css_invalidation_for_id(
+    const css_invalidation_index *index, const char *name);
+const css_invalidation_set *css_invalidation_for_attribute(
+    const css_invalidation_index *index, const char *name);
+
+/* ================================================================
+ * Mutations
+ *
+ * A css_invalidation collects the sets touched by the mutations of one
+ * element.  Restyle the element if flags has SELF, and walk the
+ * elements named by the other flags, restyling those for which
+ * css_invalidation_affects() is true.  Reuse between mutations with
+ * css_invalidation_reset(), then free.  Its array grows and is freed
+ * through the current allocator, which must not change meanwhile.
+ * ================================================================ */
+
+typedef struct {
+    unsigned flags;
+    bool any_element;           /* set if the sets could not be kept */
+    const css_invalidation_set **sets;
+    size_t count;
+    size_t cap;
+} css_invalidation;
+
+/* Class list changed from old_classes to new_classes: only classes in
+ * one list but not the other count; [class] selectors always do */
+void css_invalidation_add_class_change(
+    const css_invalidation_index *index,
+    const char *const *old_classes, size_t old_count,
+    const char *const *new_classes, size_t new_count,
+    css_invalidation *out);
+
+/* id changed (NULL = absent); also counts as a change of [id] */
+void css_invalidation_add_id_change(const css_invalidation_index *index,
+                                    const char *old_id, const char *new_id,
+                                    css_invalidation *out);
+
+/* Attribute name was added, removed or changed its value */
+void css_invalidation_add_attribute_change(
+    const css_invalidation_index *index, const char *name,
+    css_invalidation *out);
+
+/* May el, reached through out->flags, need restyling? */
+bool css_invalidation_affects(const css_invalidation *inv,
+                              const css_element_adapter *adapter,
+                              const void *el);
+
+void css_invalidation_reset(css_invalidation *inv);
+void css_invalidation_free(css_invalidation *inv);
+
+#endif /* CSS_INVALIDATION_H */
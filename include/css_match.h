@@ -0,0 +1,105 @@
+#ifndef CSS_MATCH_H
+#define CSS_MATCH_H
+
+#include "css_selector.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct css_sibling_cache css_sibling_cache;
+
+/* ================================================================
+ * Element adapter
+ *
+ * Matching runs against the caller's document through these callbacks;
+ * an element is an opaque pointer.  Callbacks marked optional may be
+ * NULL.  Returned strings only need to live until the callback is
+ * invoked again.
+ * ================================================================ */
+
+typedef struct {
+    /* Local name, e.g. "div" (compared ASCII case-insensitively) */
+    const char *(*tag_name)(void *ctx, const void *el);
+
+    /* ID attribute value, NULL if none */
+    const char *(*id)(void *ctx, const void *el);
+
+    /* Class names: sets *classes and returns their count */
+    size_t (*classes)(void *ctx, const void *el,
+                      const char *const **classes);
+
+    /* Value of attribute name, NULL if absent */
+    const char *(*attribute)(void *ctx, const void *el, const char *name);
+
+    /* Parent / previous sibling element, NULL if none */
+    const void *(*parent)(void *ctx, const void *el);
+    const void *(*prev_sibling)(void *ctx, const void *el);
+
+    /* Optional: next sibling element (:last-child, :only-child) */
+    const void *(*next_sibling)(void *ctx, const void *el);
+
+    /* Optional: state pseudo-classes (:hover, :checked, ...) not derived
+     * from the tree; NULL = never */
+    bool (*pseudo_class)(void *ctx, const void *el, const char *name);
+
+    void *ctx;
+
+    /* Optional: memo of sibling positions for :nth-*() (below) */
+    css_sibling_cache *sibling_cache;
+} css_element_adapter;
+
+/* ================================================================
+ * Matching (CSS Selectors Level 4 §17)
+ *
+ * Complex selectors are matched right to left: the rightmost compound
+ * against el, then each combinator walks to the candidate parent,
+ * ancestors or previous siblings.  Within a compound the simple
+ * selectors are tested most selective first (id, class, type,
+ * attribute, pseudo-class), so most non-matches are rejected by a
+ * single string compare.
+ *
+ * :root, :first-child, :last-child, :only-child and :nth-*() are
+ * derived from the tree, :not(), :is() and :where() from their
+ * arguments; other pseudo-classes go to adapter->pseudo_class.
+ * Counting from the end needs adapter->next_sibling.
+ * Selectors with a pseudo-element never match an element.
+ * ================================================================ */
+
+bool css_match_compound(const css_compound_selector *comp,
+                        const css_element_adapter *adapter, const void *el);
+bool css_match_complex(const css_complex_selector *sel,
+                       const css_element_adapter *adapter, const void *el);
+
+/* Does attribute value actual satisfy the prepared matcher? */
+bool css_attr_matcher_match(const css_attr_matcher *m, const char *actual);
+
+/* True if any selector of list matches el */
+bool css_match_selector_list(const css_selector_list *list,
+                             const css_element_adapter *adapter,
+                             const void *el);
+
+/* ================================================================
+ * :nth-*() positions
+ *
+ * css_nth_index() is el's 1-based position among its parent's children
+ * for kind (PSEUDO_NTH_CHILD ... PSEUDO_NTH_LAST_OF_TYPE; "of S" is not
+ * considered), 0 if el has no parent or kind counts from the end and
+ * the adapter has no next_sibling.  css_nth_matches() is the An+B test
+ * itself: O(1), no loop over n.
+ *
+ * Without a cache every position walks the siblings before (or after)
+ * el, which is quadratic over a long child list.  A sibling cache
+ * remembers the positions computed on the way, so the children of one
+ * parent are walked about once when matched in document order.  A
+ * cache belongs to one thread and one document state: clear it after
+ * the tree changes.
+ * ================================================================ */
+
+bool   css_nth_matches(css_nth nth, size_t index);
+size_t css_nth_index(const css_element_adapter *adapter, const void *el,
+                     css_pseudo_class_kind kind);
+
+css_sibling_cache *css_sibling_cache_create(void);
+void               css_sibling_cache_clear(css_sibling_cache *cache);
+void               css_sibling_cache_free(css_sibling_cache *cache);
+
+#endif /* CSS_MATCH_H */
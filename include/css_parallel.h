@@ -0,0 +1,65 @@
+#ifndef CSS_PARALLEL_H
+#define CSS_PARALLEL_H
+
+#include "css_rule_index.h"
+#include "css_match.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+/* ================================================================
+ * Parallel matching over a document
+ *
+ * Every element under a root is matched against one rule index by a
+ * pool of worker threads.  The stylesheet and the index are shared and
+ * only read; each worker owns an ancestor Bloom filter, a sibling
+ * cache and a style sharing cache, so the threads never write to
+ * common state except their own task queues.
+ *
+ * Work is a queue of elements per worker.  Matching an element pushes
+ * its children, last first, so the owner pops them in document order
+ * (depth first), which keeps its Bloom filter to a push or pop per
+ * step and lets its sharing cache see siblings one after another.  An
+ * idle worker steals the oldest element of another queue: the one
+ * nearest the root, with the largest subtree left.  A stolen element's
+ * ancestors are added to the thief's Bloom filter from scratch.
+ *
+ * The adapter's callbacks are called from all workers at once and must
+ * be safe for that; strings they return only need to live until the
+ * same thread calls again.  adapter->next_sibling is required, and the
+ * adapter's own sibling_cache is ignored in favour of the workers'.
+ * visit is called once per element, from the worker that matched it;
+ * matches are in source order and only valid during the call.
+ * Workers allocate through the caller's current allocator (css_alloc.h),
+ * which must be safe to use from several threads at once.
+ * ================================================================ */
+
+typedef void (*css_parallel_visit)(void *user, const void *el,
+                                   const css_rule_matches *matches);
+
+typedef struct {
+    size_t workers;             /* 0 = one per online CPU */
+
+    /* First child element of el, NULL if none */
+    const void *(*first_child)(void *ctx, const void *el);
+
+    css_parallel_visit visit;
+    void *user;
+} css_parallel_options;
+
+typedef struct {
+    size_t workers;             /* threads that took part */
+    size_t elements;            /* elements matched */
+    size_t shared;              /* answered by a style sharing cache */
+    size_t steals;              /* elements taken from another queue */
+} css_parallel_stats;
+
+/* Match root and all its descendants.  stats may be NULL.  Returns
+ * false if opts is incomplete or memory ran out, in which case some
+ * elements may not have been visited. */
+bool css_parallel_match(const css_rule_index *index,
+                        const css_element_adapter *adapter,
+                        const void *root,
+                        const css_parallel_options *opts,
+                        css_parallel_stats *stats);
+
+#endif /* CSS_PARALLEL_H */
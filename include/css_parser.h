@@ -2,8 +2,151 @@
 #define CSS_PARSER_H
 
 #include "css_ast.h"
+#include <stdio.h>
+#include <stdbool.h>
+
+/* Bumped whenever parse output can change for the same input; part of
+ * the on-disk cache key (css_cache.h) */
+#define CSS_PARSER_VERSION "0.4.0"
+
+/* Reusable parser context (tokenizer buffers survive between parses) */
+typedef struct css_parser_ctx css_parser_ctx;
+
+#define CSS_TOKEN_TYPE_COUNT (CSS_TOKEN_EOF + 1)
+#define CSS_NODE_TYPE_COUNT  (CSS_NODE_FUNCTION + 1)
+
+/* Per-parse instrumentation, filled in when css_parser_options.stats is
+ * set (reset at the start of every parse).  Phases partition the
+ * parse: rules is whatever remains once preprocessing, tokenizing and
+ * selector parsing are taken out.  Node counts come from a walk of the
+ * result, so a shared block is counted once per reference. */
+typedef struct {
+    double preprocess_seconds;      /* input copy and §3.3 filtering */
+    double tokenize_seconds;        /* inside css_tokenizer_next(),
+                                       estimated from a sample of the
+                                       tokens */
+    double rules_seconds;           /* rule / declaration consumption */
+    double selectors_seconds;       /* prelude -> selector lists
+                                       (eager_selectors only; tokens
+                                       read on the way count here) */
+    double total_seconds;
+
+    size_t token_count;
+    size_t tokens[CSS_TOKEN_TYPE_COUNT];    /* by css_token_type */
+    size_t nodes[CSS_NODE_TYPE_COUNT];      /* by css_node_type */
+    size_t selector_count;                  /* complex selectors */
+
+    size_t allocations;             /* css_malloc / css_realloc calls */
+    size_t alloc_bytes;
+    size_t errors;                  /* tokenizer parse errors */
+} css_parse_stats;
+
+/* Parser options (zero-initialise for defaults) */
+typedef struct {
+    /* Hash-cons rule blocks: qualified-rule and at-rule {} blocks whose
+     * token streams are identical (positions aside) are stored once and
+     * shared by reference.  Shared tokens keep the line/column of the
+     * first occurrence. */
+    bool dedup_blocks;
+
+    /* Parse each qualified rule's selectors during the parse, straight
+     * from the tokens as its prelude is read.  By default they are
+     * parsed on first access through css_qualified_rule_selectors(), so
+     * consumers that never look at selectors do not pay for them. */
+    bool eager_selectors;
+
+    /* Build qualified-rule preludes as component values and keep them
+     * on the rule.  By default only the prelude's source text is kept
+     * (css_ast.h), which is a single string instead of a token and a
+     * value per token; the printers then tokenize it again
+     * (css_qualified_rule_prelude()).  Keep them when every prelude
+     * will be printed or walked. */
+    bool keep_preludes;
+
+    /* Allocator for the parse and the resulting tree (css_alloc.h).
+     * NULL = the calling thread's current allocator, or for a reusable
+     * context the one current when it was created. */
+    const css_allocator *allocator;
+
+    /* Instrumentation target, or NULL (the default) for none.  Not to be
+     * shared between threads. */
+    css_parse_stats *stats;
+} css_parser_options;
 
 /* Parse a CSS stylesheet from input string */
 css_stylesheet *css_parse_stylesheet(const char *input, size_t length);
 
+/* Same, with options (NULL = defaults) */
+css_stylesheet *css_parse_stylesheet_with_options(
+    const char *input, size_t length, const css_parser_options *options);
+
+/* Parse a list of declarations (§5.3.8), e.g. a style="" attribute */
+css_declaration_list *css_parse_declaration_list(const char *input,
+                                                 size_t length);
+
+/* Declarations found in a {} block of an already parsed stylesheet
+ * (the same detection css_parse_dump uses).  Caller frees the list. */
+css_declaration_list *css_parse_block_declarations(css_simple_block *block);
+
+/* True for at-rules whose {} block holds rules (@media, @supports,
+ * @keyframes, ...) rather than declarations; vendor prefixes ignored */
+bool css_at_rule_has_rule_list(const char *name);
+
+/* Those of them whose rules are style rules under a condition or in a
+ * group (@media, @supports, @layer, @container, ...): all but
+ * @keyframes */
+bool css_at_rule_has_style_rules(const char *name);
+
+/* Rules in the block of an at-rule of css_at_rule_has_rule_list(),
+ * grouped as §5.4.1 consumes them; NULL for other at-rules or when
+ * memory ran out.  Parsed on the first call and kept on the at-rule
+ * (freed with it), like css_qualified_rule_selectors(); safe to call
+ * from several threads. */
+css_stylesheet *css_at_rule_rules(const css_at_rule *ar);
+
+/* qr's prelude as component values: qr->prelude when the parse kept it
+ * (keep_preludes), else a new array tokenized from the prelude text,
+ * with the tokens' original lines and columns.  Hand the result back
+ * to css_qualified_rule_prelude_release() while the same allocator is
+ * current.  NULL with *count 0 for an empty prelude or when memory ran
+ * out. */
+css_component_value **css_qualified_rule_prelude(const css_qualified_rule *qr,
+                                                 size_t *count);
+void css_qualified_rule_prelude_release(const css_qualified_rule *qr,
+                                        css_component_value **values,
+                                        size_t count);
+
+/* Call visit for each qualified rule of sheet in source order,
+ * descending into the rules of at-rules of css_at_rule_has_style_rules()
+ * for which enter returns true (enter NULL = all of them).  Returns
+ * false if a nested rule list could not be parsed (out of memory). */
+typedef bool (*css_style_rule_filter)(void *user, const css_at_rule *ar);
+typedef void (*css_style_rule_visit)(void *user,
+                                     const css_qualified_rule *qr);
+bool css_stylesheet_walk_style_rules(const css_stylesheet *sheet,
+                                     css_style_rule_filter enter,
+                                     css_style_rule_visit visit, void *user);
+
+/* Batch variant: parse count attribute strings with one parser context.
+ * out[i] receives the list for inputs[i] (NULL on allocation failure).
+ * Returns the number of lists successfully parsed. */
+size_t css_parse_declaration_lists(const char *const *inputs,
+                                   const size_t *lengths, size_t count,
+                                   css_declaration_list **out);
+
+/* === Reusable context === */
+css_parser_ctx       *css_parser_create(void);
+void                  css_parser_free(css_parser_ctx *p);
+void                  css_parser_set_options(css_parser_ctx *p,
+                                             const css_parser_options *options);
+css_stylesheet       *css_parser_parse_stylesheet(css_parser_ctx *p,
+                                                  const char *input,
+                                                  size_t length);
+css_declaration_list *css_parser_parse_declaration_list(css_parser_ctx *p,
+                                                        const char *input,
+                                                        size_t length);
+
+/* === Dump (debug output) === */
+void css_declaration_list_dump(css_declaration_list *list, FILE *out);
+
 #endif /* CSS_PARSER_H */
@@ -0,0 +1,102 @@
+#ifndef CSS_RULE_INDEX_H
+#define CSS_RULE_INDEX_H
+
+#include "css_ast.h"
+#include "css_parser.h"
+#include "css_selector.h"
+#include "css_match.h"
+#include "css_bloom.h"
+#include <stddef.h>
+
+/* ================================================================
+ * Rule index: selectors bucketed by their rightmost compound
+ *
+ * Each complex selector of a stylesheet's style rules, including those
+ * nested in @media, @supports, @layer and the other grouping at-rules
+ * (css_stylesheet_walk_style_rules()), is filed under the most
+ * selective key of its rightmost compound: its
+ * id, else its first class, else its type (case-insensitive), else the
+ * universal bucket.  Matching an element then only tests the buckets
+ * for its id, its classes, its tag and the universal bucket.
+ *
+ * Entries of one bucket are stored next to each other, and their
+ * selectors are compiled into one css_selector_program.  The index is
+ * read-only once built and may be shared between threads; it borrows
+ * the stylesheet, which must outlive it.  It lives in the allocator
+ * current when it was built and frees itself through it.
+ * ================================================================ */
+
+typedef struct {
+    const css_complex_selector *selector;
+    const css_qualified_rule *rule;
+    size_t order;               /* source order over all entries */
+    uint32_t specificity;       /* selector->specificity_key */
+    uint32_t ancestor_hashes[CSS_ANCESTOR_HASH_COUNT];  /* copied from
+                                   selector, for the Bloom test */
+} css_rule_entry;
+
+typedef struct css_rule_index css_rule_index;
+
+/* Matched entries in source order; reuse between calls, then free.
+ * The array grows and is freed through the current allocator
+ * (css_alloc.h), which must stay the same over the struct's life. */
+typedef struct {
+    const css_rule_entry **entries;
+    size_t count;
+    size_t cap;
+} css_rule_matches;
+
+typedef struct {
+    /* Called for each grouping at-rule on the way down; returning false
+     * leaves its rules out (e.g. a media query that does not hold).
+     * NULL = every condition holds. */
+    css_style_rule_filter condition;
+    void *user;
+} css_rule_index_options;
+
+css_rule_index *css_rule_index_build(const css_stylesheet *sheet);
+
+/* Same, with options (NULL = defaults).  Entry order is source order
+ * over the rules that were included; cascade layers are not ranked. */
+css_rule_index *css_rule_index_build_with_options(
+    const css_stylesheet *sheet, const css_rule_index_options *options);
+void            css_rule_index_free(css_rule_index *index);
+
+/* Number of indexed selectors */
+size_t css_rule_index_size(const css_rule_index *index);
+
+/* Entry i, 0 <= i < size; entries are in bucket order, not source
+ * order */
+const css_rule_entry *css_rule_index_entry(const css_rule_index *index,
+                                           size_t i);
+
+/* Does entry i's selector match el?  No Bloom test. */
+bool css_rule_index_entry_matches(const css_rule_index *index, size_t i,
+                                  const css_element_adapter *adapter,
+                                  const void *el);
+
+/* Replace out's contents with the entries matching el.  Returns the
+ * match count; on allocation failure the list may be incomplete. */
+size_t css_rule_index_match(const css_rule_index *index,
+                            const css_element_adapter *adapter,
+                            const void *el, css_rule_matches *out);
+
+/* Same, first rejecting selectors whose ancestor hashes are missing
+ * from ancestors, which must hold exactly el's ancestors (NULL = no
+ * filter) */
+size_t css_rule_index_match_filtered(const css_rule_index *index,
+                                     const css_element_adapter *adapter,
+                                     const void *el,
+                                     const css_bloom_filter *ancestors,
+                                     css_rule_matches *out);
+
+/* Reorder matches for the cascade: ascending specificity, then source
+ * order, so later entries win */
+void css_rule_matches_sort_cascade(css_rule_matches *matches);
+
+/* Make room for count entries; false if memory ran out */
+bool css_rule_matches_reserve(css_rule_matches *matches, size_t count);
+
+void css_rule_matches_free(css_rule_matches *matches);
+
+#endif /* CSS_RULE_INDEX_H */
@@ -0,0 +1,55 @@
+#ifndef CSS_SAX_H
+#define CSS_SAX_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* ================================================================
+ * Event-driven (SAX-style) parsing
+ *
+ * Runs the CSS Syntax §5.4 consume algorithms directly on the token
+ * stream and reports rules and declarations through callbacks instead
+ * of building a css_stylesheet.  No AST nodes are allocated; tokens
+ * are released as soon as they have been looked at.
+ *
+ * All strings passed to callbacks point into parser-owned memory and
+ * are only valid for the duration of the callback.  Text ranges are
+ * NOT NUL-terminated: always use the accompanying length.
+ * ================================================================ */
+
+/* Declaration event payload */
+typedef struct {
+    const char *name;        /* property name (NUL-terminated) */
+    const char *value;       /* value source text, trimmed, without !important */
+    size_t value_length;
+    size_t value_offset;     /* byte offset of value in the preprocessed input */
+    bool important;          /* ended with !important */
+    size_t line;             /* position of the property name */
+    size_t column;
+} css_sax_declaration;
+
+/* Callbacks — any of them may be NULL */
+typedef struct {
+    /* @name prelude { or @name prelude ;
+     * has_block is false for statement at-rules (no on_block_end follows) */
+    void (*on_at_rule_start)(void *user_data, const char *name,
+                             const char *prelude, size_t prelude_length,
+                             bool has_block);
+
+    /* Prelude of a qualified rule (its selector text), trimmed */
+    void (*on_selector_text)(void *user_data, const char *text,
+                             size_t length);
+
+    /* name: value [!important] inside a declaration block */
+    void (*on_declaration)(void *user_data, const css_sax_declaration *decl);
+
+    /* Closing } of a qualified rule or block at-rule */
+    void (*on_block_end)(void *user_data);
+} css_sax_handler;
+
+/* Parse a stylesheet, reporting events to handler.
+ * Returns false only if the tokenizer could not be created. */
+bool css_sax_parse(const char *input, size_t length,
+                   const css_sax_handler *handler, void *user_data);
+
+#endif /* CSS_SAX_H */
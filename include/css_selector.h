@@ -51,6 +51,56 @@ typedef struct {
     unsigned int c;   /* type, ::pseudo-element count */
 } css_specificity;
 
+/* Packed form: a, b and c in 10 bits each (a highest), each saturating
+ * at CSS_SPECIFICITY_MAX, so packed values compare as (a, b, c) do */
+#define CSS_SPECIFICITY_BITS 10
+#define CSS_SPECIFICITY_MAX  ((1u << CSS_SPECIFICITY_BITS) - 1)
+
+uint32_t        css_specificity_pack(css_specificity spec);
+css_specificity css_specificity_unpack(uint32_t packed);
+
+/* ================================================================
+ * Attribute value matcher, prepared by css_complex_selector_append()
+ * so matching needs no case folding of the selector side and no
+ * strlen of the needle (css_attr_matcher_match() in css_match.h)
+ * ================================================================ */
+typedef struct {
+    css_attr_match op;
+    const char *needle;          /* attr_value, or its lowercased copy
+                                    when case-insensitive */
+    size_t length;               /* strlen(needle) */
+    bool case_insensitive;
+    bool never;                  /* cannot match any value: empty needle
+                                    for ~= ^= $= *=, whitespace for ~= */
+} css_attr_matcher;
+
+/* ================================================================
+ * Pseudo-classes with structure (Selectors Level 4 §4.2 - §4.4, §14.4)
+ *
+ * :nth-*() keep their An+B as (a, b): position i (1-based) matches when
+ * i = a*n + b for some integer n >= 0 (css_nth_matches() in
+ * css_match.h).  :is() and :where() take forgiving selector lists
+ * (invalid entries are dropped); :not() and "of S" take strict ones.
+ * ================================================================ */
+typedef enum {
+    PSEUDO_OTHER,             /* by name: :hover, :first-child, ... */
+    PSEUDO_NOT,               /* :not(S) */
+    PSEUDO_IS,                /* :is(S) */
+    PSEUDO_WHERE,             /* :where(S), zero specificity */
+    PSEUDO_NTH_CHILD,         /* :nth-child(An+B [of S]) */
+    PSEUDO_NTH_LAST_CHILD,    /* :nth-last-child(An+B [of S]) */
+    PSEUDO_NTH_OF_TYPE,       /* :nth-of-type(An+B) */
+    PSEUDO_NTH_LAST_OF_TYPE   /* :nth-last-of-type(An+B) */
+} css_pseudo_class_kind;
+
+typedef struct {
+    int a;
+    int b;
+} css_nth;
+
+/* Write nth in canonical form ("2n+1", "-n+3", "5") like snprintf */
+int css_nth_format(css_nth nth, char *buf, size_t size);
+
 /* ================================================================
  * Simple selector
  * ================================================================ */
@@ -62,6 +112,13 @@ typedef struct {
     char *attr_name;             /* attribute name (SEL_ATTRIBUTE only) */
     char *attr_value;            /* attribute value (SEL_ATTRIBUTE only, NULL for EXISTS) */
     bool attr_case_insensitive;  /* [attr=val i] case-insensitive flag */
+    char *attr_value_folded;     /* lowercased attr_value for [attr=val i] */
+    css_attr_matcher attr_matcher;  /* SEL_ATTRIBUTE only */
+    css_pseudo_class_kind pseudo;   /* SEL_PSEUDO_CLASS only */
+    css_nth nth;                    /* :nth-*() only */
+    struct css_selector_list *argument;  /* :not/:is/:where list, or the
+                                            S of :nth-child(An+B of S);
+                                            NULL otherwise */
 } css_simple_selector;
 
 /* ================================================================
@@ -69,9 +126,16 @@ typedef struct {
  * e.g. div.foo#bar
  * ================================================================ */
 typedef struct {
-    css_simple_selector **selectors;
+    css_simple_selector **selectors;    /* source order */
     size_t count;
     size_t cap;
+
+    /* The same selectors, most selective first for css_match_compound():
+     * id, class, type, attribute, pseudo-class, pseudo-element (universal
+     * always matches and is left out).  Set when the compound is
+     * appended to a complex selector; NULL before that. */
+    css_simple_selector **match_order;
+    size_t match_count;
 } css_compound_selector;
 
 /* ================================================================
@@ -81,11 +145,20 @@ typedef struct {
  * compounds[0] COMB combinators[0] compounds[1] COMB combinators[1] ...
  * combinators array has (count - 1) entries when count > 0.
  * ================================================================ */
+#define CSS_ANCESTOR_HASH_COUNT 4
+
 typedef struct {
     css_compound_selector **compounds;
     css_combinator *combinators;   /* combinators[i] sits between compounds[i] and compounds[i+1] */
     size_t count;                  /* number of compound selectors */
     size_t cap;
+
+    /* Bloom filter keys (css_bloom.h) of ids, classes and tags that
+     * must appear on ancestors of a match; 0-terminated if shorter */
+    uint32_t ancestor_hashes[CSS_ANCESTOR_HASH_COUNT];
+
+    css_specificity specificity;
+    uint32_t specificity_key;      /* css_specificity_pack(specificity) */
 } css_complex_selector;
 
 /* ================================================================
@@ -96,6 +169,7 @@ typedef struct css_selector_list {
     css_complex_selector **selectors;
     size_t count;
     size_t cap;
+    const css_allocator *allocator;
 } css_selector_list;
 
 /* ================================================================
@@ -114,6 +188,11 @@ void                   css_complex_selector_free(css_complex_selector *cx);
 void                   css_complex_selector_append(css_complex_selector *cx,
                                                    css_compound_selector *comp,
                                                    css_combinator comb);
+/* Appending a compound prepares it and updates the derived fields
+ * (ancestor_hashes, specificity, attribute matchers, match_order).
+ * Call css_complex_selector_finish() to recompute them after changing
+ * a compound that was already appended. */
+void                   css_complex_selector_finish(css_complex_selector *cx);
 
 css_selector_list     *css_selector_list_create(void);
 void                   css_selector_list_free(css_selector_list *list);
@@ -121,15 +200,70 @@ void                   css_selector_list_append(css_selector_list *list,
                                                 css_complex_selector *cx);
 
 /* ================================================================
- * Parsing (stub until Task 4-5)
+ * Parsing: NULL if any complex selector is invalid.  Functional
+ * pseudo-classes other than those of css_pseudo_class_kind are
+ * invalid, as are pseudo-elements inside their arguments.
+ *
+ * The parser reads tokens one at a time: peek returns the next token
+ * without consuming it (an EOF token at the end of the input, for
+ * good), next consumes it.  A peeked token stays valid until next is
+ * called.  Blocks and functions come as their opening token, contents
+ * and closing token, as from the tokenizer.
  * ================================================================ */
+typedef struct {
+    const css_token *(*peek)(void *ctx);
+    void (*next)(void *ctx);
+    void *ctx;
+} css_token_stream;
+
+/* Selector list up to the first end token outside any block or
+ * function (CSS_TOKEN_EOF = the whole input), which is not consumed.
+ * The tokens before it are consumed even when the list is invalid. */
+css_selector_list *css_parse_selector_stream(css_token_stream *in,
+                                             css_token_type end);
+
+/* The same over component values (a prelude kept by the parser) */
 css_selector_list *css_parse_selector_list(css_component_value **values,
                                            size_t count);
 
 /* ================================================================
- * Specificity (stub until Task 6)
+ * Qualified-rule selectors
+ *
+ * css_qualified_rule_selectors() parses qr's prelude (its component
+ * values if kept, else its source text) on first use and caches the
+ * list on qr (NULL if the prelude is not a valid selector list).
+ * Concurrent first calls may both parse; one result is kept with a
+ * compare-and-swap and the other freed, so any number of threads may
+ * call it on a shared sheet.
+ *
+ * css_qualified_rule_parse_selectors() is the parser's hook: it parses
+ * the prelude straight from the token stream being read, up to end,
+ * into the same cache.
+ * ================================================================ */
+css_selector_list *css_qualified_rule_selectors(const css_qualified_rule *qr);
+css_selector_list *css_qualified_rule_parse_selectors(
+    css_qualified_rule *qr, css_token_stream *in, css_token_type end);
+
+/* ================================================================
+ * Specificity: kept up to date by css_complex_selector_append(), so
+ * this is a field read
+ * ================================================================ */
+css_specificity css_selector_specificity(const css_complex_selector *sel);
+
+/* ================================================================
+ * Memory accounting: bytes held by a list (structs, arrays including
+ * spare capacity, strings), see css_stylesheet_memory_usage()
+ * ================================================================ */
+size_t css_selector_list_memory_usage(const css_selector_list *list);
+
+/* ================================================================
+ * Names used by the dumps: "type", "class", ... for simple selector
+ * types, " ", ">", "+", "~" for combinators, "", "=", "~=", ... for
+ * attribute operators
  * ================================================================ */
-css_specificity css_selector_specificity(css_complex_selector *sel);
+const char *css_simple_selector_type_name(css_simple_selector_type type);
+const char *css_combinator_name(css_combinator comb);
+const char *css_attr_match_name(css_attr_match match);
 
 /* ================================================================
  * Dump (debug output)
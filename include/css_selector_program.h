@@ -0,0 +1,68 @@
+#ifndef CSS_SELECTOR_PROGRAM_H
+#define CSS_SELECTOR_PROGRAM_H
+
+#include "css_selector.h"
+#include "css_match.h"
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/* ================================================================
+ * Compiled selectors
+ *
+ * A program is a list of complex selectors lowered to one flat array
+ * of 8-byte instructions, in ONE allocation:
+ *
+ *   header | ops[] | starts[] | attribute, nth and list tables |
+ *   atom pool
+ *
+ * Each selector is its compounds right to left: the instructions of a
+ * compound (id, class, type, attribute, pseudo-class, most selective
+ * first), then the combinator instruction that moves to the next
+ * element, and finally MATCH.  Strings are interned once per program;
+ * type names and pseudo-class names are lowercased at compile time,
+ * and :root / :first-child / :last-child / :only-child get their own
+ * instructions.  Selectors with a pseudo-element compile to FAIL.
+ *
+ * :nth-*() compile to one instruction over a precompiled (a, b) test.
+ * The selectors inside :is() / :where() / :not() and "of S" are
+ * compiled after the top-level ones, as unnumbered selectors that
+ * those instructions run against the current element.
+ *
+ * Matching gives the same answers as css_match_complex(), except that
+ * adapter->pseudo_class receives the lowercased name.  A program does
+ * not borrow the selectors and is read-only once compiled, so it may
+ * be shared between threads.
+ * ================================================================ */
+
+typedef struct css_selector_program css_selector_program;
+
+/* Compile selectors[0 .. count); selector i of the program is
+ * selectors[i].  Returns NULL on allocation failure or if the program
+ * does not fit in 32-bit offsets.  Release with
+ * css_selector_program_free(). */
+css_selector_program *css_selector_program_compile(
+    const css_complex_selector *const *selectors, size_t count);
+css_selector_program *css_selector_program_compile_list(
+    const css_selector_list *list);
+void css_selector_program_free(css_selector_program *prog);
+
+/* Number of selectors / total bytes of the program */
+size_t css_selector_program_count(const css_selector_program *prog);
+size_t css_selector_program_size(const css_selector_program *prog);
+
+/* Run selector index against el */
+bool css_selector_program_match(const css_selector_program *prog,
+                                size_t index,
+                                const css_element_adapter *adapter,
+                                const void *el);
+
+/* True if any selector of prog matches el */
+bool css_selector_program_match_any(const css_selector_program *prog,
+                                    const css_element_adapter *adapter,
+                                    const void *el);
+
+/* Disassembly, one instruction per line */
+void css_selector_program_dump(const css_selector_program *prog, FILE *out);
+
+#endif /* CSS_SELECTOR_PROGRAM_H */
@@ -0,0 +1,45 @@
+#ifndef CSS_SERIALIZE_H
+#define CSS_SERIALIZE_H
+
+#include "css_ast.h"
+#include "css_buffer.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+/* ================================================================
+ * Serialization back to CSS text (CSS Syntax §9)
+ *
+ * PRETTY  one declaration per line, two-space indentation.
+ * MINIFY  whitespace dropped wherever it cannot change meaning (block
+ *         edges, around commas, around selector combinators), numbers
+ *         in their shortest round-trip form without a leading zero,
+ *         no semicolon after the last declaration of a block.
+ *
+ * Rule blocks are written through the same declaration detection as
+ * css_parse_dump, so invalid declarations are dropped.  Tokens that
+ * would merge when written next to each other are separated with an
+ * empty comment, so the output re-tokenizes to the same tokens
+ * (whitespace aside).  Serializing the parse of the output again gives
+ * identical text.
+ * ================================================================ */
+
+typedef enum {
+    CSS_SERIALIZE_PRETTY,
+    CSS_SERIALIZE_MINIFY
+} css_serialize_mode;
+
+/* Append sheet as CSS text to out */
+void css_serialize_stylesheet(css_stylesheet *sheet, css_serialize_mode mode,
+                              css_buffer *out);
+
+/* NUL-terminated CSS text (caller frees); *length gets the text length
+ * if length is not NULL.  NULL on allocation failure. */
+char *css_serialize_to_string(css_stylesheet *sheet, css_serialize_mode mode,
+                              size_t *length);
+
+/* Write CSS text to fd in CSS_BUFFER_FLUSH_SIZE chunks.  Returns false
+ * on a write or allocation error. */
+bool css_serialize_to_fd(css_stylesheet *sheet, css_serialize_mode mode,
+                         int fd);
+
+#endif /* CSS_SERIALIZE_H */
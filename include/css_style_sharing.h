@@ -0,0 +1,77 @@
+#ifndef CSS_STYLE_SHARING_H
+#define CSS_STYLE_SHARING_H
+
+#include "css_rule_index.h"
+#include "css_match.h"
+#include "css_bloom.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+/* ================================================================
+ * Style sharing cache
+ *
+ * Siblings with the same tag, classes and attributes usually match the
+ * same rules (list items, table cells).  The cache remembers the
+ * matched entries of the last CSS_STYLE_SHARING_ENTRIES elements it was
+ * given and hands them to a later element when that element provably
+ * matches exactly the same selectors of the index:
+ *
+ *   - same parent, so every ancestor compound sees the same elements
+ *   - same tag (case-insensitive) and the same set of classes
+ *   - the same value (or absence) of every attribute named in a
+ *     selector's subject compound
+ *   - the same result for every state pseudo-class named there
+ *     (adapter->pseudo_class, e.g. :hover)
+ *   - the same result for every "revalidation" selector: one whose
+ *     match depends on the element's position among its siblings
+ *     (:first-child, :nth-*(), a + or ~ before the subject compound).
+ *     These are matched again for the candidate, which is still far
+ *     cheaper than matching the whole index.
+ *
+ * Features inside :is() / :where() / :not() count where the pseudo-class
+ * sits.  Elements with an id are unique in a valid document, so they
+ * are neither shared nor cached.
+ *
+ * Candidates are found by a signature hash over parent, tag, classes,
+ * attribute values and pseudo-class results; equal signatures are then
+ * compared exactly.  A cache belongs to one thread and one document
+ * state: clear it after the tree changes.  It borrows the index, which
+ * must outlive it, and keeps its copies in the allocator current when
+ * it was created.
+ * ================================================================ */
+
+#define CSS_STYLE_SHARING_ENTRIES 32
+
+typedef struct css_style_sharing_cache css_style_sharing_cache;
+
+css_style_sharing_cache *css_style_sharing_cache_create(
+    const css_rule_index *index);
+void css_style_sharing_cache_clear(css_style_sharing_cache *cache);
+void css_style_sharing_cache_free(css_style_sharing_cache *cache);
+
+/* If a cached element is equivalent to el, replace out's contents with
+ * its matched entries (source order) and return true; otherwise leave
+ * out unchanged and return false */
+bool css_style_sharing_lookup(css_style_sharing_cache *cache,
+                              const css_element_adapter *adapter,
+                              const void *el, css_rule_matches *out);
+
+/* Remember matches, computed for el, as a candidate for later elements */
+void css_style_sharing_insert(css_style_sharing_cache *cache,
+                              const css_element_adapter *adapter,
+                              const void *el,
+                              const css_rule_matches *matches);
+
+/* css_rule_index_match_filtered() through the cache: a lookup, else a
+ * full match whose result is inserted.  Returns the match count. */
+size_t css_style_sharing_match(css_style_sharing_cache *cache,
+                               const css_element_adapter *adapter,
+                               const void *el,
+                               const css_bloom_filter *ancestors,
+                               css_rule_matches *out);
+
+/* Lookups answered from the cache, and lookups that were not */
+void css_style_sharing_stats(const css_style_sharing_cache *cache,
+                             size_t *hits, size_t *misses);
+
+#endif /* CSS_STYLE_SHARING_H */
@@ -2,6 +2,7 @@
 #define CSS_TOKENIZER_H
 
 #include "css_token.h"
+#include "css_alloc.h"
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -11,7 +12,9 @@
 typedef struct {
     char *input;           /* Preprocessed copy (owned, must free) */
     size_t length;         /* Length of preprocessed input */
+    size_t input_cap;      /* Allocated size of input buffer */
     size_t pos;            /* Current byte offset */
+    size_t token_start;    /* Byte offset where the last returned token began */
 
     uint32_t current;      /* Current code point */
     uint32_t peek1;        /* Lookahead +1 */
@@ -22,10 +25,15 @@ typedef struct {
     size_t column;         /* Current column (1-based) */
 
     bool reconsume;        /* Reconsume flag */
+    size_t error_count;    /* Parse errors since the last reset */
+
+    const css_allocator *allocator;  /* for this struct and input */
 } css_tokenizer;
 
 css_tokenizer *css_tokenizer_create(const char *input, size_t length);
 css_token     *css_tokenizer_next(css_tokenizer *t);
+bool           css_tokenizer_reset(css_tokenizer *t, const char *input,
+                                   size_t length);
 void           css_tokenizer_free(css_tokenizer *t);
 
 #endif /* CSS_TOKENIZER_H */
@@ -0,0 +1,145 @@
+#define _POSIX_C_SOURCE 200809L
+#include "css_alloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* ================================================================
+ * Default allocator and per-thread current allocator
+ * ================================================================ */
+
+static void *default_malloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void *default_realloc(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    return realloc(ptr, size);
+}
+
+static void default_free(void *ctx, void *ptr)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+static const css_allocator default_allocator = {
+    default_malloc, default_realloc, default_free, NULL
+};
+
+static _Thread_local const css_allocator *current_allocator;
+static _Thread_local css_alloc_counts *current_counts;
+
+const css_allocator *css_allocator_default(void)
+{
+    return &default_allocator;
+}
+
+const css_allocator *css_allocator_current(void)
+{
+    return current_allocator ? current_allocator : &default_allocator;
+}
+
+const css_allocator *css_allocator_use(const css_allocator *a)
+{
+    const css_allocator *prev = css_allocator_current();
+    current_allocator = a;
+    return prev;
+}
+
+css_alloc_counts *css_alloc_count(css_alloc_counts *counts)
+{
+    css_alloc_counts *prev = current_counts;
+    current_counts = counts;
+    return prev;
+}
+
+/* ================================================================
+ * Allocation through the current allocator
+ * ================================================================ */
+
+void *css_malloc(size_t size)
+{
+    if (current_counts) {
+        current_counts->allocations++;
+        current_counts->bytes += size;
+    }
+    const css_allocator *a = css_allocator_current();
+    return a->malloc(a->ctx, size);
+}
+
+void *css_calloc(size_t count, size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size) return NULL;
+    void *ptr = css_malloc(count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void *css_realloc(void *ptr, size_t size)
+{
+    if (current_counts) {
+        current_counts->allocations++;
+        current_counts->bytes += size;
+    }
+    const css_allocator *a = css_allocator_current();
+    return a->realloc(a->ctx, ptr, size);
+}
+
+char *css_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = css_malloc(len);
+    if (copy) memcpy(copy, s, len);
+    return copy;
+}
+
+void css_free(void *ptr)
+{
+    if (!ptr) return;
+    const css_allocator *a = css_allocator_current();
+    a->free(a->ctx, ptr);
+}
+
+/* ================================================================
+ * Counting allocator
+ * ================================================================ */
+
+static void *counting_malloc(void *ctx, size_t size)
+{
+    css_counting_allocator *c = ctx;
+    c->allocations++;
+    c->bytes += size;
+    return c->parent->malloc(c->parent->ctx, size);
+}
+
+static void *counting_realloc(void *ctx, void *ptr, size_t size)
+{
+    css_counting_allocator *c = ctx;
+    c->allocations++;
+    c->bytes += size;
+    return c->parent->realloc(c->parent->ctx, ptr, size);
+}
+
+static void counting_free(void *ctx, void *ptr)
+{
+    css_counting_allocator *c = ctx;
+    c->frees++;
+    c->parent->free(c->parent->ctx, ptr);
+}
+
+void css_counting_allocator_init(css_counting_allocator *c,
+                                 const css_allocator *parent)
+{
+    c->allocator.malloc  = counting_malloc;
+    c->allocator.realloc = counting_realloc;
+    c->allocator.free    = counting_free;
+    c->allocator.ctx     = c;
+    c->parent = parent ? parent : &default_allocator;
+    c->allocations = 0;
+    c->frees = 0;
+    c->bytes = 0;
+}
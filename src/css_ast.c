@@ -11,13 +11,14 @@
 
 css_stylesheet *css_stylesheet_create(void)
 {
-    css_stylesheet *sheet = calloc(1, sizeof(css_stylesheet));
+    css_stylesheet *sheet = css_calloc(1, sizeof(css_stylesheet));
+    if (sheet) sheet->allocator = css_allocator_current();
     return sheet;
 }
 
 css_rule *css_rule_create_at(css_at_rule *ar)
 {
-    css_rule *rule = calloc(1, sizeof(css_rule));
+    css_rule *rule = css_calloc(1, sizeof(css_rule));
     if (!rule) return NULL;
     rule->type = CSS_NODE_AT_RULE;
     rule->u.at_rule = ar;
@@ -26,7 +27,7 @@ css_rule *css_rule_create_at(css_at_rule *ar)
 
 css_rule *css_rule_create_qualified(css_qualified_rule *qr)
 {
-    css_rule *rule = calloc(1, sizeof(css_rule));
+    css_rule *rule = css_calloc(1, sizeof(css_rule));
     if (!rule) return NULL;
     rule->type = CSS_NODE_QUALIFIED_RULE;
     rule->u.qualified_rule = qr;
@@ -35,45 +36,55 @@ css_rule *css_rule_create_qualified(css_qualified_rule *qr)
 
 css_at_rule *css_at_rule_create(const char *name)
 {
-    css_at_rule *ar = calloc(1, sizeof(css_at_rule));
+    css_at_rule *ar = css_calloc(1, sizeof(css_at_rule));
     if (!ar) return NULL;
-    if (name) ar->name = strdup(name);
+    ar->allocator = css_allocator_current();
+    if (name) ar->name = css_strdup(name);
     return ar;
 }
 
 css_qualified_rule *css_qualified_rule_create(void)
 {
-    css_qualified_rule *qr = calloc(1, sizeof(css_qualified_rule));
+    css_qualified_rule *qr = css_calloc(1, sizeof(css_qualified_rule));
+    if (qr) qr->allocator = css_allocator_current();
     return qr;
 }
 
 css_declaration *css_declaration_create(const char *name)
 {
-    css_declaration *decl = calloc(1, sizeof(css_declaration));
+    css_declaration *decl = css_calloc(1, sizeof(css_declaration));
     if (!decl) return NULL;
-    if (name) decl->name = strdup(name);
+    if (name) decl->name = css_strdup(name);
     return decl;
 }
 
 css_simple_block *css_simple_block_create(css_token_type associated)
 {
-    css_simple_block *block = calloc(1, sizeof(css_simple_block));
+    css_simple_block *block = css_calloc(1, sizeof(css_simple_block));
     if (!block) return NULL;
     block->associated_token = associated;
     return block;
 }
 
+css_simple_block *css_simple_block_ref(css_simple_block *block)
+{
+    if (block) {
+        atomic_fetch_add_explicit(&block->shares, 1, memory_order_relaxed);
+    }
+    return block;
+}
+
 css_function *css_function_create(const char *name)
 {
-    css_function *func = calloc(1, sizeof(css_function));
+    css_function *func = css_calloc(1, sizeof(css_function));
     if (!func) return NULL;
-    if (name) func->name = strdup(name);
+    if (name) func->name = css_strdup(name);
     return func;
 }
 
 css_component_value *css_component_value_create_token(css_token *token)
 {
-    css_component_value *cv = calloc(1, sizeof(css_component_value));
+    css_component_value *cv = css_calloc(1, sizeof(css_component_value));
     if (!cv) return NULL;
     cv->type = CSS_NODE_COMPONENT_VALUE;
     cv->u.token = token;
@@ -82,7 +93,7 @@ css_component_value *css_component_value_create_token(css_token *token)
 
 css_component_value *css_component_value_create_block(css_simple_block *block)
 {
-    css_component_value *cv = calloc(1, sizeof(css_component_value));
+    css_component_value *cv = css_calloc(1, sizeof(css_component_value));
     if (!cv) return NULL;
     cv->type = CSS_NODE_SIMPLE_BLOCK;
     cv->u.block = block;
@@ -91,13 +102,20 @@ css_component_value *css_component_value_create_block(css_simple_block *block)
 
 css_component_value *css_component_value_create_function(css_function *func)
 {
-    css_component_value *cv = calloc(1, sizeof(css_component_value));
+    css_component_value *cv = css_calloc(1, sizeof(css_component_value));
     if (!cv) return NULL;
     cv->type = CSS_NODE_FUNCTION;
     cv->u.function = func;
     return cv;
 }
 
+css_declaration_list *css_declaration_list_create(void)
+{
+    css_declaration_list *list = css_calloc(1, sizeof(css_declaration_list));
+    if (list) list->allocator = css_allocator_current();
+    return list;
+}
+
 /* ================================================================
  * Free functions (all NULL-safe)
  * ================================================================ */
@@ -118,51 +136,70 @@ void css_component_value_free(css_component_value *cv)
     default:
         break;
     }
-    free(cv);
+    css_free(cv);
 }
 
 void css_simple_block_free(css_simple_block *block)
 {
     if (!block) return;
+    /* Shared: drop this owner's reference only.  Owners may be on
+     * different threads (css_at_rule_rules() shares nested blocks). */
+    if (atomic_load_explicit(&block->shares, memory_order_acquire) > 0 &&
+        atomic_fetch_sub_explicit(&block->shares, 1,
+                                  memory_order_acq_rel) > 0)
+        return;
     for (size_t i = 0; i < block->value_count; i++) {
         css_component_value_free(block->values[i]);
     }
-    free(block->values);
-    free(block);
+    css_free(block->values);
+    css_free(block);
 }
 
 void css_function_free(css_function *func)
 {
     if (!func) return;
-    free(func->name);
+    css_free(func->name);
     for (size_t i = 0; i < func->value_count; i++) {
         css_component_value_free(func->values[i]);
     }
-    free(func->values);
-    free(func);
+    css_free(func->values);
+    css_free(func);
 }
 
 void css_declaration_free(css_declaration *decl)
 {
     if (!decl) return;
-    free(decl->name);
+    css_free(decl->name);
     for (size_t i = 0; i < decl->value_count; i++) {
         css_component_value_free(decl->values[i]);
     }
-    free(decl->values);
-    free(decl);
+    css_free(decl->values);
+    css_free(decl);
+}
+
+void css_declaration_list_free(css_declaration_list *list)
+{
+    if (!list) return;
+    const css_allocator *prev = css_allocator_use(list->allocator);
+    for (size_t i = 0; i < list->declaration_count; i++) {
+        css_declaration_free(list->declarations[i]);
+    }
+    css_free(list->declarations);
+    css_free(list);
+    css_allocator_use(prev);
 }
 
 void css_at_rule_free(css_at_rule *ar)
 {
     if (!ar) return;
-    free(ar->name);
+    css_free(ar->name);
     for (size_t i = 0; i < ar->prelude_count; i++) {
         css_component_value_free(ar->prelude[i]);
     }
-    free(ar->prelude);
+    css_free(ar->prelude);
     css_simple_block_free(ar->block);
-    free(ar);
+    css_stylesheet_free(atomic_load(&ar->rules_cache));
+    css_free(ar);
 }
 
 void css_qualified_rule_free(css_qualified_rule *qr)
@@ -171,10 +208,11 @@ void css_qualified_rule_free(css_qualified_rule *qr)
     for (size_t i = 0; i < qr->prelude_count; i++) {
         css_component_value_free(qr->prelude[i]);
     }
-    free(qr->prelude);
+    css_free(qr->prelude);
+    css_free(qr->prelude_text);
     css_simple_block_free(qr->block);
-    css_selector_list_free(qr->selectors);
-    free(qr);
+    css_selector_list_free(atomic_load(&qr->selectors_cache));
+    css_free(qr);
 }
 
 void css_rule_free(css_rule *rule)
@@ -190,17 +228,19 @@ void css_rule_free(css_rule *rule)
     default:
         break;
     }
-    free(rule);
+    css_free(rule);
 }
 
 void css_stylesheet_free(css_stylesheet *sheet)
 {
     if (!sheet) return;
+    const css_allocator *prev = css_allocator_use(sheet->allocator);
     for (size_t i = 0; i < sheet->rule_count; i++) {
         css_rule_free(sheet->rules[i]);
     }
-    free(sheet->rules);
-    free(sheet);
+    css_free(sheet->rules);
+    css_free(sheet);
+    css_allocator_use(prev);
 }
 
 /* ================================================================
@@ -212,7 +252,7 @@ void css_stylesheet_append_rule(css_stylesheet *sheet, css_rule *rule)
     if (!sheet || !rule) return;
     if (sheet->rule_count >= sheet->rule_cap) {
         sheet->rule_cap = sheet->rule_cap ? sheet->rule_cap * 2 : 4;
-        sheet->rules = realloc(sheet->rules,
+        sheet->rules = css_realloc(sheet->rules,
                                sheet->rule_cap * sizeof(css_rule *));
     }
     sheet->rules[sheet->rule_count++] = rule;
@@ -223,7 +263,7 @@ void css_at_rule_append_prelude(css_at_rule *ar, css_component_value *cv)
     if (!ar || !cv) return;
     if (ar->prelude_count >= ar->prelude_cap) {
         ar->prelude_cap = ar->prelude_cap ? ar->prelude_cap * 2 : 4;
-        ar->prelude = realloc(ar->prelude,
+        ar->prelude = css_realloc(ar->prelude,
                               ar->prelude_cap * sizeof(css_component_value *));
     }
     ar->prelude[ar->prelude_count++] = cv;
@@ -235,7 +275,7 @@ void css_qualified_rule_append_prelude(css_qualified_rule *qr,
     if (!qr || !cv) return;
     if (qr->prelude_count >= qr->prelude_cap) {
         qr->prelude_cap = qr->prelude_cap ? qr->prelude_cap * 2 : 4;
-        qr->prelude = realloc(qr->prelude,
+        qr->prelude = css_realloc(qr->prelude,
                               qr->prelude_cap * sizeof(css_component_value *));
     }
     qr->prelude[qr->prelude_count++] = cv;
@@ -247,7 +287,7 @@ void css_simple_block_append_value(css_simple_block *block,
     if (!block || !cv) return;
     if (block->value_count >= block->value_cap) {
         block->value_cap = block->value_cap ? block->value_cap * 2 : 4;
-        block->values = realloc(block->values,
+        block->values = css_realloc(block->values,
                                 block->value_cap * sizeof(css_component_value *));
     }
     block->values[block->value_count++] = cv;
@@ -258,7 +298,7 @@ void css_function_append_value(css_function *func, css_component_value *cv)
     if (!func || !cv) return;
     if (func->value_count >= func->value_cap) {
         func->value_cap = func->value_cap ? func->value_cap * 2 : 4;
-        func->values = realloc(func->values,
+        func->values = css_realloc(func->values,
                                func->value_cap * sizeof(css_component_value *));
     }
     func->values[func->value_count++] = cv;
@@ -269,12 +309,169 @@ void css_declaration_append_value(css_declaration *decl, css_component_value *cv
     if (!decl || !cv) return;
     if (decl->value_count >= decl->value_cap) {
         decl->value_cap = decl->value_cap ? decl->value_cap * 2 : 4;
-        decl->values = realloc(decl->values,
+        decl->values = css_realloc(decl->values,
                                decl->value_cap * sizeof(css_component_value *));
     }
     decl->values[decl->value_count++] = cv;
 }
 
+void css_declaration_list_append(css_declaration_list *list,
+                                 css_declaration *decl)
+{
+    if (!list || !decl) return;
+    if (list->declaration_count >= list->declaration_cap) {
+        list->declaration_cap = list->declaration_cap ?
+                                list->declaration_cap * 2 : 4;
+        list->declarations = css_realloc(list->declarations,
+            list->declaration_cap * sizeof(css_declaration *));
+    }
+    list->declarations[list->declaration_count++] = decl;
+}
+
+/* ================================================================
+ * Memory accounting
+ * ================================================================ */
+
+/* Shared blocks already counted (open addressing, power-of-two cap) */
+typedef struct {
+    const css_simple_block **slots;
+    size_t count;
+    size_t cap;
+} block_set;
+
+static size_t block_slot(const css_simple_block *block, size_t cap)
+{
+    uintptr_t h = (uintptr_t)block;
+    h ^= h >> 17;
+    h *= (uintptr_t)0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 7) & (cap - 1);
+}
+
+/* Returns true if block was not in the set yet */
+static bool block_set_insert(block_set *set, const css_simple_block *block)
+{
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 64;
+        const css_simple_block **slots = css_calloc(cap, sizeof(*slots));
+        if (!slots) return true;   /* may count a block twice */
+        for (size_t i = 0; i < set->cap; i++) {
+            if (!set->slots[i]) continue;
+            size_t j = block_slot(set->slots[i], cap);
+            while (slots[j]) j = (j + 1) & (cap - 1);
+            slots[j] = set->slots[i];
+        }
+        css_free(set->slots);
+        set->slots = slots;
+        set->cap = cap;
+    }
+    size_t j = block_slot(block, set->cap);
+    while (set->slots[j]) {
+        if (set->slots[j] == block) return false;
+        j = (j + 1) & (set->cap - 1);
+    }
+    set->slots[j] = block;
+    set->count++;
+    return true;
+}
+
+static size_t string_size(const char *s)
+{
+    return s ? strlen(s) + 1 : 0;
+}
+
+static void usage_values(css_memory_usage *u, block_set *seen,
+                         css_component_value **values, size_t count,
+                         size_t cap);
+
+static void usage_block(css_memory_usage *u, block_set *seen,
+                        const css_simple_block *block)
+{
+    if (!block) return;
+    if (block->shares > 0 && !block_set_insert(seen, block)) return;
+    u->blocks += sizeof(*block);
+    usage_values(u, seen, block->values, block->value_count,
+                 block->value_cap);
+}
+
+static void usage_values(css_memory_usage *u, block_set *seen,
+                         css_component_value **values, size_t count,
+                         size_t cap)
+{
+    u->value_arrays += count * sizeof(*values);
+    u->value_slack += (cap - count) * sizeof(*values);
+    for (size_t i = 0; i < count; i++) {
+        const css_component_value *cv = values[i];
+        if (!cv) continue;
+        u->values += sizeof(*cv);
+        switch (cv->type) {
+        case CSS_NODE_COMPONENT_VALUE:
+            if (cv->u.token) {
+                u->tokens += sizeof(*cv->u.token);
+                u->token_strings += string_size(cv->u.token->value) +
+                                    string_size(cv->u.token->unit);
+            }
+            break;
+        case CSS_NODE_SIMPLE_BLOCK:
+            usage_block(u, seen, cv->u.block);
+            break;
+        case CSS_NODE_FUNCTION:
+            if (cv->u.function) {
+                const css_function *fn = cv->u.function;
+                u->blocks += sizeof(*fn) + string_size(fn->name);
+                usage_values(u, seen, fn->values, fn->value_count,
+                             fn->value_cap);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* sheet's rules, and those of at-rules whose rule lists were parsed */
+static void usage_rules(css_memory_usage *u, block_set *seen,
+                        const css_stylesheet *sheet)
+{
+    u->rules += sizeof(*sheet) + sheet->rule_cap * sizeof(*sheet->rules);
+    for (size_t i = 0; i < sheet->rule_count; i++) {
+        const css_rule *rule = sheet->rules[i];
+        u->rules += sizeof(*rule);
+        if (rule->type == CSS_NODE_AT_RULE) {
+            const css_at_rule *ar = rule->u.at_rule;
+            u->rules += sizeof(*ar) + string_size(ar->name);
+            usage_values(u, seen, ar->prelude, ar->prelude_count,
+                         ar->prelude_cap);
+            usage_block(u, seen, ar->block);
+            const css_stylesheet *nested = atomic_load(&ar->rules_cache);
+            if (nested) usage_rules(u, seen, nested);
+        } else {
+            const css_qualified_rule *qr = rule->u.qualified_rule;
+            u->rules += sizeof(*qr) + string_size(qr->prelude_text);
+            usage_values(u, seen, qr->prelude, qr->prelude_count,
+                         qr->prelude_cap);
+            usage_block(u, seen, qr->block);
+            u->selectors += css_selector_list_memory_usage(
+                atomic_load(&qr->selectors_cache));
+        }
+    }
+}
+
+void css_stylesheet_memory_usage(const css_stylesheet *sheet,
+                                 css_memory_usage *usage)
+{
+    if (!usage) return;
+    memset(usage, 0, sizeof(*usage));
+    if (!sheet) return;
+
+    block_set seen = { NULL, 0, 0 };
+    css_memory_usage *u = usage;
+    usage_rules(u, &seen, sheet);
+    css_free(seen.slots);
+
+    u->total = u->tokens + u->token_strings + u->values + u->value_arrays +
+               u->value_slack + u->blocks + u->selectors + u->rules;
+}
+
 /* ================================================================
  * Dump (debug output)
  * ================================================================ */
@@ -282,8 +479,12 @@ void css_declaration_append_value(css_declaration *decl, css_component_value *cv
 /* Print indentation: depth levels of "  " (two spaces each) */
 static void dump_indent(FILE *out, int depth)
 {
-    for (int i = 0; i < depth; i++) {
-        fprintf(out, "  ");
+    static const char spaces[] = "                                ";
+    size_t n = depth > 0 ? (size_t)depth * 2 : 0;
+    while (n > 0) {
+        size_t chunk = n < sizeof(spaces) - 1 ? n : sizeof(spaces) - 1;
+        fwrite(spaces, 1, chunk, out);
+        n -= chunk;
     }
 }
 
@@ -456,6 +657,9 @@ static void dump_rule(FILE *out, css_rule *rule, int depth)
             for (size_t i = 0; i < qr->prelude_count; i++) {
                 dump_component_value(out, qr->prelude[i], depth + 2);
             }
+        } else if (qr->prelude_text) {
+            dump_indent(out, depth + 1);
+            fprintf(out, "prelude: \"%s\"\n", qr->prelude_text);
         }
         if (qr->block) {
             dump_simple_block(out, qr->block, depth + 1);
@@ -0,0 +1,198 @@
+#define _POSIX_C_SOURCE 200809L
+#include "css_batch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* ================================================================
+ * Shared job state and per-worker state
+ * ================================================================ */
+
+typedef struct {
+    const char *const *paths;
+    css_batch_result *results;
+    size_t count;
+    atomic_size_t next;         /* next unclaimed file index */
+    const css_allocator *allocator;     /* the caller's current one */
+} batch_job;
+
+typedef struct {
+    batch_job *job;
+    css_parser_ctx *parser;
+    char *buf;
+    size_t buf_cap;
+} batch_worker;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Read path into the worker's buffer, growing it as needed.
+ * Returns 0 or an errno value. */
+static int read_file(batch_worker *w, const char *path, size_t *length)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        close(fd);
+        return EISDIR;
+    }
+
+    size_t need = (size_t)st.st_size + 1;
+    if (need > w->buf_cap) {
+        char *nb = css_realloc(w->buf, need);
+        if (!nb) {
+            close(fd);
+            return ENOMEM;
+        }
+        w->buf = nb;
+        w->buf_cap = need;
+    }
+
+    size_t total = 0;
+    while (total < (size_t)st.st_size) {
+        ssize_t n = read(fd, w->buf + total, (size_t)st.st_size - total);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            int err = errno;
+            close(fd);
+            return err;
+        }
+        if (n == 0) break;      /* file shrank underneath us */
+        total += (size_t)n;
+    }
+    close(fd);
+
+    w->buf[total] = '\0';
+    *length = total;
+    return 0;
+}
+
+static void parse_one(batch_worker *w, size_t index)
+{
+    css_batch_result *r = &w->job->results[index];
+    memset(r, 0, sizeof(*r));
+    r->path = w->job->paths[index];
+
+    double start = now_seconds();
+    size_t length = 0;
+    r->error = read_file(w, r->path, &length);
+    if (r->error == 0) {
+        r->bytes = length;
+        css_stylesheet *sheet =
+            css_parser_parse_stylesheet(w->parser, w->buf, length);
+        if (sheet) {
+            r->rule_count = sheet->rule_count;
+            r->ok = true;
+            css_stylesheet_free(sheet);
+        } else {
+            r->error = ENOMEM;
+        }
+    }
+    r->seconds = now_seconds() - start;
+}
+
+static void *worker_main(void *arg)
+{
+    batch_worker *w = arg;
+    batch_job *job = w->job;
+    /* Buffers grow in the caller's allocator, whatever thread we are */
+    const css_allocator *prev = css_allocator_use(job->allocator);
+    for (;;) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->count) break;
+        parse_one(w, i);
+    }
+    css_allocator_use(prev);
+    return NULL;
+}
+
+/* ================================================================
+ * css_batch_parse_files (public API)
+ * ================================================================ */
+
+bool css_batch_parse_files(const char *const *paths, size_t count,
+                           const css_batch_options *opts,
+                           css_batch_result *results)
+{
+    if (count == 0) return true;
+    if (!paths || !results) return false;
+
+    css_parser_options parser_options;
+    memset(&parser_options, 0, sizeof(parser_options));
+    size_t nworkers = 0;
+    if (opts) {
+        parser_options = opts->parser;
+        nworkers = opts->workers;
+    }
+    if (nworkers == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpu > 0 ? (size_t)ncpu : 1;
+    }
+    if (nworkers > count) nworkers = count;
+
+    batch_job job;
+    job.paths = paths;
+    job.results = results;
+    job.count = count;
+    atomic_init(&job.next, 0);
+    job.allocator = css_allocator_current();
+
+    batch_worker *workers = css_calloc(nworkers, sizeof(*workers));
+    pthread_t *threads = css_calloc(nworkers, sizeof(*threads));
+    if (!workers || !threads) {
+        css_free(workers);
+        css_free(threads);
+        return false;
+    }
+
+    size_t ready = 0;
+    for (; ready < nworkers; ready++) {
+        workers[ready].job = &job;
+        workers[ready].parser = css_parser_create();
+        if (!workers[ready].parser) break;
+        css_parser_set_options(workers[ready].parser, &parser_options);
+    }
+
+    bool ok = ready > 0;
+    if (ok) {
+        /* Worker 0 runs on the calling thread */
+        size_t started = 1;
+        for (; started < ready; started++) {
+            if (pthread_create(&threads[started], NULL, worker_main,
+                               &workers[started]) != 0)
+                break;
+        }
+        worker_main(&workers[0]);
+        for (size_t i = 1; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (!results[i].ok) ok = false;
+        }
+    }
+
+    for (size_t i = 0; i < nworkers; i++) {
+        css_parser_free(workers[i].parser);
+        css_free(workers[i].buf);
+    }
+    css_free(workers);
+    css_free(threads);
+    return ok;
+}
@@ -0,0 +1,125 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_bloom.h"
+#include "css_hash.h"
+#include <string.h>
+
+/* ================================================================
+ * Key hashes: css_hash_name() folded to 32 bits, salted per kind so a
+ * tag, an id and a class with the same name hash differently
+ * ================================================================ */
+
+static uint32_t hash_key(char salt, const char *name, bool fold_case)
+{
+    uint64_t h = css_hash_bytes(CSS_HASH_SEED, &salt, 1);
+    h = css_hash_name(h, name, fold_case);
+    uint32_t folded = (uint32_t)(h ^ (h >> 32));
+    return folded ? folded : 1;
+}
+
+uint32_t css_bloom_hash_tag(const char *name)
+{
+    return hash_key('t', name, true);
+}
+
+uint32_t css_bloom_hash_id(const char *name)
+{
+    return hash_key('#', name, false);
+}
+
+uint32_t css_bloom_hash_class(const char *name)
+{
+    return hash_key('.', name, false);
+}
+
+/* ================================================================
+ * Counting filter: two slots per hash, from its low and high halves
+ * ================================================================ */
+
+#define BLOOM_MASK (CSS_BLOOM_SIZE - 1)
+
+static uint32_t slot1(uint32_t hash)
+{
+    return hash & BLOOM_MASK;
+}
+
+static uint32_t slot2(uint32_t hash)
+{
+    return (hash >> 16) & BLOOM_MASK;
+}
+
+void css_bloom_clear(css_bloom_filter *filter)
+{
+    memset(filter->counters, 0, sizeof(filter->counters));
+}
+
+static void counter_inc(uint8_t *c)
+{
+    if (*c != UINT8_MAX) (*c)++;
+}
+
+static void counter_dec(uint8_t *c)
+{
+    if (*c != 0 && *c != UINT8_MAX) (*c)--;
+}
+
+void css_bloom_add(css_bloom_filter *filter, uint32_t hash)
+{
+    counter_inc(&filter->counters[slot1(hash)]);
+    counter_inc(&filter->counters[slot2(hash)]);
+}
+
+void css_bloom_remove(css_bloom_filter *filter, uint32_t hash)
+{
+    counter_dec(&filter->counters[slot1(hash)]);
+    counter_dec(&filter->counters[slot2(hash)]);
+}
+
+bool css_bloom_may_contain(const css_bloom_filter *filter, uint32_t hash)
+{
+    return filter->counters[slot1(hash)] && filter->counters[slot2(hash)];
+}
+
+/* ================================================================
+ * Elements
+ * ================================================================ */
+
+static void update_element(css_bloom_filter *filter,
+                           const css_element_adapter *a, const void *el,
+                           void (*update)(css_bloom_filter *, uint32_t))
+{
+    const char *tag = a->tag_name(a->ctx, el);
+    if (tag) update(filter, css_bloom_hash_tag(tag));
+    const char *id = a->id(a->ctx, el);
+    if (id) update(filter, css_bloom_hash_id(id));
+    const char *const *classes = NULL;
+    size_t count = a->classes(a->ctx, el, &classes);
+    for (size_t i = 0; i < count; i++) {
+        update(filter, css_bloom_hash_class(classes[i]));
+    }
+}
+
+void css_bloom_push_element(css_bloom_filter *filter,
+                            const css_element_adapter *adapter,
+                            const void *el)
+{
+    update_element(filter, adapter, el, css_bloom_add);
+}
+
+void css_bloom_pop_element(css_bloom_filter *filter,
+                           const css_element_adapter *adapter,
+                           const void *el)
+{
+    update_element(filter, adapter, el, css_bloom_remove);
+}
+
+bool css_bloom_may_match(const css_bloom_filter *filter,
+                         const css_complex_selector *sel)
+{
+    for (size_t i = 0; i < CSS_ANCESTOR_HASH_COUNT; i++) {
+        uint32_t h = sel->ancestor_hashes[i];
+        if (!h) break;
+        if (!css_bloom_may_contain(filter, h)) return false;
+    }
+    return true;
+}
@@ -0,0 +1,109 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_buffer.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+void css_buffer_init(css_buffer *b)
+{
+    memset(b, 0, sizeof(*b));
+    b->fd = -1;
+    b->allocator = css_allocator_current();
+}
+
+void css_buffer_init_fd(css_buffer *b, int fd)
+{
+    css_buffer_init(b);
+    b->fd = fd;
+}
+
+void css_buffer_free(css_buffer *b)
+{
+    if (!b) return;
+    const css_allocator *prev = css_allocator_use(b->allocator);
+    css_free(b->data);
+    css_allocator_use(prev);
+    b->data = NULL;
+    b->length = 0;
+    b->cap = 0;
+}
+
+/* Write everything pending, retrying short writes */
+static bool write_out(css_buffer *b)
+{
+    size_t done = 0;
+    while (done < b->length) {
+        ssize_t n = write(b->fd, b->data + done, b->length - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            b->failed = true;
+            return false;
+        }
+        done += (size_t)n;
+    }
+    b->length = 0;
+    return true;
+}
+
+static bool reserve(css_buffer *b, size_t extra)
+{
+    if (b->length + extra <= b->cap) return true;
+
+    size_t cap = b->cap ? b->cap : (b->fd >= 0 ? CSS_BUFFER_FLUSH_SIZE : 256);
+    while (cap < b->length + extra) cap *= 2;
+    const css_allocator *prev = css_allocator_use(b->allocator);
+    char *data = css_realloc(b->data, cap);
+    css_allocator_use(prev);
+    if (!data) {
+        b->failed = true;
+        return false;
+    }
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+void css_buffer_append(css_buffer *b, const char *data, size_t length)
+{
+    if (b->failed || length == 0) return;
+
+    if (b->fd >= 0 && b->length + length > CSS_BUFFER_FLUSH_SIZE) {
+        if (!write_out(b)) return;
+        if (length >= CSS_BUFFER_FLUSH_SIZE) {
+            /* Large chunk: write it straight through */
+            css_buffer tmp = *b;
+            tmp.data = (char *)data;
+            tmp.length = length;
+            if (!write_out(&tmp)) b->failed = true;
+            return;
+        }
+    }
+
+    if (!reserve(b, length)) return;
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+}
+
+void css_buffer_puts(css_buffer *b, const char *s)
+{
+    css_buffer_append(b, s, strlen(s));
+}
+
+void css_buffer_putc(css_buffer *b, char c)
+{
+    if (b->failed) return;
+    if (b->length < b->cap &&
+        (b->fd < 0 || b->length < CSS_BUFFER_FLUSH_SIZE)) {
+        b->data[b->length++] = c;
+        return;
+    }
+    css_buffer_append(b, &c, 1);
+}
+
+bool css_buffer_flush(css_buffer *b)
+{
+    if (b->failed) return false;
+    if (b->fd >= 0 && b->length > 0) return write_out(b);
+    return true;
+}
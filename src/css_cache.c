@@ -0,0 +1,88 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_cache.h"
+#include "css_parser.h"
+#include "css_hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* ================================================================
+ * Key
+ * ================================================================ */
+
+uint64_t css_cache_key(const char *input, size_t length)
+{
+    /* Seed with the versions so each release gets its own key space */
+    static const char seed[] = "css_parser " CSS_PARSER_VERSION;
+    uint32_t flat_version = CSS_FLAT_VERSION;
+
+    uint64_t h = css_hash_bytes(CSS_HASH_SEED, seed, sizeof(seed) - 1);
+    h = css_hash_bytes(h, &flat_version, sizeof(flat_version));
+    return css_hash_bytes(h, input, length);
+}
+
+/* ================================================================
+ * Entry paths
+ * ================================================================ */
+
+static char *entry_path(const char *dir, uint64_t key, const char *suffix)
+{
+    size_t len = strlen(dir) + 1 + 16 + strlen(suffix) + 1;
+    char *path = css_malloc(len);
+    if (!path) return NULL;
+    snprintf(path, len, "%s/%016llx%s", dir, (unsigned long long)key,
+             suffix);
+    return path;
+}
+
+/* ================================================================
+ * Load / store
+ * ================================================================ */
+
+const css_flat_sheet *css_cache_load(const char *dir, uint64_t key)
+{
+    if (!dir) return NULL;
+    char *path = entry_path(dir, key, ".cssb");
+    if (!path) return NULL;
+    const css_flat_sheet *flat = css_flat_map(path);
+    css_free(path);
+    return flat;
+}
+
+bool css_cache_store(const char *dir, uint64_t key,
+                     const css_flat_sheet *flat)
+{
+    if (!dir || !flat) return false;
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) return false;
+
+    char *path = entry_path(dir, key, ".cssb");
+    char *tmp = entry_path(dir, key, ".cssb.XXXXXX");
+    if (!path || !tmp) {
+        css_free(path);
+        css_free(tmp);
+        return false;
+    }
+
+    /* Write a private temporary, then publish it with an atomic rename */
+    bool ok = false;
+    int fd = mkstemp(tmp);
+    if (fd >= 0) {
+        FILE *out = fdopen(fd, "wb");
+        if (out) {
+            ok = fchmod(fd, 0644) == 0 && css_flat_write(flat, out);
+            if (fclose(out) != 0) ok = false;
+        } else {
+            close(fd);
+        }
+        if (ok) ok = rename(tmp, path) == 0;
+        if (!ok) unlink(tmp);
+    }
+
+    css_free(path);
+    css_free(tmp);
+    return ok;
+}
@@ -0,0 +1,932 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_dump.h"
+#include "css_parser.h"
+#include "css_selector.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* ================================================================
+ * Shared helpers
+ * ================================================================ */
+
+typedef struct {
+    css_buffer *out;
+    css_dump_format format;
+} dump_ctx;
+
+static void put_indent(dump_ctx *d, int depth)
+{
+    static const char spaces[] = "                                ";
+    size_t n = (size_t)depth * 2;
+    while (n > 0) {
+        size_t chunk = n < sizeof(spaces) - 1 ? n : sizeof(spaces) - 1;
+        css_buffer_append(d->out, spaces, chunk);
+        n -= chunk;
+    }
+}
+
+static void put_fmt_number(dump_ctx *d, const char *fmt, double v)
+{
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), fmt, v);
+    if (n > 0) css_buffer_append(d->out, buf, (size_t)n);
+}
+
+static void put_int(dump_ctx *d, long long v)
+{
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%lld", v);
+    if (n > 0) css_buffer_append(d->out, buf, (size_t)n);
+}
+
+static const char *block_open_text(css_token_type type)
+{
+    switch (type) {
+    case CSS_TOKEN_OPEN_CURLY:  return "{";
+    case CSS_TOKEN_OPEN_SQUARE: return "[";
+    case CSS_TOKEN_OPEN_PAREN:  return "(";
+    default:                    return "?";
+    }
+}
+
+static const char *block_close_text(css_token_type type)
+{
+    switch (type) {
+    case CSS_TOKEN_OPEN_CURLY:  return "}";
+    case CSS_TOKEN_OPEN_SQUARE: return "]";
+    case CSS_TOKEN_OPEN_PAREN:  return ")";
+    default:                    return "?";
+    }
+}
+
+/* Declarations of a {} block, or NULL (raw values) */
+static css_declaration_list *block_declarations(css_simple_block *block)
+{
+    if (block->associated_token != CSS_TOKEN_OPEN_CURLY) return NULL;
+    css_declaration_list *decls = css_parse_block_declarations(block);
+    if (decls && decls->declaration_count == 0) {
+        css_declaration_list_free(decls);
+        return NULL;
+    }
+    return decls;
+}
+
+/* ================================================================
+ * TEXT (css_parse_dump format)
+ * ================================================================ */
+
+static void text_cv(dump_ctx *d, css_component_value *cv, int depth);
+
+static void text_token(dump_ctx *d, css_token *tok)
+{
+    css_buffer *out = d->out;
+    if (!tok) {
+        css_buffer_puts(out, "<null>");
+        return;
+    }
+    const char *value = tok->value ? tok->value : "";
+    bool integer = tok->number_type == CSS_NUM_INTEGER;
+
+    switch (tok->type) {
+    case CSS_TOKEN_IDENT:
+    case CSS_TOKEN_FUNCTION:
+    case CSS_TOKEN_AT_KEYWORD:
+    case CSS_TOKEN_STRING:
+    case CSS_TOKEN_URL:
+        css_buffer_putc(out, '<');
+        css_buffer_puts(out, css_token_type_name(tok->type));
+        css_buffer_append(out, " \"", 2);
+        css_buffer_puts(out, value);
+        css_buffer_append(out, "\">", 2);
+        break;
+    case CSS_TOKEN_HASH:
+        css_buffer_append(out, "<hash \"", 7);
+        css_buffer_puts(out, value);
+        css_buffer_putc(out, '"');
+        if (tok->hash_type == CSS_HASH_ID) css_buffer_append(out, " id", 3);
+        css_buffer_putc(out, '>');
+        break;
+    case CSS_TOKEN_NUMBER:
+    case CSS_TOKEN_PERCENTAGE:
+    case CSS_TOKEN_DIMENSION:
+        css_buffer_putc(out, '<');
+        css_buffer_puts(out, css_token_type_name(tok->type));
+        css_buffer_putc(out, ' ');
+        if (integer)
+            put_int(d, (int)tok->numeric_value);
+        else
+            put_fmt_number(d, "%g", tok->numeric_value);
+        if (tok->type == CSS_TOKEN_DIMENSION) {
+            css_buffer_append(out, " \"", 2);
+            css_buffer_puts(out, tok->unit ? tok->unit : "");
+            css_buffer_putc(out, '"');
+        }
+        css_buffer_putc(out, '>');
+        break;
+    case CSS_TOKEN_DELIM: {
+        char buf[24];
+        int n;
+        if (tok->delim_codepoint < 0x80)
+            n = snprintf(buf, sizeof(buf), "<delim '%c'>",
+                         (char)tok->delim_codepoint);
+        else
+            n = snprintf(buf, sizeof(buf), "<delim U+%04X>",
+                         tok->delim_codepoint);
+        if (n > 0) css_buffer_append(out, buf, (size_t)n);
+        break;
+    }
+    default:
+        css_buffer_putc(out, '<');
+        css_buffer_puts(out, css_token_type_name(tok->type));
+        css_buffer_putc(out, '>');
+        break;
+    }
+}
+
+static void text_declaration(dump_ctx *d, css_declaration *decl, int depth)
+{
+    put_indent(d, depth);
+    css_buffer_append(d->out, "DECLARATION \"", 13);
+    css_buffer_puts(d->out, decl->name ? decl->name : "");
+    css_buffer_putc(d->out, '"');
+    if (decl->important) css_buffer_puts(d->out, " !important");
+    css_buffer_putc(d->out, '\n');
+    for (size_t i = 0; i < decl->value_count; i++) {
+        text_cv(d, decl->values[i], depth + 1);
+    }
+}
+
+static void text_block(dump_ctx *d, css_simple_block *block, int depth)
+{
+    if (!block) return;
+    put_indent(d, depth);
+    css_buffer_append(d->out, "BLOCK ", 6);
+    css_buffer_puts(d->out, block_open_text(block->associated_token));
+    css_buffer_puts(d->out, block_close_text(block->associated_token));
+    css_buffer_putc(d->out, '\n');
+
+    css_declaration_list *decls = block_declarations(block);
+    if (decls) {
+        for (size_t i = 0; i < decls->declaration_count; i++) {
+            text_declaration(d, decls->declarations[i], depth + 1);
+        }
+        css_declaration_list_free(decls);
+        return;
+    }
+    for (size_t i = 0; i < block->value_count; i++) {
+        text_cv(d, block->values[i], depth + 1);
+    }
+}
+
+static void text_cv(dump_ctx *d, css_component_value *cv, int depth)
+{
+    if (!cv) return;
+    switch (cv->type) {
+    case CSS_NODE_COMPONENT_VALUE:
+        put_indent(d, depth);
+        text_token(d, cv->u.token);
+        css_buffer_putc(d->out, '\n');
+        break;
+    case CSS_NODE_SIMPLE_BLOCK:
+        text_block(d, cv->u.block, depth);
+        break;
+    case CSS_NODE_FUNCTION:
+        put_indent(d, depth);
+        css_buffer_append(d->out, "FUNCTION \"", 10);
+        if (cv->u.function && cv->u.function->name)
+            css_buffer_puts(d->out, cv->u.function->name);
+        css_buffer_append(d->out, "\"\n", 2);
+        if (cv->u.function) {
+            for (size_t i = 0; i < cv->u.function->value_count; i++) {
+                text_cv(d, cv->u.function->values[i], depth + 1);
+            }
+        }
+        break;
+    default:
+        put_indent(d, depth);
+        css_buffer_puts(d->out, "<unknown node type ");
+        put_int(d, cv->type);
+        css_buffer_append(d->out, ">\n", 2);
+        break;
+    }
+}
+
+static bool has_nth(const css_simple_selector *sel)
+{
+    return sel->type == SEL_PSEUDO_CLASS && sel->pseudo >= PSEUDO_NTH_CHILD;
+}
+
+static void text_selectors(dump_ctx *d, css_selector_list *list, int depth)
+{
+    css_buffer *out = d->out;
+    put_indent(d, depth);
+    css_buffer_puts(out, "SELECTOR_LIST (");
+    put_int(d, (long long)list->count);
+    css_buffer_append(out, ")\n", 2);
+
+    for (size_t i = 0; i < list->count; i++) {
+        css_complex_selector *cx = list->selectors[i];
+        if (!cx) continue;
+        put_indent(d, depth + 1);
+        css_buffer_puts(out, "COMPLEX_SELECTOR\n");
+
+        for (size_t j = 0; j < cx->count; j++) {
+            if (j > 0) {
+                put_indent(d, depth + 2);
+                css_buffer_puts(out, "COMBINATOR \"");
+                css_buffer_puts(out, css_combinator_name(cx->combinators[j - 1]));
+                css_buffer_append(out, "\"\n", 2);
+            }
+            css_compound_selector *comp = cx->compounds[j];
+            if (!comp) continue;
+            put_indent(d, depth + 2);
+            css_buffer_puts(out, "COMPOUND_SELECTOR\n");
+
+            for (size_t k = 0; k < comp->count; k++) {
+                css_simple_selector *sel = comp->selectors[k];
+                if (!sel) continue;
+                put_indent(d, depth + 3);
+                css_buffer_putc(out, '<');
+                css_buffer_puts(out, css_simple_selector_type_name(sel->type));
+                if (sel->type == SEL_ATTRIBUTE) {
+                    css_buffer_append(out, " [", 2);
+                    css_buffer_puts(out, sel->attr_name ? sel->attr_name : "");
+                    if (sel->attr_match != ATTR_EXISTS && sel->attr_value) {
+                        css_buffer_puts(out, css_attr_match_name(sel->attr_match));
+                        css_buffer_putc(out, '"');
+                        css_buffer_puts(out, sel->attr_value);
+                        css_buffer_putc(out, '"');
+                    }
+                    if (sel->attr_case_insensitive)
+                        css_buffer_append(out, " i", 2);
+                    css_buffer_putc(out, ']');
+                } else if (sel->name) {
+                    css_buffer_append(out, " \"", 2);
+                    css_buffer_puts(out, sel->name);
+                    if (has_nth(sel)) {
+                        char nth[32];
+                        css_nth_format(sel->nth, nth, sizeof(nth));
+                        css_buffer_putc(out, '(');
+                        css_buffer_puts(out, nth);
+                        css_buffer_putc(out, ')');
+                    }
+                    css_buffer_putc(out, '"');
+                }
+                css_buffer_append(out, ">\n", 2);
+                if (sel->argument)
+                    text_selectors(d, sel->argument, depth + 4);
+            }
+        }
+    }
+}
+
+static void text_prelude(dump_ctx *d, css_component_value **prelude,
+                         size_t count)
+{
+    if (count == 0) return;
+    put_indent(d, 2);
+    css_buffer_puts(d->out, "prelude:\n");
+    for (size_t i = 0; i < count; i++) {
+        text_cv(d, prelude[i], 3);
+    }
+}
+
+static void text_stylesheet(dump_ctx *d, css_stylesheet *sheet)
+{
+    css_buffer_puts(d->out, "STYLESHEET\n");
+    for (size_t i = 0; i < sheet->rule_count; i++) {
+        css_rule *rule = sheet->rules[i];
+        if (!rule) continue;
+
+        switch (rule->type) {
+        case CSS_NODE_AT_RULE: {
+            css_at_rule *ar = rule->u.at_rule;
+            if (!ar) break;
+            put_indent(d, 1);
+            css_buffer_puts(d->out, "AT_RULE \"");
+            css_buffer_puts(d->out, ar->name ? ar->name : "");
+            css_buffer_append(d->out, "\"\n", 2);
+            text_prelude(d, ar->prelude, ar->prelude_count);
+            text_block(d, ar->block, 2);
+            break;
+        }
+        case CSS_NODE_QUALIFIED_RULE: {
+            css_qualified_rule *qr = rule->u.qualified_rule;
+            if (!qr) break;
+            put_indent(d, 1);
+            css_buffer_puts(d->out, "QUALIFIED_RULE\n");
+            css_selector_list *selectors = css_qualified_rule_selectors(qr);
+            if (selectors) text_selectors(d, selectors, 2);
+            size_t count;
+            css_component_value **prelude =
+                css_qualified_rule_prelude(qr, &count);
+            text_prelude(d, prelude, count);
+            css_qualified_rule_prelude_release(qr, prelude, count);
+            text_block(d, qr->block, 2);
+            break;
+        }
+        default:
+            put_indent(d, 1);
+            css_buffer_puts(d->out, "<unknown rule type ");
+            put_int(d, rule->type);
+            css_buffer_append(d->out, ">\n", 2);
+            break;
+        }
+    }
+}
+
+/* ================================================================
+ * JSON
+ * ================================================================ */
+
+static void json_string(dump_ctx *d, const char *s)
+{
+    if (!s) {
+        css_buffer_puts(d->out, "null");
+        return;
+    }
+    static const char hex[] = "0123456789abcdef";
+    css_buffer_putc(d->out, '"');
+    const char *run = s;
+    for (const char *p = s; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        css_buffer_append(d->out, run, (size_t)(p - run));
+        run = p + 1;
+        switch (c) {
+        case '"':  css_buffer_append(d->out, "\\\"", 2); break;
+        case '\\': css_buffer_append(d->out, "\\\\", 2); break;
+        case '\n': css_buffer_append(d->out, "\\n", 2); break;
+        case '\t': css_buffer_append(d->out, "\\t", 2); break;
+        default: {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            css_buffer_append(d->out, esc, sizeof(esc));
+            break;
+        }
+        }
+    }
+    css_buffer_puts(d->out, run);
+    css_buffer_putc(d->out, '"');
+}
+
+/* Shortest decimal that reads back as v; null when not finite */
+static void json_number(dump_ctx *d, double v)
+{
+    if (!isfinite(v)) {
+        css_buffer_puts(d->out, "null");
+        return;
+    }
+    char buf[40];
+    for (int prec = 1; prec <= 17; prec++) {
+        snprintf(buf, sizeof(buf), "%.*g", prec, v);
+        if (strtod(buf, NULL) == v) break;
+    }
+    css_buffer_puts(d->out, buf);
+}
+
+static void json_key(dump_ctx *d, const char *key)
+{
+    css_buffer_putc(d->out, ',');
+    css_buffer_putc(d->out, '"');
+    css_buffer_puts(d->out, key);
+    css_buffer_append(d->out, "\":", 2);
+}
+
+static void json_cv(dump_ctx *d, css_component_value *cv);
+
+static void json_values(dump_ctx *d, css_component_value **values,
+                        size_t count)
+{
+    css_buffer_putc(d->out, '[');
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) css_buffer_putc(d->out, ',');
+        json_cv(d, values[i]);
+    }
+    css_buffer_putc(d->out, ']');
+}
+
+static void json_token(dump_ctx *d, css_token *tok)
+{
+    css_buffer_puts(d->out, "{\"type\":");
+    json_string(d, css_token_type_name(tok->type));
+
+    switch (tok->type) {
+    case CSS_TOKEN_NUMBER:
+    case CSS_TOKEN_PERCENTAGE:
+    case CSS_TOKEN_DIMENSION:
+        json_key(d, "number");
+        json_number(d, tok->numeric_value);
+        json_key(d, "integer");
+        css_buffer_puts(d->out, tok->number_type == CSS_NUM_INTEGER ?
+                                "true" : "false");
+        if (tok->type == CSS_TOKEN_DIMENSION) {
+            json_key(d, "unit");
+            json_string(d, tok->unit);
+        }
+        break;
+    case CSS_TOKEN_DELIM: {
+        char utf8[5] = { 0 };
+        uint32_t cp = tok->delim_codepoint;
+        if (cp < 0x80) {
+            utf8[0] = (char)cp;
+        } else if (cp < 0x800) {
+            utf8[0] = (char)(0xC0 | (cp >> 6));
+            utf8[1] = (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            utf8[0] = (char)(0xE0 | (cp >> 12));
+            utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            utf8[2] = (char)(0x80 | (cp & 0x3F));
+        } else {
+            utf8[0] = (char)(0xF0 | (cp >> 18));
+            utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+            utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            utf8[3] = (char)(0x80 | (cp & 0x3F));
+        }
+        json_key(d, "value");
+        json_string(d, utf8);
+        break;
+    }
+    case CSS_TOKEN_HASH:
+        json_key(d, "value");
+        json_string(d, tok->value);
+        json_key(d, "id");
+        css_buffer_puts(d->out, tok->hash_type == CSS_HASH_ID ?
+                                "true" : "false");
+        break;
+    default:
+        if (tok->value) {
+            json_key(d, "value");
+            json_string(d, tok->value);
+        }
+        break;
+    }
+    css_buffer_putc(d->out, '}');
+}
+
+static void json_declaration(dump_ctx *d, css_declaration *decl)
+{
+    css_buffer_puts(d->out, "{\"type\":\"declaration\"");
+    json_key(d, "name");
+    json_string(d, decl->name);
+    json_key(d, "important");
+    css_buffer_puts(d->out, decl->important ? "true" : "false");
+    json_key(d, "value");
+    json_values(d, decl->values, decl->value_count);
+    css_buffer_putc(d->out, '}');
+}
+
+static void json_declarations(dump_ctx *d, css_declaration_list *decls)
+{
+    css_buffer_putc(d->out, '[');
+    for (size_t i = 0; i < decls->declaration_count; i++) {
+        if (i > 0) css_buffer_putc(d->out, ',');
+        json_declaration(d, decls->declarations[i]);
+    }
+    css_buffer_putc(d->out, ']');
+}
+
+static void json_block(dump_ctx *d, css_simple_block *block)
+{
+    if (!block) {
+        css_buffer_puts(d->out, "null");
+        return;
+    }
+    css_buffer_puts(d->out, "{\"type\":\"block\"");
+    json_key(d, "open");
+    json_string(d, block_open_text(block->associated_token));
+
+    css_declaration_list *decls = block_declarations(block);
+    if (decls) {
+        json_key(d, "declarations");
+        json_declarations(d, decls);
+        css_declaration_list_free(decls);
+    } else {
+        json_key(d, "values");
+        json_values(d, block->values, block->value_count);
+    }
+    css_buffer_putc(d->out, '}');
+}
+
+static void json_cv(dump_ctx *d, css_component_value *cv)
+{
+    if (!cv) {
+        css_buffer_puts(d->out, "null");
+        return;
+    }
+    switch (cv->type) {
+    case CSS_NODE_COMPONENT_VALUE:
+        if (cv->u.token) {
+            json_token(d, cv->u.token);
+        } else {
+            css_buffer_puts(d->out, "null");
+        }
+        break;
+    case CSS_NODE_SIMPLE_BLOCK:
+        json_block(d, cv->u.block);
+        break;
+    case CSS_NODE_FUNCTION:
+        if (!cv->u.function) {
+            css_buffer_puts(d->out, "null");
+            break;
+        }
+        css_buffer_puts(d->out, "{\"type\":\"function\"");
+        json_key(d, "name");
+        json_string(d, cv->u.function->name);
+        json_key(d, "values");
+        json_values(d, cv->u.function->values, cv->u.function->value_count);
+        css_buffer_putc(d->out, '}');
+        break;
+    default:
+        css_buffer_puts(d->out, "null");
+        break;
+    }
+}
+
+static void json_selectors(dump_ctx *d, css_selector_list *list)
+{
+    css_buffer_putc(d->out, '[');
+    for (size_t i = 0; i < list->count; i++) {
+        css_complex_selector *cx = list->selectors[i];
+        if (i > 0) css_buffer_putc(d->out, ',');
+        if (!cx) {
+            css_buffer_puts(d->out, "null");
+            continue;
+        }
+        css_buffer_puts(d->out, "{\"compounds\":[");
+        for (size_t j = 0; j < cx->count; j++) {
+            css_compound_selector *comp = cx->compounds[j];
+            if (j > 0) css_buffer_putc(d->out, ',');
+            css_buffer_putc(d->out, '[');
+            for (size_t k = 0; comp && k < comp->count; k++) {
+                css_simple_selector *sel = comp->selectors[k];
+                if (k > 0) css_buffer_putc(d->out, ',');
+                css_buffer_puts(d->out, "{\"type\":");
+                json_string(d, css_simple_selector_type_name(sel->type));
+                if (sel->type == SEL_ATTRIBUTE) {
+                    json_key(d, "name");
+                    json_string(d, sel->attr_name);
+                    json_key(d, "match");
+                    json_string(d, css_attr_match_name(sel->attr_match));
+                    json_key(d, "value");
+                    json_string(d, sel->attr_value);
+                    json_key(d, "case_insensitive");
+                    css_buffer_puts(d->out, sel->attr_case_insensitive ?
+                                            "true" : "false");
+                } else {
+                    json_key(d, "name");
+                    json_string(d, sel->name);
+                }
+                if (has_nth(sel)) {
+                    json_key(d, "nth");
+                    css_buffer_puts(d->out, "{\"a\":");
+                    put_int(d, sel->nth.a);
+                    css_buffer_puts(d->out, ",\"b\":");
+                    put_int(d, sel->nth.b);
+                    css_buffer_putc(d->out, '}');
+                }
+                if (sel->argument) {
+                    json_key(d, "argument");
+                    json_selectors(d, sel->argument);
+                }
+                css_buffer_putc(d->out, '}');
+            }
+            css_buffer_putc(d->out, ']');
+        }
+        css_buffer_puts(d->out, "],\"combinators\":[");
+        for (size_t j = 1; j < cx->count; j++) {
+            if (j > 1) css_buffer_putc(d->out, ',');
+            json_string(d, css_combinator_name(cx->combinators[j - 1]));
+        }
+        css_buffer_puts(d->out, "]}");
+    }
+    css_buffer_putc(d->out, ']');
+}
+
+static void json_stylesheet(dump_ctx *d, css_stylesheet *sheet)
+{
+    css_buffer_puts(d->out, "{\"type\":\"stylesheet\",\"rules\":[");
+    bool first = true;
+    for (size_t i = 0; i < sheet->rule_count; i++) {
+        css_rule *rule = sheet->rules[i];
+        if (!rule) continue;
+
+        if (rule->type == CSS_NODE_AT_RULE && rule->u.at_rule) {
+            css_at_rule *ar = rule->u.at_rule;
+            if (!first) css_buffer_putc(d->out, ',');
+            css_buffer_puts(d->out, "{\"type\":\"at-rule\"");
+            json_key(d, "name");
+            json_string(d, ar->name);
+            json_key(d, "prelude");
+            json_values(d, ar->prelude, ar->prelude_count);
+            json_key(d, "block");
+            json_block(d, ar->block);
+            css_buffer_putc(d->out, '}');
+        } else if (rule->type == CSS_NODE_QUALIFIED_RULE &&
+                   rule->u.qualified_rule) {
+            css_qualified_rule *qr = rule->u.qualified_rule;
+            if (!first) css_buffer_putc(d->out, ',');
+            css_buffer_puts(d->out, "{\"type\":\"qualified-rule\"");
+            json_key(d, "selectors");
+            css_selector_list *selectors = css_qualified_rule_selectors(qr);
+            if (selectors) {
+                json_selectors(d, selectors);
+            } else {
+                css_buffer_puts(d->out, "null");
+            }
+            size_t count;
+            css_component_value **prelude =
+                css_qualified_rule_prelude(qr, &count);
+            json_key(d, "prelude");
+            json_values(d, prelude, count);
+            css_qualified_rule_prelude_release(qr, prelude, count);
+            json_key(d, "block");
+            json_block(d, qr->block);
+            css_buffer_putc(d->out, '}');
+        } else {
+            continue;
+        }
+        first = false;
+    }
+    css_buffer_puts(d->out, "]}\n");
+}
+
+/* ================================================================
+ * BINARY
+ * ================================================================ */
+
+static void bin_u8(dump_ctx *d, unsigned int v)
+{
+    css_buffer_putc(d->out, (char)(v & 0xFF));
+}
+
+static void bin_u32(dump_ctx *d, uint32_t v)
+{
+    char b[4] = {
+        (char)(v & 0xFF), (char)((v >> 8) & 0xFF),
+        (char)((v >> 16) & 0xFF), (char)((v >> 24) & 0xFF)
+    };
+    css_buffer_append(d->out, b, 4);
+}
+
+static void bin_f64(dump_ctx *d, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bin_u32(d, (uint32_t)bits);
+    bin_u32(d, (uint32_t)(bits >> 32));
+}
+
+static void bin_count(dump_ctx *d, size_t n)
+{
+    if (n >= UINT32_MAX) {
+        d->out->failed = true;
+        return;
+    }
+    bin_u32(d, (uint32_t)n);
+}
+
+static void bin_string(dump_ctx *d, const char *s)
+{
+    if (!s) {
+        bin_u32(d, UINT32_MAX);
+        return;
+    }
+    size_t len = strlen(s);
+    bin_count(d, len);
+    css_buffer_append(d->out, s, len);
+}
+
+static void bin_cv(dump_ctx *d, css_component_value *cv);
+
+static void bin_values(dump_ctx *d, css_component_value **values,
+                       size_t count)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (values[i]) n++;
+    }
+    bin_count(d, n);
+    for (size_t i = 0; i < count; i++) {
+        if (values[i]) bin_cv(d, values[i]);
+    }
+}
+
+static void bin_declaration(dump_ctx *d, css_declaration *decl)
+{
+    bin_u8(d, CSS_DUMP_TAG_DECLARATION);
+    bin_string(d, decl->name);
+    bin_u8(d, decl->important);
+    bin_values(d, decl->values, decl->value_count);
+}
+
+static void bin_block(dump_ctx *d, css_simple_block *block)
+{
+    bin_u8(d, CSS_DUMP_TAG_BLOCK);
+    bin_u8(d, block->associated_token);
+
+    css_declaration_list *decls = block_declarations(block);
+    if (decls) {
+        bin_u8(d, 1);
+        bin_count(d, decls->declaration_count);
+        for (size_t i = 0; i < decls->declaration_count; i++) {
+            bin_declaration(d, decls->declarations[i]);
+        }
+        css_declaration_list_free(decls);
+    } else {
+        bin_u8(d, 0);
+        bin_values(d, block->values, block->value_count);
+    }
+}
+
+static void bin_token(dump_ctx *d, css_token *tok)
+{
+    bin_u8(d, CSS_DUMP_TAG_TOKEN);
+    bin_u8(d, tok->type);
+    bin_u8(d, (tok->number_type == CSS_NUM_INTEGER ? 1u : 0u) |
+              (tok->hash_type == CSS_HASH_ID ? 2u : 0u));
+    bin_string(d, tok->value);
+    bin_string(d, tok->unit);
+    bin_f64(d, tok->numeric_value);
+    bin_u32(d, tok->delim_codepoint);
+}
+
+static void bin_cv(dump_ctx *d, css_component_value *cv)
+{
+    switch (cv->type) {
+    case CSS_NODE_SIMPLE_BLOCK:
+        if (cv->u.block) {
+            bin_block(d, cv->u.block);
+            return;
+        }
+        break;
+    case CSS_NODE_FUNCTION:
+        if (cv->u.function) {
+            bin_u8(d, CSS_DUMP_TAG_FUNCTION);
+            bin_string(d, cv->u.function->name);
+            bin_values(d, cv->u.function->values,
+                       cv->u.function->value_count);
+            return;
+        }
+        break;
+    default:
+        if (cv->u.token) {
+            bin_token(d, cv->u.token);
+            return;
+        }
+        break;
+    }
+    /* Keep the count honest for malformed nodes: an empty token */
+    css_token empty;
+    memset(&empty, 0, sizeof(empty));
+    empty.type = CSS_TOKEN_EOF;
+    bin_token(d, &empty);
+}
+
+static void bin_selectors(dump_ctx *d, css_selector_list *list)
+{
+    bin_u8(d, CSS_DUMP_TAG_SELECTOR_LIST);
+    bin_count(d, list->count);
+    for (size_t i = 0; i < list->count; i++) {
+        css_complex_selector *cx = list->selectors[i];
+        size_t count = cx ? cx->count : 0;
+        bin_count(d, count);
+        for (size_t j = 0; j < count; j++) {
+            if (j > 0) bin_u8(d, cx->combinators[j - 1]);
+            css_compound_selector *comp = cx->compounds[j];
+            size_t n = comp ? comp->count : 0;
+            bin_count(d, n);
+            for (size_t k = 0; k < n; k++) {
+                css_simple_selector *sel = comp->selectors[k];
+                bin_u8(d, sel->type);
+                bin_string(d, sel->name);
+                bin_u8(d, sel->attr_match);
+                bin_string(d, sel->attr_name);
+                bin_string(d, sel->attr_value);
+                bin_u8(d, sel->attr_case_insensitive);
+                bin_u8(d, sel->pseudo);
+                bin_u32(d, (uint32_t)sel->nth.a);
+                bin_u32(d, (uint32_t)sel->nth.b);
+                bin_u8(d, sel->argument != NULL);
+                if (sel->argument) bin_selectors(d, sel->argument);
+            }
+        }
+    }
+}
+
+static void bin_header(dump_ctx *d)
+{
+    css_buffer_append(d->out, "CSSD", 4);
+    bin_u32(d, CSS_DUMP_BINARY_VERSION);
+}
+
+static void bin_stylesheet(dump_ctx *d, css_stylesheet *sheet)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < sheet->rule_count; i++) {
+        css_rule *rule = sheet->rules[i];
+        if (rule && ((rule->type == CSS_NODE_AT_RULE && rule->u.at_rule) ||
+                     (rule->type == CSS_NODE_QUALIFIED_RULE &&
+                      rule->u.qualified_rule))) count++;
+    }
+
+    bin_header(d);
+    bin_u8(d, CSS_DUMP_TAG_STYLESHEET);
+    bin_count(d, count);
+    for (size_t i = 0; i < sheet->rule_count; i++) {
+        css_rule *rule = sheet->rules[i];
+        if (!rule) continue;
+        if (rule->type == CSS_NODE_AT_RULE && rule->u.at_rule) {
+            css_at_rule *ar = rule->u.at_rule;
+            bin_u8(d, CSS_DUMP_TAG_AT_RULE);
+            bin_string(d, ar->name);
+            bin_values(d, ar->prelude, ar->prelude_count);
+            bin_u8(d, ar->block != NULL);
+            if (ar->block) bin_block(d, ar->block);
+        } else if (rule->type == CSS_NODE_QUALIFIED_RULE &&
+                   rule->u.qualified_rule) {
+            css_qualified_rule *qr = rule->u.qualified_rule;
+            bin_u8(d, CSS_DUMP_TAG_QUALIFIED_RULE);
+            css_selector_list *selectors = css_qualified_rule_selectors(qr);
+            bin_u8(d, selectors != NULL);
+            if (selectors) bin_selectors(d, selectors);
+            size_t count;
+            css_component_value **prelude =
+                css_qualified_rule_prelude(qr, &count);
+            bin_values(d, prelude, count);
+            css_qualified_rule_prelude_release(qr, prelude, count);
+            if (qr->block) {
+                bin_block(d, qr->block);
+            } else {
+                css_simple_block empty;
+                memset(&empty, 0, sizeof(empty));
+                empty.associated_token = CSS_TOKEN_OPEN_CURLY;
+                bin_block(d, &empty);
+            }
+        }
+    }
+}
+
+/* ================================================================
+ * Public API
+ * ================================================================ */
+
+void css_dump_stylesheet(css_stylesheet *sheet, css_dump_format format,
+                         css_buffer *out)
+{
+    if (!sheet || !out) return;
+    dump_ctx d = { out, format };
+    switch (format) {
+    case CSS_DUMP_TEXT:   text_stylesheet(&d, sheet); break;
+    case CSS_DUMP_JSON:   json_stylesheet(&d, sheet); break;
+    case CSS_DUMP_BINARY: bin_stylesheet(&d, sheet); break;
+    }
+}
+
+void css_dump_declaration_list(css_declaration_list *list,
+                               css_dump_format format, css_buffer *out)
+{
+    if (!list || !out) return;
+    dump_ctx d = { out, format };
+    switch (format) {
+    case CSS_DUMP_TEXT:
+        css_buffer_puts(out, "DECLARATION_LIST (");
+        put_int(&d, (long long)list->declaration_count);
+        css_buffer_append(out, ")\n", 2);
+        for (size_t i = 0; i < list->declaration_count; i++) {
+            text_declaration(&d, list->declarations[i], 1);
+        }
+        break;
+    case CSS_DUMP_JSON:
+        css_buffer_puts(out, "{\"type\":\"declaration-list\"");
+        json_key(&d, "declarations");
+        json_declarations(&d, list);
+        css_buffer_puts(out, "}\n");
+        break;
+    case CSS_DUMP_BINARY:
+        bin_header(&d);
+        bin_u8(&d, CSS_DUMP_TAG_DECLARATION_LIST);
+        bin_count(&d, list->declaration_count);
+        for (size_t i = 0; i < list->declaration_count; i++) {
+            bin_declaration(&d, list->declarations[i]);
+        }
+        break;
+    }
+}
+
+bool css_dump_format_from_name(const char *name, css_dump_format *format)
+{
+    if (!name || !format) return false;
+    if (strcmp(name, "text") == 0) {
+        *format = CSS_DUMP_TEXT;
+    } else if (strcmp(name, "json") == 0) {
+        *format = CSS_DUMP_JSON;
+    } else if (strcmp(name, "binary") == 0) {
+        *format = CSS_DUMP_BINARY;
+    } else {
+        return false;
+    }
+    return true;
+}
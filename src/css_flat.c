@@ -0,0 +1,735 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_flat.h"
+#include "css_parser.h"
+#include "css_selector.h"
+#include "css_hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+_Static_assert(sizeof(css_flat_file_header) == 32,
+               "file header must keep the payload 8-byte aligned");
+
+/* ================================================================
+ * Builder state
+ *
+ * Nodes and strings are collected in growable arrays, then copied into
+ * the final contiguous block.  Strings are interned through an
+ * open-addressing table of pool offsets so each distinct string is
+ * stored once.
+ * ================================================================ */
+
+typedef struct {
+    css_flat_node *nodes;
+    size_t node_count;
+    size_t node_cap;
+
+    char *strings;
+    size_t string_size;
+    size_t string_cap;
+
+    uint32_t *intern;      /* pool offsets, CSS_FLAT_NO_STRING = empty */
+    size_t intern_cap;     /* power of two */
+    size_t intern_count;
+
+    bool failed;
+} flat_builder;
+
+static bool intern_grow(flat_builder *b)
+{
+    size_t cap = b->intern_cap ? b->intern_cap * 2 : 256;
+    uint32_t *table = css_malloc(cap * sizeof(uint32_t));
+    if (!table) return false;
+    for (size_t i = 0; i < cap; i++) table[i] = CSS_FLAT_NO_STRING;
+
+    for (size_t i = 0; i < b->intern_cap; i++) {
+        uint32_t off = b->intern[i];
+        if (off == CSS_FLAT_NO_STRING) continue;
+        const char *s = b->strings + off;
+        size_t slot =
+            (size_t)css_hash_bytes(CSS_HASH_SEED, s, strlen(s)) & (cap - 1);
+        while (table[slot] != CSS_FLAT_NO_STRING) {
+            slot = (slot + 1) & (cap - 1);
+        }
+        table[slot] = off;
+    }
+    css_free(b->intern);
+    b->intern = table;
+    b->intern_cap = cap;
+    return true;
+}
+
+/* Add s to the pool (or find it) and return its offset */
+static uint32_t intern_string(flat_builder *b, const char *s)
+{
+    if (!s || b->failed) return CSS_FLAT_NO_STRING;
+
+    if ((b->intern_count + 1) * 2 > b->intern_cap && !intern_grow(b)) {
+        b->failed = true;
+        return CSS_FLAT_NO_STRING;
+    }
+
+    size_t len = strlen(s);
+    size_t slot =
+        (size_t)css_hash_bytes(CSS_HASH_SEED, s, len) & (b->intern_cap - 1);
+    while (b->intern[slot] != CSS_FLAT_NO_STRING) {
+        uint32_t off = b->intern[slot];
+        if (strcmp(b->strings + off, s) == 0) return off;
+        slot = (slot + 1) & (b->intern_cap - 1);
+    }
+
+    if (b->string_size + len + 1 >= CSS_FLAT_NO_STRING) {
+        b->failed = true;
+        return CSS_FLAT_NO_STRING;
+    }
+    if (b->string_size + len + 1 > b->string_cap) {
+        size_t cap = b->string_cap ? b->string_cap * 2 : 1024;
+        while (cap < b->string_size + len + 1) cap *= 2;
+        char *strings = css_realloc(b->strings, cap);
+        if (!strings) {
+            b->failed = true;
+            return CSS_FLAT_NO_STRING;
+        }
+        b->strings = strings;
+        b->string_cap = cap;
+    }
+
+    uint32_t off = (uint32_t)b->string_size;
+    memcpy(b->strings + off, s, len + 1);
+    b->string_size += len + 1;
+    b->intern[slot] = off;
+    b->intern_count++;
+    return off;
+}
+
+static uint32_t clamp_u32(size_t v)
+{
+    return v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+}
+
+/* Append a node; its end is fixed up by close_node() after children */
+static uint32_t open_node(flat_builder *b, css_flat_kind kind,
+                          unsigned int subtype)
+{
+    if (b->failed) return CSS_FLAT_NONE;
+    if (b->node_count >= CSS_FLAT_NONE - 1) {
+        b->failed = true;
+        return CSS_FLAT_NONE;
+    }
+    if (b->node_count >= b->node_cap) {
+        size_t cap = b->node_cap ? b->node_cap * 2 : 64;
+        css_flat_node *nodes =
+            css_realloc(b->nodes, cap * sizeof(css_flat_node));
+        if (!nodes) {
+            b->failed = true;
+            return CSS_FLAT_NONE;
+        }
+        b->nodes = nodes;
+        b->node_cap = cap;
+    }
+
+    uint32_t index = (uint32_t)b->node_count++;
+    css_flat_node *n = &b->nodes[index];
+    memset(n, 0, sizeof(*n));
+    n->kind = (uint8_t)kind;
+    n->subtype = (uint8_t)subtype;
+    n->str = CSS_FLAT_NO_STRING;
+    n->str2 = CSS_FLAT_NO_STRING;
+    n->end = index + 1;
+    return index;
+}
+
+static void close_node(flat_builder *b, uint32_t index)
+{
+    if (index == CSS_FLAT_NONE || b->failed) return;
+    b->nodes[index].end = (uint32_t)b->node_count;
+}
+
+/* ================================================================
+ * AST → flat lowering
+ * ================================================================ */
+
+static void emit_component_value(flat_builder *b, css_component_value *cv);
+
+static void emit_token(flat_builder *b, css_token *tok)
+{
+    if (!tok) return;
+    uint32_t i = open_node(b, CSS_FLAT_TOKEN, tok->type);
+    if (i == CSS_FLAT_NONE) return;
+
+    uint32_t str = intern_string(b, tok->value);
+    uint32_t str2 = intern_string(b, tok->unit);
+    if (b->failed) return;
+
+    css_flat_node *n = &b->nodes[i];
+    n->str = str;
+    n->str2 = str2;
+    if (tok->type == CSS_TOKEN_DELIM) {
+        n->u.codepoint = tok->delim_codepoint;
+    } else {
+        n->u.number = tok->numeric_value;
+    }
+    if (tok->hash_type == CSS_HASH_ID) n->flags |= CSS_FLAT_HASH_ID;
+    if (tok->number_type == CSS_NUM_INTEGER) n->flags |= CSS_FLAT_NUM_INTEGER;
+    n->line = clamp_u32(tok->line);
+    n->column = clamp_u32(tok->column);
+}
+
+static void emit_values(flat_builder *b, css_component_value **values,
+                        size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        emit_component_value(b, values[i]);
+    }
+}
+
+static void emit_declaration(flat_builder *b, css_declaration *decl)
+{
+    uint32_t i = open_node(b, CSS_FLAT_DECLARATION, 0);
+    uint32_t name = intern_string(b, decl->name);
+    if (i == CSS_FLAT_NONE || b->failed) return;
+    b->nodes[i].str = name;
+    if (decl->important) b->nodes[i].flags |= CSS_FLAT_IMPORTANT;
+    emit_values(b, decl->values, decl->value_count);
+    close_node(b, i);
+}
+
+static void emit_block(flat_builder *b, css_simple_block *block)
+{
+    if (!block) return;
+    uint32_t i = open_node(b, CSS_FLAT_BLOCK, block->associated_token);
+
+    /* {} blocks: store detected declarations, like css_parse_dump */
+    if (block->associated_token == CSS_TOKEN_OPEN_CURLY) {
+        css_declaration_list *decls = css_parse_block_declarations(block);
+        if (!decls) {
+            b->failed = true;
+            return;
+        }
+        if (decls->declaration_count > 0) {
+            for (size_t j = 0; j < decls->declaration_count; j++) {
+                emit_declaration(b, decls->declarations[j]);
+            }
+            css_declaration_list_free(decls);
+            close_node(b, i);
+            return;
+        }
+        css_declaration_list_free(decls);
+    }
+
+    emit_values(b, block->values, block->value_count);
+    close_node(b, i);
+}
+
+static void emit_function(flat_builder *b, css_function *func)
+{
+    if (!func) return;
+    uint32_t i = open_node(b, CSS_FLAT_FUNCTION, 0);
+    uint32_t name = intern_string(b, func->name);
+    if (i == CSS_FLAT_NONE || b->failed) return;
+    b->nodes[i].str = name;
+    emit_values(b, func->values, func->value_count);
+    close_node(b, i);
+}
+
+static void emit_component_value(flat_builder *b, css_component_value *cv)
+{
+    if (!cv) return;
+    switch (cv->type) {
+    case CSS_NODE_COMPONENT_VALUE:
+        emit_token(b, cv->u.token);
+        break;
+    case CSS_NODE_SIMPLE_BLOCK:
+        emit_block(b, cv->u.block);
+        break;
+    case CSS_NODE_FUNCTION:
+        emit_function(b, cv->u.function);
+        break;
+    default:
+        break;
+    }
+}
+
+static void emit_prelude(flat_builder *b, css_component_value **values,
+                         size_t count)
+{
+    if (count == 0) return;
+    uint32_t i = open_node(b, CSS_FLAT_PRELUDE, 0);
+    emit_values(b, values, count);
+    close_node(b, i);
+}
+
+static void emit_selector_list(flat_builder *b, css_selector_list *list);
+
+static void emit_simple_selector(flat_builder *b, css_simple_selector *sel)
+{
+    uint32_t i = open_node(b, CSS_FLAT_SIMPLE_SELECTOR, sel->type);
+    uint32_t str = intern_string(b, sel->type == SEL_ATTRIBUTE ?
+                                    sel->attr_name : sel->name);
+    uint32_t str2 = intern_string(b, sel->attr_value);
+    if (i == CSS_FLAT_NONE || b->failed) return;
+
+    css_flat_node *n = &b->nodes[i];
+    n->str = str;
+    n->str2 = str2;
+    if (sel->type == SEL_PSEUDO_CLASS) {
+        n->attr_match = (uint8_t)sel->pseudo;
+        n->u.nth.a = sel->nth.a;
+        n->u.nth.b = sel->nth.b;
+    } else {
+        n->attr_match = (uint8_t)sel->attr_match;
+    }
+    if (sel->attr_case_insensitive) n->flags |= CSS_FLAT_ATTR_CI;
+    emit_selector_list(b, sel->argument);
+    close_node(b, i);
+}
+
+static void emit_selector_list(flat_builder *b, css_selector_list *list)
+{
+    if (!list) return;
+    uint32_t li = open_node(b, CSS_FLAT_SELECTOR_LIST, 0);
+    for (size_t i = 0; i < list->count; i++) {
+        css_complex_selector *cx = list->selectors[i];
+        if (!cx) continue;
+        uint32_t xi = open_node(b, CSS_FLAT_COMPLEX_SELECTOR, 0);
+        for (size_t j = 0; j < cx->count; j++) {
+            if (j > 0) {
+                open_node(b, CSS_FLAT_COMBINATOR, cx->combinators[j - 1]);
+            }
+            css_compound_selector *comp = cx->compounds[j];
+            if (!comp) continue;
+            uint32_t ci = open_node(b, CSS_FLAT_COMPOUND_SELECTOR, 0);
+            for (size_t k = 0; k < comp->count; k++) {
+                if (comp->selectors[k]) {
+                    emit_simple_selector(b, comp->selectors[k]);
+                }
+            }
+            close_node(b, ci);
+        }
+        close_node(b, xi);
+    }
+    close_node(b, li);
+}
+
+static void emit_rule(flat_builder *b, css_rule *rule)
+{
+    if (!rule) return;
+    switch (rule->type) {
+    case CSS_NODE_AT_RULE: {
+        css_at_rule *ar = rule->u.at_rule;
+        if (!ar) break;
+        uint32_t i = open_node(b, CSS_FLAT_AT_RULE, 0);
+        uint32_t name = intern_string(b, ar->name);
+        if (i == CSS_FLAT_NONE || b->failed) return;
+        b->nodes[i].str = name;
+        emit_prelude(b, ar->prelude, ar->prelude_count);
+        emit_block(b, ar->block);
+        close_node(b, i);
+        break;
+    }
+    case CSS_NODE_QUALIFIED_RULE: {
+        css_qualified_rule *qr = rule->u.qualified_rule;
+        if (!qr) break;
+        uint32_t i = open_node(b, CSS_FLAT_QUALIFIED_RULE, 0);
+        emit_selector_list(b, css_qualified_rule_selectors(qr));
+        size_t count;
+        css_component_value **prelude = css_qualified_rule_prelude(qr, &count);
+        emit_prelude(b, prelude, count);
+        css_qualified_rule_prelude_release(qr, prelude, count);
+        emit_block(b, qr->block);
+        close_node(b, i);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* ================================================================
+ * Public API
+ * ================================================================ */
+
+css_flat_sheet *css_flat_build(css_stylesheet *sheet)
+{
+    if (!sheet) return NULL;
+
+    flat_builder b;
+    memset(&b, 0, sizeof(b));
+
+    uint32_t root = open_node(&b, CSS_FLAT_STYLESHEET, 0);
+    for (size_t i = 0; i < sheet->rule_count; i++) {
+        emit_rule(&b, sheet->rules[i]);
+    }
+    close_node(&b, root);
+
+    css_flat_sheet *flat = NULL;
+    if (!b.failed) {
+        size_t nodes_size = b.node_count * sizeof(css_flat_node);
+        flat = css_malloc(sizeof(css_flat_sheet) + nodes_size +
+                          b.string_size);
+        if (flat) {
+            flat->node_count = (uint32_t)b.node_count;
+            flat->string_size = (uint32_t)b.string_size;
+            memcpy(flat->nodes, b.nodes, nodes_size);
+            if (b.string_size > 0) {
+                memcpy((char *)flat->nodes + nodes_size, b.strings,
+                       b.string_size);
+            }
+        }
+    }
+
+    css_free(b.nodes);
+    css_free(b.strings);
+    css_free(b.intern);
+    return flat;
+}
+
+void css_flat_free(css_flat_sheet *flat)
+{
+    css_free(flat);
+}
+
+size_t css_flat_size(const css_flat_sheet *flat)
+{
+    if (!flat) return 0;
+    return sizeof(css_flat_sheet) +
+           (size_t)flat->node_count * sizeof(css_flat_node) +
+           flat->string_size;
+}
+
+const char *css_flat_string(const css_flat_sheet *flat, uint32_t offset)
+{
+    if (!flat || offset >= flat->string_size) return NULL;
+    return (const char *)(flat->nodes + flat->node_count) + offset;
+}
+
+uint32_t css_flat_first_child(const css_flat_sheet *flat, uint32_t index)
+{
+    if (!flat || index >= flat->node_count) return CSS_FLAT_NONE;
+    return flat->nodes[index].end > index + 1 ? index + 1 : CSS_FLAT_NONE;
+}
+
+uint32_t css_flat_next_sibling(const css_flat_sheet *flat, uint32_t parent,
+                               uint32_t child)
+{
+    if (!flat || parent >= flat->node_count || child >= flat->node_count)
+        return CSS_FLAT_NONE;
+    uint32_t next = flat->nodes[child].end;
+    return next < flat->nodes[parent].end ? next : CSS_FLAT_NONE;
+}
+
+/* ================================================================
+ * Dump (same output as css_parse_dump)
+ * ================================================================ */
+
+static void dump_indent_f(FILE *out, int depth)
+{
+    static const char spaces[] = "                                ";
+    size_t n = depth > 0 ? (size_t)depth * 2 : 0;
+    while (n > 0) {
+        size_t chunk = n < sizeof(spaces) - 1 ? n : sizeof(spaces) - 1;
+        fwrite(spaces, 1, chunk, out);
+        n -= chunk;
+    }
+}
+
+static const char *str_or_empty(const css_flat_sheet *flat, uint32_t offset)
+{
+    const char *s = css_flat_string(flat, offset);
+    return s ? s : "";
+}
+
+static void dump_token_inline_f(FILE *out, const css_flat_sheet *flat,
+                                const css_flat_node *n)
+{
+    const char *value = str_or_empty(flat, n->str);
+    bool integer = (n->flags & CSS_FLAT_NUM_INTEGER) != 0;
+
+    switch ((css_token_type)n->subtype) {
+    case CSS_TOKEN_IDENT:
+        fprintf(out, "<ident \"%s\">", value);
+        break;
+    case CSS_TOKEN_FUNCTION:
+        fprintf(out, "<function \"%s\">", value);
+        break;
+    case CSS_TOKEN_AT_KEYWORD:
+        fprintf(out, "<at-keyword \"%s\">", value);
+        break;
+    case CSS_TOKEN_HASH:
+        fprintf(out, "<hash \"%s\"%s>", value,
+                (n->flags & CSS_FLAT_HASH_ID) ? " id" : "");
+        break;
+    case CSS_TOKEN_STRING:
+        fprintf(out, "<string \"%s\">", value);
+        break;
+    case CSS_TOKEN_URL:
+        fprintf(out, "<url \"%s\">", value);
+        break;
+    case CSS_TOKEN_NUMBER:
+        if (integer)
+            fprintf(out, "<number %d>", (int)n->u.number);
+        else
+            fprintf(out, "<number %g>", n->u.number);
+        break;
+    case CSS_TOKEN_PERCENTAGE:
+        if (integer)
+            fprintf(out, "<percentage %d>", (int)n->u.number);
+        else
+            fprintf(out, "<percentage %g>", n->u.number);
+        break;
+    case CSS_TOKEN_DIMENSION:
+        if (integer)
+            fprintf(out, "<dimension %d \"%s\">", (int)n->u.number,
+                    str_or_empty(flat, n->str2));
+        else
+            fprintf(out, "<dimension %g \"%s\">", n->u.number,
+                    str_or_empty(flat, n->str2));
+        break;
+    case CSS_TOKEN_DELIM:
+        if (n->u.codepoint < 0x80)
+            fprintf(out, "<delim '%c'>", (char)n->u.codepoint);
+        else
+            fprintf(out, "<delim U+%04X>", n->u.codepoint);
+        break;
+    case CSS_TOKEN_WHITESPACE:
+        fprintf(out, "<whitespace>");
+        break;
+    default:
+        fprintf(out, "<%s>", css_token_type_name((css_token_type)n->subtype));
+        break;
+    }
+}
+
+static void dump_node_f(FILE *out, const css_flat_sheet *flat,
+                        uint32_t index, int depth);
+
+static void dump_children_f(FILE *out, const css_flat_sheet *flat,
+                            uint32_t index, int depth)
+{
+    for (uint32_t c = css_flat_first_child(flat, index); c != CSS_FLAT_NONE;
+         c = css_flat_next_sibling(flat, index, c)) {
+        dump_node_f(out, flat, c, depth);
+    }
+}
+
+static void dump_simple_selector_f(FILE *out, const css_flat_sheet *flat,
+                                   const css_flat_node *n)
+{
+    const char *name = css_flat_string(flat, n->str);
+    const char *type = css_simple_selector_type_name(n->subtype);
+    if (n->subtype == SEL_ATTRIBUTE) {
+        fprintf(out, "<%s [%s", type, name ? name : "");
+        const char *value = css_flat_string(flat, n->str2);
+        if (n->attr_match != ATTR_EXISTS && value) {
+            fprintf(out, "%s\"%s\"", css_attr_match_name(n->attr_match),
+                    value);
+        }
+        if (n->flags & CSS_FLAT_ATTR_CI) {
+            fprintf(out, " i");
+        }
+        fprintf(out, "]>\n");
+    } else if (name && n->subtype == SEL_PSEUDO_CLASS &&
+               n->attr_match >= PSEUDO_NTH_CHILD) {
+        char nth[32];
+        css_nth_format((css_nth){ n->u.nth.a, n->u.nth.b }, nth, sizeof(nth));
+        fprintf(out, "<%s \"%s(%s)\">\n", type, name, nth);
+    } else if (name) {
+        fprintf(out, "<%s \"%s\">\n", type, name);
+    } else {
+        fprintf(out, "<%s>\n", type);
+    }
+}
+
+static void dump_node_f(FILE *out, const css_flat_sheet *flat,
+                        uint32_t index, int depth)
+{
+    const css_flat_node *n = &flat->nodes[index];
+
+    switch ((css_flat_kind)n->kind) {
+    case CSS_FLAT_STYLESHEET:
+        fprintf(out, "STYLESHEET\n");
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    case CSS_FLAT_AT_RULE:
+        dump_indent_f(out, depth);
+        fprintf(out, "AT_RULE \"%s\"\n", str_or_empty(flat, n->str));
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    case CSS_FLAT_QUALIFIED_RULE:
+        dump_indent_f(out, depth);
+        fprintf(out, "QUALIFIED_RULE\n");
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    case CSS_FLAT_PRELUDE:
+        dump_indent_f(out, depth);
+        fprintf(out, "prelude:\n");
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    case CSS_FLAT_BLOCK: {
+        char open = '?', close = '?';
+        switch ((css_token_type)n->subtype) {
+        case CSS_TOKEN_OPEN_CURLY:  open = '{'; close = '}'; break;
+        case CSS_TOKEN_OPEN_SQUARE: open = '['; close = ']'; break;
+        case CSS_TOKEN_OPEN_PAREN:  open = '('; close = ')'; break;
+        default: break;
+        }
+        dump_indent_f(out, depth);
+        fprintf(out, "BLOCK %c%c\n", open, close);
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    }
+    case CSS_FLAT_FUNCTION:
+        dump_indent_f(out, depth);
+        fprintf(out, "FUNCTION \"%s\"\n", str_or_empty(flat, n->str));
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    case CSS_FLAT_DECLARATION:
+        dump_indent_f(out, depth);
+        fprintf(out, "DECLARATION \"%s\"", str_or_empty(flat, n->str));
+        if (n->flags & CSS_FLAT_IMPORTANT) fprintf(out, " !important");
+        fprintf(out, "\n");
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    case CSS_FLAT_TOKEN:
+        dump_indent_f(out, depth);
+        dump_token_inline_f(out, flat, n);
+        fprintf(out, "\n");
+        break;
+    case CSS_FLAT_SELECTOR_LIST: {
+        size_t count = 0;
+        for (uint32_t c = css_flat_first_child(flat, index);
+             c != CSS_FLAT_NONE; c = css_flat_next_sibling(flat, index, c)) {
+            count++;
+        }
+        dump_indent_f(out, depth);
+        fprintf(out, "SELECTOR_LIST (%zu)\n", count);
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    }
+    case CSS_FLAT_COMPLEX_SELECTOR:
+        dump_indent_f(out, depth);
+        fprintf(out, "COMPLEX_SELECTOR\n");
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    case CSS_FLAT_COMPOUND_SELECTOR:
+        dump_indent_f(out, depth);
+        fprintf(out, "COMPOUND_SELECTOR\n");
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    case CSS_FLAT_COMBINATOR:
+        dump_indent_f(out, depth);
+        fprintf(out, "COMBINATOR \"%s\"\n", css_combinator_name(n->subtype));
+        break;
+    case CSS_FLAT_SIMPLE_SELECTOR:
+        dump_indent_f(out, depth);
+        dump_simple_selector_f(out, flat, n);
+        dump_children_f(out, flat, index, depth + 1);
+        break;
+    default:
+        dump_indent_f(out, depth);
+        fprintf(out, "<unknown node type %d>\n", n->kind);
+        break;
+    }
+}
+
+void css_flat_dump(const css_flat_sheet *flat, FILE *out)
+{
+    if (!flat || !out || flat->node_count == 0) return;
+    dump_node_f(out, flat, 0, 0);
+}
+
+/* ================================================================
+ * Precompiled file: write / map
+ * ================================================================ */
+
+bool css_flat_write(const css_flat_sheet *flat, FILE *out)
+{
+    if (!flat || !out) return false;
+
+    css_flat_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CSS_FLAT_MAGIC, sizeof(CSS_FLAT_MAGIC));
+    header.version = CSS_FLAT_VERSION;
+    header.byte_order = CSS_FLAT_BYTE_ORDER;
+    header.node_size = (uint32_t)sizeof(css_flat_node);
+    header.payload_size = css_flat_size(flat);
+
+    if (fwrite(&header, sizeof(header), 1, out) != 1) return false;
+    if (fwrite(flat, 1, (size_t)header.payload_size, out) !=
+        header.payload_size) return false;
+    return fflush(out) == 0;
+}
+
+/* Check that a block of size bytes is a well-formed sheet, so readers
+ * can index it without bounds checks of their own */
+static bool flat_validate(const css_flat_sheet *flat, size_t size)
+{
+    if (size < sizeof(css_flat_sheet)) return false;
+
+    uint64_t nodes_size = (uint64_t)flat->node_count * sizeof(css_flat_node);
+    if ((uint64_t)sizeof(css_flat_sheet) + nodes_size + flat->string_size
+        != size) return false;
+
+    if (flat->node_count == 0 || flat->nodes[0].kind != CSS_FLAT_STYLESHEET ||
+        flat->nodes[0].end != flat->node_count) return false;
+
+    const char *pool = (const char *)(flat->nodes + flat->node_count);
+    if (flat->string_size > 0 && pool[flat->string_size - 1] != '\0')
+        return false;
+
+    for (uint32_t i = 0; i < flat->node_count; i++) {
+        const css_flat_node *n = &flat->nodes[i];
+        if (n->kind > CSS_FLAT_SIMPLE_SELECTOR) return false;
+        if (n->end <= i || n->end > flat->node_count) return false;
+        if (n->str != CSS_FLAT_NO_STRING && n->str >= flat->string_size)
+            return false;
+        if (n->str2 != CSS_FLAT_NO_STRING && n->str2 >= flat->string_size)
+            return false;
+    }
+    return true;
+}
+
+const css_flat_sheet *css_flat_map(const char *path)
+{
+    if (!path) return NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(css_flat_file_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    const css_flat_file_header *header = base;
+    const css_flat_sheet *flat =
+        (const css_flat_sheet *)((const char *)base + sizeof(*header));
+
+    if (memcmp(header->magic, CSS_FLAT_MAGIC, sizeof(CSS_FLAT_MAGIC)) != 0 ||
+        header->version != CSS_FLAT_VERSION ||
+        header->byte_order != CSS_FLAT_BYTE_ORDER ||
+        header->node_size != sizeof(css_flat_node) ||
+        header->payload_size != size - sizeof(*header) ||
+        !flat_validate(flat, size - sizeof(*header))) {
+        munmap(base, size);
+        return NULL;
+    }
+    return flat;
+}
+
+void css_flat_unmap(const css_flat_sheet *flat)
+{
+    if (!flat) return;
+    const char *base = (const char *)flat - sizeof(css_flat_file_header);
+    munmap((void *)base, sizeof(css_flat_file_header) + css_flat_size(flat));
+}
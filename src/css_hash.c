@@ -0,0 +1,129 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_hash.h"
+#include "css_alloc.h"
+#include <string.h>
+
+/* ================================================================
+ * Hashing
+ * ================================================================ */
+
+uint64_t css_hash_bytes(uint64_t h, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < length; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+uint64_t css_hash_name(uint64_t h, const char *name, bool fold_case)
+{
+    for (const char *s = name; *s; s++) {
+        char c = fold_case ? css_ascii_lower(*s) : *s;
+        h ^= (unsigned char)c;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+int css_ascii_casecmp(const char *a, const char *b)
+{
+    for (;; a++, b++) {
+        unsigned char ca = (unsigned char)css_ascii_lower(*a);
+        unsigned char cb = (unsigned char)css_ascii_lower(*b);
+        if (ca != cb) return ca < cb ? -1 : 1;
+        if (!ca) return 0;
+    }
+}
+
+bool css_name_equal(const char *a, const char *b, bool fold_case)
+{
+    return fold_case ? css_ascii_casecmp(a, b) == 0 : strcmp(a, b) == 0;
+}
+
+/* ================================================================
+ * Name map
+ * ================================================================ */
+
+static css_name_key *key_at(void *slots, size_t slot_size, size_t i)
+{
+    return (css_name_key *)((char *)slots + i * slot_size);
+}
+
+void css_name_map_init(css_name_map *map, size_t slot_size, bool fold_case)
+{
+    memset(map, 0, sizeof(*map));
+    map->slot_size = slot_size;
+    map->fold_case = fold_case;
+}
+
+void css_name_map_free(css_name_map *map)
+{
+    if (!map) return;
+    css_free(map->slots);
+    map->slots = NULL;
+    map->count = 0;
+    map->cap = 0;
+}
+
+static bool map_rehash(css_name_map *map, size_t cap)
+{
+    void *slots = css_calloc(cap, map->slot_size);
+    if (!slots) return false;
+    for (size_t i = 0; i < map->cap; i++) {
+        css_name_key *from = key_at(map->slots, map->slot_size, i);
+        if (!from->name) continue;
+        size_t j = (size_t)from->hash & (cap - 1);
+        while (key_at(slots, map->slot_size, j)->name) j = (j + 1) & (cap - 1);
+        memcpy(key_at(slots, map->slot_size, j), from, map->slot_size);
+    }
+    css_free(map->slots);
+    map->slots = slots;
+    map->cap = cap;
+    return true;
+}
+
+bool css_name_map_reserve(css_name_map *map, size_t count)
+{
+    if (count * 2 <= map->cap) return true;
+    size_t cap = map->cap ? map->cap : 8;
+    while (cap < count * 2) cap *= 2;
+    return map_rehash(map, cap);
+}
+
+void *css_name_map_find(const css_name_map *map, const char *name)
+{
+    if (!name || !map->slots) return NULL;
+    uint64_t h = css_hash_name(CSS_HASH_SEED, name, map->fold_case);
+    size_t i = (size_t)h & (map->cap - 1);
+    for (;;) {
+        css_name_key *k = key_at(map->slots, map->slot_size, i);
+        if (!k->name) return NULL;
+        if (k->hash == h && css_name_equal(k->name, name, map->fold_case))
+            return k;
+        i = (i + 1) & (map->cap - 1);
+    }
+}
+
+void *css_name_map_insert(css_name_map *map, const char *name)
+{
+    css_name_key *k = css_name_map_find(map, name);
+    if (k) return k;
+    if (!css_name_map_reserve(map, map->count + 1)) return NULL;
+    uint64_t h = css_hash_name(CSS_HASH_SEED, name, map->fold_case);
+    size_t i = (size_t)h & (map->cap - 1);
+    while (key_at(map->slots, map->slot_size, i)->name)
+        i = (i + 1) & (map->cap - 1);
+    k = key_at(map->slots, map->slot_size, i);
+    k->name = name;
+    k->hash = h;
+    map->count++;
+    return k;
+}
+
+void *css_name_map_slot(const css_name_map *map, size_t i)
+{
+    return key_at(map->slots, map->slot_size, i);
+}
@@ -0,0 +1,70 @@
+#ifndef CSS_HASH_H
+#define CSS_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* ================================================================
+ * Hashing and name maps shared by the library (internal)
+ *
+ * Hashes are 64-bit FNV-1a.  Case folding is ASCII only, as CSS
+ * defines it for tag and attribute names: it never depends on the
+ * locale, so a folded hash agrees with css_ascii_casecmp() everywhere.
+ * ================================================================ */
+
+#define CSS_HASH_SEED 0xcbf29ce484222325ull     /* FNV-1a offset basis */
+
+static inline char css_ascii_lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+/* Continue hash h over length bytes of data */
+uint64_t css_hash_bytes(uint64_t h, const void *data, size_t length);
+
+/* Continue hash h over a NUL-terminated name, ASCII-folded if asked */
+uint64_t css_hash_name(uint64_t h, const char *name, bool fold_case);
+
+/* strcmp() with ASCII case folding */
+int  css_ascii_casecmp(const char *a, const char *b);
+bool css_name_equal(const char *a, const char *b, bool fold_case);
+
+/* ================================================================
+ * Name map: open addressing, power-of-two capacity, at most half
+ * full.  Slots are the caller's structs of slot_size bytes whose first
+ * member is a css_name_key; the rest of a new slot is zeroed.  Names
+ * are borrowed and must outlive the map.  Storage comes from the
+ * allocator current at the call.
+ * ================================================================ */
+
+typedef struct {
+    const char *name;           /* NULL = empty slot */
+    uint64_t hash;
+} css_name_key;
+
+typedef struct {
+    void *slots;
+    size_t slot_size;
+    size_t count;
+    size_t cap;
+    bool fold_case;
+} css_name_map;
+
+void css_name_map_init(css_name_map *map, size_t slot_size, bool fold_case);
+void css_name_map_free(css_name_map *map);
+
+/* Make room for count names without growing; false if out of memory */
+bool css_name_map_reserve(css_name_map *map, size_t count);
+
+/* The slot holding name, NULL if none */
+void *css_name_map_find(const css_name_map *map, const char *name);
+
+/* The slot holding name, added if missing; NULL if out of memory */
+void *css_name_map_insert(css_name_map *map, const char *name);
+
+/* Slot i (0 <= i < cap), for walking every slot; empty ones have a
+ * NULL name */
+void *css_name_map_slot(const css_name_map *map, size_t i);
+
+#endif /* CSS_HASH_H */
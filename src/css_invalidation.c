@@ -0,0 +1,433 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_invalidation.h"
+#include "css_parser.h"
+#include "css_alloc.h"
+#include "css_hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* ================================================================
+ * Internal structs
+ * ================================================================ */
+
+/* A slot of a name -> set map (css_hash.h; attribute names are
+ * case-folded) */
+typedef struct {
+    css_name_key key;
+    css_invalidation_set set;
+} set_slot;
+
+struct css_invalidation_index {
+    css_name_map ids;
+    css_name_map classes;
+    css_name_map attributes;
+    bool failed;                /* allocation failure while building */
+    const css_allocator *allocator;     /* current at build */
+};
+
+/* Where the restyled element sits relative to the mutated one */
+typedef enum {
+    REL_SELF,
+    REL_DESCENDANT,
+    REL_SIBLING,
+    REL_SIBLING_DESCENDANT,
+    REL_PARENT_SUBTREE
+} relation;
+
+static const unsigned relation_flags[] = {
+    [REL_SELF] = CSS_INVALIDATE_SELF,
+    [REL_DESCENDANT] = CSS_INVALIDATE_DESCENDANTS,
+    [REL_SIBLING] = CSS_INVALIDATE_SIBLINGS,
+    [REL_SIBLING_DESCENDANT] = CSS_INVALIDATE_SIBLING_DESCENDANTS,
+    [REL_PARENT_SUBTREE] = CSS_INVALIDATE_PARENT_SUBTREE
+};
+
+/* ================================================================
+ * Building
+ * ================================================================ */
+
+/* inner: mutated element -> M, outer: M -> restyled element */
+static relation compose(relation inner, relation outer)
+{
+    if (inner == REL_SELF) return outer;
+    if (outer == REL_SELF) return inner;
+    switch (inner) {
+    case REL_DESCENDANT:
+        /* everything reached from a descendant stays inside E */
+        return REL_DESCENDANT;
+    case REL_SIBLING:
+        if (outer == REL_SIBLING) return REL_SIBLING;
+        if (outer == REL_PARENT_SUBTREE) return REL_PARENT_SUBTREE;
+        return REL_SIBLING_DESCENDANT;
+    default:
+        return inner;
+    }
+}
+
+static relation combinator_relation(css_combinator comb)
+{
+    return comb == COMB_NEXT_SIBLING || comb == COMB_SUBSEQUENT_SIBLING
+               ? REL_SIBLING : REL_DESCENDANT;
+}
+
+/* Relation from compound index of cx to cx's subject */
+static relation compound_relation(const css_complex_selector *cx,
+                                  size_t index)
+{
+    relation rel = REL_SELF;
+    for (size_t i = index; i + 1 < cx->count; i++) {
+        rel = compose(rel, combinator_relation(cx->combinators[i]));
+    }
+    return rel;
+}
+
+static bool set_push_key(css_invalidation_set *set,
+                         const css_invalidation_key *key)
+{
+    if (set->key_count >= set->key_cap) {
+        size_t cap = set->key_cap ? set->key_cap * 2 : 4;
+        css_invalidation_key *keys =
+            css_realloc(set->keys, cap * sizeof(css_invalidation_key));
+        if (!keys) return false;
+        set->keys = keys;
+        set->key_cap = cap;
+    }
+    set->keys[set->key_count++] = *key;
+    return true;
+}
+
+static void add_feature(css_invalidation_index *index, css_name_map *map,
+                        const char *name, relation rel,
+                        const css_invalidation_key *subject_key)
+{
+    if (!name) return;
+    set_slot *slot = css_name_map_insert(map, name);
+    if (!slot) {
+        index->failed = true;
+        return;
+    }
+    css_invalidation_set *set = &slot->set;
+    set->flags |= relation_flags[rel];
+    if (rel == REL_SELF) return;
+    if (!subject_key) set->any_element = true;
+    else if (!set->any_element && !set_push_key(set, subject_key))
+        index->failed = true;
+}
+
+static void collect(css_invalidation_index *index,
+                    const css_complex_selector *cx, relation outer,
+                    const css_invalidation_key *subject_key)
+{
+    for (size_t i = 0; i < cx->count; i++) {
+        relation rel = compose(compound_relation(cx, i), outer);
+        const css_compound_selector *comp = cx->compounds[i];
+        for (size_t j = 0; j < comp->count; j++) {
+            const css_simple_selector *sel = comp->selectors[j];
+            switch (sel->type) {
+            case SEL_ID:
+                add_feature(index, &index->ids, sel->name, rel, subject_key);
+                break;
+            case SEL_CLASS:
+                add_feature(index, &index->classes, sel->name, rel,
+                            subject_key);
+                break;
+            case SEL_ATTRIBUTE:
+                add_feature(index, &index->attributes, sel->attr_name, rel,
+                            subject_key);
+                break;
+            default:
+                break;
+            }
+            const css_selector_list *arg = sel->argument;
+            for (size_t k = 0; arg && k < arg->count; k++) {
+                collect(index, arg->selectors[k], rel, subject_key);
+                /* "of S" also decides the position of the siblings
+                 * after (nth-child) or before (nth-last-child) a match */
+                if (sel->pseudo == PSEUDO_NTH_CHILD)
+                    collect(index, arg->selectors[k],
+                            compose(REL_SIBLING, rel), subject_key);
+                else if (sel->pseudo == PSEUDO_NTH_LAST_CHILD)
+                    collect(index, arg->selectors[k],
+                            compose(REL_PARENT_SUBTREE, rel), subject_key);
+            }
+        }
+    }
+}
+
+/* Most selective key of the subject compound; false if it has none */
+static bool subject_key_of(const css_complex_selector *cx,
+                           css_invalidation_key *key)
+{
+    if (cx->count == 0) return false;
+    const css_compound_selector *comp = cx->compounds[cx->count - 1];
+    static const struct {
+        css_simple_selector_type type;
+        css_invalidation_key_kind kind;
+    } order[] = {
+        { SEL_ID,        CSS_INVALIDATION_ID },
+        { SEL_CLASS,     CSS_INVALIDATION_CLASS },
+        { SEL_ATTRIBUTE, CSS_INVALIDATION_ATTRIBUTE },
+        { SEL_TYPE,      CSS_INVALIDATION_TAG }
+    };
+    for (size_t k = 0; k < sizeof(order) / sizeof(order[0]); k++) {
+        for (size_t i = 0; i < comp->count; i++) {
+            const css_simple_selector *sel = comp->selectors[i];
+            if (sel->type != order[k].type) continue;
+            key->kind = order[k].kind;
+            key->name = sel->type == SEL_ATTRIBUTE ? sel->attr_name
+                                                   : sel->name;
+            return key->name != NULL;
+        }
+    }
+    return false;
+}
+
+static int compare_keys(const void *pa, const void *pb)
+{
+    const css_invalidation_key *a = pa;
+    const css_invalidation_key *b = pb;
+    if (a->kind != b->kind) return a->kind < b->kind ? -1 : 1;
+    return a->kind >= CSS_INVALIDATION_ATTRIBUTE
+        ? css_ascii_casecmp(a->name, b->name)
+        : strcmp(a->name, b->name);
+}
+
+/* Sort and de-duplicate each set's keys; drop them if unused */
+static void finish_map(css_name_map *map)
+{
+    for (size_t i = 0; i < map->cap; i++) {
+        set_slot *slot = css_name_map_slot(map, i);
+        if (!slot->key.name) continue;
+        css_invalidation_set *set = &slot->set;
+        if (set->any_element) {
+            css_free(set->keys);
+            set->keys = NULL;
+            set->key_count = set->key_cap = 0;
+            continue;
+        }
+        if (set->key_count < 2) continue;
+        qsort(set->keys, set->key_count, sizeof(css_invalidation_key),
+              compare_keys);
+        size_t n = 1;
+        for (size_t k = 1; k < set->key_count; k++) {
+            if (compare_keys(&set->keys[n - 1], &set->keys[k]) != 0)
+                set->keys[n++] = set->keys[k];
+        }
+        set->key_count = n;
+    }
+}
+
+static void index_rule(void *user, const css_qualified_rule *qr)
+{
+    css_invalidation_index *index = user;
+    if (index->failed) return;
+    const css_selector_list *list = css_qualified_rule_selectors(qr);
+    for (size_t j = 0; list && j < list->count; j++) {
+        css_invalidation_key key;
+        bool has_key = subject_key_of(list->selectors[j], &key);
+        collect(index, list->selectors[j], REL_SELF, has_key ? &key : NULL);
+    }
+}
+
+css_invalidation_index *css_invalidation_index_build(
+    const css_stylesheet *sheet)
+{
+    css_invalidation_index *index = css_calloc(1, sizeof(css_invalidation_index));
+    if (!index) return NULL;
+    index->allocator = css_allocator_current();
+    css_name_map_init(&index->ids, sizeof(set_slot), false);
+    css_name_map_init(&index->classes, sizeof(set_slot), false);
+    css_name_map_init(&index->attributes, sizeof(set_slot), true);
+
+    /* Rules under @media, @supports, ... count whatever their
+     * condition: a rule that does not apply now may after a resize */
+    if (!css_stylesheet_walk_style_rules(sheet, NULL, index_rule, index))
+        index->failed = true;
+    if (index->failed) {
+        css_invalidation_index_free(index);
+        return NULL;
+    }
+    finish_map(&index->ids);
+    finish_map(&index->classes);
+    finish_map(&index->attributes);
+    return index;
+}
+
+static void map_free(css_name_map *map)
+{
+    for (size_t i = 0; i < map->cap; i++) {
+        set_slot *slot = css_name_map_slot(map, i);
+        css_free(slot->set.keys);
+    }
+    css_name_map_free(map);
+}
+
+void css_invalidation_index_free(css_invalidation_index *index)
+{
+    if (!index) return;
+    const css_allocator *prev = css_allocator_use(index->allocator);
+    map_free(&index->ids);
+    map_free(&index->classes);
+    map_free(&index->attributes);
+    css_free(index);
+    css_allocator_use(prev);
+}
+
+const css_invalidation_set *css_invalidation_for_class(
+    const css_invalidation_index *index, const char *name)
+{
+    const set_slot *s =
+        index ? css_name_map_find(&index->classes, name) : NULL;
+    return s ? &s->set : NULL;
+}
+
+const css_invalidation_set *css_invalidation_for_id(
+    const css_invalidation_index *index, const char *name)
+{
+    const set_slot *s =
+        index ? css_name_map_find(&index->ids, name) : NULL;
+    return s ? &s->set : NULL;
+}
+
+const css_invalidation_set *css_invalidation_for_attribute(
+    const css_invalidation_index *index, const char *name)
+{
+    const set_slot *s =
+        index ? css_name_map_find(&index->attributes, name) : NULL;
+    return s ? &s->set : NULL;
+}
+
+/* ================================================================
+ * Mutations
+ * ================================================================ */
+
+static void invalidation_push(css_invalidation *inv,
+                              const css_invalidation_set *set)
+{
+    if (!set) return;
+    for (size_t i = 0; i < inv->count; i++) {
+        if (inv->sets[i] == set) return;
+    }
+    if (inv->count >= inv->cap) {
+        size_t cap = inv->cap ? inv->cap * 2 : 8;
+        const css_invalidation_set **sets =
+            css_realloc(inv->sets, cap * sizeof(*sets));
+        if (!sets) {
+            /* cannot narrow the candidates any more */
+            inv->flags |= set->flags;
+            inv->any_element = true;
+            return;
+        }
+        inv->sets = sets;
+        inv->cap = cap;
+    }
+    inv->sets[inv->count++] = set;
+    inv->flags |= set->flags;
+}
+
+static bool contains_class(const char *const *classes, size_t count,
+                           const char *name)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(classes[i], name) == 0) return true;
+    }
+    return false;
+}
+
+void css_invalidation_add_class_change(
+    const css_invalidation_index *index,
+    const char *const *old_classes, size_t old_count,
+    const char *const *new_classes, size_t new_count,
+    css_invalidation *out)
+{
+    if (!index || !out) return;
+    for (size_t i = 0; i < old_count; i++) {
+        if (!contains_class(new_classes, new_count, old_classes[i]))
+            invalidation_push(out, css_invalidation_for_class(
+                                       index, old_classes[i]));
+    }
+    for (size_t i = 0; i < new_count; i++) {
+        if (!contains_class(old_classes, old_count, new_classes[i]))
+            invalidation_push(out, css_invalidation_for_class(
+                                       index, new_classes[i]));
+    }
+    invalidation_push(out, css_invalidation_for_attribute(index, "class"));
+}
+
+void css_invalidation_add_id_change(const css_invalidation_index *index,
+                                    const char *old_id, const char *new_id,
+                                    css_invalidation *out)
+{
+    if (!index || !out) return;
+    if (old_id && new_id && strcmp(old_id, new_id) == 0) return;
+    invalidation_push(out, css_invalidation_for_id(index, old_id));
+    invalidation_push(out, css_invalidation_for_id(index, new_id));
+    invalidation_push(out, css_invalidation_for_attribute(index, "id"));
+}
+
+void css_invalidation_add_attribute_change(
+    const css_invalidation_index *index, const char *name,
+    css_invalidation *out)
+{
+    if (!index || !out) return;
+    invalidation_push(out, css_invalidation_for_attribute(index, name));
+}
+
+static bool has_key(const css_invalidation_key *key,
+                    const css_element_adapter *a, const void *el)
+{
+    const char *value;
+    switch (key->kind) {
+    case CSS_INVALIDATION_ID:
+        value = a->id(a->ctx, el);
+        return value && strcmp(value, key->name) == 0;
+    case CSS_INVALIDATION_CLASS: {
+        const char *const *classes = NULL;
+        size_t count = a->classes(a->ctx, el, &classes);
+        return contains_class(classes, count, key->name);
+    }
+    case CSS_INVALIDATION_ATTRIBUTE:
+        return a->attribute(a->ctx, el, key->name) != NULL;
+    case CSS_INVALIDATION_TAG:
+        value = a->tag_name(a->ctx, el);
+        return value && css_ascii_casecmp(value, key->name) == 0;
+    }
+    return true;
+}
+
+bool css_invalidation_affects(const css_invalidation *inv,
+                              const css_element_adapter *adapter,
+                              const void *el)
+{
+    if (!inv || !adapter || !el) return false;
+    if (inv->any_element) return true;
+    for (size_t i = 0; i < inv->count; i++) {
+        const css_invalidation_set *set = inv->sets[i];
+        if (set->any_element) return true;
+        for (size_t k = 0; k < set->key_count; k++) {
+            if (has_key(&set->keys[k], adapter, el)) return true;
+        }
+    }
+    return false;
+}
+
+void css_invalidation_reset(css_invalidation *inv)
+{
+    if (!inv) return;
+    inv->flags = 0;
+    inv->any_element = false;
+    inv->count = 0;
+}
+
+void css_invalidation_free(css_invalidation *inv)
+{
+    if (!inv) return;
+    css_free(inv->sets);
+    inv->sets = NULL;
+    inv->flags = 0;
+    inv->any_element = false;
+    inv->count = 0;
+    inv->cap = 0;
+}
@@ -0,0 +1,443 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_match.h"
+#include "css_hash.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ================================================================
+ * Attribute value operators (Selectors Level 4 §6.2 - §6.3)
+ * ================================================================ */
+
+static bool is_html_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+/* The needle is lowercased already when icase: fold only the value */
+static bool bytes_equal(const char *actual, const char *needle, size_t n,
+                        bool icase)
+{
+    if (!icase) return memcmp(actual, needle, n) == 0;
+    for (size_t i = 0; i < n; i++) {
+        if (css_ascii_lower(actual[i]) != needle[i]) return false;
+    }
+    return true;
+}
+
+/* Next occurrence of c in [p, end), NULL if none */
+static const char *find_byte(const char *p, const char *end, char c)
+{
+    return p < end ? memchr(p, c, (size_t)(end - p)) : NULL;
+}
+
+/* Substring search driven by memchr on the needle's first byte (both
+ * cases of it when icase) */
+static bool contains(const char *hay, size_t hay_len, const char *needle,
+                     size_t needle_len, bool icase)
+{
+    if (needle_len > hay_len) return false;
+    const char *end = hay + (hay_len - needle_len) + 1;  /* last start + 1 */
+    char lower = needle[0];
+    char upper = icase && lower >= 'a' && lower <= 'z'
+                     ? (char)(lower - 'a' + 'A') : lower;
+    const char *lo = find_byte(hay, end, lower);
+    const char *up = upper != lower ? find_byte(hay, end, upper) : NULL;
+    while (lo || up) {
+        const char *hit = !up || (lo && lo < up) ? lo : up;
+        if (bytes_equal(hit + 1, needle + 1, needle_len - 1, icase))
+            return true;
+        if (hit == lo) lo = find_byte(lo + 1, end, lower);
+        else up = find_byte(up + 1, end, upper);
+    }
+    return false;
+}
+
+bool css_attr_matcher_match(const css_attr_matcher *m, const char *actual)
+{
+    if (m->op == ATTR_EXISTS) return true;
+    if (m->never) return false;
+
+    const char *needle = m->needle;
+    size_t nlen = m->length;
+    bool icase = m->case_insensitive;
+    size_t alen = strlen(actual);
+
+    switch (m->op) {
+    case ATTR_EXACT:
+        return alen == nlen && bytes_equal(actual, needle, nlen, icase);
+    case ATTR_INCLUDES:
+        /* whitespace-separated words of the right length only */
+        for (size_t i = 0; i < alen; ) {
+            while (i < alen && is_html_space(actual[i])) i++;
+            size_t start = i;
+            while (i < alen && !is_html_space(actual[i])) i++;
+            if (i - start == nlen &&
+                bytes_equal(actual + start, needle, nlen, icase))
+                return true;
+        }
+        return false;
+    case ATTR_DASH:
+        return alen >= nlen && (alen == nlen || actual[nlen] == '-') &&
+               bytes_equal(actual, needle, nlen, icase);
+    case ATTR_PREFIX:
+        return alen >= nlen && bytes_equal(actual, needle, nlen, icase);
+    case ATTR_SUFFIX:
+        return alen >= nlen &&
+               bytes_equal(actual + alen - nlen, needle, nlen, icase);
+    case ATTR_SUBSTRING:
+        return contains(actual, alen, needle, nlen, icase);
+    default:
+        return false;
+    }
+}
+
+/* ================================================================
+ * Sibling positions (Selectors Level 4 §14.4)
+ * ================================================================ */
+
+bool css_nth_matches(css_nth nth, size_t index)
+{
+    if (index == 0) return false;
+    long long offset = (long long)index - nth.b;
+    if (nth.a == 0) return offset == 0;
+    return offset % nth.a == 0 && offset / nth.a >= 0;
+}
+
+#define NTH_KINDS 4    /* PSEUDO_NTH_CHILD .. PSEUDO_NTH_LAST_OF_TYPE */
+
+typedef struct {
+    const void *el;              /* NULL = empty slot */
+    uint32_t index[NTH_KINDS];   /* 0 = not known yet */
+} sibling_entry;
+
+struct css_sibling_cache {
+    sibling_entry *entries;      /* open addressing on el */
+    size_t count;
+    size_t cap;
+    const css_allocator *allocator;
+};
+
+css_sibling_cache *css_sibling_cache_create(void)
+{
+    css_sibling_cache *cache = css_calloc(1, sizeof(css_sibling_cache));
+    if (cache) cache->allocator = css_allocator_current();
+    return cache;
+}
+
+void css_sibling_cache_clear(css_sibling_cache *cache)
+{
+    if (!cache || !cache->entries) return;
+    memset(cache->entries, 0, cache->cap * sizeof(sibling_entry));
+    cache->count = 0;
+}
+
+void css_sibling_cache_free(css_sibling_cache *cache)
+{
+    if (!cache) return;
+    const css_allocator *prev = css_allocator_use(cache->allocator);
+    css_free(cache->entries);
+    css_free(cache);
+    css_allocator_use(prev);
+}
+
+static size_t pointer_hash(const void *p)
+{
+    uint64_t h = (uint64_t)(uintptr_t)p * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32);
+}
+
+static sibling_entry *cache_find(const css_sibling_cache *cache,
+                                 const void *el)
+{
+    if (!cache->entries) return NULL;
+    size_t mask = cache->cap - 1;
+    for (size_t i = pointer_hash(el) & mask; cache->entries[i].el;
+         i = (i + 1) & mask) {
+        if (cache->entries[i].el == el) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+static sibling_entry *cache_insert(css_sibling_cache *cache, const void *el)
+{
+    if ((cache->count + 1) * 4 > cache->cap * 3) {
+        size_t cap = cache->cap ? cache->cap * 2 : 64;
+        const css_allocator *prev = css_allocator_use(cache->allocator);
+        sibling_entry *entries = css_calloc(cap, sizeof(sibling_entry));
+        if (!entries) {
+            css_allocator_use(prev);
+            return NULL;
+        }
+        for (size_t i = 0; i < cache->cap; i++) {
+            if (!cache->entries[i].el) continue;
+            size_t j = pointer_hash(cache->entries[i].el) & (cap - 1);
+            while (entries[j].el) j = (j + 1) & (cap - 1);
+            entries[j] = cache->entries[i];
+        }
+        css_free(cache->entries);
+        css_allocator_use(prev);
+        cache->entries = entries;
+        cache->cap = cap;
+    }
+    size_t mask = cache->cap - 1;
+    size_t i = pointer_hash(el) & mask;
+    while (cache->entries[i].el && cache->entries[i].el != el)
+        i = (i + 1) & mask;
+    if (!cache->entries[i].el) {
+        cache->entries[i].el = el;
+        cache->count++;
+    }
+    return &cache->entries[i];
+}
+
+static void remember(css_sibling_cache *cache, const void *el, size_t slot,
+                     size_t index)
+{
+    if (index > UINT32_MAX) return;
+    sibling_entry *e = cache_insert(cache, el);
+    if (e) e->index[slot] = (uint32_t)index;
+}
+
+/* Adapter strings only live until the next callback, so el's tag is
+ * copied before its siblings' tags are fetched */
+static char *copy_tag(const css_element_adapter *a, const void *el,
+                      char *small, size_t size)
+{
+    const char *tag = a->tag_name(a->ctx, el);
+    if (!tag) return NULL;
+    size_t len = strlen(tag);
+    char *copy = len < size ? small : css_malloc(len + 1);
+    if (copy) memcpy(copy, tag, len + 1);
+    return copy;
+}
+
+static bool same_type(const css_element_adapter *a, const char *tag,
+                      const void *el)
+{
+    const char *other = a->tag_name(a->ctx, el);
+    return other && css_ascii_casecmp(other, tag) == 0;
+}
+
+size_t css_nth_index(const css_element_adapter *adapter, const void *el,
+                     css_pseudo_class_kind kind)
+{
+    const css_element_adapter *a = adapter;
+    if (!a || !el || kind < PSEUDO_NTH_CHILD ||
+        kind > PSEUDO_NTH_LAST_OF_TYPE || !a->parent(a->ctx, el))
+        return 0;
+    bool from_end = kind == PSEUDO_NTH_LAST_CHILD ||
+                    kind == PSEUDO_NTH_LAST_OF_TYPE;
+    bool of_type = kind == PSEUDO_NTH_OF_TYPE ||
+                   kind == PSEUDO_NTH_LAST_OF_TYPE;
+    const void *(*step)(void *, const void *) =
+        from_end ? a->next_sibling : a->prev_sibling;
+    if (!step) return 0;
+    size_t slot = (size_t)(kind - PSEUDO_NTH_CHILD);
+    css_sibling_cache *cache = a->sibling_cache;
+
+    const sibling_entry *hit = cache ? cache_find(cache, el) : NULL;
+    if (hit && hit->index[slot]) return hit->index[slot];
+
+    char small[64];
+    char *tag = NULL;
+    if (of_type) {
+        tag = copy_tag(a, el, small, sizeof(small));
+        if (!tag) return 0;
+    }
+
+    /* Count the siblings in the way, up to one whose position is known */
+    size_t count = 0, base = 0;
+    for (const void *s = step(a->ctx, el); s; s = step(a->ctx, s)) {
+        if (of_type && !same_type(a, tag, s)) continue;
+        const sibling_entry *e = cache ? cache_find(cache, s) : NULL;
+        if (e && e->index[slot]) {
+            base = e->index[slot];
+            break;
+        }
+        count++;
+    }
+    size_t index = base + count + 1;
+
+    /* Remember el and every sibling counted on the way */
+    if (cache) {
+        size_t i = index;
+        for (const void *s = el; s && i > base; s = step(a->ctx, s)) {
+            if (s != el && of_type && !same_type(a, tag, s)) continue;
+            remember(cache, s, slot, i--);
+        }
+    }
+
+    if (tag != small) css_free(tag);
+    return index;
+}
+
+/* ================================================================
+ * Simple selectors
+ * ================================================================ */
+
+static bool has_class(const css_element_adapter *a, const void *el,
+                      const char *name)
+{
+    const char *const *classes = NULL;
+    size_t count = a->classes(a->ctx, el, &classes);
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(classes[i], name) == 0) return true;
+    }
+    return false;
+}
+
+static bool match_pseudo_class(const css_element_adapter *a, const void *el,
+                               const char *name)
+{
+    if (css_ascii_casecmp(name, "root") == 0) {
+        return a->parent(a->ctx, el) == NULL;
+    }
+    if (css_ascii_casecmp(name, "first-child") == 0) {
+        return a->parent(a->ctx, el) && !a->prev_sibling(a->ctx, el);
+    }
+    if (a->next_sibling) {
+        if (css_ascii_casecmp(name, "last-child") == 0) {
+            return a->parent(a->ctx, el) && !a->next_sibling(a->ctx, el);
+        }
+        if (css_ascii_casecmp(name, "only-child") == 0) {
+            return a->parent(a->ctx, el) && !a->prev_sibling(a->ctx, el) &&
+                   !a->next_sibling(a->ctx, el);
+        }
+    }
+    return a->pseudo_class ? a->pseudo_class(a->ctx, el, name) : false;
+}
+
+/* :nth-child(An+B of S) counts only the siblings matching S; that
+ * position depends on S, so it is not cached */
+static bool match_nth(const css_simple_selector *sel,
+                      const css_element_adapter *a, const void *el)
+{
+    if (!sel->argument)
+        return css_nth_matches(sel->nth, css_nth_index(a, el, sel->pseudo));
+
+    const void *(*step)(void *, const void *) =
+        sel->pseudo == PSEUDO_NTH_LAST_CHILD ? a->next_sibling
+                                             : a->prev_sibling;
+    if (!step || !a->parent(a->ctx, el) ||
+        !css_match_selector_list(sel->argument, a, el))
+        return false;
+    size_t index = 1;
+    for (const void *s = step(a->ctx, el); s; s = step(a->ctx, s)) {
+        if (css_match_selector_list(sel->argument, a, s)) index++;
+    }
+    return css_nth_matches(sel->nth, index);
+}
+
+static bool match_simple(const css_simple_selector *sel,
+                         const css_element_adapter *a, const void *el)
+{
+    const char *value;
+    switch (sel->type) {
+    case SEL_UNIVERSAL:
+        return true;
+    case SEL_TYPE:
+        value = a->tag_name(a->ctx, el);
+        return value && css_ascii_casecmp(value, sel->name) == 0;
+    case SEL_ID:
+        value = a->id(a->ctx, el);
+        return value && strcmp(value, sel->name) == 0;
+    case SEL_CLASS:
+        return has_class(a, el, sel->name);
+    case SEL_ATTRIBUTE:
+        value = a->attribute(a->ctx, el, sel->attr_name);
+        return value && css_attr_matcher_match(&sel->attr_matcher, value);
+    case SEL_PSEUDO_CLASS:
+        switch (sel->pseudo) {
+        case PSEUDO_OTHER:
+            return match_pseudo_class(a, el, sel->name);
+        case PSEUDO_NOT:
+            return !css_match_selector_list(sel->argument, a, el);
+        case PSEUDO_IS:
+        case PSEUDO_WHERE:
+            return css_match_selector_list(sel->argument, a, el);
+        default:
+            return match_nth(sel, a, el);
+        }
+    case SEL_PSEUDO_ELEMENT:
+    default:
+        return false;
+    }
+}
+
+/* ================================================================
+ * Compound selectors: most selective simple selector first, in the
+ * order css_complex_selector_append() prepared
+ * ================================================================ */
+
+bool css_match_compound(const css_compound_selector *comp,
+                        const css_element_adapter *adapter, const void *el)
+{
+    if (!comp || !adapter || !el) return false;
+    if (comp->match_order) {
+        for (size_t i = 0; i < comp->match_count; i++) {
+            if (!match_simple(comp->match_order[i], adapter, el)) return false;
+        }
+        return true;
+    }
+    for (size_t i = 0; i < comp->count; i++) {
+        if (!match_simple(comp->selectors[i], adapter, el)) return false;
+    }
+    return true;
+}
+
+/* ================================================================
+ * Complex selectors: right to left with backtracking over the
+ * descendant and subsequent-sibling combinators
+ * ================================================================ */
+
+/* Match compounds[0..index] with compounds[index] at el */
+static bool match_from(const css_complex_selector *sel, size_t index,
+                       const css_element_adapter *a, const void *el)
+{
+    if (!css_match_compound(sel->compounds[index], a, el)) return false;
+    if (index == 0) return true;
+
+    const void *next;
+    switch (sel->combinators[index - 1]) {
+    case COMB_CHILD:
+        next = a->parent(a->ctx, el);
+        return next && match_from(sel, index - 1, a, next);
+    case COMB_DESCENDANT:
+        for (next = a->parent(a->ctx, el); next;
+             next = a->parent(a->ctx, next)) {
+            if (match_from(sel, index - 1, a, next)) return true;
+        }
+        return false;
+    case COMB_NEXT_SIBLING:
+        next = a->prev_sibling(a->ctx, el);
+        return next && match_from(sel, index - 1, a, next);
+    case COMB_SUBSEQUENT_SIBLING:
+        for (next = a->prev_sibling(a->ctx, el); next;
+             next = a->prev_sibling(a->ctx, next)) {
+            if (match_from(sel, index - 1, a, next)) return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool css_match_complex(const css_complex_selector *sel,
+                       const css_element_adapter *adapter, const void *el)
+{
+    if (!sel || sel->count == 0 || !adapter || !el) return false;
+    return match_from(sel, sel->count - 1, adapter, el);
+}
+
+bool css_match_selector_list(const css_selector_list *list,
+                             const css_element_adapter *adapter,
+                             const void *el)
+{
+    if (!list) return false;
+    for (size_t i = 0; i < list->count; i++) {
+        if (css_match_complex(list->selectors[i], adapter, el)) return true;
+    }
+    return false;
+}
@@ -0,0 +1,384 @@
+#define _POSIX_C_SOURCE 200809L
+#include "css_parallel.h"
+#include "css_bloom.h"
+#include "css_style_sharing.h"
+#include "css_alloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/* ================================================================
+ * Shared job state and per-worker state
+ * ================================================================ */
+
+/* Elements waiting to be matched.  The owner pushes and pops at the
+ * tail; thieves take from the head. */
+typedef struct {
+    pthread_mutex_t lock;
+    const void **items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+} task_queue;
+
+typedef struct parallel_worker parallel_worker;
+
+typedef struct {
+    const css_rule_index *index;
+    const css_parallel_options *opts;
+    parallel_worker *workers;
+    size_t count;
+    atomic_size_t pending;      /* queued or being matched */
+    atomic_bool failed;
+    const css_allocator *allocator;     /* the caller's current */
+} parallel_job;
+
+struct parallel_worker {
+    parallel_job *job;
+    task_queue queue;
+    css_element_adapter adapter;    /* the caller's, with our caches */
+    css_sibling_cache *siblings;
+    css_style_sharing_cache *sharing;
+    css_bloom_filter bloom;
+    const void **path;          /* elements in bloom, outermost first */
+    size_t depth;
+    size_t path_cap;
+    const void **children;      /* scratch for queueing children */
+    size_t children_cap;
+    css_rule_matches matches;
+    uint32_t rng;
+    size_t elements;
+    size_t steals;
+};
+
+/* ================================================================
+ * Task queues
+ * ================================================================ */
+
+/* Append items[count - 1] ... items[0], so items[0] is popped first */
+static bool queue_push_reversed(task_queue *q, const void *const *items,
+                                size_t count)
+{
+    bool ok = true;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail + count > q->cap && q->head > 0) {
+        memmove(q->items, q->items + q->head,
+                (q->tail - q->head) * sizeof(*q->items));
+        q->tail -= q->head;
+        q->head = 0;
+    }
+    if (q->tail + count > q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 64;
+        while (cap < q->tail + count) cap *= 2;
+        const void **grown = css_realloc(q->items, cap * sizeof(*grown));
+        if (grown) {
+            q->items = grown;
+            q->cap = cap;
+        } else {
+            ok = false;
+        }
+    }
+    if (ok) {
+        for (size_t i = 0; i < count; i++) {
+            q->items[q->tail++] = items[count - 1 - i];
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+static const void *queue_pop(task_queue *q)
+{
+    const void *el = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        el = q->items[--q->tail];
+        if (q->tail == q->head) q->head = q->tail = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return el;
+}
+
+static const void *queue_steal(task_queue *q)
+{
+    const void *el = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        el = q->items[q->head++];
+        if (q->tail == q->head) q->head = q->tail = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return el;
+}
+
+/* xorshift32, to spread the first victim of each steal */
+static uint32_t next_random(parallel_worker *w)
+{
+    uint32_t x = w->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return w->rng = x;
+}
+
+static const void *steal(parallel_worker *w)
+{
+    parallel_job *job = w->job;
+    size_t start = next_random(w) % job->count;
+    for (size_t i = 0; i < job->count; i++) {
+        parallel_worker *victim = &job->workers[(start + i) % job->count];
+        if (victim == w) continue;
+        const void *el = queue_steal(&victim->queue);
+        if (el) {
+            w->steals++;
+            return el;
+        }
+    }
+    return NULL;
+}
+
+/* ================================================================
+ * Ancestor filter
+ * ================================================================ */
+
+static bool path_reserve(parallel_worker *w, size_t depth)
+{
+    if (depth <= w->path_cap) return true;
+    size_t cap = w->path_cap ? w->path_cap * 2 : 32;
+    while (cap < depth) cap *= 2;
+    const void **path = css_realloc(w->path, cap * sizeof(*path));
+    if (!path) return false;
+    w->path = path;
+    w->path_cap = cap;
+    return true;
+}
+
+static bool path_push(parallel_worker *w, const void *el)
+{
+    if (!path_reserve(w, w->depth + 1)) return false;
+    css_bloom_push_element(&w->bloom, &w->adapter, el);
+    w->path[w->depth++] = el;
+    return true;
+}
+
+/* Make the filter hold exactly parent and its ancestors.  Elements
+ * popped from our own queue are children of an element on the path;
+ * stolen ones usually are not, and their ancestors are added anew. */
+static bool sync_path(parallel_worker *w, const void *parent)
+{
+    const css_element_adapter *a = &w->adapter;
+    size_t keep = w->depth;
+    while (keep > 0 && w->path[keep - 1] != parent) keep--;
+    if (keep == 0 && parent) {
+        css_bloom_clear(&w->bloom);
+        w->depth = 0;
+        for (const void *p = parent; p; p = a->parent(a->ctx, p)) {
+            if (!path_reserve(w, w->depth + 1)) {
+                w->depth = 0;
+                return false;
+            }
+            w->path[w->depth++] = p;
+        }
+        for (size_t i = 0, j = w->depth - 1; i < j; i++, j--) {
+            const void *t = w->path[i];
+            w->path[i] = w->path[j];
+            w->path[j] = t;
+        }
+        for (size_t i = 0; i < w->depth; i++) {
+            css_bloom_push_element(&w->bloom, a, w->path[i]);
+        }
+        return true;
+    }
+    while (w->depth > keep) {
+        css_bloom_pop_element(&w->bloom, a, w->path[--w->depth]);
+    }
+    return true;
+}
+
+/* ================================================================
+ * Matching
+ * ================================================================ */
+
+static void fail(parallel_job *job)
+{
+    atomic_store(&job->failed, true);
+}
+
+/* Match el, then queue its children (or, if they cannot be queued,
+ * match them here) */
+static void match_element(parallel_worker *w, const void *el)
+{
+    parallel_job *job = w->job;
+    const css_element_adapter *a = &w->adapter;
+    if (!sync_path(w, a->parent(a->ctx, el))) {
+        fail(job);
+        return;
+    }
+    css_style_sharing_match(w->sharing, a, el, &w->bloom, &w->matches);
+    job->opts->visit(job->opts->user, el, &w->matches);
+    w->elements++;
+
+    const void *child = job->opts->first_child(a->ctx, el);
+    if (!child) return;
+    if (!path_push(w, el)) {
+        fail(job);
+        return;
+    }
+
+    size_t count = 0;
+    for (; child; child = a->next_sibling(a->ctx, child)) {
+        if (count >= w->children_cap) {
+            size_t cap = w->children_cap ? w->children_cap * 2 : 32;
+            const void **children =
+                css_realloc(w->children, cap * sizeof(*children));
+            if (!children) break;
+            w->children = children;
+            w->children_cap = cap;
+        }
+        w->children[count++] = child;
+    }
+    if (!child) {
+        atomic_fetch_add(&job->pending, count);
+        if (queue_push_reversed(&w->queue, w->children, count)) return;
+        atomic_fetch_sub(&job->pending, count);
+    }
+
+    /* The children could not be queued: match them here, depth first */
+    for (child = job->opts->first_child(a->ctx, el); child;
+         child = a->next_sibling(a->ctx, child)) {
+        if (atomic_load(&job->failed)) return;
+        match_element(w, child);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    parallel_worker *w = arg;
+    parallel_job *job = w->job;
+    const css_allocator *prev = css_allocator_use(job->allocator);
+    while (!atomic_load(&job->failed)) {
+        const void *el = queue_pop(&w->queue);
+        if (!el) el = steal(w);
+        if (el) {
+            match_element(w, el);
+            atomic_fetch_sub(&job->pending, 1);
+        } else if (atomic_load(&job->pending) == 0) {
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    css_allocator_use(prev);
+    return NULL;
+}
+
+/* ================================================================
+ * css_parallel_match (public API)
+ * ================================================================ */
+
+static bool worker_init(parallel_worker *w, parallel_job *job,
+                        const css_element_adapter *adapter, size_t i)
+{
+    w->job = job;
+    if (pthread_mutex_init(&w->queue.lock, NULL) != 0) return false;
+    w->siblings = css_sibling_cache_create();
+    w->sharing = css_style_sharing_cache_create(job->index);
+    w->adapter = *adapter;
+    w->adapter.sibling_cache = w->siblings;
+    w->rng = 0x9e3779b9u * (uint32_t)(i + 1);
+    css_bloom_clear(&w->bloom);
+    if (!w->siblings || !w->sharing) {
+        css_sibling_cache_free(w->siblings);
+        css_style_sharing_cache_free(w->sharing);
+        pthread_mutex_destroy(&w->queue.lock);
+        return false;
+    }
+    return true;
+}
+
+static void worker_destroy(parallel_worker *w)
+{
+    pthread_mutex_destroy(&w->queue.lock);
+    css_free(w->queue.items);
+    css_sibling_cache_free(w->siblings);
+    css_style_sharing_cache_free(w->sharing);
+    css_free(w->path);
+    css_free(w->children);
+    css_rule_matches_free(&w->matches);
+}
+
+bool css_parallel_match(const css_rule_index *index,
+                        const css_element_adapter *adapter,
+                        const void *root,
+                        const css_parallel_options *opts,
+                        css_parallel_stats *stats)
+{
+    if (stats) memset(stats, 0, sizeof(*stats));
+    if (!index || !adapter || !adapter->next_sibling || !opts ||
+        !opts->first_child || !opts->visit)
+        return false;
+    if (!root) return true;
+
+    size_t nworkers = opts->workers;
+    if (nworkers == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpu > 0 ? (size_t)ncpu : 1;
+    }
+
+    parallel_job job;
+    job.index = index;
+    job.opts = opts;
+    atomic_init(&job.pending, 1);
+    atomic_init(&job.failed, false);
+    job.allocator = css_allocator_current();
+
+    parallel_worker *workers = css_calloc(nworkers, sizeof(*workers));
+    pthread_t *threads = css_calloc(nworkers, sizeof(*threads));
+    if (!workers || !threads) {
+        css_free(workers);
+        css_free(threads);
+        return false;
+    }
+    job.workers = workers;
+
+    size_t ready = 0;
+    for (; ready < nworkers; ready++) {
+        if (!worker_init(&workers[ready], &job, adapter, ready)) break;
+    }
+    job.count = ready;
+
+    bool ok = ready > 0 &&
+              queue_push_reversed(&workers[0].queue, &root, 1);
+    if (ok) {
+        /* Worker 0 runs on the calling thread */
+        size_t started = 1;
+        for (; started < ready; started++) {
+            if (pthread_create(&threads[started], NULL, worker_main,
+                               &workers[started]) != 0)
+                break;
+        }
+        worker_main(&workers[0]);
+        for (size_t i = 1; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        ok = !atomic_load(&job.failed);
+        if (stats) stats->workers = started;
+    }
+
+    for (size_t i = 0; i < ready; i++) {
+        if (stats) {
+            size_t hits = 0;
+            css_style_sharing_stats(workers[i].sharing, &hits, NULL);
+            stats->elements += workers[i].elements;
+            stats->shared += hits;
+            stats->steals += workers[i].steals;
+        }
+        worker_destroy(&workers[i]);
+    }
+    css_free(workers);
+    css_free(threads);
+    return ok;
+}
@@ -1,31 +1,312 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "css_tokenizer.h"
 #include "css_parser.h"
+#include "css_sax.h"
+#include "css_flat.h"
+#include "css_cache.h"
+#include "css_serialize.h"
+#include "css_dump.h"
+#include "css_batch.h"
+#include <unistd.h>
+#include <time.h>
 
-/* Declared in css_parser.c — enhanced dump with declaration detection */
-extern void css_parse_dump(css_stylesheet *sheet, FILE *out);
+/* ================================================================
+ * --sax mode: print parser events with block nesting
+ * ================================================================ */
+
+static void sax_indent(int depth)
+{
+    for (int i = 0; i < depth; i++) {
+        printf("  ");
+    }
+}
+
+static void sax_at_rule_start(void *user_data, const char *name,
+                              const char *prelude, size_t prelude_length,
+                              bool has_block)
+{
+    int *depth = user_data;
+    sax_indent(*depth);
+    printf("AT_RULE_START \"%s\" prelude=\"%.*s\"%s\n", name,
+           (int)prelude_length, prelude, has_block ? " {" : "");
+    if (has_block) (*depth)++;
+}
+
+static void sax_selector_text(void *user_data, const char *text,
+                              size_t length)
+{
+    int *depth = user_data;
+    sax_indent(*depth);
+    printf("SELECTOR \"%.*s\" {\n", (int)length, text);
+    (*depth)++;
+}
+
+static void sax_declaration(void *user_data, const css_sax_declaration *decl)
+{
+    int *depth = user_data;
+    sax_indent(*depth);
+    printf("DECLARATION \"%s\" value=\"%.*s\"%s\n", decl->name,
+           (int)decl->value_length, decl->value,
+           decl->important ? " !important" : "");
+}
+
+static void sax_block_end(void *user_data)
+{
+    int *depth = user_data;
+    (*depth)--;
+    sax_indent(*depth);
+    printf("BLOCK_END\n");
+}
+
+/* ================================================================
+ * --stats: per-phase report on stderr
+ * ================================================================ */
+
+static double seconds_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void print_stats(const css_parse_stats *st, double output_seconds)
+{
+    static const char *const node_names[CSS_NODE_TYPE_COUNT] = {
+        "stylesheet", "at-rule", "qualified-rule", "declaration",
+        "component-value", "simple-block", "function"
+    };
+    fprintf(stderr, "phase        ms\n");
+    fprintf(stderr, "preprocess   %.3f\n", st->preprocess_seconds * 1e3);
+    fprintf(stderr, "tokenize     %.3f\n", st->tokenize_seconds * 1e3);
+    fprintf(stderr, "rules        %.3f\n", st->rules_seconds * 1e3);
+    fprintf(stderr, "selectors    %.3f\n", st->selectors_seconds * 1e3);
+    fprintf(stderr, "parse total  %.3f\n", st->total_seconds * 1e3);
+    fprintf(stderr, "output       %.3f\n", output_seconds * 1e3);
+    fprintf(stderr, "tokens: %zu\n", st->token_count);
+    for (int i = 0; i < CSS_TOKEN_TYPE_COUNT; i++) {
+        if (st->tokens[i]) {
+            fprintf(stderr, "  %-16s %zu\n",
+                    css_token_type_name((css_token_type)i), st->tokens[i]);
+        }
+    }
+    fprintf(stderr, "nodes:\n");
+    for (int i = 0; i < CSS_NODE_TYPE_COUNT; i++) {
+        if (st->nodes[i]) {
+            fprintf(stderr, "  %-16s %zu\n", node_names[i], st->nodes[i]);
+        }
+    }
+    fprintf(stderr, "selectors: %zu\n", st->selector_count);
+    fprintf(stderr, "allocations: %zu (%zu bytes)\n", st->allocations,
+            st->alloc_bytes);
+    fprintf(stderr, "errors: %zu\n", st->errors);
+}
+
+/* ================================================================
+ * --batch mode: parse many files on a worker pool
+ * ================================================================ */
+
+/* Read one path per line from stdin; blank lines are skipped */
+static char **read_manifest(size_t *count)
+{
+    char **paths = NULL;
+    size_t n = 0, cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, stdin)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0) continue;
+        if (n >= cap) {
+            cap = cap ? cap * 2 : 16;
+            char **np = realloc(paths, cap * sizeof(*paths));
+            if (!np) break;
+            paths = np;
+        }
+        paths[n] = strdup(line);
+        if (!paths[n]) break;
+        n++;
+    }
+    free(line);
+    *count = n;
+    return paths;
+}
+
+static int run_batch(const char *const *paths, size_t count,
+                     const css_batch_options *opts)
+{
+    css_batch_result *results = calloc(count ? count : 1, sizeof(*results));
+    if (!results) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    bool all_ok = css_batch_parse_files(paths, count, opts, results);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wall = (double)(t1.tv_sec - t0.tv_sec) +
+                  (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    size_t ok_count = 0, bytes = 0, rules = 0;
+    for (size_t i = 0; i < count; i++) {
+        const css_batch_result *r = &results[i];
+        if (r->ok) {
+            printf("ok     %s: %zu bytes, %zu rules, %.3f ms\n", r->path,
+                   r->bytes, r->rule_count, r->seconds * 1e3);
+            ok_count++;
+            bytes += r->bytes;
+            rules += r->rule_count;
+        } else {
+            printf("FAILED %s: %s\n", paths[i],
+                   r->error ? strerror(r->error) : "not parsed");
+        }
+    }
+    printf("batch: %zu files, %zu ok, %zu failed, %zu bytes, %zu rules, "
+           "%.3f s, %.2f MB/s\n", count, ok_count, count - ok_count, bytes,
+           rules, wall, wall > 0 ? (double)bytes / wall / 1e6 : 0.0);
+
+    free(results);
+    return all_ok ? 0 : 1;
+}
 
 int main(int argc, char *argv[])
 {
     bool token_mode = false;
-    const char *filename = NULL;
+    bool sax_mode = false;
+    bool decl_mode = false;
+    bool flat_mode = false;
+    const char *compile_path = NULL;
+    bool load_mode = false;
+    const char *cache_dir = NULL;
+    bool serialize_mode = false;
+    css_serialize_mode serialize_as = CSS_SERIALIZE_PRETTY;
+    css_dump_format format = CSS_DUMP_TEXT;
+    css_parser_options options;
+    memset(&options, 0, sizeof(options));
+    css_parse_stats stats;
+    bool stats_mode = false;
+    bool memory_mode = false;
+    bool batch_mode = false;
+    size_t batch_workers = 0;
+    const char **files = calloc((size_t)argc, sizeof(*files));
+    size_t file_count = 0;
+    if (!files) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
 
     /* Parse arguments */
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--tokens") == 0) {
             token_mode = true;
-        } else if (!filename) {
-            filename = argv[i];
+        } else if (strcmp(argv[i], "--sax") == 0) {
+            sax_mode = true;
+        } else if (strcmp(argv[i], "--declarations") == 0) {
+            decl_mode = true;
+        } else if (strcmp(argv[i], "--flat") == 0) {
+            flat_mode = true;
+        } else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+            compile_path = argv[++i];
+        } else if (strcmp(argv[i], "--load") == 0) {
+            load_mode = true;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            options.dedup_blocks = true;
+        } else if (strcmp(argv[i], "--keep-preludes") == 0) {
+            options.keep_preludes = true;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            if (!css_dump_format_from_name(argv[++i], &format)) {
+                fprintf(stderr, "Unknown format '%s' (text, json, binary)\n",
+                        argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--serialize") == 0) {
+            serialize_mode = true;
+            serialize_as = CSS_SERIALIZE_PRETTY;
+        } else if (strcmp(argv[i], "--minify") == 0) {
+            serialize_mode = true;
+            serialize_as = CSS_SERIALIZE_MINIFY;
+        } else if (strcmp(argv[i], "--memory") == 0) {
+            memory_mode = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats_mode = true;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch_mode = true;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            batch_workers = strtoul(argv[++i], NULL, 10);
+        } else {
+            files[file_count++] = argv[i];
+        }
+    }
+
+    if (stats_mode && !batch_mode) options.stats = &stats;
+    /* --stats times selector parsing and --memory counts the lists */
+    if (stats_mode || memory_mode) options.eager_selectors = true;
+    /* Modes that print every prelude keep them as component values
+     * rather than have the printers tokenize each one again */
+    if (!memory_mode && !batch_mode) options.keep_preludes = true;
+
+    if (batch_mode) {
+        /* --batch: paths from the command line, else a manifest on stdin */
+        css_batch_options batch_opts = { batch_workers, options };
+        int status;
+        if (file_count > 0) {
+            status = run_batch((const char *const *)files, file_count,
+                               &batch_opts);
+        } else {
+            size_t count = 0;
+            char **manifest = read_manifest(&count);
+            status = run_batch((const char *const *)manifest, count,
+                               &batch_opts);
+            for (size_t i = 0; i < count; i++) free(manifest[i]);
+            free(manifest);
         }
+        free(files);
+        return status;
     }
 
+    const char *filename = file_count > 0 ? files[0] : NULL;
+    free(files);
     if (!filename) {
-        fprintf(stderr, "Usage: %s [--tokens] <file.css>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--tokens | --sax | --declarations | --flat |\n"
+                        "       --memory | --compile <out.cssb>] [--cache-dir <dir>]\n"
+                        "       [--dedup] [--keep-preludes] [--serialize | --minify]\n"
+                        "       [--format text|json|binary] [--stats] <file.css>\n"
+                        "       %s --load <file.cssb>\n"
+                        "       %s --batch [-j N] [--dedup] [<file.css>...]\n",
+                argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    /* --cache-dir keeps the precompiled form, which only dumps as
+     * text, and a cache hit parses nothing to report --stats on */
+    bool cache_mode = cache_dir && !compile_path && !token_mode &&
+                      !sax_mode && !decl_mode && !memory_mode &&
+                      !serialize_mode;
+    if (cache_mode && (format != CSS_DUMP_TEXT || stats_mode)) {
+        fprintf(stderr, "%s: --cache-dir cannot be combined with "
+                        "--format json|binary or --stats\n", argv[0]);
         return 1;
     }
 
+    if (load_mode) {
+        /* --load: map a precompiled stylesheet and dump it in place */
+        const css_flat_sheet *flat = css_flat_map(filename);
+        if (!flat) {
+            fprintf(stderr, "%s: not a valid precompiled stylesheet\n",
+                    filename);
+            return 1;
+        }
+        css_flat_dump(flat, stdout);
+        css_flat_unmap(flat);
+        return 0;
+    }
+
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
         perror(filename);
@@ -112,16 +393,187 @@ int main(int argc, char *argv[])
         }
 
         css_tokenizer_free(tokenizer);
+    } else if (sax_mode) {
+        /* --sax mode: stream parser events without building an AST */
+        css_sax_handler handler = {
+            sax_at_rule_start,
+            sax_selector_text,
+            sax_declaration,
+            sax_block_end
+        };
+        int depth = 0;
+        if (!css_sax_parse(buf, nread, &handler, &depth)) {
+            fprintf(stderr, "Failed to create tokenizer\n");
+            free(buf);
+            return 1;
+        }
+    } else if (decl_mode) {
+        /* --declarations mode: each line is one style="" attribute,
+         * all parsed through the batch API with one parser context */
+        size_t count = 0, cap = 0;
+        const char **inputs = NULL;
+        size_t *lengths = NULL;
+        bool ok = true;
+        for (char *line = buf; ok && line < buf + nread; ) {
+            char *end = memchr(line, '\n', (size_t)(buf + nread - line));
+            if (!end) end = buf + nread;
+            if (end > line) {
+                if (count >= cap) {
+                    size_t ncap = cap ? cap * 2 : 16;
+                    const char **ni = realloc(inputs, ncap * sizeof(*inputs));
+                    if (ni) inputs = ni;
+                    size_t *nl = ni ? realloc(lengths, ncap * sizeof(*lengths))
+                                    : NULL;
+                    if (nl) lengths = nl;
+                    if (!ni || !nl) {
+                        ok = false;
+                        break;
+                    }
+                    cap = ncap;
+                }
+                inputs[count] = line;
+                lengths[count] = (size_t)(end - line);
+                count++;
+            }
+            line = end + 1;
+        }
+
+        css_declaration_list **lists = ok ? calloc(count ? count : 1,
+                                                   sizeof(*lists))
+                                          : NULL;
+        if (!lists) {
+            fprintf(stderr, "Out of memory\n");
+            free(inputs);
+            free(lengths);
+            free(buf);
+            return 1;
+        }
+        css_parse_declaration_lists(inputs, lengths, count, lists);
+        css_buffer out;
+        css_buffer_init_fd(&out, STDOUT_FILENO);
+        for (size_t i = 0; i < count; i++) {
+            css_dump_declaration_list(lists[i], format, &out);
+            css_declaration_list_free(lists[i]);
+        }
+        css_buffer_flush(&out);
+        css_buffer_free(&out);
+        free(lists);
+        free(inputs);
+        free(lengths);
+    } else if (memory_mode) {
+        /* --memory: bytes held by the parsed sheet, by category */
+        css_stylesheet *sheet =
+            css_parse_stylesheet_with_options(buf, nread, &options);
+        if (!sheet) {
+            fprintf(stderr, "Failed to parse stylesheet\n");
+            free(buf);
+            return 1;
+        }
+        css_memory_usage usage;
+        css_stylesheet_memory_usage(sheet, &usage);
+        css_stylesheet_free(sheet);
+        printf("tokens          %zu\n", usage.tokens);
+        printf("token strings   %zu\n", usage.token_strings);
+        printf("values          %zu\n", usage.values);
+        printf("value arrays    %zu\n", usage.value_arrays);
+        printf("value slack     %zu\n", usage.value_slack);
+        printf("blocks          %zu\n", usage.blocks);
+        printf("selectors       %zu\n", usage.selectors);
+        printf("rules           %zu\n", usage.rules);
+        printf("total           %zu\n", usage.total);
+    } else if (serialize_mode) {
+        /* --serialize / --minify: write the sheet back out as CSS */
+        css_stylesheet *sheet =
+            css_parse_stylesheet_with_options(buf, nread, &options);
+        if (!sheet) {
+            fprintf(stderr, "Failed to parse stylesheet\n");
+            free(buf);
+            return 1;
+        }
+        double output_start = seconds_now();
+        bool ok = css_serialize_to_fd(sheet, serialize_as, STDOUT_FILENO);
+        if (stats_mode) print_stats(&stats, seconds_now() - output_start);
+        css_stylesheet_free(sheet);
+        if (!ok) {
+            perror("write");
+            free(buf);
+            return 1;
+        }
+    } else if (cache_mode) {
+        /* --cache-dir: dump from the cached precompiled form, parsing
+         * and filling the cache only on a miss */
+        uint64_t key = css_cache_key(buf, nread);
+        const css_flat_sheet *cached = css_cache_load(cache_dir, key);
+        if (cached) {
+            css_flat_dump(cached, stdout);
+            css_flat_unmap(cached);
+        } else {
+            css_stylesheet *sheet =
+                css_parse_stylesheet_with_options(buf, nread, &options);
+            css_flat_sheet *flat = sheet ? css_flat_build(sheet) : NULL;
+            css_stylesheet_free(sheet);
+            if (!flat) {
+                fprintf(stderr, "Failed to parse stylesheet\n");
+                free(buf);
+                return 1;
+            }
+            if (!css_cache_store(cache_dir, key, flat)) {
+                fprintf(stderr, "%s: failed to store cache entry\n",
+                        cache_dir);
+            }
+            css_flat_dump(flat, stdout);
+            css_flat_free(flat);
+        }
     } else {
         /* Default mode: parse and dump AST */
-        css_stylesheet *sheet = css_parse_stylesheet(buf, nread);
+        css_stylesheet *sheet =
+            css_parse_stylesheet_with_options(buf, nread, &options);
         if (!sheet) {
             fprintf(stderr, "Failed to parse stylesheet\n");
             free(buf);
             return 1;
         }
-        css_parse_dump(sheet, stdout);
-        css_stylesheet_free(sheet);
+        if (compile_path) {
+            /* --compile: write the precompiled (.cssb) form */
+            css_flat_sheet *flat = css_flat_build(sheet);
+            css_stylesheet_free(sheet);
+            FILE *out = flat ? fopen(compile_path, "wb") : NULL;
+            bool ok = out && css_flat_write(flat, out);
+            if (out && fclose(out) != 0) ok = false;
+            if (!ok) {
+                fprintf(stderr, "%s: failed to write precompiled stylesheet\n",
+                        compile_path);
+            }
+            css_flat_free(flat);
+            free(buf);
+            return ok ? 0 : 1;
+        } else if (flat_mode) {
+            /* --flat: dump through the flat, index-based copy */
+            css_flat_sheet *flat = css_flat_build(sheet);
+            css_stylesheet_free(sheet);
+            if (!flat) {
+                fprintf(stderr, "Failed to build flat stylesheet\n");
+                free(buf);
+                return 1;
+            }
+            css_flat_dump(flat, stdout);
+            css_flat_free(flat);
+        } else {
+            /* Buffered dump in the --format of choice */
+            double output_start = seconds_now();
+            css_buffer out;
+            css_buffer_init_fd(&out, STDOUT_FILENO);
+            css_dump_stylesheet(sheet, format, &out);
+            bool ok = css_buffer_flush(&out);
+            css_buffer_free(&out);
+            if (stats_mode) print_stats(&stats, seconds_now() - output_start);
+            css_stylesheet_free(sheet);
+            if (!ok) {
+                perror("write");
+                free(buf);
+                return 1;
+            }
+        }
     }
 
     free(buf);
@@ -4,20 +4,191 @@
 #include "css_tokenizer.h"
 #include "css_ast.h"
 #include "css_selector.h"
+#include "css_dump.h"
+#include "css_hash.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <strings.h>  /* strcasecmp */
+#include <time.h>
 
 /* ================================================================
  * Internal parser struct
  * ================================================================ */
 
 typedef struct {
+    uint64_t hash;
+    css_simple_block *block;   /* NULL = empty slot */
+} block_entry;
+
+struct css_parser_ctx {
     css_tokenizer *tokenizer;
     css_token *current_token;  /* currently consumed token (owned) */
     bool reconsume;
-} css_parser_ctx;
+    css_parser_options options;
+    const css_allocator *allocator;  /* context and tokenizer memory */
+
+    /* dedup_blocks: open-addressing table of the distinct rule blocks
+     * seen in the current parse (not owning) */
+    block_entry *blocks;
+    size_t block_count;
+    size_t block_cap;          /* power of two */
+
+    /* options.stats: state of the parse being measured */
+    double stats_start;
+    double sample_seconds;      /* tokenizer time of the sampled tokens */
+    size_t samples;
+    bool in_selectors;          /* tokens go to selectors_seconds */
+    size_t selector_tokens;     /* tokens read while in_selectors */
+    css_alloc_counts alloc_counts;
+    css_alloc_counts *prev_counts;
+};
+
+/* ================================================================
+ * Instrumentation (css_parser_options.stats)
+ * ================================================================ */
+
+static double stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void stats_begin(css_parser_ctx *p)
+{
+    css_parse_stats *st = p->options.stats;
+    if (!st) return;
+    memset(st, 0, sizeof(*st));
+    memset(&p->alloc_counts, 0, sizeof(p->alloc_counts));
+    p->prev_counts = css_alloc_count(&p->alloc_counts);
+    p->sample_seconds = 0;
+    p->samples = 0;
+    p->in_selectors = false;
+    p->selector_tokens = 0;
+    p->stats_start = stats_now();
+}
+
+/* Call right after the tokenizer was (re)set up on the input */
+static void stats_preprocessed(css_parser_ctx *p)
+{
+    if (!p->options.stats) return;
+    p->options.stats->preprocess_seconds = stats_now() - p->stats_start;
+}
+
+/* Reading the clock costs about as much as a short token, so only one
+ * token in STATS_SAMPLE_PERIOD is timed (not the first, which runs with
+ * cold caches); stats_end() scales the sampled time up to all tokens
+ * read outside selector parsing, which is timed as a whole.  Counts
+ * are exact. */
+#define STATS_SAMPLE_PERIOD 64
+
+static css_token *stats_next_token(css_parser_ctx *p)
+{
+    css_parse_stats *st = p->options.stats;
+    css_token *tok;
+    if (p->in_selectors) {
+        tok = css_tokenizer_next(p->tokenizer);
+        if (tok) p->selector_tokens++;
+    } else if (st->token_count % STATS_SAMPLE_PERIOD ==
+               STATS_SAMPLE_PERIOD / 2) {
+        double start = stats_now();
+        tok = css_tokenizer_next(p->tokenizer);
+        p->sample_seconds += stats_now() - start;
+        p->samples++;
+    } else {
+        tok = css_tokenizer_next(p->tokenizer);
+    }
+    if (tok) {
+        st->token_count++;
+        st->tokens[tok->type]++;
+    }
+    return tok;
+}
+
+static void stats_count_values(css_parse_stats *st,
+                               css_component_value **values, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        css_component_value *cv = values[i];
+        if (!cv) continue;
+        st->nodes[CSS_NODE_COMPONENT_VALUE]++;
+        if (cv->type == CSS_NODE_SIMPLE_BLOCK && cv->u.block) {
+            st->nodes[CSS_NODE_SIMPLE_BLOCK]++;
+            stats_count_values(st, cv->u.block->values,
+                               cv->u.block->value_count);
+        } else if (cv->type == CSS_NODE_FUNCTION && cv->u.function) {
+            st->nodes[CSS_NODE_FUNCTION]++;
+            stats_count_values(st, cv->u.function->values,
+                               cv->u.function->value_count);
+        }
+    }
+}
+
+static void stats_count_block(css_parse_stats *st, css_simple_block *block)
+{
+    if (!block) return;
+    st->nodes[CSS_NODE_SIMPLE_BLOCK]++;
+    stats_count_values(st, block->values, block->value_count);
+}
+
+static void stats_count_declarations(css_parse_stats *st,
+                                     css_declaration_list *list)
+{
+    for (size_t i = 0; i < list->declaration_count; i++) {
+        css_declaration *decl = list->declarations[i];
+        st->nodes[CSS_NODE_DECLARATION]++;
+        stats_count_values(st, decl->values, decl->value_count);
+    }
+}
+
+static void stats_count_sheet(css_parse_stats *st, css_stylesheet *sheet)
+{
+    st->nodes[CSS_NODE_STYLESHEET]++;
+    for (size_t i = 0; i < sheet->rule_count; i++) {
+        css_rule *rule = sheet->rules[i];
+        if (rule->type == CSS_NODE_AT_RULE) {
+            css_at_rule *ar = rule->u.at_rule;
+            st->nodes[CSS_NODE_AT_RULE]++;
+            stats_count_values(st, ar->prelude, ar->prelude_count);
+            stats_count_block(st, ar->block);
+        } else {
+            css_qualified_rule *qr = rule->u.qualified_rule;
+            st->nodes[CSS_NODE_QUALIFIED_RULE]++;
+            stats_count_values(st, qr->prelude, qr->prelude_count);
+            stats_count_block(st, qr->block);
+            css_selector_list *list = atomic_load(&qr->selectors_cache);
+            if (list) st->selector_count += list->count;
+        }
+    }
+}
+
+/* Finish a measured parse of sheet or list (either may be NULL) */
+static void stats_end(css_parser_ctx *p, css_stylesheet *sheet,
+                      css_declaration_list *list)
+{
+    css_parse_stats *st = p->options.stats;
+    if (!st) return;
+    st->total_seconds = stats_now() - p->stats_start;
+    css_alloc_count(p->prev_counts);
+    st->allocations = p->alloc_counts.allocations;
+    st->alloc_bytes = p->alloc_counts.bytes;
+    st->errors = p->tokenizer ? p->tokenizer->error_count : 0;
+
+    double rest = st->total_seconds - st->preprocess_seconds -
+                  st->selectors_seconds;
+    if (p->samples > 0) {
+        st->tokenize_seconds = p->sample_seconds *
+                               (double)(st->token_count - p->selector_tokens) /
+                               (double)p->samples;
+        if (st->tokenize_seconds > rest) st->tokenize_seconds = rest;
+    }
+    st->rules_seconds = rest - st->tokenize_seconds;
+    if (st->rules_seconds < 0) st->rules_seconds = 0;
+
+    if (sheet) stats_count_sheet(st, sheet);
+    if (list) stats_count_declarations(st, list);
+}
 
 /* ================================================================
  * Token consumption helpers
@@ -32,7 +203,11 @@ static css_token *next_token(css_parser_ctx *p)
     if (p->current_token) {
         css_token_free(p->current_token);
     }
-    p->current_token = css_tokenizer_next(p->tokenizer);
+    if (p->options.stats) {
+        p->current_token = stats_next_token(p);
+    } else {
+        p->current_token = css_tokenizer_next(p->tokenizer);
+    }
     return p->current_token;
 }
 
@@ -50,10 +225,10 @@ static css_token *clone_token(css_token *src)
     if (!src) return NULL;
     css_token *dst = css_token_create(src->type);
     if (!dst) return NULL;
-    dst->value = src->value ? strdup(src->value) : NULL;
+    dst->value = src->value ? css_strdup(src->value) : NULL;
     dst->numeric_value = src->numeric_value;
     dst->number_type = src->number_type;
-    dst->unit = src->unit ? strdup(src->unit) : NULL;
+    dst->unit = src->unit ? css_strdup(src->unit) : NULL;
     dst->hash_type = src->hash_type;
     dst->delim_codepoint = src->delim_codepoint;
     dst->line = src->line;
@@ -68,6 +243,8 @@ static css_token *clone_token(css_token *src)
 static css_component_value *consume_component_value(css_parser_ctx *p);
 static css_simple_block *consume_simple_block(css_parser_ctx *p);
 static css_function *consume_function(css_parser_ctx *p);
+static bool cv_is_token(css_component_value *cv, css_token_type type);
+static void check_important(css_declaration *decl);
 
 /* ================================================================
  * consume_component_value (CSS Syntax §5.4.7)
@@ -89,9 +266,10 @@ static css_component_value *consume_component_value(css_parser_ctx *p)
         return css_component_value_create_function(func);
     }
 
-    /* Preserved token — clone since current_token is owned by parser */
-    css_token *copy = clone_token(tok);
-    return css_component_value_create_token(copy);
+    /* Preserved token — take it over from the parser instead of cloning.
+     * The next next_token() call then has nothing to free. */
+    p->current_token = NULL;
+    return css_component_value_create_token(tok);
 }
 
 /* ================================================================
@@ -152,11 +330,196 @@ static css_function *consume_function(css_parser_ctx *p)
     }
 }
 
+/* ================================================================
+ * Block hash-consing (dedup_blocks option)
+ *
+ * Blocks are compared by their token streams: types, values, units,
+ * numbers and flags, recursively.  Source positions are ignored.
+ * ================================================================ */
+
+static uint64_t hash_str(uint64_t h, const char *s)
+{
+    /* Include the NUL so NULL, "" and adjacent strings stay distinct */
+    if (!s) return css_hash_bytes(h, "\xff", 1);
+    return css_hash_bytes(h, s, strlen(s) + 1);
+}
+
+static uint64_t hash_values(uint64_t h, css_component_value **values,
+                            size_t count);
+
+static uint64_t hash_cv(uint64_t h, css_component_value *cv)
+{
+    if (!cv) return css_hash_bytes(h, "", 1);
+    unsigned char type = (unsigned char)cv->type;
+    h = css_hash_bytes(h, &type, 1);
+
+    switch (cv->type) {
+    case CSS_NODE_COMPONENT_VALUE: {
+        css_token *tok = cv->u.token;
+        if (!tok) break;
+        unsigned char info[3] = {
+            (unsigned char)tok->type, (unsigned char)tok->number_type,
+            (unsigned char)tok->hash_type
+        };
+        h = css_hash_bytes(h, info, sizeof(info));
+        h = hash_str(h, tok->value);
+        h = hash_str(h, tok->unit);
+        h = css_hash_bytes(h, &tok->numeric_value, sizeof(tok->numeric_value));
+        h = css_hash_bytes(h, &tok->delim_codepoint,
+                       sizeof(tok->delim_codepoint));
+        break;
+    }
+    case CSS_NODE_SIMPLE_BLOCK:
+        if (!cv->u.block) break;
+        h = css_hash_bytes(h, &cv->u.block->associated_token,
+                       sizeof(cv->u.block->associated_token));
+        h = hash_values(h, cv->u.block->values, cv->u.block->value_count);
+        break;
+    case CSS_NODE_FUNCTION:
+        if (!cv->u.function) break;
+        h = hash_str(h, cv->u.function->name);
+        h = hash_values(h, cv->u.function->values,
+                        cv->u.function->value_count);
+        break;
+    default:
+        break;
+    }
+    return h;
+}
+
+static uint64_t hash_values(uint64_t h, css_component_value **values,
+                            size_t count)
+{
+    h = css_hash_bytes(h, &count, sizeof(count));
+    for (size_t i = 0; i < count; i++) {
+        h = hash_cv(h, values[i]);
+    }
+    return h;
+}
+
+static bool str_equal(const char *a, const char *b)
+{
+    if (!a || !b) return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static bool values_equal(css_component_value **a, size_t a_count,
+                         css_component_value **b, size_t b_count);
+
+static bool cv_equal(css_component_value *a, css_component_value *b)
+{
+    if (!a || !b) return a == b;
+    if (a->type != b->type) return false;
+
+    switch (a->type) {
+    case CSS_NODE_COMPONENT_VALUE: {
+        css_token *x = a->u.token, *y = b->u.token;
+        if (!x || !y) return x == y;
+        return x->type == y->type &&
+               x->number_type == y->number_type &&
+               x->hash_type == y->hash_type &&
+               x->delim_codepoint == y->delim_codepoint &&
+               memcmp(&x->numeric_value, &y->numeric_value,
+                      sizeof(x->numeric_value)) == 0 &&
+               str_equal(x->value, y->value) &&
+               str_equal(x->unit, y->unit);
+    }
+    case CSS_NODE_SIMPLE_BLOCK: {
+        css_simple_block *x = a->u.block, *y = b->u.block;
+        if (!x || !y) return x == y;
+        return x->associated_token == y->associated_token &&
+               values_equal(x->values, x->value_count,
+                            y->values, y->value_count);
+    }
+    case CSS_NODE_FUNCTION: {
+        css_function *x = a->u.function, *y = b->u.function;
+        if (!x || !y) return x == y;
+        return str_equal(x->name, y->name) &&
+               values_equal(x->values, x->value_count,
+                            y->values, y->value_count);
+    }
+    default:
+        return false;
+    }
+}
+
+static bool values_equal(css_component_value **a, size_t a_count,
+                         css_component_value **b, size_t b_count)
+{
+    if (a_count != b_count) return false;
+    for (size_t i = 0; i < a_count; i++) {
+        if (!cv_equal(a[i], b[i])) return false;
+    }
+    return true;
+}
+
+static bool block_table_grow(css_parser_ctx *p)
+{
+    size_t cap = p->block_cap ? p->block_cap * 2 : 64;
+    block_entry *table = css_calloc(cap, sizeof(block_entry));
+    if (!table) return false;
+
+    for (size_t i = 0; i < p->block_cap; i++) {
+        if (!p->blocks[i].block) continue;
+        size_t slot = (size_t)p->blocks[i].hash & (cap - 1);
+        while (table[slot].block) slot = (slot + 1) & (cap - 1);
+        table[slot] = p->blocks[i];
+    }
+    css_free(p->blocks);
+    p->blocks = table;
+    p->block_cap = cap;
+    return true;
+}
+
+/* Return the shared copy of block if an identical one was seen in this
+ * parse (freeing block), otherwise remember block and return it */
+static css_simple_block *intern_block(css_parser_ctx *p,
+                                      css_simple_block *block)
+{
+    if (!block || !p->options.dedup_blocks) return block;
+
+    if ((p->block_count + 1) * 2 > p->block_cap && !block_table_grow(p)) {
+        return block;  /* no memory for the table: keep it unshared */
+    }
+
+    uint64_t h = css_hash_bytes(CSS_HASH_SEED, &block->associated_token,
+                            sizeof(block->associated_token));
+    h = hash_values(h, block->values, block->value_count);
+
+    size_t slot = (size_t)h & (p->block_cap - 1);
+    while (p->blocks[slot].block) {
+        css_simple_block *seen = p->blocks[slot].block;
+        if (p->blocks[slot].hash == h &&
+            seen->associated_token == block->associated_token &&
+            values_equal(seen->values, seen->value_count,
+                         block->values, block->value_count)) {
+            css_simple_block_free(block);
+            return css_simple_block_ref(seen);
+        }
+        slot = (slot + 1) & (p->block_cap - 1);
+    }
+
+    p->blocks[slot].hash = h;
+    p->blocks[slot].block = block;
+    p->block_count++;
+    return block;
+}
+
+static void block_table_clear(css_parser_ctx *p)
+{
+    css_free(p->blocks);
+    p->blocks = NULL;
+    p->block_count = 0;
+    p->block_cap = 0;
+}
+
 /* ================================================================
  * consume_at_rule (CSS Syntax §5.4.2)
  * ================================================================ */
 
-static css_at_rule *consume_at_rule(css_parser_ctx *p)
+/* share: intern the block for dedup_blocks.  Pass false when the rule is
+ * freed straight away, or the table would keep a dangling block. */
+static css_at_rule *consume_at_rule(css_parser_ctx *p, bool share)
 {
     /* Current token is at-keyword-token */
     css_at_rule *ar = css_at_rule_create(p->current_token->value);
@@ -172,6 +535,7 @@ static css_at_rule *consume_at_rule(css_parser_ctx *p)
         }
         if (tok->type == CSS_TOKEN_OPEN_CURLY) {
             ar->block = consume_simple_block(p);
+            if (share) ar->block = intern_block(p, ar->block);
             return ar;
         }
         reconsume(p);
@@ -184,9 +548,81 @@ static css_at_rule *consume_at_rule(css_parser_ctx *p)
  * consume_qualified_rule (CSS Syntax §5.4.3)
  * ================================================================ */
 
+/* Skip one component value without building it */
+static void skip_component_value(css_parser_ctx *p)
+{
+    css_token *tok = next_token(p);
+    css_token_type mirror;
+    if (tok->type == CSS_TOKEN_OPEN_CURLY)
+        mirror = CSS_TOKEN_CLOSE_CURLY;
+    else if (tok->type == CSS_TOKEN_OPEN_SQUARE)
+        mirror = CSS_TOKEN_CLOSE_SQUARE;
+    else if (tok->type == CSS_TOKEN_OPEN_PAREN ||
+             tok->type == CSS_TOKEN_FUNCTION)
+        mirror = CSS_TOKEN_CLOSE_PAREN;
+    else
+        return;
+
+    for (;;) {
+        tok = next_token(p);
+        if (tok->type == mirror || tok->type == CSS_TOKEN_EOF) return;
+        reconsume(p);
+        skip_component_value(p);
+    }
+}
+
+/* The parser's token stream, for the selector parser */
+static const css_token *stream_peek(void *ctx)
+{
+    css_parser_ctx *p = ctx;
+    css_token *tok = next_token(p);
+    reconsume(p);
+    return tok;
+}
+
+static void stream_next(void *ctx)
+{
+    next_token(ctx);
+}
+
+/* Parse qr's selectors from the prelude being read, up to its '{' */
+static void parse_rule_selectors(css_parser_ctx *p, css_qualified_rule *qr)
+{
+    double start = p->options.stats ? stats_now() : 0;
+    p->in_selectors = true;
+    css_token_stream in = { stream_peek, stream_next, p };
+    css_qualified_rule_parse_selectors(qr, &in, CSS_TOKEN_OPEN_CURLY);
+    p->in_selectors = false;
+    if (p->options.stats) {
+        p->options.stats->selectors_seconds += stats_now() - start;
+    }
+}
+
+/* Keep input[start, end) of the preprocessed input as qr's prelude */
+static void keep_prelude_text(css_parser_ctx *p, css_qualified_rule *qr,
+                              size_t start, size_t end,
+                              size_t line, size_t column)
+{
+    char *text = css_malloc(end - start + 1);
+    if (!text) return;
+    memcpy(text, p->tokenizer->input + start, end - start);
+    text[end - start] = '\0';
+    qr->prelude_text = text;
+    qr->prelude_length = end - start;
+    qr->prelude_line = line;
+    qr->prelude_column = column;
+}
+
 static css_qualified_rule *consume_qualified_rule(css_parser_ctx *p)
 {
     css_qualified_rule *qr = css_qualified_rule_create();
+    bool keep = p->options.keep_preludes;
+
+    /* The prelude's first token is the current one, reconsumed */
+    size_t start = p->tokenizer->token_start;
+    size_t line = p->current_token->line;
+    size_t column = p->current_token->column;
+    if (!keep && p->options.eager_selectors) parse_rule_selectors(p, qr);
 
     for (;;) {
         css_token *tok = next_token(p);
@@ -196,12 +632,27 @@ static css_qualified_rule *consume_qualified_rule(css_parser_ctx *p)
             return NULL;
         }
         if (tok->type == CSS_TOKEN_OPEN_CURLY) {
-            qr->block = consume_simple_block(p);
+            if (!keep && qr) {
+                keep_prelude_text(p, qr, start, p->tokenizer->token_start,
+                                  line, column);
+            } else if (p->options.eager_selectors) {
+                double selectors_start = p->options.stats ? stats_now() : 0;
+                css_qualified_rule_selectors(qr);
+                if (p->options.stats) {
+                    p->options.stats->selectors_seconds +=
+                        stats_now() - selectors_start;
+                }
+            }
+            qr->block = intern_block(p, consume_simple_block(p));
             return qr;
         }
         reconsume(p);
-        css_component_value *cv = consume_component_value(p);
-        css_qualified_rule_append_prelude(qr, cv);
+        if (keep) {
+            css_qualified_rule_append_prelude(qr,
+                                              consume_component_value(p));
+        } else {
+            skip_component_value(p);
+        }
     }
 }
 
@@ -231,7 +682,7 @@ static void consume_list_of_rules(css_parser_ctx *p, css_stylesheet *sheet,
             continue;
         }
         if (tok->type == CSS_TOKEN_AT_KEYWORD) {
-            css_at_rule *ar = consume_at_rule(p);
+            css_at_rule *ar = consume_at_rule(p, true);
             css_stylesheet_append_rule(sheet, css_rule_create_at(ar));
             continue;
         }
@@ -244,6 +695,117 @@ static void consume_list_of_rules(css_parser_ctx *p, css_stylesheet *sheet,
     }
 }
 
+/* ================================================================
+ * consume_declaration (CSS Syntax §5.4.6)
+ *
+ * Consumes component values straight from the token stream into the
+ * declaration (no temporary list).  Stops after ';' or before EOF.
+ * Returns NULL on parse error, with the rest of the declaration skipped.
+ * ================================================================ */
+
+static css_declaration *consume_declaration(css_parser_ctx *p)
+{
+    /* Current token is the ident holding the property name */
+    css_declaration *decl = css_declaration_create(p->current_token->value);
+    if (!decl) return NULL;
+
+    css_token *tok = next_token(p);
+    while (tok->type == CSS_TOKEN_WHITESPACE) {
+        tok = next_token(p);
+    }
+
+    bool valid = (tok->type == CSS_TOKEN_COLON);
+    if (valid) {
+        /* Skip whitespace after colon */
+        tok = next_token(p);
+        while (tok->type == CSS_TOKEN_WHITESPACE) {
+            tok = next_token(p);
+        }
+    }
+    reconsume(p);
+
+    for (;;) {
+        tok = next_token(p);
+        if (tok->type == CSS_TOKEN_SEMICOLON) {
+            break;
+        }
+        if (tok->type == CSS_TOKEN_EOF) {
+            reconsume(p);
+            break;
+        }
+        reconsume(p);
+        css_component_value *cv = consume_component_value(p);
+        if (valid) {
+            css_declaration_append_value(decl, cv);
+        } else {
+            /* Parse error — discard up to the next semicolon */
+            css_component_value_free(cv);
+        }
+    }
+
+    if (!valid) {
+        css_declaration_free(decl);
+        return NULL;
+    }
+
+    /* Trim trailing whitespace from values */
+    while (decl->value_count > 0) {
+        css_component_value *last = decl->values[decl->value_count - 1];
+        if (cv_is_token(last, CSS_TOKEN_WHITESPACE)) {
+            css_component_value_free(last);
+            decl->value_count--;
+        } else {
+            break;
+        }
+    }
+
+    check_important(decl);
+    return decl;
+}
+
+/* ================================================================
+ * consume_list_of_declarations (CSS Syntax §5.4.5)
+ *
+ * At-rules are consumed for error recovery but not kept: the result
+ * holds declarations only.
+ * ================================================================ */
+
+static void consume_list_of_declarations(css_parser_ctx *p,
+                                         css_declaration_list *list)
+{
+    for (;;) {
+        css_token *tok = next_token(p);
+        if (tok->type == CSS_TOKEN_WHITESPACE ||
+            tok->type == CSS_TOKEN_SEMICOLON) {
+            continue;
+        }
+        if (tok->type == CSS_TOKEN_EOF) {
+            return;
+        }
+        if (tok->type == CSS_TOKEN_AT_KEYWORD) {
+            css_at_rule_free(consume_at_rule(p, false));
+            continue;
+        }
+        if (tok->type == CSS_TOKEN_IDENT) {
+            css_declaration *decl = consume_declaration(p);
+            if (decl) css_declaration_list_append(list, decl);
+            continue;
+        }
+        /* Parse error — skip component values up to the next semicolon */
+        reconsume(p);
+        for (;;) {
+            tok = next_token(p);
+            if (tok->type == CSS_TOKEN_SEMICOLON) break;
+            if (tok->type == CSS_TOKEN_EOF) {
+                reconsume(p);
+                break;
+            }
+            reconsume(p);
+            css_component_value_free(consume_component_value(p));
+        }
+    }
+}
+
 /* ================================================================
  * Post-processing: parse declarations from block contents
  *
@@ -488,49 +1050,254 @@ static void parse_declarations_from_block(css_simple_block *block,
         /* Add to output array */
         if (*out_count >= cap) {
             cap = cap ? cap * 2 : 4;
-            *out_decls = realloc(*out_decls, cap * sizeof(css_declaration *));
+            *out_decls = css_realloc(*out_decls, cap * sizeof(css_declaration *));
         }
         (*out_decls)[(*out_count)++] = decl;
     }
 }
 
+/* Public wrapper: declarations of a {} block as a css_declaration_list */
+css_declaration_list *css_parse_block_declarations(css_simple_block *block)
+{
+    css_declaration_list *list = css_declaration_list_create();
+    if (!list) return NULL;
+    parse_declarations_from_block(block, &list->declarations,
+                                  &list->declaration_count);
+    list->declaration_cap = list->declaration_count;
+    return list;
+}
+
 /* ================================================================
- * css_parse_stylesheet (public API)
+ * Block content classification
+ *
+ * At-rules whose block holds rules rather than declarations.  Vendor
+ * prefixes (-webkit-keyframes) are ignored.
  * ================================================================ */
 
-css_stylesheet *css_parse_stylesheet(const char *input, size_t length)
+bool css_at_rule_has_rule_list(const char *name)
 {
-    css_parser_ctx parser;
-    memset(&parser, 0, sizeof(parser));
+    if (!name) return false;
+    static const char *const rule_list_at_rules[] = {
+        "media", "supports", "document", "layer", "container",
+        "scope", "starting-style", "keyframes"
+    };
+
+    if (name[0] == '-') {
+        const char *dash = strchr(name + 1, '-');
+        if (dash) name = dash + 1;
+    }
+    for (size_t i = 0;
+         i < sizeof(rule_list_at_rules) / sizeof(rule_list_at_rules[0]);
+         i++) {
+        if (strcasecmp(name, rule_list_at_rules[i]) == 0) return true;
+    }
+    return false;
+}
 
-    parser.tokenizer = css_tokenizer_create(input, length);
-    if (!parser.tokenizer) return NULL;
+bool css_at_rule_has_style_rules(const char *name)
+{
+    if (!css_at_rule_has_rule_list(name)) return false;
+    const char *dash = name[0] == '-' ? strchr(name + 1, '-') : NULL;
+    return strcasecmp(dash ? dash + 1 : name, "keyframes") != 0;
+}
 
-    css_stylesheet *sheet = css_stylesheet_create();
-    if (!sheet) {
-        css_tokenizer_free(parser.tokenizer);
+/* ================================================================
+ * Qualified-rule preludes for printing
+ * ================================================================ */
+
+css_component_value **css_qualified_rule_prelude(const css_qualified_rule *qr,
+                                                 size_t *count)
+{
+    *count = 0;
+    if (!qr) return NULL;
+    if (qr->prelude_count > 0 || !qr->prelude_text) {
+        *count = qr->prelude_count;
+        return qr->prelude;
+    }
+
+    css_parser_ctx p;
+    memset(&p, 0, sizeof(p));
+    p.tokenizer = css_tokenizer_create(qr->prelude_text, qr->prelude_length);
+    if (!p.tokenizer) return NULL;
+    p.tokenizer->line = qr->prelude_line;
+    p.tokenizer->column = qr->prelude_column;
+
+    css_component_value **values = NULL;
+    size_t n = 0, cap = 0;
+    bool ok = true;
+    while (ok && next_token(&p)->type != CSS_TOKEN_EOF) {
+        reconsume(&p);
+        css_component_value *cv = consume_component_value(&p);
+        if (n >= cap) {
+            cap = cap ? cap * 2 : 8;
+            css_component_value **grown =
+                css_realloc(values, cap * sizeof(*values));
+            if (!grown) {
+                css_component_value_free(cv);
+                ok = false;
+                break;
+            }
+            values = grown;
+        }
+        values[n++] = cv;
+    }
+    css_token_free(p.current_token);
+    css_tokenizer_free(p.tokenizer);
+    if (!ok) {
+        css_qualified_rule_prelude_release(qr, values, n);
         return NULL;
     }
+    *count = n;
+    return values;
+}
 
-    consume_list_of_rules(&parser, sheet, true);
+void css_qualified_rule_prelude_release(const css_qualified_rule *qr,
+                                        css_component_value **values,
+                                        size_t count)
+{
+    if (!values || (qr && values == qr->prelude)) return;
+    for (size_t i = 0; i < count; i++) {
+        css_component_value_free(values[i]);
+    }
+    css_free(values);
+}
 
-    /* Post-process: parse selectors from qualified rule preludes */
-    for (size_t i = 0; i < sheet->rule_count; i++) {
-        css_rule *rule = sheet->rules[i];
-        if (rule && rule->type == CSS_NODE_QUALIFIED_RULE) {
-            css_qualified_rule *qr = rule->u.qualified_rule;
-            if (qr && qr->prelude_count > 0) {
-                qr->selectors = css_parse_selector_list(
-                    qr->prelude, qr->prelude_count);
+/* ================================================================
+ * Nested rule lists
+ *
+ * The block of @media and friends holds raw component values.  They
+ * are grouped into rules the way consume_list_of_rules would (§5.4.1,
+ * not top-level), like put_rule_list in css_serialize.c.  Preludes are
+ * copied; {} blocks are shared with the at-rule's block.
+ * ================================================================ */
+
+static bool cv_is_curly_block(css_component_value *cv)
+{
+    return cv && cv->type == CSS_NODE_SIMPLE_BLOCK && cv->u.block &&
+           cv->u.block->associated_token == CSS_TOKEN_OPEN_CURLY;
+}
+
+static bool rules_from_values(css_stylesheet *sheet,
+                              css_component_value **values, size_t count)
+{
+    size_t i = 0;
+    while (i < count) {
+        css_component_value *cv = values[i];
+        if (!cv || cv_is_token(cv, CSS_TOKEN_WHITESPACE)) {
+            i++;
+            continue;
+        }
+
+        size_t end = i;
+        css_rule *rule = NULL;
+        if (cv_is_token(cv, CSS_TOKEN_AT_KEYWORD)) {
+            /* At-rule: prelude up to ';' or a {} block */
+            css_at_rule *ar = css_at_rule_create(cv->u.token->value);
+            if (!ar) return false;
+            for (end = i + 1; end < count; end++) {
+                css_component_value *v = values[end];
+                if (cv_is_token(v, CSS_TOKEN_SEMICOLON)) break;
+                if (cv_is_curly_block(v)) {
+                    ar->block = css_simple_block_ref(v->u.block);
+                    break;
+                }
+                css_at_rule_append_prelude(ar, clone_cv(v));
+            }
+            rule = css_rule_create_at(ar);
+            if (!rule) css_at_rule_free(ar);
+        } else {
+            /* Qualified rule: prelude up to a {} block, dropped at the
+             * end of the list */
+            while (end < count && !cv_is_curly_block(values[end])) end++;
+            if (end == count) break;
+            css_qualified_rule *qr = css_qualified_rule_create();
+            if (!qr) return false;
+            for (size_t k = i; k < end; k++) {
+                css_qualified_rule_append_prelude(qr, clone_cv(values[k]));
             }
+            qr->block = css_simple_block_ref(values[end]->u.block);
+            rule = css_rule_create_qualified(qr);
+            if (!rule) css_qualified_rule_free(qr);
         }
+        if (!rule) return false;
+        css_stylesheet_append_rule(sheet, rule);
+        i = end + 1;
     }
+    return true;
+}
 
-    /* Clean up parser state */
-    if (parser.current_token) {
-        css_token_free(parser.current_token);
+css_stylesheet *css_at_rule_rules(const css_at_rule *ar)
+{
+    if (!ar || !ar->block || !css_at_rule_has_rule_list(ar->name))
+        return NULL;
+    css_at_rule *rule = (css_at_rule *)ar;  /* cache only */
+    css_stylesheet *sheet =
+        atomic_load_explicit(&rule->rules_cache, memory_order_acquire);
+    if (sheet) return sheet;
+
+    const css_allocator *prev = css_allocator_use(ar->allocator);
+    sheet = css_stylesheet_create();
+    if (sheet && !rules_from_values(sheet, ar->block->values,
+                                    ar->block->value_count)) {
+        css_stylesheet_free(sheet);
+        sheet = NULL;
     }
-    css_tokenizer_free(parser.tokenizer);
+    css_allocator_use(prev);
+    if (!sheet) return NULL;
+
+    css_stylesheet *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(
+            &rule->rules_cache, &expected, sheet,
+            memory_order_acq_rel, memory_order_acquire)) {
+        /* another thread got there first */
+        css_stylesheet_free(sheet);
+        return expected;
+    }
+    return sheet;
+}
+
+bool css_stylesheet_walk_style_rules(const css_stylesheet *sheet,
+                                     css_style_rule_filter enter,
+                                     css_style_rule_visit visit, void *user)
+{
+    if (!sheet || !visit) return true;
+    for (size_t i = 0; i < sheet->rule_count; i++) {
+        const css_rule *rule = sheet->rules[i];
+        if (rule->type == CSS_NODE_QUALIFIED_RULE) {
+            visit(user, rule->u.qualified_rule);
+            continue;
+        }
+        const css_at_rule *ar = rule->u.at_rule;
+        if (!ar->block || !css_at_rule_has_style_rules(ar->name)) continue;
+        if (enter && !enter(user, ar)) continue;
+        css_stylesheet *nested = css_at_rule_rules(ar);
+        if (!nested ||
+            !css_stylesheet_walk_style_rules(nested, enter, visit, user))
+            return false;
+    }
+    return true;
+}
+
+/* ================================================================
+ * css_parse_stylesheet (public API)
+ * ================================================================ */
+
+/* Parse a whole stylesheet from the context's tokenizer.  Parser state
+ * (current token, dedup table) is dropped afterwards. */
+static css_stylesheet *parse_stylesheet(css_parser_ctx *p)
+{
+    /* Selectors are parsed on first access, or with eager_selectors as
+     * each rule's prelude is read */
+    css_stylesheet *sheet = css_stylesheet_create();
+    if (sheet) {
+        consume_list_of_rules(p, sheet, true);
+    }
+
+    /* Clean up parser state */
+    css_token_free(p->current_token);
+    p->current_token = NULL;
+    p->reconsume = false;
+    block_table_clear(p);
 
     /* Post-process: parse declarations from qualified rule blocks.
      * We store the declarations in a format that css_ast_dump can
@@ -544,212 +1311,194 @@ css_stylesheet *css_parse_stylesheet(const char *input, size_t length)
     return sheet;
 }
 
+css_stylesheet *css_parse_stylesheet(const char *input, size_t length)
+{
+    return css_parse_stylesheet_with_options(input, length, NULL);
+}
+
+css_stylesheet *css_parse_stylesheet_with_options(
+    const char *input, size_t length, const css_parser_options *options)
+{
+    css_parser_ctx parser;
+    memset(&parser, 0, sizeof(parser));
+    if (options) parser.options = *options;
+
+    const css_allocator *prev = css_allocator_use(
+        parser.options.allocator ? parser.options.allocator
+                                 : css_allocator_current());
+    css_stylesheet *sheet = NULL;
+    stats_begin(&parser);
+    parser.tokenizer = css_tokenizer_create(input, length);
+    stats_preprocessed(&parser);
+    if (parser.tokenizer) sheet = parse_stylesheet(&parser);
+    stats_end(&parser, sheet, NULL);
+    css_tokenizer_free(parser.tokenizer);
+    css_allocator_use(prev);
+    return sheet;
+}
+
 /* ================================================================
- * Enhanced dump: parse declarations inline during dump
+ * Parser context (public API)
  * ================================================================ */
 
-/* Forward declarations for dump helpers */
-static void dump_indent_p(FILE *out, int depth)
+css_parser_ctx *css_parser_create(void)
 {
-    for (int i = 0; i < depth; i++) {
-        fprintf(out, "  ");
+    css_parser_ctx *p = css_calloc(1, sizeof(css_parser_ctx));
+    if (!p) return NULL;
+    p->allocator = css_allocator_current();
+    p->tokenizer = css_tokenizer_create("", 0);
+    if (!p->tokenizer) {
+        css_free(p);
+        return NULL;
     }
+    return p;
 }
 
-static void dump_token_inline_p(FILE *out, css_token *tok)
+void css_parser_free(css_parser_ctx *p)
 {
-    if (!tok) {
-        fprintf(out, "<null>");
-        return;
-    }
-    switch (tok->type) {
-    case CSS_TOKEN_IDENT:
-        fprintf(out, "<ident \"%s\">", tok->value ? tok->value : "");
-        break;
-    case CSS_TOKEN_FUNCTION:
-        fprintf(out, "<function \"%s\">", tok->value ? tok->value : "");
-        break;
-    case CSS_TOKEN_AT_KEYWORD:
-        fprintf(out, "<at-keyword \"%s\">", tok->value ? tok->value : "");
-        break;
-    case CSS_TOKEN_HASH:
-        fprintf(out, "<hash \"%s\"%s>", tok->value ? tok->value : "",
-                tok->hash_type == CSS_HASH_ID ? " id" : "");
-        break;
-    case CSS_TOKEN_STRING:
-        fprintf(out, "<string \"%s\">", tok->value ? tok->value : "");
-        break;
-    case CSS_TOKEN_URL:
-        fprintf(out, "<url \"%s\">", tok->value ? tok->value : "");
-        break;
-    case CSS_TOKEN_NUMBER:
-        if (tok->number_type == CSS_NUM_INTEGER)
-            fprintf(out, "<number %d>", (int)tok->numeric_value);
-        else
-            fprintf(out, "<number %g>", tok->numeric_value);
-        break;
-    case CSS_TOKEN_PERCENTAGE:
-        if (tok->number_type == CSS_NUM_INTEGER)
-            fprintf(out, "<percentage %d>", (int)tok->numeric_value);
-        else
-            fprintf(out, "<percentage %g>", tok->numeric_value);
-        break;
-    case CSS_TOKEN_DIMENSION:
-        if (tok->number_type == CSS_NUM_INTEGER)
-            fprintf(out, "<dimension %d \"%s\">", (int)tok->numeric_value,
-                    tok->unit ? tok->unit : "");
-        else
-            fprintf(out, "<dimension %g \"%s\">", tok->numeric_value,
-                    tok->unit ? tok->unit : "");
-        break;
-    case CSS_TOKEN_DELIM:
-        if (tok->delim_codepoint < 0x80)
-            fprintf(out, "<delim '%c'>", (char)tok->delim_codepoint);
-        else
-            fprintf(out, "<delim U+%04X>", tok->delim_codepoint);
-        break;
-    case CSS_TOKEN_WHITESPACE:
-        fprintf(out, "<whitespace>");
-        break;
-    default:
-        fprintf(out, "<%s>", css_token_type_name(tok->type));
-        break;
+    if (!p) return;
+    const css_allocator *prev = css_allocator_use(p->allocator);
+    css_tokenizer_free(p->tokenizer);
+    css_free(p);
+    css_allocator_use(prev);
+}
+
+/* Trees are built in the options' allocator, else the context's own.
+ * Tokens and the dedup table live in it too and never outlive a parse,
+ * so the context holds no tree memory between calls. */
+static const css_allocator *tree_allocator(const css_parser_ctx *p)
+{
+    return p->options.allocator ? p->options.allocator : p->allocator;
+}
+
+/* Point the context at new input, keeping the tokenizer's buffer */
+static bool parser_reset(css_parser_ctx *p, const char *input, size_t length)
+{
+    css_token_free(p->current_token);
+    p->current_token = NULL;
+    p->reconsume = false;
+    return css_tokenizer_reset(p->tokenizer, input, length);
+}
+
+void css_parser_set_options(css_parser_ctx *p,
+                            const css_parser_options *options)
+{
+    if (!p) return;
+    if (options) {
+        p->options = *options;
+    } else {
+        memset(&p->options, 0, sizeof(p->options));
     }
 }
 
-static void dump_cv_p(FILE *out, css_component_value *cv, int depth);
-static void dump_block_with_decls(FILE *out, css_simple_block *block,
-                                  int depth);
+css_stylesheet *css_parser_parse_stylesheet(css_parser_ctx *p,
+                                            const char *input, size_t length)
+{
+    if (!p) return NULL;
+    const css_allocator *prev = css_allocator_use(tree_allocator(p));
+    stats_begin(p);
+    bool ok = parser_reset(p, input, length);
+    stats_preprocessed(p);
+    css_stylesheet *sheet = ok ? parse_stylesheet(p) : NULL;
+    stats_end(p, sheet, NULL);
+    css_allocator_use(prev);
+    return sheet;
+}
 
-static void dump_cv_p(FILE *out, css_component_value *cv, int depth)
+css_declaration_list *css_parser_parse_declaration_list(css_parser_ctx *p,
+                                                        const char *input,
+                                                        size_t length)
 {
-    if (!cv) return;
-    switch (cv->type) {
-    case CSS_NODE_COMPONENT_VALUE:
-        dump_indent_p(out, depth);
-        dump_token_inline_p(out, cv->u.token);
-        fprintf(out, "\n");
-        break;
-    case CSS_NODE_SIMPLE_BLOCK:
-        dump_block_with_decls(out, cv->u.block, depth);
-        break;
-    case CSS_NODE_FUNCTION:
-        dump_indent_p(out, depth);
-        fprintf(out, "FUNCTION \"%s\"\n",
-                cv->u.function ? (cv->u.function->name ?
-                cv->u.function->name : "") : "");
-        if (cv->u.function) {
-            for (size_t i = 0; i < cv->u.function->value_count; i++) {
-                dump_cv_p(out, cv->u.function->values[i], depth + 1);
-            }
-        }
-        break;
-    default:
-        dump_indent_p(out, depth);
-        fprintf(out, "<unknown node type %d>\n", cv->type);
-        break;
+    if (!p) return NULL;
+    const css_allocator *prev = css_allocator_use(tree_allocator(p));
+    css_declaration_list *list = NULL;
+    stats_begin(p);
+    bool ok = parser_reset(p, input, length);
+    stats_preprocessed(p);
+    if (ok) {
+        list = css_declaration_list_create();
+        if (list) consume_list_of_declarations(p, list);
     }
+    css_token_free(p->current_token);
+    p->current_token = NULL;
+    block_table_clear(p);
+    stats_end(p, NULL, list);
+    css_allocator_use(prev);
+    return list;
 }
 
-/* Dump a block with declaration detection for {} blocks */
-static void dump_block_with_decls(FILE *out, css_simple_block *block,
-                                  int depth)
+/* ================================================================
+ * css_parse_declaration_list / batch variant (public API)
+ * ================================================================ */
+
+css_declaration_list *css_parse_declaration_list(const char *input,
+                                                 size_t length)
 {
-    if (!block) return;
-    dump_indent_p(out, depth);
-    char open = '?', close = '?';
-    switch (block->associated_token) {
-    case CSS_TOKEN_OPEN_CURLY:  open = '{'; close = '}'; break;
-    case CSS_TOKEN_OPEN_SQUARE: open = '['; close = ']'; break;
-    case CSS_TOKEN_OPEN_PAREN:  open = '('; close = ')'; break;
-    default: break;
-    }
-    fprintf(out, "BLOCK %c%c\n", open, close);
-
-    /* For {} blocks, try to parse as declarations */
-    if (block->associated_token == CSS_TOKEN_OPEN_CURLY) {
-        css_declaration **decls = NULL;
-        size_t decl_count = 0;
-        parse_declarations_from_block(block, &decls, &decl_count);
-
-        if (decl_count > 0) {
-            for (size_t i = 0; i < decl_count; i++) {
-                css_declaration *d = decls[i];
-                dump_indent_p(out, depth + 1);
-                fprintf(out, "DECLARATION \"%s\"",
-                        d->name ? d->name : "");
-                if (d->important) fprintf(out, " !important");
-                fprintf(out, "\n");
-                for (size_t j = 0; j < d->value_count; j++) {
-                    dump_cv_p(out, d->values[j], depth + 2);
-                }
-                css_declaration_free(d);
-            }
-            free(decls);
-            return;
-        }
-        free(decls);
-        /* Fall through to raw dump if no declarations found */
+    css_parser_ctx *p = css_parser_create();
+    if (!p) return NULL;
+    css_declaration_list *list =
+        css_parser_parse_declaration_list(p, input, length);
+    css_parser_free(p);
+    return list;
+}
+
+size_t css_parse_declaration_lists(const char *const *inputs,
+                                   const size_t *lengths, size_t count,
+                                   css_declaration_list **out)
+{
+    if (!inputs || !lengths || !out) return 0;
+
+    css_parser_ctx *p = css_parser_create();
+    size_t parsed = 0;
+    for (size_t i = 0; i < count; i++) {
+        out[i] = p ? css_parser_parse_declaration_list(p, inputs[i],
+                                                       lengths[i]) : NULL;
+        if (out[i]) parsed++;
     }
+    css_parser_free(p);
+    return parsed;
+}
+
+/* ================================================================
+ * Dump (debug output), written through the buffered emitter
+ * ================================================================ */
+
+/* Stream into out's descriptor in large chunks; stdio output already
+ * queued on out is flushed first so ordering is kept.  A stream with
+ * no descriptor (open_memstream, fmemopen, cookie streams) collects
+ * the dump in memory and gets it through fwrite at the end. */
+static css_buffer *dump_begin(css_buffer *b, FILE *out)
+{
+    int fd = fileno(out);
+    if (fd >= 0) fflush(out);
+    css_buffer_init_fd(b, fd);
+    return b;
+}
 
-    /* Raw dump for non-{} blocks or blocks with no declarations */
-    for (size_t i = 0; i < block->value_count; i++) {
-        dump_cv_p(out, block->values[i], depth + 1);
+static void dump_end(css_buffer *b, FILE *out)
+{
+    if (b->fd < 0) {
+        if (!b->failed && b->length) fwrite(b->data, 1, b->length, out);
+    } else {
+        css_buffer_flush(b);
     }
+    css_buffer_free(b);
 }
 
 /* Enhanced dump for parsed AST with declaration detection */
 void css_parse_dump(css_stylesheet *sheet, FILE *out)
 {
     if (!sheet || !out) return;
-    fprintf(out, "STYLESHEET\n");
-
-    for (size_t i = 0; i < sheet->rule_count; i++) {
-        css_rule *rule = sheet->rules[i];
-        if (!rule) continue;
+    css_buffer b;
+    css_dump_stylesheet(sheet, CSS_DUMP_TEXT, dump_begin(&b, out));
+    dump_end(&b, out);
+}
 
-        switch (rule->type) {
-        case CSS_NODE_AT_RULE: {
-            css_at_rule *ar = rule->u.at_rule;
-            if (!ar) break;
-            dump_indent_p(out, 1);
-            fprintf(out, "AT_RULE \"%s\"\n", ar->name ? ar->name : "");
-            if (ar->prelude_count > 0) {
-                dump_indent_p(out, 2);
-                fprintf(out, "prelude:\n");
-                for (size_t j = 0; j < ar->prelude_count; j++) {
-                    dump_cv_p(out, ar->prelude[j], 3);
-                }
-            }
-            if (ar->block) {
-                dump_block_with_decls(out, ar->block, 2);
-            }
-            break;
-        }
-        case CSS_NODE_QUALIFIED_RULE: {
-            css_qualified_rule *qr = rule->u.qualified_rule;
-            if (!qr) break;
-            dump_indent_p(out, 1);
-            fprintf(out, "QUALIFIED_RULE\n");
-            if (qr->selectors) {
-                css_selector_dump(qr->selectors, out, 2);
-            }
-            if (qr->prelude_count > 0) {
-                dump_indent_p(out, 2);
-                fprintf(out, "prelude:\n");
-                for (size_t j = 0; j < qr->prelude_count; j++) {
-                    dump_cv_p(out, qr->prelude[j], 3);
-                }
-            }
-            if (qr->block) {
-                dump_block_with_decls(out, qr->block, 2);
-            }
-            break;
-        }
-        default:
-            dump_indent_p(out, 1);
-            fprintf(out, "<unknown rule type %d>\n", rule->type);
-            break;
-        }
-    }
+/* Dump a declaration list (css_parse_declaration_list result) */
+void css_declaration_list_dump(css_declaration_list *list, FILE *out)
+{
+    if (!list || !out) return;
+    css_buffer b;
+    css_dump_declaration_list(list, CSS_DUMP_TEXT, dump_begin(&b, out));
+    dump_end(&b, out);
 }
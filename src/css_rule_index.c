@@ -0,0 +1,429 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_rule_index.h"
+#include "css_selector_program.h"
+#include "css_alloc.h"
+#include "css_hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* ================================================================
+ * Internal structs
+ * ================================================================ */
+
+typedef enum {
+    KEY_ID,
+    KEY_CLASS,
+    KEY_TAG,
+    KEY_UNIVERSAL
+} key_kind;
+
+/* Entry while building: its bucket key */
+typedef struct {
+    css_rule_entry entry;
+    key_kind kind;
+    const char *key;            /* NULL for KEY_UNIVERSAL */
+} build_entry;
+
+/* One bucket: entries[start .. start + count), a slot of a key ->
+ * bucket map (css_hash.h; tag names are case-folded) */
+typedef struct {
+    css_name_key key;
+    size_t start;
+    size_t count;
+} bucket;
+
+struct css_rule_index {
+    css_rule_entry *entries;    /* grouped by bucket */
+    size_t entry_count;
+    css_selector_program *program;  /* selector i = entries[i].selector */
+    css_name_map ids;
+    css_name_map classes;
+    css_name_map tags;
+    size_t universal_start;
+    size_t universal_count;
+    const css_allocator *allocator;     /* current at build */
+};
+
+/* ================================================================
+ * Building
+ * ================================================================ */
+
+/* Most selective key of the rightmost compound */
+static void choose_key(const css_complex_selector *sel, build_entry *be)
+{
+    be->kind = KEY_UNIVERSAL;
+    be->key = NULL;
+    if (sel->count == 0) return;
+    const css_compound_selector *comp = sel->compounds[sel->count - 1];
+    for (size_t i = 0; i < comp->count; i++) {
+        const css_simple_selector *s = comp->selectors[i];
+        key_kind kind;
+        if (s->type == SEL_ID) kind = KEY_ID;
+        else if (s->type == SEL_CLASS) kind = KEY_CLASS;
+        else if (s->type == SEL_TYPE) kind = KEY_TAG;
+        else continue;
+        if (kind < be->kind) {
+            be->kind = kind;
+            be->key = s->name;
+        }
+    }
+}
+
+static int compare_build(const void *pa, const void *pb)
+{
+    const build_entry *a = pa;
+    const build_entry *b = pb;
+    if (a->kind != b->kind) return a->kind < b->kind ? -1 : 1;
+    if (a->key && b->key) {
+        int c = a->kind == KEY_TAG ? css_ascii_casecmp(a->key, b->key)
+                                   : strcmp(a->key, b->key);
+        if (c != 0) return c;
+    }
+    if (a->entry.order != b->entry.order)
+        return a->entry.order < b->entry.order ? -1 : 1;
+    return 0;
+}
+
+/* Style rules in source order, collected by the stylesheet walk */
+typedef struct {
+    const css_rule_index_options *options;
+    const css_qualified_rule **rules;
+    size_t count;
+    size_t cap;
+    bool failed;
+} rule_walk;
+
+static bool enter_group(void *user, const css_at_rule *ar)
+{
+    const css_rule_index_options *options = ((rule_walk *)user)->options;
+    return !options || !options->condition ||
+           options->condition(options->user, ar);
+}
+
+static void collect_rule(void *user, const css_qualified_rule *qr)
+{
+    rule_walk *walk = user;
+    if (walk->failed) return;
+    if (walk->count >= walk->cap) {
+        size_t cap = walk->cap ? walk->cap * 2 : 64;
+        const css_qualified_rule **rules =
+            css_realloc(walk->rules, cap * sizeof(*rules));
+        if (!rules) {
+            walk->failed = true;
+            return;
+        }
+        walk->rules = rules;
+        walk->cap = cap;
+    }
+    walk->rules[walk->count++] = qr;
+}
+
+css_rule_index *css_rule_index_build(const css_stylesheet *sheet)
+{
+    return css_rule_index_build_with_options(sheet, NULL);
+}
+
+css_rule_index *css_rule_index_build_with_options(
+    const css_stylesheet *sheet, const css_rule_index_options *options)
+{
+    css_rule_index *index = css_calloc(1, sizeof(css_rule_index));
+    if (!index) return NULL;
+    index->allocator = css_allocator_current();
+    css_name_map_init(&index->ids, sizeof(bucket), false);
+    css_name_map_init(&index->classes, sizeof(bucket), false);
+    css_name_map_init(&index->tags, sizeof(bucket), true);
+
+    /* Every style rule, nested ones included, in source order */
+    rule_walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.options = options;
+    if (!css_stylesheet_walk_style_rules(sheet, enter_group, collect_rule,
+                                         &walk) ||
+        walk.failed) {
+        css_free(walk.rules);
+        css_rule_index_free(index);
+        return NULL;
+    }
+    size_t rule_count = walk.count;
+    const css_qualified_rule **rules = walk.rules;
+
+    /* Collect one entry per complex selector */
+    size_t count = 0;
+    for (size_t i = 0; i < rule_count; i++) {
+        const css_selector_list *list = css_qualified_rule_selectors(rules[i]);
+        if (list) count += list->count;
+    }
+    build_entry *build = css_calloc(count ? count : 1, sizeof(build_entry));
+    index->entries = css_calloc(count ? count : 1, sizeof(css_rule_entry));
+    if (!build || !index->entries) {
+        css_free(build);
+        css_free(rules);
+        css_rule_index_free(index);
+        return NULL;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < rule_count; i++) {
+        const css_qualified_rule *qr = rules[i];
+        const css_selector_list *list = css_qualified_rule_selectors(qr);
+        if (!list) continue;
+        for (size_t j = 0; j < list->count; j++) {
+            build_entry *be = &build[n];
+            be->entry.selector = list->selectors[j];
+            be->entry.rule = qr;
+            be->entry.order = n;
+            be->entry.specificity = be->entry.selector->specificity_key;
+            memcpy(be->entry.ancestor_hashes,
+                   be->entry.selector->ancestor_hashes,
+                   sizeof(be->entry.ancestor_hashes));
+            choose_key(be->entry.selector, be);
+            n++;
+        }
+    }
+    css_free(rules);
+    qsort(build, count, sizeof(build_entry), compare_build);
+
+    /* Count distinct keys per kind, then lay out the buckets */
+    size_t keys[KEY_UNIVERSAL] = { 0, 0, 0 };
+    for (size_t i = 0; i < count && build[i].kind != KEY_UNIVERSAL; i++) {
+        if (i == 0 || build[i - 1].kind != build[i].kind ||
+            !css_name_equal(build[i - 1].key, build[i].key,
+                            build[i].kind == KEY_TAG))
+            keys[build[i].kind]++;
+    }
+    if (!css_name_map_reserve(&index->ids, keys[KEY_ID]) ||
+        !css_name_map_reserve(&index->classes, keys[KEY_CLASS]) ||
+        !css_name_map_reserve(&index->tags, keys[KEY_TAG])) {
+        css_free(build);
+        css_rule_index_free(index);
+        return NULL;
+    }
+
+    css_name_map *maps[KEY_UNIVERSAL] = {
+        &index->ids, &index->classes, &index->tags
+    };
+    for (size_t i = 0; i < count; ) {
+        size_t start = i;
+        key_kind kind = build[i].kind;
+        if (kind == KEY_UNIVERSAL) {
+            i = count;
+        } else {
+            while (i < count && build[i].kind == kind &&
+                   css_name_equal(build[i].key, build[start].key,
+                                  kind == KEY_TAG))
+                i++;
+        }
+        for (size_t k = start; k < i; k++) {
+            index->entries[k] = build[k].entry;
+        }
+        if (kind == KEY_UNIVERSAL) {
+            index->universal_start = start;
+            index->universal_count = i - start;
+        } else {
+            /* reserved above, so this cannot fail */
+            bucket *b = css_name_map_insert(maps[kind], build[start].key);
+            b->start = start;
+            b->count = i - start;
+        }
+    }
+    index->entry_count = count;
+    css_free(build);
+
+    const css_complex_selector **selectors =
+        css_malloc((count ? count : 1) * sizeof(*selectors));
+    if (selectors) {
+        for (size_t i = 0; i < count; i++) {
+            selectors[i] = index->entries[i].selector;
+        }
+        index->program = css_selector_program_compile(selectors, count);
+        css_free(selectors);
+    }
+    if (!index->program) {
+        css_rule_index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+void css_rule_index_free(css_rule_index *index)
+{
+    if (!index) return;
+    const css_allocator *prev = css_allocator_use(index->allocator);
+    css_free(index->entries);
+    css_selector_program_free(index->program);
+    css_name_map_free(&index->ids);
+    css_name_map_free(&index->classes);
+    css_name_map_free(&index->tags);
+    css_free(index);
+    css_allocator_use(prev);
+}
+
+size_t css_rule_index_size(const css_rule_index *index)
+{
+    return index ? index->entry_count : 0;
+}
+
+const css_rule_entry *css_rule_index_entry(const css_rule_index *index,
+                                           size_t i)
+{
+    if (!index || i >= index->entry_count) return NULL;
+    return &index->entries[i];
+}
+
+bool css_rule_index_entry_matches(const css_rule_index *index, size_t i,
+                                  const css_element_adapter *adapter,
+                                  const void *el)
+{
+    if (!index || i >= index->entry_count || !adapter || !el) return false;
+    return css_selector_program_match(index->program, i, adapter, el);
+}
+
+/* ================================================================
+ * Matching
+ * ================================================================ */
+
+bool css_rule_matches_reserve(css_rule_matches *matches, size_t count)
+{
+    if (count <= matches->cap) return true;
+    size_t cap = matches->cap ? matches->cap * 2 : 16;
+    while (cap < count) cap *= 2;
+    const css_rule_entry **entries =
+        css_realloc(matches->entries, cap * sizeof(*entries));
+    if (!entries) return false;
+    matches->entries = entries;
+    matches->cap = cap;
+    return true;
+}
+
+static bool matches_push(css_rule_matches *out, const css_rule_entry *e)
+{
+    if (!css_rule_matches_reserve(out, out->count + 1)) return false;
+    out->entries[out->count++] = e;
+    return true;
+}
+
+static bool entry_may_match(const css_rule_entry *e,
+                            const css_bloom_filter *ancestors)
+{
+    for (size_t i = 0; i < CSS_ANCESTOR_HASH_COUNT; i++) {
+        if (!e->ancestor_hashes[i]) break;
+        if (!css_bloom_may_contain(ancestors, e->ancestor_hashes[i]))
+            return false;
+    }
+    return true;
+}
+
+static void match_bucket(const css_rule_index *index, size_t start,
+                         size_t count, const css_element_adapter *adapter,
+                         const void *el, const css_bloom_filter *ancestors,
+                         css_rule_matches *out)
+{
+    for (size_t i = start; i < start + count; i++) {
+        const css_rule_entry *e = &index->entries[i];
+        if (ancestors && !entry_may_match(e, ancestors)) continue;
+        if (css_selector_program_match(index->program, i, adapter, el))
+            matches_push(out, e);
+    }
+}
+
+/* Class buckets looked up without allocating */
+#define CLASS_BUCKETS_LOCAL 16
+
+static int compare_order(const void *pa, const void *pb)
+{
+    const css_rule_entry *a = *(const css_rule_entry *const *)pa;
+    const css_rule_entry *b = *(const css_rule_entry *const *)pb;
+    return a->order < b->order ? -1 : a->order > b->order;
+}
+
+size_t css_rule_index_match(const css_rule_index *index,
+                            const css_element_adapter *adapter,
+                            const void *el, css_rule_matches *out)
+{
+    return css_rule_index_match_filtered(index, adapter, el, NULL, out);
+}
+
+size_t css_rule_index_match_filtered(const css_rule_index *index,
+                                     const css_element_adapter *adapter,
+                                     const void *el,
+                                     const css_bloom_filter *ancestors,
+                                     css_rule_matches *out)
+{
+    if (!out) return 0;
+    out->count = 0;
+    if (!index || !adapter || !el) return 0;
+
+    const bucket *b =
+        css_name_map_find(&index->ids, adapter->id(adapter->ctx, el));
+    if (b) match_bucket(index, b->start, b->count, adapter, el, ancestors,
+                          out);
+
+    /* Look every class up before matching any bucket: matching calls
+     * the adapter again, which may reuse or free the classes array */
+    const bucket *local[CLASS_BUCKETS_LOCAL];
+    const bucket **found = local;
+    const char *const *classes = NULL;
+    size_t class_count = adapter->classes(adapter->ctx, el, &classes);
+    if (class_count > CLASS_BUCKETS_LOCAL) {
+        found = css_malloc(class_count * sizeof(*found));
+        if (!found) {
+            found = local;
+            class_count = CLASS_BUCKETS_LOCAL;
+        }
+    }
+    size_t found_count = 0;
+    for (size_t i = 0; i < class_count; i++) {
+        b = css_name_map_find(&index->classes, classes[i]);
+        if (!b) continue;
+        /* a repeated class name must not test its bucket twice */
+        size_t j = 0;
+        while (j < found_count && found[j] != b) j++;
+        if (j == found_count) found[found_count++] = b;
+    }
+    for (size_t i = 0; i < found_count; i++) {
+        match_bucket(index, found[i]->start, found[i]->count, adapter, el,
+                     ancestors, out);
+    }
+    if (found != local) css_free(found);
+
+    b = css_name_map_find(&index->tags, adapter->tag_name(adapter->ctx, el));
+    if (b) match_bucket(index, b->start, b->count, adapter, el, ancestors,
+                          out);
+
+    match_bucket(index, index->universal_start, index->universal_count,
+                 adapter, el, ancestors, out);
+
+    if (out->count > 1) {
+        qsort(out->entries, out->count, sizeof(*out->entries),
+              compare_order);
+    }
+    return out->count;
+}
+
+static int compare_cascade(const void *pa, const void *pb)
+{
+    const css_rule_entry *a = *(const css_rule_entry *const *)pa;
+    const css_rule_entry *b = *(const css_rule_entry *const *)pb;
+    if (a->specificity != b->specificity)
+        return a->specificity < b->specificity ? -1 : 1;
+    return a->order < b->order ? -1 : a->order > b->order;
+}
+
+void css_rule_matches_sort_cascade(css_rule_matches *matches)
+{
+    if (matches && matches->count > 1) {
+        qsort(matches->entries, matches->count, sizeof(*matches->entries),
+              compare_cascade);
+    }
+}
+
+void css_rule_matches_free(css_rule_matches *matches)
+{
+    if (!matches) return;
+    css_free(matches->entries);
+    matches->entries = NULL;
+    matches->count = 0;
+    matches->cap = 0;
+}
@@ -0,0 +1,431 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_sax.h"
+#include "css_parser.h"
+#include "css_tokenizer.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>  /* strcasecmp */
+
+/* ================================================================
+ * Internal SAX parser struct
+ *
+ * Same token-consumption model as css_parser_ctx, plus the byte range
+ * of the current token so callers can report source text slices.
+ * ================================================================ */
+
+typedef struct {
+    css_tokenizer *tokenizer;
+    css_token *current_token;  /* currently consumed token (owned) */
+    size_t tok_start;          /* byte range of current_token */
+    size_t tok_end;
+    bool reconsume;
+    size_t depth;              /* number of enclosing {} blocks */
+
+    const css_sax_handler *handler;
+    void *user_data;
+} css_sax_ctx;
+
+/* Names are bounded by the tokenizer's ident buffer (256 bytes) */
+#define SAX_NAME_MAX 256
+
+/* ================================================================
+ * Token consumption helpers
+ * ================================================================ */
+
+static css_token *next_token(css_sax_ctx *p)
+{
+    if (p->reconsume) {
+        p->reconsume = false;
+        return p->current_token;
+    }
+    if (p->current_token) {
+        css_token_free(p->current_token);
+    }
+    p->current_token = css_tokenizer_next(p->tokenizer);
+    p->tok_start = p->tokenizer->token_start;
+    p->tok_end = p->tokenizer->pos;
+    return p->current_token;
+}
+
+static void reconsume(css_sax_ctx *p)
+{
+    p->reconsume = true;
+}
+
+static const char *source_at(css_sax_ctx *p, size_t offset)
+{
+    return p->tokenizer->input + offset;
+}
+
+static void copy_name(char *dst, const char *src)
+{
+    snprintf(dst, SAX_NAME_MAX, "%s", src ? src : "");
+}
+
+/* ================================================================
+ * Skipping component values (§5.4.7 – §5.4.9 without building nodes)
+ * ================================================================ */
+
+static void skip_component_value(css_sax_ctx *p);
+
+static void skip_simple_block(css_sax_ctx *p, css_token_type mirror)
+{
+    for (;;) {
+        css_token *tok = next_token(p);
+        if (tok->type == mirror || tok->type == CSS_TOKEN_EOF) {
+            return;
+        }
+        reconsume(p);
+        skip_component_value(p);
+    }
+}
+
+static void skip_component_value(css_sax_ctx *p)
+{
+    css_token *tok = next_token(p);
+
+    switch (tok->type) {
+    case CSS_TOKEN_OPEN_CURLY:
+        skip_simple_block(p, CSS_TOKEN_CLOSE_CURLY);
+        break;
+    case CSS_TOKEN_OPEN_SQUARE:
+        skip_simple_block(p, CSS_TOKEN_CLOSE_SQUARE);
+        break;
+    case CSS_TOKEN_OPEN_PAREN:
+    case CSS_TOKEN_FUNCTION:
+        skip_simple_block(p, CSS_TOKEN_CLOSE_PAREN);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Error recovery inside a block: skip to the next ';' (consumed) or
+ * '}' / EOF (left for the caller) */
+static void skip_to_declaration_end(css_sax_ctx *p)
+{
+    for (;;) {
+        css_token *tok = next_token(p);
+        if (tok->type == CSS_TOKEN_SEMICOLON) {
+            return;
+        }
+        if (tok->type == CSS_TOKEN_CLOSE_CURLY ||
+            tok->type == CSS_TOKEN_EOF) {
+            reconsume(p);
+            return;
+        }
+        reconsume(p);
+        skip_component_value(p);
+    }
+}
+
+/* ================================================================
+ * Forward declarations
+ * ================================================================ */
+
+static void consume_list_of_rules(css_sax_ctx *p, bool top_level);
+static void consume_list_of_declarations(css_sax_ctx *p);
+
+/* ================================================================
+ * consume_declaration (CSS Syntax §5.4.6)
+ *
+ * The value is reported as a source range.  The last three
+ * non-whitespace component values are remembered so that a trailing
+ * "! important" can be cut off the range.
+ * ================================================================ */
+
+typedef enum {
+    SAX_VALUE_OTHER,
+    SAX_VALUE_BANG,
+    SAX_VALUE_IMPORTANT
+} sax_value_kind;
+
+typedef struct {
+    sax_value_kind kind;
+    size_t end;
+} sax_value_part;
+
+static void consume_declaration(css_sax_ctx *p)
+{
+    /* Current token is the ident holding the property name */
+    char name[SAX_NAME_MAX];
+    copy_name(name, p->current_token->value);
+    size_t line = p->current_token->line;
+    size_t column = p->current_token->column;
+
+    css_token *tok = next_token(p);
+    while (tok->type == CSS_TOKEN_WHITESPACE) {
+        tok = next_token(p);
+    }
+    if (tok->type != CSS_TOKEN_COLON) {
+        /* Parse error — discard the declaration */
+        reconsume(p);
+        skip_to_declaration_end(p);
+        return;
+    }
+
+    size_t value_start = p->tok_end;
+    size_t part_count = 0;
+    sax_value_part last[3] = {{SAX_VALUE_OTHER, 0}};  /* [0] = most recent */
+
+    for (;;) {
+        tok = next_token(p);
+        if (tok->type == CSS_TOKEN_SEMICOLON) {
+            break;
+        }
+        if (tok->type == CSS_TOKEN_CLOSE_CURLY ||
+            tok->type == CSS_TOKEN_EOF) {
+            reconsume(p);
+            break;
+        }
+        if (tok->type == CSS_TOKEN_WHITESPACE) {
+            continue;
+        }
+
+        sax_value_kind kind = SAX_VALUE_OTHER;
+        if (tok->type == CSS_TOKEN_DELIM && tok->delim_codepoint == '!') {
+            kind = SAX_VALUE_BANG;
+        } else if (tok->type == CSS_TOKEN_IDENT && tok->value &&
+                   strcasecmp(tok->value, "important") == 0) {
+            kind = SAX_VALUE_IMPORTANT;
+        }
+        if (part_count == 0) {
+            value_start = p->tok_start;
+        }
+
+        reconsume(p);
+        skip_component_value(p);
+
+        last[2] = last[1];
+        last[1] = last[0];
+        last[0].kind = kind;
+        last[0].end = p->tok_end;
+        part_count++;
+    }
+
+    css_sax_declaration decl;
+    decl.name = name;
+    decl.important = false;
+    decl.line = line;
+    decl.column = column;
+    decl.value_offset = value_start;
+
+    size_t value_end = part_count > 0 ? last[0].end : value_start;
+    if (part_count >= 2 && last[0].kind == SAX_VALUE_IMPORTANT &&
+        last[1].kind == SAX_VALUE_BANG) {
+        decl.important = true;
+        value_end = part_count >= 3 ? last[2].end : value_start;
+    }
+    decl.value = source_at(p, value_start);
+    decl.value_length = value_end - value_start;
+
+    if (p->handler->on_declaration) {
+        p->handler->on_declaration(p->user_data, &decl);
+    }
+}
+
+/* ================================================================
+ * consume_at_rule (CSS Syntax §5.4.2)
+ * ================================================================ */
+
+static void consume_at_rule(css_sax_ctx *p)
+{
+    /* Current token is at-keyword-token */
+    char name[SAX_NAME_MAX];
+    copy_name(name, p->current_token->value);
+
+    size_t prelude_start = p->tok_end;
+    size_t prelude_end = p->tok_end;
+    bool have_prelude = false;
+
+    for (;;) {
+        css_token *tok = next_token(p);
+        bool block_end = p->depth > 0 &&
+                         tok->type == CSS_TOKEN_CLOSE_CURLY;
+        if (tok->type == CSS_TOKEN_SEMICOLON ||
+            tok->type == CSS_TOKEN_EOF || block_end) {
+            if (block_end) reconsume(p);
+            if (p->handler->on_at_rule_start) {
+                p->handler->on_at_rule_start(p->user_data, name,
+                    source_at(p, prelude_start),
+                    prelude_end - prelude_start, false);
+            }
+            return;
+        }
+        if (tok->type == CSS_TOKEN_OPEN_CURLY) {
+            if (p->handler->on_at_rule_start) {
+                p->handler->on_at_rule_start(p->user_data, name,
+                    source_at(p, prelude_start),
+                    prelude_end - prelude_start, true);
+            }
+            p->depth++;
+            if (css_at_rule_has_rule_list(name)) {
+                consume_list_of_rules(p, false);
+            } else {
+                consume_list_of_declarations(p);
+            }
+            p->depth--;
+            /* Eat the closing } (EOF simply stays current) */
+            next_token(p);
+            if (p->handler->on_block_end) {
+                p->handler->on_block_end(p->user_data);
+            }
+            return;
+        }
+        if (tok->type == CSS_TOKEN_WHITESPACE) {
+            continue;
+        }
+        if (!have_prelude) {
+            prelude_start = p->tok_start;
+            have_prelude = true;
+        }
+        reconsume(p);
+        skip_component_value(p);
+        prelude_end = p->tok_end;
+    }
+}
+
+/* ================================================================
+ * consume_qualified_rule (CSS Syntax §5.4.3)
+ * ================================================================ */
+
+static void consume_qualified_rule(css_sax_ctx *p, bool top_level)
+{
+    size_t prelude_start = p->tok_start;
+    size_t prelude_end = p->tok_start;
+    bool have_prelude = false;
+
+    for (;;) {
+        css_token *tok = next_token(p);
+        if (tok->type == CSS_TOKEN_EOF) {
+            /* Parse error — discard the rule */
+            return;
+        }
+        if (!top_level && tok->type == CSS_TOKEN_CLOSE_CURLY) {
+            /* End of the enclosing block — discard the rule */
+            reconsume(p);
+            return;
+        }
+        if (tok->type == CSS_TOKEN_OPEN_CURLY) {
+            if (p->handler->on_selector_text) {
+                p->handler->on_selector_text(p->user_data,
+                    source_at(p, prelude_start),
+                    prelude_end - prelude_start);
+            }
+            p->depth++;
+            consume_list_of_declarations(p);
+            p->depth--;
+            next_token(p);  /* closing } */
+            if (p->handler->on_block_end) {
+                p->handler->on_block_end(p->user_data);
+            }
+            return;
+        }
+        if (tok->type == CSS_TOKEN_WHITESPACE) {
+            continue;
+        }
+        if (!have_prelude) {
+            prelude_start = p->tok_start;
+            have_prelude = true;
+        }
+        reconsume(p);
+        skip_component_value(p);
+        prelude_end = p->tok_end;
+    }
+}
+
+/* ================================================================
+ * consume_list_of_rules (CSS Syntax §5.4.1)
+ *
+ * Nested lists (top_level == false) stop before the closing '}'.
+ * ================================================================ */
+
+static void consume_list_of_rules(css_sax_ctx *p, bool top_level)
+{
+    for (;;) {
+        css_token *tok = next_token(p);
+        if (tok->type == CSS_TOKEN_WHITESPACE) {
+            continue;
+        }
+        if (tok->type == CSS_TOKEN_EOF) {
+            reconsume(p);
+            return;
+        }
+        if (!top_level && tok->type == CSS_TOKEN_CLOSE_CURLY) {
+            reconsume(p);
+            return;
+        }
+        if (tok->type == CSS_TOKEN_CDO || tok->type == CSS_TOKEN_CDC) {
+            if (top_level) continue;
+            reconsume(p);
+            consume_qualified_rule(p, top_level);
+            continue;
+        }
+        if (tok->type == CSS_TOKEN_AT_KEYWORD) {
+            consume_at_rule(p);
+            continue;
+        }
+        reconsume(p);
+        consume_qualified_rule(p, top_level);
+    }
+}
+
+/* ================================================================
+ * consume_list_of_declarations (CSS Syntax §5.4.5)
+ *
+ * Stops before the closing '}' (or EOF).
+ * ================================================================ */
+
+static void consume_list_of_declarations(css_sax_ctx *p)
+{
+    for (;;) {
+        css_token *tok = next_token(p);
+        if (tok->type == CSS_TOKEN_WHITESPACE ||
+            tok->type == CSS_TOKEN_SEMICOLON) {
+            continue;
+        }
+        if (tok->type == CSS_TOKEN_CLOSE_CURLY ||
+            tok->type == CSS_TOKEN_EOF) {
+            reconsume(p);
+            return;
+        }
+        if (tok->type == CSS_TOKEN_AT_KEYWORD) {
+            consume_at_rule(p);
+            continue;
+        }
+        if (tok->type == CSS_TOKEN_IDENT) {
+            consume_declaration(p);
+            continue;
+        }
+        /* Parse error — skip to the next declaration */
+        reconsume(p);
+        skip_to_declaration_end(p);
+    }
+}
+
+/* ================================================================
+ * css_sax_parse (public API)
+ * ================================================================ */
+
+bool css_sax_parse(const char *input, size_t length,
+                   const css_sax_handler *handler, void *user_data)
+{
+    static const css_sax_handler no_handler;
+
+    css_sax_ctx parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.handler = handler ? handler : &no_handler;
+    parser.user_data = user_data;
+
+    parser.tokenizer = css_tokenizer_create(input, length);
+    if (!parser.tokenizer) return false;
+
+    consume_list_of_rules(&parser, true);
+
+    if (parser.current_token) {
+        css_token_free(parser.current_token);
+    }
+    css_tokenizer_free(parser.tokenizer);
+    return true;
+}
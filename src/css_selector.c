@@ -1,8 +1,12 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include "css_selector.h"
+#include "css_bloom.h"
+#include "css_tokenizer.h"
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>  /* strcasecmp */
+#include <limits.h>
 
 /* ================================================================
  * Simple selector lifecycle
@@ -10,7 +14,7 @@
 
 css_simple_selector *css_simple_selector_create(css_simple_selector_type type)
 {
-    css_simple_selector *sel = calloc(1, sizeof(css_simple_selector));
+    css_simple_selector *sel = css_calloc(1, sizeof(css_simple_selector));
     if (!sel) return NULL;
     sel->type = type;
     return sel;
@@ -19,10 +23,12 @@ css_simple_selector *css_simple_selector_create(css_simple_selector_type type)
 void css_simple_selector_free(css_simple_selector *sel)
 {
     if (!sel) return;
-    free(sel->name);
-    free(sel->attr_name);
-    free(sel->attr_value);
-    free(sel);
+    css_free(sel->name);
+    css_free(sel->attr_name);
+    css_free(sel->attr_value);
+    css_free(sel->attr_value_folded);
+    css_selector_list_free(sel->argument);
+    css_free(sel);
 }
 
 /* ================================================================
@@ -31,7 +37,7 @@ void css_simple_selector_free(css_simple_selector *sel)
 
 css_compound_selector *css_compound_selector_create(void)
 {
-    css_compound_selector *comp = calloc(1, sizeof(css_compound_selector));
+    css_compound_selector *comp = css_calloc(1, sizeof(css_compound_selector));
     return comp;
 }
 
@@ -41,8 +47,9 @@ void css_compound_selector_free(css_compound_selector *comp)
     for (size_t i = 0; i < comp->count; i++) {
         css_simple_selector_free(comp->selectors[i]);
     }
-    free(comp->selectors);
-    free(comp);
+    css_free(comp->selectors);
+    css_free(comp->match_order);
+    css_free(comp);
 }
 
 void css_compound_selector_append(css_compound_selector *comp,
@@ -51,7 +58,7 @@ void css_compound_selector_append(css_compound_selector *comp,
     if (!comp || !sel) return;
     if (comp->count >= comp->cap) {
         comp->cap = comp->cap ? comp->cap * 2 : 4;
-        comp->selectors = realloc(comp->selectors,
+        comp->selectors = css_realloc(comp->selectors,
                                   comp->cap * sizeof(css_simple_selector *));
     }
     comp->selectors[comp->count++] = sel;
@@ -63,7 +70,7 @@ void css_compound_selector_append(css_compound_selector *comp,
 
 css_complex_selector *css_complex_selector_create(void)
 {
-    css_complex_selector *cx = calloc(1, sizeof(css_complex_selector));
+    css_complex_selector *cx = css_calloc(1, sizeof(css_complex_selector));
     return cx;
 }
 
@@ -73,9 +80,198 @@ void css_complex_selector_free(css_complex_selector *cx)
     for (size_t i = 0; i < cx->count; i++) {
         css_compound_selector_free(cx->compounds[i]);
     }
-    free(cx->compounds);
-    free(cx->combinators);
-    free(cx);
+    css_free(cx->compounds);
+    css_free(cx->combinators);
+    css_free(cx);
+}
+
+/* Largest specificity among list's selectors (Selectors 4 §16: the
+ * specificity of :is(), :not() and "of S") */
+static css_specificity max_specificity(const css_selector_list *list)
+{
+    css_specificity max = {0, 0, 0};
+    uint32_t max_key = 0;
+    for (size_t i = 0; list && i < list->count; i++) {
+        if (list->selectors[i]->specificity_key >= max_key) {
+            max_key = list->selectors[i]->specificity_key;
+            max = list->selectors[i]->specificity;
+        }
+    }
+    return max;
+}
+
+static css_specificity compound_specificity(const css_compound_selector *comp)
+{
+    css_specificity spec = {0, 0, 0};
+    for (size_t j = 0; j < comp->count; j++) {
+        css_simple_selector *ss = comp->selectors[j];
+        if (!ss) continue;
+        switch (ss->type) {
+        case SEL_ID:             spec.a++; break;
+        case SEL_CLASS:          spec.b++; break;
+        case SEL_ATTRIBUTE:      spec.b++; break;
+        case SEL_TYPE:           spec.c++; break;
+        case SEL_PSEUDO_ELEMENT: spec.c++; break;
+        case SEL_UNIVERSAL:      break;
+        case SEL_PSEUDO_CLASS: {
+            /* :where() counts nothing, :is() and :not() count their
+             * most specific argument, :nth-*() one pseudo-class plus
+             * the most specific of S */
+            if (ss->pseudo == PSEUDO_WHERE) break;
+            if (ss->pseudo != PSEUDO_IS && ss->pseudo != PSEUDO_NOT)
+                spec.b++;
+            css_specificity arg = max_specificity(ss->argument);
+            spec.a += arg.a;
+            spec.b += arg.b;
+            spec.c += arg.c;
+            break;
+        }
+        }
+    }
+    return spec;
+}
+
+static void add_specificity(css_complex_selector *cx,
+                            const css_compound_selector *comp)
+{
+    css_specificity spec = compound_specificity(comp);
+    cx->specificity.a += spec.a;
+    cx->specificity.b += spec.b;
+    cx->specificity.c += spec.c;
+    cx->specificity_key = css_specificity_pack(cx->specificity);
+}
+
+static bool is_attr_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+/* Fill in sel->attr_matcher from the attribute fields */
+static void compile_attr_matcher(css_simple_selector *sel)
+{
+    css_attr_matcher *m = &sel->attr_matcher;
+    css_free(sel->attr_value_folded);
+    sel->attr_value_folded = NULL;
+    m->op = sel->attr_match;
+    m->needle = sel->attr_value;
+    m->length = sel->attr_value ? strlen(sel->attr_value) : 0;
+    m->case_insensitive = sel->attr_case_insensitive;
+    m->never = false;
+
+    if (sel->attr_match == ATTR_EXISTS) return;
+    if (!sel->attr_value) {
+        m->never = true;
+        return;
+    }
+    switch (sel->attr_match) {
+    case ATTR_INCLUDES:
+        for (size_t i = 0; i < m->length; i++) {
+            if (is_attr_space(m->needle[i])) m->never = true;
+        }
+        /* fall through */
+    case ATTR_PREFIX:
+    case ATTR_SUFFIX:
+    case ATTR_SUBSTRING:
+        if (m->length == 0) m->never = true;
+        break;
+    default:
+        break;
+    }
+
+    if (m->case_insensitive) {
+        sel->attr_value_folded = css_malloc(m->length + 1);
+        if (!sel->attr_value_folded) {
+            /* keep the raw value; it only matches same-case values */
+            m->case_insensitive = false;
+            return;
+        }
+        for (size_t i = 0; i <= m->length; i++) {
+            char c = sel->attr_value[i];
+            sel->attr_value_folded[i] =
+                c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+        }
+        m->needle = sel->attr_value_folded;
+    }
+}
+
+/* Rank in match_order; universal (-1) is not matched at all */
+static int match_rank(css_simple_selector_type type)
+{
+    switch (type) {
+    case SEL_ID:             return 0;
+    case SEL_CLASS:          return 1;
+    case SEL_TYPE:           return 2;
+    case SEL_ATTRIBUTE:      return 3;
+    case SEL_PSEUDO_CLASS:   return 4;
+    case SEL_PSEUDO_ELEMENT: return 5;
+    case SEL_UNIVERSAL:
+    default:                 return -1;
+    }
+}
+
+/* Fill comp->match_order, stably sorted by match_rank().  On
+ * allocation failure it stays NULL and matching uses source order. */
+static void order_compound(css_compound_selector *comp)
+{
+    css_free(comp->match_order);
+    comp->match_order = NULL;
+    comp->match_count = 0;
+    if (comp->count == 0) return;
+    comp->match_order = css_malloc(comp->count * sizeof(css_simple_selector *));
+    if (!comp->match_order) return;
+    for (int rank = 0; rank <= match_rank(SEL_PSEUDO_ELEMENT); rank++) {
+        for (size_t i = 0; i < comp->count; i++) {
+            if (match_rank(comp->selectors[i]->type) == rank)
+                comp->match_order[comp->match_count++] = comp->selectors[i];
+        }
+    }
+}
+
+/* Attribute matchers and match_order of one compound */
+static void prepare_compound(css_compound_selector *comp)
+{
+    for (size_t j = 0; j < comp->count; j++) {
+        if (comp->selectors[j]->type == SEL_ATTRIBUTE)
+            compile_attr_matcher(comp->selectors[j]);
+    }
+    order_compound(comp);
+}
+
+/* Ancestor hashes: compounds left of a child or descendant combinator
+ * are ancestors of the subject (a compound left of a sibling
+ * combinator is only a sibling of whatever it is attached to) */
+static void fill_ancestor_hashes(css_complex_selector *cx)
+{
+    size_t n = 0;
+    memset(cx->ancestor_hashes, 0, sizeof(cx->ancestor_hashes));
+    for (size_t i = cx->count; i-- > 1 && n < CSS_ANCESTOR_HASH_COUNT; ) {
+        css_combinator comb = cx->combinators[i - 1];
+        if (comb != COMB_CHILD && comb != COMB_DESCENDANT) continue;
+        const css_compound_selector *comp = cx->compounds[i - 1];
+        for (size_t j = 0; j < comp->count && n < CSS_ANCESTOR_HASH_COUNT;
+             j++) {
+            const css_simple_selector *sel = comp->selectors[j];
+            if (sel->type == SEL_ID) {
+                cx->ancestor_hashes[n++] = css_bloom_hash_id(sel->name);
+            } else if (sel->type == SEL_CLASS) {
+                cx->ancestor_hashes[n++] = css_bloom_hash_class(sel->name);
+            } else if (sel->type == SEL_TYPE) {
+                cx->ancestor_hashes[n++] = css_bloom_hash_tag(sel->name);
+            }
+        }
+    }
+}
+
+void css_complex_selector_finish(css_complex_selector *cx)
+{
+    if (!cx) return;
+    memset(&cx->specificity, 0, sizeof(cx->specificity));
+    for (size_t i = 0; i < cx->count; i++) {
+        prepare_compound(cx->compounds[i]);
+        add_specificity(cx, cx->compounds[i]);
+    }
+    cx->specificity_key = css_specificity_pack(cx->specificity);
+    fill_ancestor_hashes(cx);
 }
 
 void css_complex_selector_append(css_complex_selector *cx,
@@ -85,11 +281,11 @@ void css_complex_selector_append(css_complex_selector *cx,
     if (!cx || !comp) return;
     if (cx->count >= cx->cap) {
         cx->cap = cx->cap ? cx->cap * 2 : 4;
-        cx->compounds = realloc(cx->compounds,
+        cx->compounds = css_realloc(cx->compounds,
                                 cx->cap * sizeof(css_compound_selector *));
         /* combinators array: at most (cap - 1) entries, but allocate cap
          * for simplicity — the extra slot is never read */
-        cx->combinators = realloc(cx->combinators,
+        cx->combinators = css_realloc(cx->combinators,
                                   cx->cap * sizeof(css_combinator));
     }
     /* If this is not the first compound, store the combinator that sits
@@ -98,6 +294,9 @@ void css_complex_selector_append(css_complex_selector *cx,
         cx->combinators[cx->count - 1] = comb;
     }
     cx->compounds[cx->count++] = comp;
+    prepare_compound(comp);
+    add_specificity(cx, comp);
+    fill_ancestor_hashes(cx);
 }
 
 /* ================================================================
@@ -106,18 +305,21 @@ void css_complex_selector_append(css_complex_selector *cx,
 
 css_selector_list *css_selector_list_create(void)
 {
-    css_selector_list *list = calloc(1, sizeof(css_selector_list));
+    css_selector_list *list = css_calloc(1, sizeof(css_selector_list));
+    if (list) list->allocator = css_allocator_current();
     return list;
 }
 
 void css_selector_list_free(css_selector_list *list)
 {
     if (!list) return;
+    const css_allocator *prev = css_allocator_use(list->allocator);
     for (size_t i = 0; i < list->count; i++) {
         css_complex_selector_free(list->selectors[i]);
     }
-    free(list->selectors);
-    free(list);
+    css_free(list->selectors);
+    css_free(list);
+    css_allocator_use(prev);
 }
 
 void css_selector_list_append(css_selector_list *list,
@@ -126,17 +328,74 @@ void css_selector_list_append(css_selector_list *list,
     if (!list || !cx) return;
     if (list->count >= list->cap) {
         list->cap = list->cap ? list->cap * 2 : 4;
-        list->selectors = realloc(list->selectors,
+        list->selectors = css_realloc(list->selectors,
                                   list->cap * sizeof(css_complex_selector *));
     }
     list->selectors[list->count++] = cx;
 }
 
 /* ================================================================
- * Dump helpers (static)
+ * Memory accounting
+ * ================================================================ */
+
+static size_t string_size(const char *s)
+{
+    return s ? strlen(s) + 1 : 0;
+}
+
+size_t css_selector_list_memory_usage(const css_selector_list *list)
+{
+    if (!list) return 0;
+    size_t bytes = sizeof(*list) + list->cap * sizeof(*list->selectors);
+    for (size_t i = 0; i < list->count; i++) {
+        const css_complex_selector *cx = list->selectors[i];
+        bytes += sizeof(*cx) + cx->cap * (sizeof(*cx->compounds) +
+                                          sizeof(*cx->combinators));
+        for (size_t j = 0; j < cx->count; j++) {
+            const css_compound_selector *comp = cx->compounds[j];
+            bytes += sizeof(*comp) + comp->cap * sizeof(*comp->selectors);
+            if (comp->match_order)
+                bytes += comp->count * sizeof(*comp->match_order);
+            for (size_t k = 0; k < comp->count; k++) {
+                const css_simple_selector *sel = comp->selectors[k];
+                bytes += sizeof(*sel) + string_size(sel->name) +
+                         string_size(sel->attr_name) +
+                         string_size(sel->attr_value) +
+                         string_size(sel->attr_value_folded) +
+                         css_selector_list_memory_usage(sel->argument);
+            }
+        }
+    }
+    return bytes;
+}
+
+/* ================================================================
+ * An+B
  * ================================================================ */
 
-static const char *simple_sel_type_name(css_simple_selector_type type)
+static bool is_nth_kind(css_pseudo_class_kind kind)
+{
+    return kind == PSEUDO_NTH_CHILD || kind == PSEUDO_NTH_LAST_CHILD ||
+           kind == PSEUDO_NTH_OF_TYPE || kind == PSEUDO_NTH_LAST_OF_TYPE;
+}
+
+int css_nth_format(css_nth nth, char *buf, size_t size)
+{
+    if (nth.a == 0) return snprintf(buf, size, "%d", nth.b);
+    const char *a = nth.a == 1 ? "" : nth.a == -1 ? "-" : NULL;
+    if (nth.b == 0) {
+        return a ? snprintf(buf, size, "%sn", a)
+                 : snprintf(buf, size, "%dn", nth.a);
+    }
+    return a ? snprintf(buf, size, "%sn%+d", a, nth.b)
+             : snprintf(buf, size, "%dn%+d", nth.a, nth.b);
+}
+
+/* ================================================================
+ * Names for output (public)
+ * ================================================================ */
+
+const char *css_simple_selector_type_name(css_simple_selector_type type)
 {
     switch (type) {
     case SEL_TYPE:           return "type";
@@ -150,7 +409,7 @@ static const char *simple_sel_type_name(css_simple_selector_type type)
     return "unknown";
 }
 
-static const char *combinator_name(css_combinator comb)
+const char *css_combinator_name(css_combinator comb)
 {
     switch (comb) {
     case COMB_DESCENDANT:          return " ";
@@ -161,7 +420,7 @@ static const char *combinator_name(css_combinator comb)
     return "?";
 }
 
-static const char *attr_match_name(css_attr_match match)
+const char *css_attr_match_name(css_attr_match match)
 {
     switch (match) {
     case ATTR_EXISTS:    return "";
@@ -175,10 +434,18 @@ static const char *attr_match_name(css_attr_match match)
     return "?";
 }
 
+/* ================================================================
+ * Dump helpers (static)
+ * ================================================================ */
+
 static void dump_indent_s(FILE *out, int depth)
 {
-    for (int i = 0; i < depth; i++) {
-        fprintf(out, "  ");
+    static const char spaces[] = "                                ";
+    size_t n = depth > 0 ? (size_t)depth * 2 : 0;
+    while (n > 0) {
+        size_t chunk = n < sizeof(spaces) - 1 ? n : sizeof(spaces) - 1;
+        fwrite(spaces, 1, chunk, out);
+        n -= chunk;
     }
 }
 
@@ -205,7 +472,7 @@ void css_selector_dump(css_selector_list *list, FILE *out, int depth)
             if (j > 0) {
                 dump_indent_s(out, depth + 2);
                 fprintf(out, "COMBINATOR \"%s\"\n",
-                        combinator_name(cx->combinators[j - 1]));
+                        css_combinator_name(cx->combinators[j - 1]));
             }
 
             css_compound_selector *comp = cx->compounds[j];
@@ -223,11 +490,11 @@ void css_selector_dump(css_selector_list *list, FILE *out, int depth)
                 if (sel->type == SEL_ATTRIBUTE) {
                     /* <attribute [href^="https"]> */
                     fprintf(out, "<%s [%s",
-                            simple_sel_type_name(sel->type),
+                            css_simple_selector_type_name(sel->type),
                             sel->attr_name ? sel->attr_name : "");
                     if (sel->attr_match != ATTR_EXISTS && sel->attr_value) {
                         fprintf(out, "%s\"%s\"",
-                                attr_match_name(sel->attr_match),
+                                css_attr_match_name(sel->attr_match),
                                 sel->attr_value);
                     }
                     if (sel->attr_case_insensitive) {
@@ -236,161 +503,378 @@ void css_selector_dump(css_selector_list *list, FILE *out, int depth)
                     fprintf(out, "]>\n");
                 } else {
                     /* <type "div">, <class "foo">, <id "bar">, <universal>, etc. */
-                    if (sel->name) {
+                    if (sel->type == SEL_PSEUDO_CLASS &&
+                        is_nth_kind(sel->pseudo)) {
+                        char nth[32];
+                        css_nth_format(sel->nth, nth, sizeof(nth));
+                        fprintf(out, "<%s \"%s(%s)\">\n",
+                                css_simple_selector_type_name(sel->type),
+                                sel->name, nth);
+                    } else if (sel->name) {
                         fprintf(out, "<%s \"%s\">\n",
-                                simple_sel_type_name(sel->type),
+                                css_simple_selector_type_name(sel->type),
                                 sel->name);
                     } else {
                         fprintf(out, "<%s>\n",
-                                simple_sel_type_name(sel->type));
+                                css_simple_selector_type_name(sel->type));
                     }
                 }
+                css_selector_dump(sel->argument, out, depth + 4);
             }
         }
     }
 }
 
 /* ================================================================
- * CV helper functions (Task 4)
+ * Token input
+ *
+ * The parser reads a css_token_stream one token at a time: the
+ * parser's own stream while a prelude is being read, a tokenizer over
+ * a prelude's source text, or a walk over component values.  Blocks
+ * and functions arrive as their opening token, their contents and
+ * their closing token.  Every parse function reads up to the end of
+ * what it parses and no further, except where noted.
  * ================================================================ */
 
-/* Check if a component value is a preserved token of specific type */
-static bool cv_is(css_component_value *cv, css_token_type type)
+static const css_token eof_token = { .type = CSS_TOKEN_EOF };
+
+static const css_token *peek(css_token_stream *in)
 {
-    if (!cv) return false;
-    return cv->type == CSS_NODE_COMPONENT_VALUE && cv->u.token &&
-           cv->u.token->type == type;
+    return in->peek(in->ctx);
 }
 
-/* Check if a component value is a delim with specific codepoint */
-static bool cv_is_delim(css_component_value *cv, uint32_t cp)
+static void advance(css_token_stream *in)
 {
-    if (!cv) return false;
-    return cv->type == CSS_NODE_COMPONENT_VALUE && cv->u.token &&
-           cv->u.token->type == CSS_TOKEN_DELIM &&
-           cv->u.token->delim_codepoint == cp;
+    in->next(in->ctx);
 }
 
-/* Get token value string from a CV (NULL if not applicable) */
-static const char *cv_token_value(css_component_value *cv)
+static bool peek_is(css_token_stream *in, css_token_type type)
 {
-    if (!cv || cv->type != CSS_NODE_COMPONENT_VALUE || !cv->u.token)
-        return NULL;
-    return cv->u.token->value;
+    return peek(in)->type == type;
+}
+
+static bool peek_is_delim(css_token_stream *in, uint32_t cp)
+{
+    const css_token *tok = peek(in);
+    return tok->type == CSS_TOKEN_DELIM && tok->delim_codepoint == cp;
+}
+
+/* At end, or at the end of the input */
+static bool at_end(css_token_stream *in, css_token_type end)
+{
+    css_token_type type = peek(in)->type;
+    return type == end || type == CSS_TOKEN_EOF;
+}
+
+static void skip_whitespace(css_token_stream *in)
+{
+    while (peek_is(in, CSS_TOKEN_WHITESPACE)) advance(in);
+}
+
+/* Token closing a block or function opened by type; EOF for others */
+static css_token_type closing_token(css_token_type type)
+{
+    switch (type) {
+    case CSS_TOKEN_OPEN_SQUARE: return CSS_TOKEN_CLOSE_SQUARE;
+    case CSS_TOKEN_OPEN_PAREN:
+    case CSS_TOKEN_FUNCTION:    return CSS_TOKEN_CLOSE_PAREN;
+    case CSS_TOKEN_OPEN_CURLY:  return CSS_TOKEN_CLOSE_CURLY;
+    default:                    return CSS_TOKEN_EOF;
+    }
+}
+
+static void skip_until(css_token_stream *in, css_token_type end);
+
+/* Skip one component value: a token, or a block or function whole */
+static void skip_value(css_token_stream *in)
+{
+    css_token_type close = closing_token(peek(in)->type);
+    advance(in);
+    if (close == CSS_TOKEN_EOF) return;
+    skip_until(in, close);
+    if (peek_is(in, close)) advance(in);
+}
+
+/* Skip component values up to end (not consumed) */
+static void skip_until(css_token_stream *in, css_token_type end)
+{
+    while (!at_end(in, end)) skip_value(in);
 }
 
 /* ================================================================
  * Attribute selector parsing (Task 4)
  * ================================================================ */
 
-static css_simple_selector *parse_attribute_selector(css_simple_block *block)
+/* [name op value modifier] -> attribute selector, read through the
+ * closing ']' (after the '['); NULL if invalid */
+static css_simple_selector *parse_attribute_selector(css_token_stream *in)
 {
-    if (!block || block->associated_token != CSS_TOKEN_OPEN_SQUARE)
-        return NULL;
+    css_simple_selector *sel = css_simple_selector_create(SEL_ATTRIBUTE);
+    bool valid = sel != NULL;
+    skip_whitespace(in);
+
+    /* Read attr_name (must be ident) */
+    const css_token *tok = peek(in);
+    valid = valid && tok->type == CSS_TOKEN_IDENT && tok->value;
+    if (valid) {
+        sel->attr_name = css_strdup(tok->value);
+        sel->attr_match = ATTR_EXISTS;
+        advance(in);
+        skip_whitespace(in);
+    }
+
+    /* Determine match operator; without one -> ATTR_EXISTS */
+    static const struct {
+        uint32_t cp;
+        css_attr_match match;
+    } operators[] = {
+        { '~', ATTR_INCLUDES }, { '|', ATTR_DASH }, { '^', ATTR_PREFIX },
+        { '$', ATTR_SUFFIX }, { '*', ATTR_SUBSTRING }
+    };
+    if (valid && !at_end(in, CSS_TOKEN_CLOSE_SQUARE)) {
+        if (peek_is_delim(in, '=')) {
+            sel->attr_match = ATTR_EXACT;
+        } else {
+            size_t i = 0;
+            size_t n = sizeof(operators) / sizeof(operators[0]);
+            while (i < n && !peek_is_delim(in, operators[i].cp)) i++;
+            valid = i < n;
+            if (valid) {
+                advance(in);
+                valid = peek_is_delim(in, '=');
+                sel->attr_match = operators[i].match;
+            }
+        }
+        if (valid) {
+            advance(in);
+            skip_whitespace(in);
+        }
 
-    css_component_value **vals = block->values;
-    size_t cnt = block->value_count;
-    size_t pos = 0;
+        /* Read attr_value (ident or string) */
+        tok = peek(in);
+        valid = valid && (tok->type == CSS_TOKEN_IDENT ||
+                          tok->type == CSS_TOKEN_STRING);
+        if (valid) {
+            sel->attr_value = tok->value ? css_strdup(tok->value) : NULL;
+            advance(in);
+            skip_whitespace(in);
+        }
 
-    /* Skip leading whitespace */
-    while (pos < cnt && cv_is(vals[pos], CSS_TOKEN_WHITESPACE))
-        pos++;
+        /* Optional case flag: i or s (explicit case-sensitive, the
+         * default); nothing else may follow the value */
+        tok = peek(in);
+        if (valid && tok->type == CSS_TOKEN_IDENT) {
+            const char *flag = tok->value ? tok->value : "";
+            sel->attr_case_insensitive = strcasecmp(flag, "i") == 0;
+            valid = sel->attr_case_insensitive || strcasecmp(flag, "s") == 0;
+            advance(in);
+            skip_whitespace(in);
+        }
+        valid = valid && at_end(in, CSS_TOKEN_CLOSE_SQUARE);
+    }
+    skip_until(in, CSS_TOKEN_CLOSE_SQUARE);
+    if (peek_is(in, CSS_TOKEN_CLOSE_SQUARE)) advance(in);
 
-    /* Read attr_name (must be ident) */
-    if (pos >= cnt || !cv_is(vals[pos], CSS_TOKEN_IDENT))
+    if (!valid) {
+        css_simple_selector_free(sel);
         return NULL;
+    }
+    return sel;
+}
 
-    const char *attr_name = cv_token_value(vals[pos]);
-    if (!attr_name) return NULL;
-    pos++;
+/* ================================================================
+ * Functional pseudo-classes
+ * ================================================================ */
 
-    /* Skip whitespace after attr_name */
-    while (pos < cnt && cv_is(vals[pos], CSS_TOKEN_WHITESPACE))
-        pos++;
+static css_selector_list *parse_selector_list(css_token_stream *in,
+                                              css_token_type end,
+                                              bool nested, bool forgiving);
 
-    /* If no more tokens -> ATTR_EXISTS */
-    if (pos >= cnt) {
-        css_simple_selector *sel = css_simple_selector_create(SEL_ATTRIBUTE);
-        if (!sel) return NULL;
-        sel->attr_name = strdup(attr_name);
-        sel->attr_match = ATTR_EXISTS;
-        return sel;
-    }
-
-    /* Determine match operator */
-    css_attr_match match = ATTR_EXISTS;
-
-    if (cv_is_delim(vals[pos], '=')) {
-        /* Exact match: = */
-        match = ATTR_EXACT;
-        pos++;
-    } else if (cv_is_delim(vals[pos], '~') &&
-               pos + 1 < cnt && cv_is_delim(vals[pos + 1], '=')) {
-        match = ATTR_INCLUDES;
-        pos += 2;
-    } else if (cv_is_delim(vals[pos], '|') &&
-               pos + 1 < cnt && cv_is_delim(vals[pos + 1], '=')) {
-        match = ATTR_DASH;
-        pos += 2;
-    } else if (cv_is_delim(vals[pos], '^') &&
-               pos + 1 < cnt && cv_is_delim(vals[pos + 1], '=')) {
-        match = ATTR_PREFIX;
-        pos += 2;
-    } else if (cv_is_delim(vals[pos], '$') &&
-               pos + 1 < cnt && cv_is_delim(vals[pos + 1], '=')) {
-        match = ATTR_SUFFIX;
-        pos += 2;
-    } else if (cv_is_delim(vals[pos], '*') &&
-               pos + 1 < cnt && cv_is_delim(vals[pos + 1], '=')) {
-        match = ATTR_SUBSTRING;
-        pos += 2;
-    } else {
-        /* No operator found after attr_name -> ATTR_EXISTS */
-        css_simple_selector *sel = css_simple_selector_create(SEL_ATTRIBUTE);
-        if (!sel) return NULL;
-        sel->attr_name = strdup(attr_name);
-        sel->attr_match = ATTR_EXISTS;
-        return sel;
-    }
+static bool is_integer(const css_token *tok)
+{
+    return tok->type == CSS_TOKEN_NUMBER &&
+           tok->number_type == CSS_NUM_INTEGER;
+}
 
-    /* Skip whitespace after operator */
-    while (pos < cnt && cv_is(vals[pos], CSS_TOKEN_WHITESPACE))
-        pos++;
+static int clamp_int(double v)
+{
+    if (v >= INT_MAX) return INT_MAX;
+    if (v <= INT_MIN) return INT_MIN;
+    return (int)v;
+}
 
-    /* Read attr_value (ident or string) */
-    if (pos >= cnt) return NULL;
+/* The "n..." part of an An+B ident or dimension unit */
+typedef enum {
+    NTH_INVALID,
+    NTH_N,          /* "n": an optional signed B follows */
+    NTH_N_DASH,     /* "n-": a signless B follows, negated */
+    NTH_DONE        /* B is known: "n-<digits>", odd, even or bare B */
+} nth_suffix;
 
-    const char *attr_value = NULL;
-    if (cv_is(vals[pos], CSS_TOKEN_IDENT) || cv_is(vals[pos], CSS_TOKEN_STRING)) {
-        attr_value = cv_token_value(vals[pos]);
-        pos++;
-    } else {
-        return NULL; /* invalid attribute value */
+static nth_suffix parse_nth_suffix(const char *s, int *b)
+{
+    if (!s || (s[0] != 'n' && s[0] != 'N')) return NTH_INVALID;
+    if (s[1] == '\0') return NTH_N;
+    if (s[1] != '-') return NTH_INVALID;
+    if (s[2] == '\0') return NTH_N_DASH;
+    long long value = 0;
+    for (const char *c = s + 2; *c; c++) {
+        if (*c < '0' || *c > '9') return NTH_INVALID;
+        if (value <= INT_MAX) value = value * 10 + (*c - '0');
     }
+    *b = value > INT_MAX ? INT_MIN : (int)-value;
+    return NTH_DONE;
+}
 
-    /* Skip whitespace */
-    while (pos < cnt && cv_is(vals[pos], CSS_TOKEN_WHITESPACE))
-        pos++;
+/* A signless integer B, negated if negative */
+static bool parse_nth_b(css_token_stream *in, bool negative, int *b)
+{
+    skip_whitespace(in);
+    const css_token *tok = peek(in);
+    if (!is_integer(tok) || tok->numeric_value < 0) return false;
+    *b = clamp_int(tok->numeric_value);
+    if (negative) *b = *b == INT_MAX ? INT_MIN : -*b;
+    advance(in);
+    return true;
+}
 
-    /* Optional case flag: i or s */
-    bool case_insensitive = false;
-    if (pos < cnt && cv_is(vals[pos], CSS_TOKEN_IDENT)) {
-        const char *flag = cv_token_value(vals[pos]);
-        if (flag && (flag[0] == 'i' || flag[0] == 'I') && flag[1] == '\0') {
-            case_insensitive = true;
-            pos++;
-        } else if (flag && (flag[0] == 's' || flag[0] == 'S') && flag[1] == '\0') {
-            /* explicit case-sensitive, default behavior */
-            pos++;
+/* <an+b> (CSS Syntax §6).  The tokens do not record whether a number
+ * was written with a sign, so "2n 1" is accepted along with "2n+1".
+ * May read whitespace after it. */
+static bool parse_nth(css_token_stream *in, css_nth *out)
+{
+    skip_whitespace(in);
+    const css_token *tok = peek(in);
+    int a = 0, b = 0;
+    nth_suffix suffix = NTH_INVALID;
+
+    if (tok->type == CSS_TOKEN_IDENT && tok->value &&
+        strcasecmp(tok->value, "odd") == 0) {
+        a = 2;
+        b = 1;
+        suffix = NTH_DONE;
+    } else if (tok->type == CSS_TOKEN_IDENT && tok->value &&
+               strcasecmp(tok->value, "even") == 0) {
+        a = 2;
+        suffix = NTH_DONE;
+    } else if (is_integer(tok)) {
+        b = clamp_int(tok->numeric_value);
+        suffix = NTH_DONE;
+    } else if (tok->type == CSS_TOKEN_DIMENSION &&
+               tok->number_type == CSS_NUM_INTEGER) {
+        a = clamp_int(tok->numeric_value);
+        suffix = parse_nth_suffix(tok->unit, &b);
+    } else if (tok->type == CSS_TOKEN_IDENT && tok->value) {
+        bool negative = tok->value[0] == '-';
+        a = negative ? -1 : 1;
+        suffix = parse_nth_suffix(tok->value + negative, &b);
+    } else if (peek_is_delim(in, '+')) {
+        advance(in);
+        tok = peek(in);
+        if (tok->type != CSS_TOKEN_IDENT) return false;
+        a = 1;
+        suffix = parse_nth_suffix(tok->value, &b);
+    }
+    if (suffix == NTH_INVALID) return false;
+    advance(in);
+
+    if (suffix == NTH_N) {
+        skip_whitespace(in);
+        tok = peek(in);
+        if (is_integer(tok)) {
+            b = clamp_int(tok->numeric_value);
+            advance(in);
+        } else if (peek_is_delim(in, '+') || peek_is_delim(in, '-')) {
+            bool negative = peek_is_delim(in, '-');
+            advance(in);
+            if (!parse_nth_b(in, negative, &b)) return false;
         }
+    } else if (suffix == NTH_N_DASH) {
+        if (!parse_nth_b(in, true, &b)) return false;
     }
 
-    css_simple_selector *sel = css_simple_selector_create(SEL_ATTRIBUTE);
-    if (!sel) return NULL;
-    sel->attr_name = strdup(attr_name);
-    sel->attr_match = match;
-    sel->attr_value = attr_value ? strdup(attr_value) : NULL;
-    sel->attr_case_insensitive = case_insensitive;
+    out->a = a;
+    out->b = b;
+    return true;
+}
+
+static const struct {
+    const char *name;
+    css_pseudo_class_kind kind;
+} functional_pseudo_classes[] = {
+    { "not",              PSEUDO_NOT },
+    { "is",               PSEUDO_IS },
+    { "where",            PSEUDO_WHERE },
+    { "nth-child",        PSEUDO_NTH_CHILD },
+    { "nth-last-child",   PSEUDO_NTH_LAST_CHILD },
+    { "nth-of-type",      PSEUDO_NTH_OF_TYPE },
+    { "nth-last-of-type", PSEUDO_NTH_LAST_OF_TYPE }
+};
+
+/* :name(...) -> pseudo-class, read through the closing ')'; NULL if
+ * unknown or the argument is invalid */
+static css_simple_selector *parse_functional_pseudo_class(
+    css_token_stream *in)
+{
+    const char *name = peek(in)->value;
+    size_t n = sizeof(functional_pseudo_classes) /
+               sizeof(functional_pseudo_classes[0]);
+    size_t i = 0;
+    while (name && i < n &&
+           strcasecmp(name, functional_pseudo_classes[i].name))
+        i++;
+
+    css_simple_selector *sel = NULL;
+    if (name && i < n) {
+        sel = css_simple_selector_create(SEL_PSEUDO_CLASS);
+        if (sel) {
+            sel->name = css_strdup(name);
+            sel->pseudo = functional_pseudo_classes[i].kind;
+        }
+    }
+    advance(in);
+
+    bool valid = sel && sel->name;
+    if (valid) {
+        switch (sel->pseudo) {
+        case PSEUDO_NOT:
+            sel->argument =
+                parse_selector_list(in, CSS_TOKEN_CLOSE_PAREN, true, false);
+            valid = sel->argument != NULL;
+            break;
+        case PSEUDO_IS:
+        case PSEUDO_WHERE:
+            sel->argument =
+                parse_selector_list(in, CSS_TOKEN_CLOSE_PAREN, true, true);
+            valid = sel->argument != NULL;
+            break;
+        default:
+            valid = parse_nth(in, &sel->nth);
+            skip_whitespace(in);
+            if (valid && !at_end(in, CSS_TOKEN_CLOSE_PAREN)) {
+                /* :nth-child(An+B of S) / :nth-last-child(An+B of S) */
+                const css_token *of = peek(in);
+                valid = of->type == CSS_TOKEN_IDENT && of->value &&
+                        strcasecmp(of->value, "of") == 0 &&
+                        (sel->pseudo == PSEUDO_NTH_CHILD ||
+                         sel->pseudo == PSEUDO_NTH_LAST_CHILD);
+                if (valid) {
+                    advance(in);
+                    sel->argument = parse_selector_list(
+                        in, CSS_TOKEN_CLOSE_PAREN, true, false);
+                    valid = sel->argument != NULL;
+                }
+            }
+            break;
+        }
+    }
+    skip_until(in, CSS_TOKEN_CLOSE_PAREN);
+    if (peek_is(in, CSS_TOKEN_CLOSE_PAREN)) advance(in);
+
+    if (!valid) {
+        css_simple_selector_free(sel);
+        return NULL;
+    }
     return sel;
 }
 
@@ -398,100 +882,90 @@ static css_simple_selector *parse_attribute_selector(css_simple_block *block)
  * Compound selector parsing (Task 4)
  * ================================================================ */
 
-static css_compound_selector *parse_compound_selector(
-    css_component_value **values, size_t count, size_t *pos)
+/* Simple selector named by the token at the head of in, consumed */
+static void append_named(css_compound_selector *comp,
+                         css_simple_selector_type type, css_token_stream *in)
 {
-    if (!values || *pos >= count) return NULL;
+    const css_token *tok = peek(in);
+    if (tok->value) {
+        css_simple_selector *sel = css_simple_selector_create(type);
+        if (sel) {
+            sel->name = css_strdup(tok->value);
+            css_compound_selector_append(comp, sel);
+        }
+    }
+    advance(in);
+}
 
+/* NULL if no simple selector is here or one of them is invalid.  After
+ * a pseudo-element only pseudo-classes and pseudo-elements may follow
+ * in the compound; *pseudo_element is set when there is one. */
+static css_compound_selector *parse_compound_selector(css_token_stream *in,
+                                                      bool *pseudo_element)
+{
     css_compound_selector *comp = css_compound_selector_create();
     if (!comp) return NULL;
-
-    size_t p = *pos;
+    bool valid = true;
 
     /* 1. Try type selector: ident -> SEL_TYPE, delim('*') -> SEL_UNIVERSAL */
-    if (p < count && cv_is(values[p], CSS_TOKEN_IDENT)) {
-        const char *name = cv_token_value(values[p]);
-        if (name) {
-            css_simple_selector *sel = css_simple_selector_create(SEL_TYPE);
-            if (sel) {
-                sel->name = strdup(name);
-                css_compound_selector_append(comp, sel);
-            }
-            p++;
-        }
-    } else if (p < count && cv_is_delim(values[p], '*')) {
+    if (peek_is(in, CSS_TOKEN_IDENT)) {
+        append_named(comp, SEL_TYPE, in);
+    } else if (peek_is_delim(in, '*')) {
         css_simple_selector *sel = css_simple_selector_create(SEL_UNIVERSAL);
         if (sel) {
             css_compound_selector_append(comp, sel);
         }
-        p++;
+        advance(in);
     }
 
     /* 2. Loop subclass selectors */
-    while (p < count) {
-        /* hash token (type=id) -> SEL_ID */
-        if (cv_is(values[p], CSS_TOKEN_HASH)) {
-            const char *name = cv_token_value(values[p]);
-            if (name) {
-                css_simple_selector *sel = css_simple_selector_create(SEL_ID);
-                if (sel) {
-                    sel->name = strdup(name);
-                    css_compound_selector_append(comp, sel);
-                }
-            }
-            p++;
+    while (valid) {
+        bool subclass = peek_is(in, CSS_TOKEN_HASH) ||
+                        peek_is_delim(in, '.') ||
+                        peek_is(in, CSS_TOKEN_OPEN_SQUARE);
+        if (subclass && *pseudo_element) {
+            valid = false;
+        }
+        /* hash token -> SEL_ID; it must be a valid identifier */
+        else if (peek_is(in, CSS_TOKEN_HASH)) {
+            valid = peek(in)->hash_type == CSS_HASH_ID;
+            if (valid) append_named(comp, SEL_ID, in);
         }
         /* delim('.') + ident -> SEL_CLASS */
-        else if (cv_is_delim(values[p], '.') &&
-                 p + 1 < count && cv_is(values[p + 1], CSS_TOKEN_IDENT)) {
-            const char *name = cv_token_value(values[p + 1]);
-            if (name) {
-                css_simple_selector *sel = css_simple_selector_create(SEL_CLASS);
-                if (sel) {
-                    sel->name = strdup(name);
-                    css_compound_selector_append(comp, sel);
+        else if (peek_is_delim(in, '.')) {
+            advance(in);
+            valid = peek_is(in, CSS_TOKEN_IDENT);
+            if (valid) append_named(comp, SEL_CLASS, in);
+        }
+        /* [ ... ] -> attribute selector */
+        else if (peek_is(in, CSS_TOKEN_OPEN_SQUARE)) {
+            advance(in);
+            css_simple_selector *sel = parse_attribute_selector(in);
+            valid = sel != NULL;
+            if (sel) css_compound_selector_append(comp, sel);
+        }
+        else if (peek_is(in, CSS_TOKEN_COLON)) {
+            advance(in);
+            /* colon + colon + ident -> SEL_PSEUDO_ELEMENT */
+            if (peek_is(in, CSS_TOKEN_COLON)) {
+                advance(in);
+                valid = peek_is(in, CSS_TOKEN_IDENT);
+                if (valid) {
+                    append_named(comp, SEL_PSEUDO_ELEMENT, in);
+                    *pseudo_element = true;
                 }
             }
-            p += 2;
-        }
-        /* simple_block (associated=OPEN_SQUARE) -> attribute selector */
-        else if (p < count && values[p]->type == CSS_NODE_SIMPLE_BLOCK &&
-                 values[p]->u.block &&
-                 values[p]->u.block->associated_token == CSS_TOKEN_OPEN_SQUARE) {
-            css_simple_selector *sel = parse_attribute_selector(values[p]->u.block);
-            if (sel) {
-                css_compound_selector_append(comp, sel);
+            /* colon + function -> functional pseudo-class */
+            else if (peek_is(in, CSS_TOKEN_FUNCTION)) {
+                css_simple_selector *sel = parse_functional_pseudo_class(in);
+                valid = sel != NULL;
+                if (sel) css_compound_selector_append(comp, sel);
             }
-            p++;
-        }
-        /* colon + colon + ident -> SEL_PSEUDO_ELEMENT */
-        else if (cv_is(values[p], CSS_TOKEN_COLON) &&
-                 p + 2 < count &&
-                 cv_is(values[p + 1], CSS_TOKEN_COLON) &&
-                 cv_is(values[p + 2], CSS_TOKEN_IDENT)) {
-            const char *name = cv_token_value(values[p + 2]);
-            if (name) {
-                css_simple_selector *sel = css_simple_selector_create(SEL_PSEUDO_ELEMENT);
-                if (sel) {
-                    sel->name = strdup(name);
-                    css_compound_selector_append(comp, sel);
-                }
+            /* colon + ident -> SEL_PSEUDO_CLASS */
+            else {
+                valid = peek_is(in, CSS_TOKEN_IDENT);
+                if (valid) append_named(comp, SEL_PSEUDO_CLASS, in);
             }
-            p += 3;
-        }
-        /* colon + ident -> SEL_PSEUDO_CLASS */
-        else if (cv_is(values[p], CSS_TOKEN_COLON) &&
-                 p + 1 < count &&
-                 cv_is(values[p + 1], CSS_TOKEN_IDENT)) {
-            const char *name = cv_token_value(values[p + 1]);
-            if (name) {
-                css_simple_selector *sel = css_simple_selector_create(SEL_PSEUDO_CLASS);
-                if (sel) {
-                    sel->name = strdup(name);
-                    css_compound_selector_append(comp, sel);
-                }
-            }
-            p += 2;
         }
         else {
             break; /* not a subclass selector */
@@ -499,12 +973,10 @@ static css_compound_selector *parse_compound_selector(
     }
 
     /* At least 1 simple selector required */
-    if (comp->count == 0) {
+    if (!valid || comp->count == 0) {
         css_compound_selector_free(comp);
         return NULL;
     }
-
-    *pos = p;
     return comp;
 }
 
@@ -512,27 +984,25 @@ static css_compound_selector *parse_compound_selector(
  * Complex selector parsing (Task 5)
  * ================================================================ */
 
-static css_complex_selector *parse_complex_selector(
-    css_component_value **values, size_t start, size_t end)
+/* End of one complex selector in a list ending at end */
+static bool at_selector_end(css_token_stream *in, css_token_type end)
 {
-    if (!values || start >= end) return NULL;
+    return at_end(in, end) || peek_is(in, CSS_TOKEN_COMMA);
+}
 
+/* Compounds joined by combinators, up to the end of the selector; NULL
+ * if anything else is found.  Only the last compound may hold a
+ * pseudo-element. */
+static css_complex_selector *parse_complex_selector(css_token_stream *in,
+                                                    css_token_type end)
+{
     css_complex_selector *cx = css_complex_selector_create();
     if (!cx) return NULL;
 
-    size_t pos = start;
-
-    /* Skip leading whitespace */
-    while (pos < end && cv_is(values[pos], CSS_TOKEN_WHITESPACE))
-        pos++;
-
-    if (pos >= end) {
-        css_complex_selector_free(cx);
-        return NULL;
-    }
-
     /* Parse first compound selector */
-    css_compound_selector *first = parse_compound_selector(values, end, &pos);
+    bool pseudo_element = false;
+    css_compound_selector *first =
+        parse_compound_selector(in, &pseudo_element);
     if (!first) {
         css_complex_selector_free(cx);
         return NULL;
@@ -540,49 +1010,40 @@ static css_complex_selector *parse_complex_selector(
     css_complex_selector_append(cx, first, COMB_DESCENDANT); /* comb ignored for first */
 
     /* Loop: combinator + compound */
-    while (pos < end) {
+    for (;;) {
         /* Skip whitespace, record if any */
         bool had_whitespace = false;
-        while (pos < end && cv_is(values[pos], CSS_TOKEN_WHITESPACE)) {
+        while (peek_is(in, CSS_TOKEN_WHITESPACE)) {
             had_whitespace = true;
-            pos++;
+            advance(in);
         }
 
-        if (pos >= end) break;
+        if (at_selector_end(in, end)) break;
 
         /* Check for explicit combinator: >, +, ~ */
-        css_combinator comb = COMB_DESCENDANT;
-        bool explicit_comb = false;
-
-        if (cv_is_delim(values[pos], '>')) {
+        css_combinator comb;
+        if (peek_is_delim(in, '>')) {
             comb = COMB_CHILD;
-            explicit_comb = true;
-            pos++;
-        } else if (cv_is_delim(values[pos], '+')) {
+        } else if (peek_is_delim(in, '+')) {
             comb = COMB_NEXT_SIBLING;
-            explicit_comb = true;
-            pos++;
-        } else if (cv_is_delim(values[pos], '~')) {
+        } else if (peek_is_delim(in, '~')) {
             comb = COMB_SUBSEQUENT_SIBLING;
-            explicit_comb = true;
-            pos++;
         } else if (had_whitespace) {
             comb = COMB_DESCENDANT;
         } else {
-            /* No whitespace, no combinator — should not happen in valid CSS */
-            break;
+            /* No whitespace, no combinator: not part of a selector */
+            css_complex_selector_free(cx);
+            return NULL;
         }
-
-        /* Skip whitespace after explicit combinator */
-        if (explicit_comb) {
-            while (pos < end && cv_is(values[pos], CSS_TOKEN_WHITESPACE))
-                pos++;
+        if (comb != COMB_DESCENDANT) {
+            advance(in);
+            skip_whitespace(in);
         }
 
-        if (pos >= end) break;
-
-        /* Parse next compound selector */
-        css_compound_selector *next = parse_compound_selector(values, end, &pos);
+        /* Parse next compound selector; a combinator needs one, and
+         * nothing may follow a pseudo-element's compound */
+        css_compound_selector *next = pseudo_element
+            ? NULL : parse_compound_selector(in, &pseudo_element);
         if (!next) {
             css_complex_selector_free(cx);
             return NULL;
@@ -597,82 +1058,319 @@ static css_complex_selector *parse_complex_selector(
  * Selector list parsing (Task 5)
  * ================================================================ */
 
-css_selector_list *css_parse_selector_list(css_component_value **values,
-                                           size_t count)
+static bool has_pseudo_element(const css_complex_selector *cx)
 {
-    if (!values || count == 0) return NULL;
+    for (size_t i = 0; i < cx->count; i++) {
+        const css_compound_selector *comp = cx->compounds[i];
+        for (size_t j = 0; j < comp->count; j++) {
+            if (comp->selectors[j]->type == SEL_PSEUDO_ELEMENT) return true;
+        }
+    }
+    return false;
+}
 
+/* Comma-separated complex selectors up to end (not consumed).  nested:
+ * the argument of a functional pseudo-class, where pseudo-elements are
+ * invalid.  forgiving: drop invalid and empty selectors instead of
+ * failing, and return an empty list rather than NULL.  Reads up to end
+ * even when the list is invalid. */
+static css_selector_list *parse_selector_list(css_token_stream *in,
+                                              css_token_type end,
+                                              bool nested, bool forgiving)
+{
     css_selector_list *list = css_selector_list_create();
-    if (!list) return NULL;
+    bool failed = !list;
+
+    for (bool first = true;; first = false) {
+        if (!first) advance(in);    /* the ',' */
+        skip_whitespace(in);
+
+        css_complex_selector *cx = NULL;
+        if (!failed && !at_selector_end(in, end)) {
+            cx = parse_complex_selector(in, end);
+            if (cx && nested && has_pseudo_element(cx)) {
+                css_complex_selector_free(cx);
+                cx = NULL;
+            }
+        }
+        if (cx) {
+            css_selector_list_append(list, cx);
+        } else if (!forgiving && !(first && at_end(in, end))) {
+            /* Any invalid or empty selector -> entire list is invalid */
+            failed = true;
+        }
 
-    /* Split by comma tokens into segments, parse each as complex selector */
-    size_t seg_start = 0;
+        /* Whatever is left of an invalid selector's segment */
+        while (!at_selector_end(in, end)) skip_value(in);
+        if (at_end(in, end)) break;
+    }
 
-    for (size_t i = 0; i <= count; i++) {
-        bool is_comma = (i < count && cv_is(values[i], CSS_TOKEN_COMMA));
-        bool is_end = (i == count);
+    /* Empty list -> return NULL */
+    if (failed || (list->count == 0 && !forgiving)) {
+        css_selector_list_free(list);
+        return NULL;
+    }
+    return list;
+}
 
-        if (is_comma || is_end) {
-            size_t seg_end = i;
+css_selector_list *css_parse_selector_stream(css_token_stream *in,
+                                             css_token_type end)
+{
+    if (!in) return NULL;
+    return parse_selector_list(in, end, false, false);
+}
 
-            /* Skip empty segments (e.g. leading comma) */
-            /* But check if segment has any non-whitespace content */
-            bool has_content = false;
-            for (size_t j = seg_start; j < seg_end; j++) {
-                if (!cv_is(values[j], CSS_TOKEN_WHITESPACE)) {
-                    has_content = true;
-                    break;
-                }
-            }
+/* ================================================================
+ * Component-value input
+ *
+ * Walks a component value list depth first, handing out the tokens a
+ * tokenizer would have produced for it.  The opening and closing
+ * tokens of blocks and functions are made up on the fly.
+ * ================================================================ */
 
-            if (has_content) {
-                css_complex_selector *cx = parse_complex_selector(
-                    values, seg_start, seg_end);
-                if (!cx) {
-                    /* Any failure -> entire list is invalid */
-                    css_selector_list_free(list);
-                    return NULL;
-                }
-                css_selector_list_append(list, cx);
-            }
+typedef struct {
+    css_component_value **values;
+    size_t count;
+    size_t pos;
+    css_token_type close;       /* handed out once values run out */
+} cv_frame;
+
+#define CV_STREAM_DEPTH 8
+
+typedef struct {
+    cv_frame *frames;
+    size_t depth;
+    size_t cap;
+    bool closing;               /* the peeked token ends the top frame */
+    bool failed;                /* out of memory: reads as the end */
+    css_token made_up;          /* peeked opening or closing token */
+    cv_frame local[CV_STREAM_DEPTH];
+} cv_stream;
+
+static void cv_stream_init(cv_stream *s, css_component_value **values,
+                           size_t count)
+{
+    memset(s, 0, sizeof(*s));
+    s->frames = s->local;
+    s->cap = CV_STREAM_DEPTH;
+    s->depth = 1;
+    s->local[0].values = values;
+    s->local[0].count = count;
+    s->local[0].close = CSS_TOKEN_EOF;
+}
+
+static void cv_stream_free(cv_stream *s)
+{
+    if (s->frames != s->local) css_free(s->frames);
+}
+
+static const css_token *make_up(cv_stream *s, css_token_type type,
+                                char *value)
+{
+    memset(&s->made_up, 0, sizeof(s->made_up));
+    s->made_up.type = type;
+    s->made_up.value = value;
+    return &s->made_up;
+}
 
-            seg_start = i + 1;
+static const css_token *cv_peek(void *ctx)
+{
+    cv_stream *s = ctx;
+    s->closing = false;
+    if (s->failed) return &eof_token;
+    for (;;) {
+        cv_frame *f = &s->frames[s->depth - 1];
+        if (f->pos >= f->count) {
+            if (s->depth == 1) return &eof_token;
+            s->closing = true;
+            return make_up(s, f->close, NULL);
         }
+        css_component_value *cv = f->values[f->pos];
+        if (cv && cv->type == CSS_NODE_COMPONENT_VALUE && cv->u.token)
+            return cv->u.token;
+        if (cv && cv->type == CSS_NODE_SIMPLE_BLOCK && cv->u.block)
+            return make_up(s, cv->u.block->associated_token, NULL);
+        if (cv && cv->type == CSS_NODE_FUNCTION && cv->u.function)
+            return make_up(s, CSS_TOKEN_FUNCTION, cv->u.function->name);
+        f->pos++;   /* nothing to hand out */
     }
+}
 
-    /* Empty list -> return NULL */
-    if (list->count == 0) {
-        css_selector_list_free(list);
-        return NULL;
+static bool cv_push(cv_stream *s, css_component_value **values,
+                    size_t count, css_token_type close)
+{
+    if (s->depth == s->cap) {
+        size_t cap = s->cap * 2;
+        cv_frame *frames;
+        if (s->frames == s->local) {
+            frames = css_malloc(cap * sizeof(*frames));
+            if (frames) memcpy(frames, s->local, sizeof(s->local));
+        } else {
+            frames = css_realloc(s->frames, cap * sizeof(*frames));
+        }
+        if (!frames) return false;
+        s->frames = frames;
+        s->cap = cap;
+    }
+    cv_frame *f = &s->frames[s->depth++];
+    f->values = values;
+    f->count = count;
+    f->pos = 0;
+    f->close = close;
+    return true;
+}
+
+static void cv_next(void *ctx)
+{
+    cv_stream *s = ctx;
+    const css_token *tok = cv_peek(s);
+    if (s->closing) {
+        s->depth--;
+        return;
     }
+    if (tok->type == CSS_TOKEN_EOF) return;
+    cv_frame *f = &s->frames[s->depth - 1];
+    css_component_value *cv = f->values[f->pos++];
+    bool ok = true;
+    if (cv->type == CSS_NODE_SIMPLE_BLOCK) {
+        ok = cv_push(s, cv->u.block->values, cv->u.block->value_count,
+                     closing_token(cv->u.block->associated_token));
+    } else if (cv->type == CSS_NODE_FUNCTION) {
+        ok = cv_push(s, cv->u.function->values,
+                     cv->u.function->value_count, CSS_TOKEN_CLOSE_PAREN);
+    }
+    if (!ok) s->failed = true;
+}
+
+css_selector_list *css_parse_selector_list(css_component_value **values,
+                                           size_t count)
+{
+    if (!values || count == 0) return NULL;
+    cv_stream s;
+    cv_stream_init(&s, values, count);
+    css_token_stream in = { cv_peek, cv_next, &s };
+    css_selector_list *list = css_parse_selector_stream(&in, CSS_TOKEN_EOF);
+    cv_stream_free(&s);
+    return list;
+}
+
+/* ================================================================
+ * Source-text input
+ * ================================================================ */
+
+typedef struct {
+    css_tokenizer *tokenizer;
+    css_token *current;         /* peeked, owned */
+} text_stream;
+
+static const css_token *text_peek(void *ctx)
+{
+    text_stream *s = ctx;
+    if (!s->current) s->current = css_tokenizer_next(s->tokenizer);
+    return s->current ? s->current : &eof_token;
+}
+
+static void text_next(void *ctx)
+{
+    text_stream *s = ctx;
+    text_peek(s);
+    css_token_free(s->current);
+    s->current = NULL;
+}
+
+static css_selector_list *parse_selector_text(const char *text,
+                                              size_t length)
+{
+    text_stream s = { css_tokenizer_create(text, length), NULL };
+    if (!s.tokenizer) return NULL;
+    css_token_stream in = { text_peek, text_next, &s };
+    css_selector_list *list = css_parse_selector_stream(&in, CSS_TOKEN_EOF);
+    css_token_free(s.current);
+    css_tokenizer_free(s.tokenizer);
+    return list;
+}
+
+/* ================================================================
+ * Qualified-rule selectors (parsed on first access)
+ * ================================================================ */
 
+/* Publish list (NULL = invalid prelude) in qr's cache */
+static css_selector_list *cache_selectors(css_qualified_rule *qr,
+                                          css_selector_list *list)
+{
+    if (!list) {
+        atomic_store_explicit(&qr->selectors_invalid, true,
+                              memory_order_release);
+        return NULL;
+    }
+    css_selector_list *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(
+            &qr->selectors_cache, &expected, list,
+            memory_order_acq_rel, memory_order_acquire)) {
+        /* another thread got there first */
+        css_selector_list_free(list);
+        return expected;
+    }
     return list;
 }
 
+css_selector_list *css_qualified_rule_parse_selectors(
+    css_qualified_rule *qr, css_token_stream *in, css_token_type end)
+{
+    if (!qr) return NULL;
+    const css_allocator *prev = css_allocator_use(qr->allocator);
+    css_selector_list *list = css_parse_selector_stream(in, end);
+    css_allocator_use(prev);
+    return cache_selectors(qr, list);
+}
+
+css_selector_list *css_qualified_rule_selectors(const css_qualified_rule *qr)
+{
+    if (!qr) return NULL;
+    css_qualified_rule *rule = (css_qualified_rule *)qr;  /* cache only */
+    css_selector_list *list =
+        atomic_load_explicit(&rule->selectors_cache, memory_order_acquire);
+    if (list ||
+        atomic_load_explicit(&rule->selectors_invalid, memory_order_acquire))
+        return list;
+
+    const css_allocator *prev = css_allocator_use(qr->allocator);
+    if (qr->prelude_count > 0) {
+        list = css_parse_selector_list(qr->prelude, qr->prelude_count);
+    } else if (qr->prelude_text) {
+        list = parse_selector_text(qr->prelude_text, qr->prelude_length);
+    }
+    css_allocator_use(prev);
+    return cache_selectors(rule, list);
+}
+
 /* ================================================================
  * Specificity calculation (Task 6)
  * ================================================================ */
 
-css_specificity css_selector_specificity(css_complex_selector *sel)
+css_specificity css_selector_specificity(const css_complex_selector *sel)
 {
     css_specificity spec = {0, 0, 0};
-    if (!sel) return spec;
-    for (size_t i = 0; i < sel->count; i++) {
-        css_compound_selector *comp = sel->compounds[i];
-        if (!comp) continue;
-        for (size_t j = 0; j < comp->count; j++) {
-            css_simple_selector *ss = comp->selectors[j];
-            if (!ss) continue;
-            switch (ss->type) {
-            case SEL_ID:             spec.a++; break;
-            case SEL_CLASS:          spec.b++; break;
-            case SEL_ATTRIBUTE:      spec.b++; break;
-            case SEL_PSEUDO_CLASS:   spec.b++; break;
-            case SEL_TYPE:           spec.c++; break;
-            case SEL_PSEUDO_ELEMENT: spec.c++; break;
-            case SEL_UNIVERSAL:      break;
-            }
-        }
-    }
+    return sel ? sel->specificity : spec;
+}
+
+static uint32_t saturate(unsigned int n)
+{
+    return n > CSS_SPECIFICITY_MAX ? CSS_SPECIFICITY_MAX : n;
+}
+
+uint32_t css_specificity_pack(css_specificity spec)
+{
+    return saturate(spec.a) << (2 * CSS_SPECIFICITY_BITS) |
+           saturate(spec.b) << CSS_SPECIFICITY_BITS |
+           saturate(spec.c);
+}
+
+css_specificity css_specificity_unpack(uint32_t packed)
+{
+    css_specificity spec;
+    spec.a = (packed >> (2 * CSS_SPECIFICITY_BITS)) & CSS_SPECIFICITY_MAX;
+    spec.b = (packed >> CSS_SPECIFICITY_BITS) & CSS_SPECIFICITY_MAX;
+    spec.c = packed & CSS_SPECIFICITY_MAX;
     return spec;
 }
@@ -0,0 +1,763 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_selector_program.h"
+#include "css_hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* ================================================================
+ * Instructions
+ * ================================================================ */
+
+typedef enum {
+    OP_MATCH,             /* selector matched */
+    OP_FAIL,              /* selector never matches (pseudo-element) */
+    OP_ID,                /* arg = atom */
+    OP_CLASS,             /* arg = atom */
+    OP_TAG,               /* arg = atom, lowercase */
+    OP_ATTR,              /* arg = attribute table index */
+    OP_ROOT,
+    OP_FIRST_CHILD,
+    OP_LAST_CHILD,        /* arg = atom ("last-child") for the fallback */
+    OP_ONLY_CHILD,        /* arg = atom ("only-child") for the fallback */
+    OP_PSEUDO,            /* arg = atom, lowercase: adapter->pseudo_class */
+    OP_PARENT,            /* '>'  move to the parent */
+    OP_ANCESTOR,          /* ' '  try every ancestor */
+    OP_PREV,              /* '+'  move to the previous sibling */
+    OP_PREV_ANY,          /* '~'  try every previous sibling */
+    OP_NTH,               /* arg = nth table index */
+    OP_IS,                /* arg = list table index: some selector matches */
+    OP_NOT                /* arg = list table index: none matches */
+} opcode;
+
+typedef struct {
+    uint8_t  code;        /* opcode */
+    uint8_t  unused[3];
+    uint32_t arg;
+} op;
+
+#define NO_ATOM UINT32_MAX
+
+typedef struct {
+    uint32_t name;        /* atom */
+    uint32_t value;       /* atom (lowercase if case-insensitive),
+                             NO_ATOM for ATTR_EXISTS */
+    css_attr_matcher matcher;   /* needle points at value in the pool */
+} attr_test;
+
+#define NO_LIST UINT32_MAX
+
+typedef struct {
+    uint8_t  kind;        /* css_pseudo_class_kind */
+    uint8_t  unused[3];
+    int32_t  a, b;        /* css_nth */
+    uint32_t list;        /* S of "of S", NO_LIST if none */
+} nth_test;
+
+/* Argument of :is() / :not() / "of S": selectors starts[first ..
+ * first + count), compiled after the top-level ones */
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} list_ref;
+
+struct css_selector_program {
+    size_t size;          /* bytes of the whole allocation */
+    uint32_t selector_count;    /* top-level selectors */
+    uint32_t start_count;       /* top-level and argument selectors */
+    uint32_t op_count;
+    uint32_t attr_count;
+    uint32_t nth_count;
+    uint32_t list_count;
+    uint32_t pool_size;
+    const op *ops;
+    const uint32_t *starts;     /* first instruction of each selector */
+    const attr_test *attrs;
+    const nth_test *nths;
+    const list_ref *lists;
+    const char *pool;           /* NUL-terminated atoms */
+    const css_allocator *allocator;     /* holds the block */
+};
+
+/* ================================================================
+ * Building
+ * ================================================================ */
+
+typedef struct {
+    op *ops;
+    size_t op_count, op_cap;
+    uint32_t *starts;
+    size_t start_count, start_cap;
+    size_t selector_count;      /* top-level: starts[0 .. selector_count) */
+    attr_test *attrs;
+    size_t attr_count, attr_cap;
+    nth_test *nths;
+    size_t nth_count, nth_cap;
+    list_ref *lists;
+    const css_selector_list **pending;  /* lists[i] compiles pending[i] */
+    size_t list_count, list_cap;
+    char *pool;
+    size_t pool_size, pool_cap;
+    uint32_t *atoms;            /* open addressing: pool offset + 1 */
+    size_t atom_count, atom_cap;
+    bool failed;
+} builder;
+
+static size_t atom_hash(const char *s, size_t len)
+{
+    return (size_t)css_hash_bytes(CSS_HASH_SEED, s, len);
+}
+
+static bool atoms_grow(builder *b)
+{
+    size_t cap = b->atom_cap ? b->atom_cap * 2 : 64;
+    uint32_t *atoms = css_calloc(cap, sizeof(uint32_t));
+    if (!atoms) return false;
+    for (size_t i = 0; i < b->atom_cap; i++) {
+        if (!b->atoms[i]) continue;
+        const char *s = b->pool + b->atoms[i] - 1;
+        size_t j = atom_hash(s, strlen(s)) & (cap - 1);
+        while (atoms[j]) j = (j + 1) & (cap - 1);
+        atoms[j] = b->atoms[i];
+    }
+    css_free(b->atoms);
+    b->atoms = atoms;
+    b->atom_cap = cap;
+    return true;
+}
+
+/* Intern s (lowercased if fold); returns its pool offset */
+static uint32_t intern(builder *b, const char *s, bool fold)
+{
+    if (b->failed) return 0;
+    if (!s) s = "";
+    size_t len = strlen(s);
+    if ((b->atom_count + 1) * 2 > b->atom_cap && !atoms_grow(b)) {
+        b->failed = true;
+        return 0;
+    }
+
+    char small[64];
+    char *key = len < sizeof(small) ? small : css_malloc(len + 1);
+    if (!key) {
+        b->failed = true;
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        key[i] = fold ? css_ascii_lower(s[i]) : s[i];
+    }
+    key[len] = '\0';
+
+    uint32_t result = 0;
+    size_t i = atom_hash(key, len) & (b->atom_cap - 1);
+    for (; b->atoms[i]; i = (i + 1) & (b->atom_cap - 1)) {
+        if (strcmp(b->pool + b->atoms[i] - 1, key) == 0) {
+            result = b->atoms[i] - 1;
+            goto done;
+        }
+    }
+    if (b->pool_size + len + 1 >= UINT32_MAX) {
+        b->failed = true;
+        goto done;
+    }
+    if (b->pool_size + len + 1 > b->pool_cap) {
+        size_t cap = b->pool_cap ? b->pool_cap * 2 : 256;
+        while (cap < b->pool_size + len + 1) cap *= 2;
+        char *pool = css_realloc(b->pool, cap);
+        if (!pool) {
+            b->failed = true;
+            goto done;
+        }
+        b->pool = pool;
+        b->pool_cap = cap;
+    }
+    result = (uint32_t)b->pool_size;
+    memcpy(b->pool + b->pool_size, key, len + 1);
+    b->pool_size += len + 1;
+    b->atoms[i] = result + 1;
+    b->atom_count++;
+
+done:
+    if (key != small) css_free(key);
+    return result;
+}
+
+static void emit(builder *b, opcode code, uint32_t arg)
+{
+    if (b->failed) return;
+    if (b->op_count >= UINT32_MAX) {
+        b->failed = true;
+        return;
+    }
+    if (b->op_count >= b->op_cap) {
+        size_t cap = b->op_cap ? b->op_cap * 2 : 64;
+        op *ops = css_realloc(b->ops, cap * sizeof(op));
+        if (!ops) {
+            b->failed = true;
+            return;
+        }
+        b->ops = ops;
+        b->op_cap = cap;
+    }
+    op *o = &b->ops[b->op_count++];
+    memset(o, 0, sizeof(*o));
+    o->code = (uint8_t)code;
+    o->arg = arg;
+}
+
+static uint32_t add_attr(builder *b, const css_simple_selector *sel)
+{
+    const css_attr_matcher *m = &sel->attr_matcher;
+    uint32_t name = intern(b, sel->attr_name, false);
+    uint32_t value = m->needle ? intern(b, m->needle, false) : NO_ATOM;
+    if (b->failed) return 0;
+    if (b->attr_count >= b->attr_cap) {
+        size_t cap = b->attr_cap ? b->attr_cap * 2 : 8;
+        attr_test *attrs = css_realloc(b->attrs, cap * sizeof(attr_test));
+        if (!attrs) {
+            b->failed = true;
+            return 0;
+        }
+        b->attrs = attrs;
+        b->attr_cap = cap;
+    }
+    attr_test *t = &b->attrs[b->attr_count];
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    t->value = value;
+    t->matcher = *m;
+    t->matcher.needle = NULL;
+    return (uint32_t)b->attr_count++;
+}
+
+/* Reserve a list table entry for an argument list; its selectors are
+ * compiled once the top-level ones are done */
+static uint32_t add_list(builder *b, const css_selector_list *list)
+{
+    if (b->failed) return 0;
+    if (b->list_count >= UINT32_MAX - 1) {
+        b->failed = true;
+        return 0;
+    }
+    if (b->list_count >= b->list_cap) {
+        size_t cap = b->list_cap ? b->list_cap * 2 : 8;
+        list_ref *lists = css_realloc(b->lists, cap * sizeof(list_ref));
+        if (lists) b->lists = lists;
+        const css_selector_list **pending =
+            css_realloc(b->pending, cap * sizeof(*pending));
+        if (pending) b->pending = pending;
+        if (!lists || !pending) {
+            b->failed = true;
+            return 0;
+        }
+        b->list_cap = cap;
+    }
+    memset(&b->lists[b->list_count], 0, sizeof(list_ref));
+    b->pending[b->list_count] = list;
+    return (uint32_t)b->list_count++;
+}
+
+static uint32_t add_nth(builder *b, const css_simple_selector *sel)
+{
+    uint32_t list = sel->argument ? add_list(b, sel->argument) : NO_LIST;
+    if (b->failed) return 0;
+    if (b->nth_count >= b->nth_cap) {
+        size_t cap = b->nth_cap ? b->nth_cap * 2 : 8;
+        nth_test *nths = css_realloc(b->nths, cap * sizeof(nth_test));
+        if (!nths) {
+            b->failed = true;
+            return 0;
+        }
+        b->nths = nths;
+        b->nth_cap = cap;
+    }
+    nth_test *t = &b->nths[b->nth_count];
+    memset(t, 0, sizeof(*t));
+    t->kind = (uint8_t)sel->pseudo;
+    t->a = sel->nth.a;
+    t->b = sel->nth.b;
+    t->list = list;
+    return (uint32_t)b->nth_count++;
+}
+
+static void emit_pseudo_class(builder *b, const css_simple_selector *sel)
+{
+    switch (sel->pseudo) {
+    case PSEUDO_OTHER:
+        break;
+    case PSEUDO_NOT:
+        emit(b, OP_NOT, add_list(b, sel->argument));
+        return;
+    case PSEUDO_IS:
+    case PSEUDO_WHERE:
+        emit(b, OP_IS, add_list(b, sel->argument));
+        return;
+    default:
+        emit(b, OP_NTH, add_nth(b, sel));
+        return;
+    }
+    uint32_t name = intern(b, sel->name, true);
+    const char *lower = b->failed ? "" : b->pool + name;
+    if (strcmp(lower, "root") == 0) emit(b, OP_ROOT, 0);
+    else if (strcmp(lower, "first-child") == 0) emit(b, OP_FIRST_CHILD, 0);
+    else if (strcmp(lower, "last-child") == 0) emit(b, OP_LAST_CHILD, name);
+    else if (strcmp(lower, "only-child") == 0) emit(b, OP_ONLY_CHILD, name);
+    else emit(b, OP_PSEUDO, name);
+}
+
+/* Same order as css_match_compound(): match_order when the compound was
+ * finished, else source order */
+static void emit_compound(builder *b, const css_compound_selector *comp)
+{
+    css_simple_selector *const *sels =
+        comp->match_order ? comp->match_order : comp->selectors;
+    size_t count = comp->match_order ? comp->match_count : comp->count;
+    for (size_t i = 0; i < count; i++) {
+        const css_simple_selector *sel = sels[i];
+        switch (sel->type) {
+        case SEL_ID:
+            emit(b, OP_ID, intern(b, sel->name, false));
+            break;
+        case SEL_CLASS:
+            emit(b, OP_CLASS, intern(b, sel->name, false));
+            break;
+        case SEL_TYPE:
+            emit(b, OP_TAG, intern(b, sel->name, true));
+            break;
+        case SEL_ATTRIBUTE:
+            emit(b, OP_ATTR, add_attr(b, sel));
+            break;
+        case SEL_PSEUDO_CLASS:
+            emit_pseudo_class(b, sel);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static bool never_matches(const css_complex_selector *sel)
+{
+    if (!sel || sel->count == 0) return true;
+    for (size_t i = 0; i < sel->count; i++) {
+        const css_compound_selector *comp = sel->compounds[i];
+        for (size_t j = 0; j < comp->count; j++) {
+            if (comp->selectors[j]->type == SEL_PSEUDO_ELEMENT) return true;
+        }
+    }
+    return false;
+}
+
+static const opcode combinator_ops[] = {
+    [COMB_DESCENDANT] = OP_ANCESTOR,
+    [COMB_CHILD] = OP_PARENT,
+    [COMB_NEXT_SIBLING] = OP_PREV,
+    [COMB_SUBSEQUENT_SIBLING] = OP_PREV_ANY
+};
+
+static void emit_selector(builder *b, const css_complex_selector *sel)
+{
+    if (never_matches(sel)) {
+        emit(b, OP_FAIL, 0);
+        return;
+    }
+    for (size_t i = sel->count; i-- > 0; ) {
+        emit_compound(b, sel->compounds[i]);
+        if (i > 0) emit(b, combinator_ops[sel->combinators[i - 1]], 0);
+    }
+    emit(b, OP_MATCH, 0);
+}
+
+static void add_selector(builder *b, const css_complex_selector *sel)
+{
+    if (b->failed) return;
+    if (b->start_count >= UINT32_MAX) {
+        b->failed = true;
+        return;
+    }
+    if (b->start_count >= b->start_cap) {
+        size_t cap = b->start_cap ? b->start_cap * 2 : 16;
+        uint32_t *starts = css_realloc(b->starts, cap * sizeof(uint32_t));
+        if (!starts) {
+            b->failed = true;
+            return;
+        }
+        b->starts = starts;
+        b->start_cap = cap;
+    }
+    b->starts[b->start_count++] = (uint32_t)b->op_count;
+    emit_selector(b, sel);
+}
+
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+/* Pack the builder's arrays into one allocation */
+static css_selector_program *pack(const builder *b)
+{
+    size_t ops_at = align8(sizeof(css_selector_program));
+    size_t starts_at = ops_at + b->op_count * sizeof(op);
+    size_t attrs_at = align8(starts_at + b->start_count * sizeof(uint32_t));
+    size_t nths_at = attrs_at + b->attr_count * sizeof(attr_test);
+    size_t lists_at = nths_at + b->nth_count * sizeof(nth_test);
+    size_t pool_at = lists_at + b->list_count * sizeof(list_ref);
+    size_t size = pool_at + b->pool_size;
+
+    char *block = css_malloc(size);
+    if (!block) return NULL;
+    css_selector_program *prog = (css_selector_program *)block;
+    if (b->op_count) memcpy(block + ops_at, b->ops, b->op_count * sizeof(op));
+    if (b->start_count)
+        memcpy(block + starts_at, b->starts,
+               b->start_count * sizeof(uint32_t));
+    if (b->attr_count)
+        memcpy(block + attrs_at, b->attrs, b->attr_count * sizeof(attr_test));
+    if (b->nth_count)
+        memcpy(block + nths_at, b->nths, b->nth_count * sizeof(nth_test));
+    if (b->list_count)
+        memcpy(block + lists_at, b->lists, b->list_count * sizeof(list_ref));
+    if (b->pool_size) memcpy(block + pool_at, b->pool, b->pool_size);
+    prog->size = size;
+    prog->allocator = css_allocator_current();
+    prog->selector_count = (uint32_t)b->selector_count;
+    prog->start_count = (uint32_t)b->start_count;
+    prog->op_count = (uint32_t)b->op_count;
+    prog->attr_count = (uint32_t)b->attr_count;
+    prog->nth_count = (uint32_t)b->nth_count;
+    prog->list_count = (uint32_t)b->list_count;
+    prog->pool_size = (uint32_t)b->pool_size;
+    prog->ops = (const op *)(block + ops_at);
+    prog->starts = (const uint32_t *)(block + starts_at);
+    prog->attrs = (const attr_test *)(block + attrs_at);
+    prog->nths = (const nth_test *)(block + nths_at);
+    prog->lists = (const list_ref *)(block + lists_at);
+    prog->pool = block + pool_at;
+
+    attr_test *attrs = (attr_test *)(block + attrs_at);
+    for (size_t i = 0; i < b->attr_count; i++) {
+        if (attrs[i].value != NO_ATOM)
+            attrs[i].matcher.needle = prog->pool + attrs[i].value;
+    }
+    return prog;
+}
+
+css_selector_program *css_selector_program_compile(
+    const css_complex_selector *const *selectors, size_t count)
+{
+    if (count >= UINT32_MAX) return NULL;
+    builder b;
+    memset(&b, 0, sizeof(b));
+
+    for (size_t i = 0; i < count && !b.failed; i++) {
+        add_selector(&b, selectors[i]);
+    }
+    b.selector_count = b.start_count;
+
+    /* Argument lists, breadth first: compiling one may add more */
+    for (size_t i = 0; i < b.list_count && !b.failed; i++) {
+        const css_selector_list *list = b.pending[i];
+        b.lists[i].first = (uint32_t)b.start_count;
+        b.lists[i].count = (uint32_t)list->count;
+        for (size_t j = 0; j < list->count && !b.failed; j++) {
+            add_selector(&b, list->selectors[j]);
+        }
+    }
+
+    css_selector_program *prog = b.failed ? NULL : pack(&b);
+    css_free(b.ops);
+    css_free(b.starts);
+    css_free(b.attrs);
+    css_free(b.nths);
+    css_free(b.lists);
+    css_free(b.pending);
+    css_free(b.pool);
+    css_free(b.atoms);
+    return prog;
+}
+
+css_selector_program *css_selector_program_compile_list(
+    const css_selector_list *list)
+{
+    if (!list) return css_selector_program_compile(NULL, 0);
+    return css_selector_program_compile(
+        (const css_complex_selector *const *)list->selectors, list->count);
+}
+
+void css_selector_program_free(css_selector_program *prog)
+{
+    if (!prog) return;
+    const css_allocator *prev = css_allocator_use(prog->allocator);
+    css_free(prog);
+    css_allocator_use(prev);
+}
+
+size_t css_selector_program_count(const css_selector_program *prog)
+{
+    return prog ? prog->selector_count : 0;
+}
+
+size_t css_selector_program_size(const css_selector_program *prog)
+{
+    return prog ? prog->size : 0;
+}
+
+/* ================================================================
+ * Interpreter
+ * ================================================================ */
+
+/* Type selector atoms are lowercase already: fold only the element */
+static bool tag_equal(const char *tag, const char *lower)
+{
+    for (; *lower; tag++, lower++) {
+        if (css_ascii_lower(*tag) != *lower) return false;
+    }
+    return *tag == '\0';
+}
+
+static bool pseudo_fallback(const css_element_adapter *a, const void *el,
+                            const char *name)
+{
+    return a->pseudo_class ? a->pseudo_class(a->ctx, el, name) : false;
+}
+
+static bool run(const css_selector_program *prog, uint32_t pc,
+                const css_element_adapter *a, const void *el);
+
+/* True if some selector of list matches el */
+static bool run_list(const css_selector_program *prog, uint32_t list,
+                     const css_element_adapter *a, const void *el)
+{
+    const list_ref *l = &prog->lists[list];
+    for (uint32_t i = 0; i < l->count; i++) {
+        if (run(prog, prog->starts[l->first + i], a, el)) return true;
+    }
+    return false;
+}
+
+/* As match_nth() in css_match.c */
+static bool run_nth(const css_selector_program *prog, const nth_test *t,
+                    const css_element_adapter *a, const void *el)
+{
+    css_nth nth = { t->a, t->b };
+    css_pseudo_class_kind kind = (css_pseudo_class_kind)t->kind;
+    if (t->list == NO_LIST)
+        return css_nth_matches(nth, css_nth_index(a, el, kind));
+
+    const void *(*step)(void *, const void *) =
+        kind == PSEUDO_NTH_LAST_CHILD ? a->next_sibling : a->prev_sibling;
+    if (!step || !a->parent(a->ctx, el) || !run_list(prog, t->list, a, el))
+        return false;
+    size_t index = 1;
+    for (const void *s = step(a->ctx, el); s; s = step(a->ctx, s)) {
+        if (run_list(prog, t->list, a, s)) index++;
+    }
+    return css_nth_matches(nth, index);
+}
+
+/* Run from instruction pc with el as the current element */
+static bool run(const css_selector_program *prog, uint32_t pc,
+                const css_element_adapter *a, const void *el)
+{
+    /* classes of el, fetched on first use */
+    const char *const *classes = NULL;
+    size_t class_count = 0;
+    bool have_classes = false;
+    const char *value;
+
+    for (;; pc++) {
+        const op *o = &prog->ops[pc];
+        switch ((opcode)o->code) {
+        case OP_MATCH:
+            return true;
+        case OP_FAIL:
+            return false;
+        case OP_ID:
+            value = a->id(a->ctx, el);
+            if (!value || strcmp(value, prog->pool + o->arg) != 0)
+                return false;
+            break;
+        case OP_CLASS: {
+            if (!have_classes) {
+                class_count = a->classes(a->ctx, el, &classes);
+                have_classes = true;
+            }
+            const char *name = prog->pool + o->arg;
+            size_t i = 0;
+            while (i < class_count && strcmp(classes[i], name) != 0) i++;
+            if (i == class_count) return false;
+            break;
+        }
+        case OP_TAG:
+            value = a->tag_name(a->ctx, el);
+            if (!value || !tag_equal(value, prog->pool + o->arg))
+                return false;
+            break;
+        case OP_ATTR: {
+            const attr_test *t = &prog->attrs[o->arg];
+            value = a->attribute(a->ctx, el, prog->pool + t->name);
+            if (!value || !css_attr_matcher_match(&t->matcher, value))
+                return false;
+            break;
+        }
+        case OP_ROOT:
+            if (a->parent(a->ctx, el)) return false;
+            break;
+        case OP_FIRST_CHILD:
+            if (!a->parent(a->ctx, el) || a->prev_sibling(a->ctx, el))
+                return false;
+            break;
+        case OP_LAST_CHILD:
+            if (!a->next_sibling) {
+                if (!pseudo_fallback(a, el, prog->pool + o->arg))
+                    return false;
+            } else if (!a->parent(a->ctx, el) || a->next_sibling(a->ctx, el)) {
+                return false;
+            }
+            break;
+        case OP_ONLY_CHILD:
+            if (!a->next_sibling) {
+                if (!pseudo_fallback(a, el, prog->pool + o->arg))
+                    return false;
+            } else if (!a->parent(a->ctx, el) ||
+                       a->prev_sibling(a->ctx, el) ||
+                       a->next_sibling(a->ctx, el)) {
+                return false;
+            }
+            break;
+        case OP_PSEUDO:
+            if (!pseudo_fallback(a, el, prog->pool + o->arg)) return false;
+            break;
+        case OP_NTH:
+            if (!run_nth(prog, &prog->nths[o->arg], a, el)) return false;
+            break;
+        case OP_IS:
+            if (!run_list(prog, o->arg, a, el)) return false;
+            break;
+        case OP_NOT:
+            if (run_list(prog, o->arg, a, el)) return false;
+            break;
+        case OP_PARENT:
+            el = a->parent(a->ctx, el);
+            if (!el) return false;
+            have_classes = false;
+            break;
+        case OP_PREV:
+            el = a->prev_sibling(a->ctx, el);
+            if (!el) return false;
+            have_classes = false;
+            break;
+        case OP_ANCESTOR:
+            for (el = a->parent(a->ctx, el); el; el = a->parent(a->ctx, el)) {
+                if (run(prog, pc + 1, a, el)) return true;
+            }
+            return false;
+        case OP_PREV_ANY:
+            for (el = a->prev_sibling(a->ctx, el); el;
+                 el = a->prev_sibling(a->ctx, el)) {
+                if (run(prog, pc + 1, a, el)) return true;
+            }
+            return false;
+        default:
+            return false;
+        }
+    }
+}
+
+bool css_selector_program_match(const css_selector_program *prog,
+                                size_t index,
+                                const css_element_adapter *adapter,
+                                const void *el)
+{
+    if (!prog || index >= prog->selector_count || !adapter || !el)
+        return false;
+    return run(prog, prog->starts[index], adapter, el);
+}
+
+bool css_selector_program_match_any(const css_selector_program *prog,
+                                    const css_element_adapter *adapter,
+                                    const void *el)
+{
+    if (!prog || !adapter || !el) return false;
+    for (uint32_t i = 0; i < prog->selector_count; i++) {
+        if (run(prog, prog->starts[i], adapter, el)) return true;
+    }
+    return false;
+}
+
+/* ================================================================
+ * Disassembly
+ * ================================================================ */
+
+static const char *const op_names[] = {
+    "match", "fail", "id", "class", "tag", "attr", "root", "first-child",
+    "last-child", "only-child", "pseudo", "parent", "ancestor", "prev",
+    "prev-any", "nth", "is", "not"
+};
+
+static void dump_list(const css_selector_program *prog, uint32_t list,
+                      FILE *out)
+{
+    const list_ref *l = &prog->lists[list];
+    if (l->count == 0) fprintf(out, "(none)");
+    else if (l->count == 1) fprintf(out, "selector %u", l->first);
+    else fprintf(out, "selectors %u-%u", l->first, l->first + l->count - 1);
+}
+
+void css_selector_program_dump(const css_selector_program *prog, FILE *out)
+{
+    if (!prog) return;
+    fprintf(out, "program: %u selectors, %u ops, %zu bytes\n",
+            prog->selector_count, prog->op_count, prog->size);
+    for (uint32_t s = 0; s < prog->start_count; s++) {
+        fprintf(out, "selector %u%s:\n", s,
+                s < prog->selector_count ? "" : " (argument)");
+        for (uint32_t pc = prog->starts[s]; ; pc++) {
+            const op *o = &prog->ops[pc];
+            fprintf(out, "  %04u ", pc);
+            switch ((opcode)o->code) {
+            case OP_ID: case OP_CLASS: case OP_TAG: case OP_PSEUDO:
+                fprintf(out, "%-11s \"%s\"", op_names[o->code],
+                        prog->pool + o->arg);
+                break;
+            case OP_ATTR: {
+                const attr_test *t = &prog->attrs[o->arg];
+                fprintf(out, "%-11s [%s%s", op_names[o->code],
+                        prog->pool + t->name,
+                        css_attr_match_name(t->matcher.op));
+                if (t->value != NO_ATOM)
+                    fprintf(out, "\"%s\"", prog->pool + t->value);
+                fprintf(out, "%s]", t->matcher.case_insensitive ? " i" : "");
+                break;
+            }
+            case OP_NTH: {
+                const nth_test *t = &prog->nths[o->arg];
+                static const char *const kinds[] = {
+                    "nth-child", "nth-last-child", "nth-of-type",
+                    "nth-last-of-type"
+                };
+                char nth[32];
+                css_nth_format((css_nth){ t->a, t->b }, nth, sizeof(nth));
+                fprintf(out, "%-11s %s(%s)", op_names[o->code],
+                        kinds[t->kind - PSEUDO_NTH_CHILD], nth);
+                if (t->list != NO_LIST) {
+                    fprintf(out, " of ");
+                    dump_list(prog, t->list, out);
+                }
+                break;
+            }
+            case OP_IS: case OP_NOT:
+                fprintf(out, "%-11s ", op_names[o->code]);
+                dump_list(prog, o->arg, out);
+                break;
+            default:
+                fputs(op_names[o->code], out);
+                break;
+            }
+            fputc('\n', out);
+            if (o->code == OP_MATCH || o->code == OP_FAIL) break;
+        }
+    }
+}
@@ -0,0 +1,694 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_serialize.h"
+#include "css_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* ================================================================
+ * Serializer state
+ * ================================================================ */
+
+/* Where a component value list sits; decides which whitespace MINIFY
+ * may drop */
+typedef enum {
+    CTX_SELECTOR,   /* top level of a qualified-rule prelude */
+    CTX_OTHER       /* values, at-rule preludes, nested blocks */
+} ser_context;
+
+typedef struct {
+    css_buffer *out;
+    bool minify;
+    css_token_type last_type;   /* last token written */
+    uint32_t last_delim;        /* its codepoint when a delim */
+} ser_ctx;
+
+static void indent(ser_ctx *s, int depth)
+{
+    if (s->minify) return;
+    for (int i = 0; i < depth; i++) {
+        css_buffer_append(s->out, "  ", 2);
+    }
+}
+
+/* Write structural text that never needs separating from neighbours */
+static void put_struct(ser_ctx *s, const char *text, css_token_type type)
+{
+    css_buffer_puts(s->out, text);
+    s->last_type = type;
+    s->last_delim = 0;
+}
+
+/* ================================================================
+ * Token separation (CSS Syntax §9, comment insertion table)
+ * ================================================================ */
+
+static bool is_delim(css_token_type type, uint32_t cp, uint32_t want)
+{
+    return type == CSS_TOKEN_DELIM && cp == want;
+}
+
+static bool needs_separator(css_token_type prev, uint32_t prev_cp,
+                            css_token_type next, uint32_t next_cp)
+{
+    bool identish = next == CSS_TOKEN_IDENT || next == CSS_TOKEN_FUNCTION ||
+                    next == CSS_TOKEN_URL || next == CSS_TOKEN_BAD_URL;
+    bool numeric = next == CSS_TOKEN_NUMBER ||
+                   next == CSS_TOKEN_PERCENTAGE ||
+                   next == CSS_TOKEN_DIMENSION;
+    bool minus = is_delim(next, next_cp, '-');
+
+    switch (prev) {
+    case CSS_TOKEN_IDENT:
+        return identish || minus || numeric || next == CSS_TOKEN_CDC ||
+               next == CSS_TOKEN_OPEN_PAREN;
+    case CSS_TOKEN_AT_KEYWORD:
+    case CSS_TOKEN_HASH:
+    case CSS_TOKEN_DIMENSION:
+        return identish || minus || numeric || next == CSS_TOKEN_CDC;
+    case CSS_TOKEN_NUMBER:
+        return identish || minus || numeric || next == CSS_TOKEN_CDC ||
+               is_delim(next, next_cp, '%');
+    case CSS_TOKEN_DELIM:
+        switch (prev_cp) {
+        case '#': return identish || minus || numeric;
+        case '-': return identish || minus || numeric;
+        case '@': return identish || minus;
+        case '.':
+        case '+': return numeric;
+        case '/': return is_delim(next, next_cp, '*');
+        default:  return false;
+        }
+    default:
+        return false;
+    }
+}
+
+/* Called before writing a token of the given type */
+static void begin_token(ser_ctx *s, css_token_type type, uint32_t cp)
+{
+    if (needs_separator(s->last_type, s->last_delim, type, cp)) {
+        css_buffer_append(s->out, "/**/", 4);
+    }
+    s->last_type = type;
+    s->last_delim = cp;
+}
+
+/* ================================================================
+ * Token text
+ * ================================================================ */
+
+static void put_hex_escape(ser_ctx *s, unsigned int cp)
+{
+    char buf[16];
+    int n = snprintf(buf, sizeof(buf), "\\%x ", cp);
+    css_buffer_append(s->out, buf, (size_t)n);
+}
+
+static bool is_name_byte(unsigned char c)
+{
+    return c >= 0x80 || c == '-' || c == '_' ||
+           (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z');
+}
+
+/* Serialize an identifier (CSSOM §2.1); as_ident = false serializes a
+ * name, which may start with a digit */
+static void put_name(ser_ctx *s, const char *str, bool as_ident)
+{
+    const unsigned char *p = (const unsigned char *)(str ? str : "");
+    for (size_t i = 0; p[i]; i++) {
+        unsigned char c = p[i];
+        bool digit = c >= '0' && c <= '9';
+        if (c < 0x20 || c == 0x7F) {
+            put_hex_escape(s, c);
+        } else if (as_ident && digit && (i == 0 || (i == 1 && p[0] == '-'))) {
+            put_hex_escape(s, c);
+        } else if (as_ident && i == 0 && c == '-' && !p[1]) {
+            css_buffer_append(s->out, "\\-", 2);
+        } else if (is_name_byte(c)) {
+            css_buffer_putc(s->out, (char)c);
+        } else {
+            css_buffer_putc(s->out, '\\');
+            css_buffer_putc(s->out, (char)c);
+        }
+    }
+}
+
+/* Dimension units: like an ident, but a leading "e" followed by a digit
+ * (optionally signed) would be read back as an exponent */
+static void put_unit(ser_ctx *s, const char *unit)
+{
+    const char *u = unit ? unit : "";
+    if (u[0] == 'e' || u[0] == 'E') {
+        const char *rest = u + 1;
+        if (*rest == '+' || *rest == '-') rest++;
+        if (*rest >= '0' && *rest <= '9') {
+            put_hex_escape(s, (unsigned char)u[0]);
+            put_name(s, u + 1, false);
+            return;
+        }
+    }
+    put_name(s, u, true);
+}
+
+static void put_string(ser_ctx *s, const char *str)
+{
+    const unsigned char *p = (const unsigned char *)(str ? str : "");
+    css_buffer_putc(s->out, '"');
+    for (; *p; p++) {
+        if (*p < 0x20 || *p == 0x7F) {
+            put_hex_escape(s, *p);
+        } else if (*p == '"' || *p == '\\') {
+            css_buffer_putc(s->out, '\\');
+            css_buffer_putc(s->out, (char)*p);
+        } else {
+            css_buffer_putc(s->out, (char)*p);
+        }
+    }
+    css_buffer_putc(s->out, '"');
+}
+
+static void put_url(ser_ctx *s, const char *str)
+{
+    const unsigned char *p = (const unsigned char *)(str ? str : "");
+    css_buffer_append(s->out, "url(", 4);
+    for (; *p; p++) {
+        if (*p <= 0x20 || *p == 0x7F) {
+            put_hex_escape(s, *p);
+        } else if (*p == '"' || *p == '\'' || *p == '(' || *p == ')' ||
+                   *p == '\\') {
+            css_buffer_putc(s->out, '\\');
+            css_buffer_putc(s->out, (char)*p);
+        } else {
+            css_buffer_putc(s->out, (char)*p);
+        }
+    }
+    css_buffer_putc(s->out, ')');
+}
+
+static void put_codepoint(ser_ctx *s, uint32_t cp)
+{
+    char buf[4];
+    size_t n;
+    if (cp < 0x80) {
+        buf[0] = (char)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        buf[0] = (char)(0xC0 | (cp >> 6));
+        buf[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    } else if (cp < 0x10000) {
+        buf[0] = (char)(0xE0 | (cp >> 12));
+        buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    } else {
+        buf[0] = (char)(0xF0 | (cp >> 18));
+        buf[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        buf[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[3] = (char)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    css_buffer_append(s->out, buf, n);
+}
+
+/* Shortest text that reads back as the same double, keeping a
+ * non-integer number non-integer ("1.0": the type can decide whether a
+ * declaration is valid).  MINIFY drops the leading zero ("0.5" ->
+ * ".5"). */
+static void put_number(ser_ctx *s, double value, bool integer)
+{
+    char buf[40];
+
+    if (isinf(value)) {
+        css_buffer_puts(s->out, value < 0 ? "-1e999" : "1e999");
+        return;
+    }
+    if (integer) {
+        snprintf(buf, sizeof(buf), "%.0f", value);
+    } else {
+        for (int prec = 1; prec <= 17; prec++) {
+            snprintf(buf, sizeof(buf), "%.*g", prec, value);
+            if (strtod(buf, NULL) == value) break;
+        }
+        if (!strpbrk(buf, ".e")) {
+            strcat(buf, ".0");
+        }
+    }
+
+    const char *text = buf;
+    if (s->minify) {
+        if (text[0] == '0' && text[1] == '.') {
+            text++;
+        } else if (text[0] == '-' && text[1] == '0' && text[2] == '.') {
+            buf[1] = '-';
+            text = buf + 1;
+        }
+    }
+    css_buffer_puts(s->out, text);
+}
+
+static void put_token(ser_ctx *s, css_token *tok)
+{
+    if (!tok) return;
+    begin_token(s, tok->type, tok->delim_codepoint);
+
+    bool integer = tok->number_type == CSS_NUM_INTEGER;
+    switch (tok->type) {
+    case CSS_TOKEN_IDENT:
+        put_name(s, tok->value, true);
+        break;
+    case CSS_TOKEN_FUNCTION:
+        put_name(s, tok->value, true);
+        css_buffer_putc(s->out, '(');
+        break;
+    case CSS_TOKEN_AT_KEYWORD:
+        css_buffer_putc(s->out, '@');
+        put_name(s, tok->value, true);
+        break;
+    case CSS_TOKEN_HASH:
+        css_buffer_putc(s->out, '#');
+        put_name(s, tok->value, tok->hash_type == CSS_HASH_ID);
+        break;
+    case CSS_TOKEN_STRING:
+        put_string(s, tok->value);
+        break;
+    case CSS_TOKEN_BAD_STRING:
+        /* An unterminated string reads back as bad-string */
+        css_buffer_append(s->out, "\"\n", 2);
+        s->last_type = CSS_TOKEN_WHITESPACE;
+        break;
+    case CSS_TOKEN_URL:
+        put_url(s, tok->value);
+        break;
+    case CSS_TOKEN_BAD_URL:
+        /* A quote inside an unquoted url reads back as bad-url */
+        css_buffer_puts(s->out, "url(a\"b)");
+        break;
+    case CSS_TOKEN_NUMBER:
+        put_number(s, tok->numeric_value, integer);
+        break;
+    case CSS_TOKEN_PERCENTAGE:
+        put_number(s, tok->numeric_value, integer);
+        css_buffer_putc(s->out, '%');
+        break;
+    case CSS_TOKEN_DIMENSION:
+        put_number(s, tok->numeric_value, integer);
+        put_unit(s, tok->unit);
+        break;
+    case CSS_TOKEN_DELIM:
+        if (tok->delim_codepoint == '\\') {
+            /* Only produced by an escaped newline */
+            css_buffer_append(s->out, "\\\n", 2);
+            s->last_type = CSS_TOKEN_WHITESPACE;
+        } else {
+            put_codepoint(s, tok->delim_codepoint);
+        }
+        break;
+    case CSS_TOKEN_WHITESPACE:   css_buffer_putc(s->out, ' '); break;
+    case CSS_TOKEN_CDO:          css_buffer_puts(s->out, "<!--"); break;
+    case CSS_TOKEN_CDC:          css_buffer_puts(s->out, "-->"); break;
+    case CSS_TOKEN_COLON:        css_buffer_putc(s->out, ':'); break;
+    case CSS_TOKEN_SEMICOLON:    css_buffer_putc(s->out, ';'); break;
+    case CSS_TOKEN_COMMA:        css_buffer_putc(s->out, ','); break;
+    case CSS_TOKEN_OPEN_SQUARE:  css_buffer_putc(s->out, '['); break;
+    case CSS_TOKEN_CLOSE_SQUARE: css_buffer_putc(s->out, ']'); break;
+    case CSS_TOKEN_OPEN_PAREN:   css_buffer_putc(s->out, '('); break;
+    case CSS_TOKEN_CLOSE_PAREN:  css_buffer_putc(s->out, ')'); break;
+    case CSS_TOKEN_OPEN_CURLY:   css_buffer_putc(s->out, '{'); break;
+    case CSS_TOKEN_CLOSE_CURLY:  css_buffer_putc(s->out, '}'); break;
+    default:
+        break;
+    }
+}
+
+/* ================================================================
+ * Component values
+ * ================================================================ */
+
+static void put_values(ser_ctx *s, css_component_value **values,
+                       size_t count, ser_context ctx, bool trim);
+
+static bool cv_is_ws(css_component_value *cv)
+{
+    return cv && cv->type == CSS_NODE_COMPONENT_VALUE && cv->u.token &&
+           cv->u.token->type == CSS_TOKEN_WHITESPACE;
+}
+
+static bool cv_is_type(css_component_value *cv, css_token_type type)
+{
+    return cv && cv->type == CSS_NODE_COMPONENT_VALUE && cv->u.token &&
+           cv->u.token->type == type;
+}
+
+static bool cv_is_combinator(css_component_value *cv)
+{
+    if (!cv_is_type(cv, CSS_TOKEN_DELIM)) return false;
+    uint32_t cp = cv->u.token->delim_codepoint;
+    return cp == '>' || cp == '+' || cp == '~';
+}
+
+/* MINIFY: may the whitespace between a and b go? */
+static bool ws_droppable(css_component_value *a, css_component_value *b,
+                         ser_context ctx)
+{
+    if (cv_is_type(a, CSS_TOKEN_COMMA) || cv_is_type(b, CSS_TOKEN_COMMA))
+        return true;
+    if (ctx == CTX_SELECTOR && (cv_is_combinator(a) || cv_is_combinator(b)))
+        return true;
+    return false;
+}
+
+static void put_cv(ser_ctx *s, css_component_value *cv)
+{
+    if (!cv) return;
+    switch (cv->type) {
+    case CSS_NODE_COMPONENT_VALUE:
+        put_token(s, cv->u.token);
+        break;
+    case CSS_NODE_SIMPLE_BLOCK: {
+        css_simple_block *block = cv->u.block;
+        if (!block) break;
+        const char *open = "(", *close = ")";
+        css_token_type close_type = CSS_TOKEN_CLOSE_PAREN;
+        if (block->associated_token == CSS_TOKEN_OPEN_CURLY) {
+            open = "{"; close = "}"; close_type = CSS_TOKEN_CLOSE_CURLY;
+        } else if (block->associated_token == CSS_TOKEN_OPEN_SQUARE) {
+            open = "["; close = "]"; close_type = CSS_TOKEN_CLOSE_SQUARE;
+        }
+        begin_token(s, block->associated_token, 0);
+        css_buffer_puts(s->out, open);
+        put_values(s, block->values, block->value_count, CTX_OTHER,
+                   s->minify);
+        put_struct(s, close, close_type);
+        break;
+    }
+    case CSS_NODE_FUNCTION: {
+        css_function *func = cv->u.function;
+        if (!func) break;
+        begin_token(s, CSS_TOKEN_FUNCTION, 0);
+        put_name(s, func->name, true);
+        css_buffer_putc(s->out, '(');
+        put_values(s, func->values, func->value_count, CTX_OTHER,
+                   s->minify);
+        put_struct(s, ")", CSS_TOKEN_CLOSE_PAREN);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* Write a component value list.  Whitespace runs become one space;
+ * with trim, leading and trailing whitespace is dropped. */
+static void put_values(ser_ctx *s, css_component_value **values,
+                       size_t count, ser_context ctx, bool trim)
+{
+    css_component_value *prev = NULL;   /* last non-whitespace value */
+    bool pending_ws = false;
+
+    for (size_t i = 0; i < count; i++) {
+        css_component_value *cv = values[i];
+        if (!cv) continue;
+        if (cv_is_ws(cv)) {
+            if (prev || !trim) pending_ws = true;
+            continue;
+        }
+        if (pending_ws) {
+            if (!(s->minify && (!prev || ws_droppable(prev, cv, ctx)))) {
+                put_struct(s, " ", CSS_TOKEN_WHITESPACE);
+            }
+            pending_ws = false;
+        }
+        put_cv(s, cv);
+        prev = cv;
+    }
+    if (pending_ws && !trim) {
+        put_struct(s, " ", CSS_TOKEN_WHITESPACE);
+    }
+}
+
+/* Type of the first token a component value writes */
+static css_token_type first_token_type(css_component_value *cv,
+                                       uint32_t *cp)
+{
+    *cp = 0;
+    switch (cv->type) {
+    case CSS_NODE_COMPONENT_VALUE:
+        *cp = cv->u.token->delim_codepoint;
+        return cv->u.token->type;
+    case CSS_NODE_SIMPLE_BLOCK:
+        return cv->u.block->associated_token;
+    default:
+        return CSS_TOKEN_FUNCTION;
+    }
+}
+
+static bool values_blank(css_component_value **values, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (values[i] && !cv_is_ws(values[i])) return false;
+    }
+    return true;
+}
+
+/* ================================================================
+ * Rules
+ * ================================================================ */
+
+static void put_rule_list(ser_ctx *s, css_component_value **values,
+                          size_t count, int depth);
+
+static void put_declaration(ser_ctx *s, css_declaration *decl, int depth)
+{
+    indent(s, depth);
+    begin_token(s, CSS_TOKEN_IDENT, 0);
+    put_name(s, decl->name, true);
+    put_struct(s, s->minify ? ":" : ": ", CSS_TOKEN_COLON);
+    put_values(s, decl->values, decl->value_count, CTX_OTHER, true);
+    if (decl->important) {
+        put_struct(s, s->minify ? "!important" : " !important",
+                   CSS_TOKEN_IDENT);
+    }
+}
+
+/* Body of a declaration block, between the braces */
+static void put_declaration_block(ser_ctx *s, css_simple_block *block,
+                                  int depth)
+{
+    css_declaration_list *decls = css_parse_block_declarations(block);
+    if (!decls) {
+        s->out->failed = true;
+        return;
+    }
+
+    if (decls->declaration_count == 0) {
+        /* Nothing recognisable as declarations: keep the raw contents */
+        if (!values_blank(block->values, block->value_count)) {
+            if (!s->minify) css_buffer_putc(s->out, '\n');
+            indent(s, depth + 1);
+            put_values(s, block->values, block->value_count, CTX_OTHER,
+                       true);
+            if (!s->minify) css_buffer_putc(s->out, '\n');
+            indent(s, depth);
+        }
+    } else {
+        if (!s->minify) css_buffer_putc(s->out, '\n');
+        for (size_t i = 0; i < decls->declaration_count; i++) {
+            put_declaration(s, decls->declarations[i], depth + 1);
+            /* MINIFY: the last semicolon is redundant */
+            if (!s->minify) {
+                css_buffer_append(s->out, ";\n", 2);
+            } else if (i + 1 < decls->declaration_count) {
+                css_buffer_putc(s->out, ';');
+            }
+            s->last_type = CSS_TOKEN_SEMICOLON;
+        }
+        indent(s, depth);
+    }
+    css_declaration_list_free(decls);
+}
+
+static void put_block(ser_ctx *s, css_simple_block *block, bool rule_list,
+                      int depth)
+{
+    put_struct(s, s->minify ? "{" : " {", CSS_TOKEN_OPEN_CURLY);
+    if (rule_list) {
+        if (!values_blank(block->values, block->value_count)) {
+            if (!s->minify) css_buffer_putc(s->out, '\n');
+            put_rule_list(s, block->values, block->value_count, depth + 1);
+            indent(s, depth);
+        }
+    } else {
+        put_declaration_block(s, block, depth);
+    }
+    put_struct(s, "}", CSS_TOKEN_CLOSE_CURLY);
+}
+
+static void put_at_rule(ser_ctx *s, const char *name,
+                        css_component_value **prelude, size_t prelude_count,
+                        css_simple_block *block, int depth)
+{
+    indent(s, depth);
+    begin_token(s, CSS_TOKEN_AT_KEYWORD, 0);
+    css_buffer_putc(s->out, '@');
+    put_name(s, name, true);
+    if (!values_blank(prelude, prelude_count)) {
+        /* MINIFY keeps the space only where the prelude would run into
+         * the name ("@import url(...)", not "@media(...)") */
+        size_t first = 0;
+        while (cv_is_ws(prelude[first])) first++;
+        uint32_t cp;
+        css_token_type type = first_token_type(prelude[first], &cp);
+        if (!s->minify ||
+            needs_separator(CSS_TOKEN_AT_KEYWORD, 0, type, cp)) {
+            put_struct(s, " ", CSS_TOKEN_WHITESPACE);
+        }
+        put_values(s, prelude, prelude_count, CTX_OTHER, true);
+    }
+    if (block) {
+        put_block(s, block, css_at_rule_has_rule_list(name), depth);
+    } else {
+        put_struct(s, ";", CSS_TOKEN_SEMICOLON);
+    }
+}
+
+static void put_qualified_rule(ser_ctx *s, css_component_value **prelude,
+                               size_t prelude_count, css_simple_block *block,
+                               int depth)
+{
+    indent(s, depth);
+    put_values(s, prelude, prelude_count, CTX_SELECTOR, true);
+    put_block(s, block, false, depth);
+}
+
+static void end_rule(ser_ctx *s)
+{
+    if (!s->minify) css_buffer_putc(s->out, '\n');
+}
+
+/* Rules held as raw component values (the block of @media and
+ * friends): grouped the way consume_list_of_rules would (§5.4.1) */
+static void put_rule_list(ser_ctx *s, css_component_value **values,
+                          size_t count, int depth)
+{
+    size_t i = 0;
+    while (i < count) {
+        css_component_value *cv = values[i];
+        if (!cv || cv_is_ws(cv)) {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        if (cv_is_type(cv, CSS_TOKEN_AT_KEYWORD)) {
+            /* At-rule: prelude up to ';' or a {} block */
+            size_t end = ++i;
+            css_simple_block *block = NULL;
+            while (end < count) {
+                css_component_value *v = values[end];
+                if (cv_is_type(v, CSS_TOKEN_SEMICOLON)) break;
+                if (v && v->type == CSS_NODE_SIMPLE_BLOCK && v->u.block &&
+                    v->u.block->associated_token == CSS_TOKEN_OPEN_CURLY) {
+                    block = v->u.block;
+                    break;
+                }
+                end++;
+            }
+            put_at_rule(s, cv->u.token->value, values + start + 1,
+                        end - start - 1, block, depth);
+            end_rule(s);
+            i = end + 1;
+        } else {
+            /* Qualified rule: prelude up to a {} block; dropped at the
+             * end of the list like in the parser */
+            size_t end = i;
+            while (end < count) {
+                css_component_value *v = values[end];
+                if (v && v->type == CSS_NODE_SIMPLE_BLOCK && v->u.block &&
+                    v->u.block->associated_token == CSS_TOKEN_OPEN_CURLY) {
+                    break;
+                }
+                end++;
+            }
+            if (end < count) {
+                put_qualified_rule(s, values + start, end - start,
+                                   values[end]->u.block, depth);
+                end_rule(s);
+            }
+            i = end + 1;
+        }
+    }
+}
+
+/* ================================================================
+ * Public API
+ * ================================================================ */
+
+void css_serialize_stylesheet(css_stylesheet *sheet, css_serialize_mode mode,
+                              css_buffer *out)
+{
+    if (!sheet || !out) return;
+
+    ser_ctx s;
+    memset(&s, 0, sizeof(s));
+    s.out = out;
+    s.minify = mode == CSS_SERIALIZE_MINIFY;
+    s.last_type = CSS_TOKEN_WHITESPACE;
+
+    bool first = true;
+    for (size_t i = 0; i < sheet->rule_count; i++) {
+        css_rule *rule = sheet->rules[i];
+        if (!rule) continue;
+
+        if (rule->type == CSS_NODE_AT_RULE && rule->u.at_rule) {
+            css_at_rule *ar = rule->u.at_rule;
+            if (!first && !s.minify) css_buffer_putc(out, '\n');
+            put_at_rule(&s, ar->name, ar->prelude, ar->prelude_count,
+                        ar->block, 0);
+        } else if (rule->type == CSS_NODE_QUALIFIED_RULE &&
+                   rule->u.qualified_rule &&
+                   rule->u.qualified_rule->block) {
+            css_qualified_rule *qr = rule->u.qualified_rule;
+            if (!first && !s.minify) css_buffer_putc(out, '\n');
+            size_t count;
+            css_component_value **prelude =
+                css_qualified_rule_prelude(qr, &count);
+            put_qualified_rule(&s, prelude, count, qr->block, 0);
+            css_qualified_rule_prelude_release(qr, prelude, count);
+        } else {
+            continue;
+        }
+        end_rule(&s);
+        first = false;
+    }
+}
+
+char *css_serialize_to_string(css_stylesheet *sheet, css_serialize_mode mode,
+                              size_t *length)
+{
+    css_buffer b;
+    css_buffer_init(&b);
+    css_serialize_stylesheet(sheet, mode, &b);
+    css_buffer_putc(&b, '\0');
+    if (b.failed) {
+        css_buffer_free(&b);
+        return NULL;
+    }
+    if (length) *length = b.length - 1;
+    return b.data;
+}
+
+bool css_serialize_to_fd(css_stylesheet *sheet, css_serialize_mode mode,
+                         int fd)
+{
+    css_buffer b;
+    css_buffer_init_fd(&b, fd);
+    css_serialize_stylesheet(sheet, mode, &b);
+    bool ok = css_buffer_flush(&b);
+    css_buffer_free(&b);
+    return ok;
+}
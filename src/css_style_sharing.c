@@ -0,0 +1,551 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_style_sharing.h"
+#include "css_alloc.h"
+#include "css_hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* ================================================================
+ * Internal structs
+ * ================================================================ */
+
+/* Names borrowed from the stylesheet, distinct */
+typedef struct {
+    const char **names;
+    size_t count;
+    size_t cap;
+} name_list;
+
+/* One cached element */
+typedef struct {
+    uint64_t signature;
+    const void *parent;
+    char *tag;
+    char **classes;             /* distinct, sorted */
+    size_t class_count;
+    char **attrs;               /* value per cache->attrs name, NULL =
+                                   absent */
+    uint64_t *pseudo_bits;      /* result per cache->pseudos name */
+    uint64_t *revalidate_bits;  /* result per cache->revalidate entry */
+    const css_rule_entry **matches;
+    size_t match_count;
+} share_entry;
+
+struct css_style_sharing_cache {
+    const css_rule_index *index;
+    name_list attrs;            /* named in subject compounds */
+    name_list pseudos;          /* state pseudo-classes, likewise */
+    size_t *revalidate;         /* index entries to match again */
+    size_t revalidate_count;
+    size_t revalidate_cap;
+    size_t pseudo_words;
+    size_t revalidate_words;
+    bool failed;                /* allocation failure while building */
+
+    share_entry entries[CSS_STYLE_SHARING_ENTRIES];  /* most recent first */
+    size_t count;
+
+    /* Results for the element being looked up */
+    uint64_t *pseudo_scratch;
+    uint64_t *revalidate_scratch;
+
+    size_t hits;
+    size_t misses;
+    const css_allocator *allocator;     /* current at create */
+};
+
+/* What a lookup learnt about its element, reused when inserting it */
+typedef struct {
+    const void *parent;
+    uint64_t signature;
+    bool revalidated;           /* revalidate_scratch is filled */
+} probe;
+
+/* ================================================================
+ * Signature hashing
+ * ================================================================ */
+
+static uint64_t combine(uint64_t h, uint64_t v)
+{
+    return h ^ (v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2));
+}
+
+static size_t words_for(size_t bits)
+{
+    return (bits + 63) / 64;
+}
+
+/* ================================================================
+ * Building: which features decide a match
+ * ================================================================ */
+
+static void names_add(css_style_sharing_cache *cache, name_list *list,
+                      const char *name)
+{
+    if (!name) return;
+    for (size_t i = 0; i < list->count; i++) {
+        if (strcmp(list->names[i], name) == 0) return;
+    }
+    if (list->count >= list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 8;
+        const char **names = css_realloc(list->names, cap * sizeof(*names));
+        if (!names) {
+            cache->failed = true;
+            return;
+        }
+        list->names = names;
+        list->cap = cap;
+    }
+    list->names[list->count++] = name;
+}
+
+static void revalidate_add(css_style_sharing_cache *cache, size_t entry)
+{
+    if (cache->revalidate_count >= cache->revalidate_cap) {
+        size_t cap = cache->revalidate_cap ? cache->revalidate_cap * 2 : 8;
+        size_t *r = css_realloc(cache->revalidate, cap * sizeof(*r));
+        if (!r) {
+            cache->failed = true;
+            return;
+        }
+        cache->revalidate = r;
+        cache->revalidate_cap = cap;
+    }
+    cache->revalidate[cache->revalidate_count++] = entry;
+}
+
+/* Pseudo-classes by name that depend on the siblings, not the parent */
+static bool is_positional(const char *name)
+{
+    return css_ascii_casecmp(name, "first-child") == 0 ||
+           css_ascii_casecmp(name, "last-child") == 0 ||
+           css_ascii_casecmp(name, "only-child") == 0;
+}
+
+static bool scan_subject(css_style_sharing_cache *cache,
+                         const css_complex_selector *sel);
+
+/* Collect comp's attribute and state pseudo-class names; true if its
+ * result can differ between siblings that agree on them */
+static bool scan_compound(css_style_sharing_cache *cache,
+                          const css_compound_selector *comp)
+{
+    bool revalidate = false;
+    for (size_t i = 0; i < comp->count; i++) {
+        const css_simple_selector *s = comp->selectors[i];
+        if (s->type == SEL_ATTRIBUTE) {
+            names_add(cache, &cache->attrs, s->attr_name);
+        } else if (s->type == SEL_PSEUDO_CLASS) {
+            switch (s->pseudo) {
+            case PSEUDO_OTHER:
+                if (is_positional(s->name)) revalidate = true;
+                else names_add(cache, &cache->pseudos, s->name);
+                break;
+            case PSEUDO_NOT:
+            case PSEUDO_IS:
+            case PSEUDO_WHERE:
+                for (size_t j = 0; s->argument && j < s->argument->count;
+                     j++) {
+                    if (scan_subject(cache, s->argument->selectors[j]))
+                        revalidate = true;
+                }
+                break;
+            default:                /* :nth-*() */
+                revalidate = true;
+                break;
+            }
+        }
+    }
+    return revalidate;
+}
+
+/* Only the subject compound is scanned: compounds reached through
+ * descendant and child combinators test the ancestors, which sharing
+ * elements have in common.  A sibling combinator before the subject
+ * makes the selector positional. */
+static bool scan_subject(css_style_sharing_cache *cache,
+                         const css_complex_selector *sel)
+{
+    if (sel->count == 0) return false;
+    bool revalidate = false;
+    if (sel->count > 1) {
+        css_combinator comb = sel->combinators[sel->count - 2];
+        revalidate = comb == COMB_NEXT_SIBLING ||
+                     comb == COMB_SUBSEQUENT_SIBLING;
+    }
+    if (scan_compound(cache, sel->compounds[sel->count - 1]))
+        revalidate = true;
+    return revalidate;
+}
+
+css_style_sharing_cache *css_style_sharing_cache_create(
+    const css_rule_index *index)
+{
+    css_style_sharing_cache *cache =
+        css_calloc(1, sizeof(css_style_sharing_cache));
+    if (!cache) return NULL;
+    cache->index = index;
+    cache->allocator = css_allocator_current();
+
+    size_t count = css_rule_index_size(index);
+    for (size_t i = 0; i < count; i++) {
+        const css_rule_entry *e = css_rule_index_entry(index, i);
+        if (scan_subject(cache, e->selector)) revalidate_add(cache, i);
+    }
+
+    cache->pseudo_words = words_for(cache->pseudos.count);
+    cache->revalidate_words = words_for(cache->revalidate_count);
+    cache->pseudo_scratch =
+        css_calloc(cache->pseudo_words ? cache->pseudo_words : 1,
+               sizeof(uint64_t));
+    cache->revalidate_scratch =
+        css_calloc(cache->revalidate_words ? cache->revalidate_words : 1,
+               sizeof(uint64_t));
+    if (cache->failed || !cache->pseudo_scratch ||
+        !cache->revalidate_scratch) {
+        css_style_sharing_cache_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/* ================================================================
+ * Entries
+ * ================================================================ */
+
+static void entry_clear(share_entry *e, size_t attr_count)
+{
+    css_free(e->tag);
+    for (size_t i = 0; i < e->class_count; i++) css_free(e->classes[i]);
+    css_free(e->classes);
+    if (e->attrs) {
+        for (size_t i = 0; i < attr_count; i++) css_free(e->attrs[i]);
+        css_free(e->attrs);
+    }
+    css_free(e->pseudo_bits);
+    css_free(e->revalidate_bits);
+    css_free(e->matches);
+    memset(e, 0, sizeof(*e));
+}
+
+void css_style_sharing_cache_clear(css_style_sharing_cache *cache)
+{
+    if (!cache) return;
+    const css_allocator *prev = css_allocator_use(cache->allocator);
+    for (size_t i = 0; i < cache->count; i++) {
+        entry_clear(&cache->entries[i], cache->attrs.count);
+    }
+    cache->count = 0;
+    css_allocator_use(prev);
+}
+
+void css_style_sharing_cache_free(css_style_sharing_cache *cache)
+{
+    if (!cache) return;
+    css_style_sharing_cache_clear(cache);
+    const css_allocator *prev = css_allocator_use(cache->allocator);
+    css_free(cache->attrs.names);
+    css_free(cache->pseudos.names);
+    css_free(cache->revalidate);
+    css_free(cache->pseudo_scratch);
+    css_free(cache->revalidate_scratch);
+    css_free(cache);
+    css_allocator_use(prev);
+}
+
+/* ================================================================
+ * Signatures and equivalence
+ * ================================================================ */
+
+static bool repeated_class(const char *const *classes, size_t i)
+{
+    for (size_t j = 0; j < i; j++) {
+        if (strcmp(classes[i], classes[j]) == 0) return true;
+    }
+    return false;
+}
+
+/* Hash everything but the revalidation selectors, filling
+ * pseudo_scratch on the way */
+static void compute_signature(css_style_sharing_cache *cache,
+                              const css_element_adapter *a,
+                              const void *el, probe *p)
+{
+    p->parent = a->parent(a->ctx, el);
+    p->revalidated = false;
+    uint64_t h = combine(0, (uint64_t)(uintptr_t)p->parent);
+
+    const char *tag = a->tag_name(a->ctx, el);
+    h = combine(h, tag ? css_hash_name(CSS_HASH_SEED, tag, true) : 0);
+
+    /* order-independent over the distinct classes */
+    const char *const *classes = NULL;
+    size_t class_count = a->classes(a->ctx, el, &classes);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < class_count; i++) {
+        if (!repeated_class(classes, i))
+            sum += css_hash_name(CSS_HASH_SEED, classes[i], false);
+    }
+    h = combine(h, sum);
+
+    for (size_t i = 0; i < cache->attrs.count; i++) {
+        const char *v = a->attribute(a->ctx, el, cache->attrs.names[i]);
+        h = combine(h, v ? css_hash_name(CSS_HASH_SEED, v, false) : 0);
+    }
+
+    memset(cache->pseudo_scratch, 0,
+           cache->pseudo_words * sizeof(uint64_t));
+    for (size_t i = 0; a->pseudo_class && i < cache->pseudos.count; i++) {
+        if (a->pseudo_class(a->ctx, el, cache->pseudos.names[i]))
+            cache->pseudo_scratch[i / 64] |= 1ull << (i % 64);
+    }
+    for (size_t i = 0; i < cache->pseudo_words; i++) {
+        h = combine(h, cache->pseudo_scratch[i]);
+    }
+    p->signature = h;
+}
+
+static void compute_revalidation(css_style_sharing_cache *cache,
+                                 const css_element_adapter *a,
+                                 const void *el, probe *p)
+{
+    if (p->revalidated) return;
+    memset(cache->revalidate_scratch, 0,
+           cache->revalidate_words * sizeof(uint64_t));
+    for (size_t i = 0; i < cache->revalidate_count; i++) {
+        if (css_rule_index_entry_matches(cache->index, cache->revalidate[i],
+                                         a, el))
+            cache->revalidate_scratch[i / 64] |= 1ull << (i % 64);
+    }
+    p->revalidated = true;
+}
+
+static int compare_names(const void *pa, const void *pb)
+{
+    return strcmp(*(const char *const *)pa, *(const char *const *)pb);
+}
+
+static bool same_classes(const css_element_adapter *a, const void *el,
+                         const share_entry *e)
+{
+    const char *const *classes = NULL;
+    size_t class_count = a->classes(a->ctx, el, &classes);
+    size_t distinct = 0;
+    for (size_t i = 0; i < class_count; i++) {
+        if (repeated_class(classes, i)) continue;
+        if (!bsearch(&classes[i], e->classes, e->class_count,
+                     sizeof(*e->classes), compare_names))
+            return false;
+        distinct++;
+    }
+    return distinct == e->class_count;
+}
+
+/* Exact comparison after the signatures agreed */
+static bool equivalent(css_style_sharing_cache *cache,
+                       const css_element_adapter *a, const void *el,
+                       probe *p, const share_entry *e)
+{
+    if (e->signature != p->signature || e->parent != p->parent)
+        return false;
+    const char *tag = a->tag_name(a->ctx, el);
+    if (!tag || css_ascii_casecmp(tag, e->tag) != 0) return false;
+    if (!same_classes(a, el, e)) return false;
+    for (size_t i = 0; i < cache->attrs.count; i++) {
+        const char *v = a->attribute(a->ctx, el, cache->attrs.names[i]);
+        if (!v != !e->attrs[i]) return false;
+        if (v && strcmp(v, e->attrs[i]) != 0) return false;
+    }
+    if (cache->pseudo_words &&
+        memcmp(cache->pseudo_scratch, e->pseudo_bits,
+               cache->pseudo_words * sizeof(uint64_t)) != 0)
+        return false;
+    if (cache->revalidate_count) {
+        compute_revalidation(cache, a, el, p);
+        if (memcmp(cache->revalidate_scratch, e->revalidate_bits,
+                   cache->revalidate_words * sizeof(uint64_t)) != 0)
+            return false;
+    }
+    return true;
+}
+
+/* ================================================================
+ * Lookup and insertion
+ * ================================================================ */
+
+static bool copy_matches(const share_entry *e, css_rule_matches *out)
+{
+    if (!css_rule_matches_reserve(out, e->match_count)) return false;
+    if (e->match_count) {
+        memcpy(out->entries, e->matches,
+               e->match_count * sizeof(*out->entries));
+    }
+    out->count = e->match_count;
+    return true;
+}
+
+static bool probe_cache(css_style_sharing_cache *cache,
+                        const css_element_adapter *a, const void *el,
+                        probe *p, css_rule_matches *out)
+{
+    for (size_t i = 0; i < cache->count; i++) {
+        if (!equivalent(cache, a, el, p, &cache->entries[i])) continue;
+        if (!copy_matches(&cache->entries[i], out)) break;
+        if (i > 0) {
+            share_entry hit = cache->entries[i];
+            memmove(&cache->entries[1], &cache->entries[0],
+                    i * sizeof(share_entry));
+            cache->entries[0] = hit;
+        }
+        cache->hits++;
+        return true;
+    }
+    cache->misses++;
+    return false;
+}
+
+static char *copy_string(const char *s)
+{
+    return s ? css_strdup(s) : NULL;
+}
+
+/* Copy el's features and matches into a new most-recent entry */
+static void store(css_style_sharing_cache *cache,
+                  const css_element_adapter *a, const void *el, probe *p,
+                  const css_rule_matches *matches)
+{
+    share_entry e;
+    memset(&e, 0, sizeof(e));
+    e.signature = p->signature;
+    e.parent = p->parent;
+
+    bool ok = (e.tag = copy_string(a->tag_name(a->ctx, el))) != NULL;
+
+    const char *const *classes = NULL;
+    size_t class_count = ok ? a->classes(a->ctx, el, &classes) : 0;
+    if (class_count) {
+        e.classes = css_malloc(class_count * sizeof(*e.classes));
+        ok = e.classes != NULL;
+        for (size_t i = 0; ok && i < class_count; i++) {
+            if (repeated_class(classes, i)) continue;
+            ok = (e.classes[e.class_count] = css_strdup(classes[i])) != NULL;
+            if (ok) e.class_count++;
+        }
+        if (ok) {
+            qsort(e.classes, e.class_count, sizeof(*e.classes),
+                  compare_names);
+        }
+    }
+
+    if (ok && cache->attrs.count) {
+        e.attrs = css_calloc(cache->attrs.count, sizeof(*e.attrs));
+        ok = e.attrs != NULL;
+        for (size_t i = 0; ok && i < cache->attrs.count; i++) {
+            const char *v = a->attribute(a->ctx, el, cache->attrs.names[i]);
+            ok = !v || (e.attrs[i] = css_strdup(v)) != NULL;
+        }
+    }
+
+    if (ok && cache->pseudo_words) {
+        e.pseudo_bits = css_malloc(cache->pseudo_words * sizeof(uint64_t));
+        ok = e.pseudo_bits != NULL;
+        if (ok) {
+            memcpy(e.pseudo_bits, cache->pseudo_scratch,
+                   cache->pseudo_words * sizeof(uint64_t));
+        }
+    }
+
+    if (ok && cache->revalidate_words) {
+        compute_revalidation(cache, a, el, p);
+        e.revalidate_bits =
+            css_malloc(cache->revalidate_words * sizeof(uint64_t));
+        ok = e.revalidate_bits != NULL;
+        if (ok) {
+            memcpy(e.revalidate_bits, cache->revalidate_scratch,
+                   cache->revalidate_words * sizeof(uint64_t));
+        }
+    }
+
+    if (ok && matches->count) {
+        e.matches = css_malloc(matches->count * sizeof(*e.matches));
+        ok = e.matches != NULL;
+        if (ok) {
+            memcpy(e.matches, matches->entries,
+                   matches->count * sizeof(*e.matches));
+            e.match_count = matches->count;
+        }
+    }
+
+    if (!ok) {
+        entry_clear(&e, cache->attrs.count);
+        return;
+    }
+    if (cache->count == CSS_STYLE_SHARING_ENTRIES) {
+        entry_clear(&cache->entries[--cache->count], cache->attrs.count);
+    }
+    memmove(&cache->entries[1], &cache->entries[0],
+            cache->count * sizeof(share_entry));
+    cache->entries[0] = e;
+    cache->count++;
+}
+
+bool css_style_sharing_lookup(css_style_sharing_cache *cache,
+                              const css_element_adapter *adapter,
+                              const void *el, css_rule_matches *out)
+{
+    if (!cache || !adapter || !el || !out) return false;
+    if (cache->count == 0 || adapter->id(adapter->ctx, el)) {
+        cache->misses++;
+        return false;
+    }
+    probe p;
+    compute_signature(cache, adapter, el, &p);
+    return probe_cache(cache, adapter, el, &p, out);
+}
+
+void css_style_sharing_insert(css_style_sharing_cache *cache,
+                              const css_element_adapter *adapter,
+                              const void *el,
+                              const css_rule_matches *matches)
+{
+    if (!cache || !adapter || !el || !matches) return;
+    if (adapter->id(adapter->ctx, el)) return;
+    probe p;
+    compute_signature(cache, adapter, el, &p);
+    store(cache, adapter, el, &p, matches);
+}
+
+size_t css_style_sharing_match(css_style_sharing_cache *cache,
+                               const css_element_adapter *adapter,
+                               const void *el,
+                               const css_bloom_filter *ancestors,
+                               css_rule_matches *out)
+{
+    if (!cache || !adapter || !el || !out) {
+        return css_rule_index_match_filtered(cache ? cache->index : NULL,
+                                             adapter, el, ancestors, out);
+    }
+    if (adapter->id(adapter->ctx, el)) {
+        cache->misses++;
+        return css_rule_index_match_filtered(cache->index, adapter, el,
+                                             ancestors, out);
+    }
+    probe p;
+    compute_signature(cache, adapter, el, &p);
+    if (cache->count && probe_cache(cache, adapter, el, &p, out))
+        return out->count;
+    if (!cache->count) cache->misses++;
+    css_rule_index_match_filtered(cache->index, adapter, el, ancestors,
+                                  out);
+    store(cache, adapter, el, &p, out);
+    return out->count;
+}
+
+void css_style_sharing_stats(const css_style_sharing_cache *cache,
+                             size_t *hits, size_t *misses)
+{
+    if (hits) *hits = cache ? cache->hits : 0;
+    if (misses) *misses = cache ? cache->misses : 0;
+}
@@ -1,9 +1,10 @@
 #include "css_token.h"
+#include "css_alloc.h"
 #include <stdlib.h>
 #include <string.h>
 
 css_token *css_token_create(css_token_type type) {
-    css_token *t = calloc(1, sizeof(css_token));
+    css_token *t = css_calloc(1, sizeof(css_token));
     if (!t) return NULL;
     t->type = type;
     return t;
@@ -11,9 +12,9 @@ css_token *css_token_create(css_token_type type) {
 
 void css_token_free(css_token *token) {
     if (!token) return;
-    free(token->value);
-    free(token->unit);
-    free(token);
+    css_free(token->value);
+    css_free(token->unit);
+    css_free(token);
 }
 
 const char *css_token_type_name(css_token_type type) {
@@ -217,14 +217,16 @@ static void consume_codepoint(css_tokenizer *t)
  *  - FF (0x0C)         -> LF (0x0A)
  *  - NULL (0x00)       -> U+FFFD (0xEF 0xBF 0xBD in UTF-8)
  *
- * Returns a malloc'd buffer; sets *out_len to the length.
+ * buf must hold preprocess_size(length) bytes.  Returns the output length.
  */
-static char *preprocess(const char *input, size_t length, size_t *out_len)
+static size_t preprocess_size(size_t length)
 {
     /* Worst case: every byte is NULL -> 3 bytes each */
-    char *buf = malloc(length * 3 + 1);
-    if (!buf) return NULL;
+    return length * 3 + 1;
+}
 
+static size_t preprocess(const char *input, size_t length, char *buf)
+{
     size_t j = 0;
     for (size_t i = 0; i < length; i++) {
         unsigned char c = (unsigned char)input[i];
@@ -248,14 +250,14 @@ static char *preprocess(const char *input, size_t length, size_t *out_len)
         }
     }
     buf[j] = '\0';
-    *out_len = j;
-    return buf;
+    return j;
 }
 
 /* ---------- Parse error helper ---------- */
 
 static void css_parse_error(css_tokenizer *t, const char *msg)
 {
+    t->error_count++;
     if (getenv("CSSPARSER_PARSE_ERRORS")) {
         fprintf(stderr, "CSS parse error at %zu:%zu: %s\n",
                 t->line, t->column, msg);
@@ -444,7 +446,7 @@ static char *consume_ident_sequence(css_tokenizer *t)
         }
     }
     buf[len] = '\0';
-    return strdup(buf);
+    return css_strdup(buf);
 }
 
 /* §4.3.14: Consume the remnants of a bad url */
@@ -488,7 +490,7 @@ static css_token *consume_string_token(css_tokenizer *t, uint32_t ending)
             /* Don't consume the newline */
             css_token *tok = css_token_create(CSS_TOKEN_BAD_STRING);
             buf[len] = '\0';
-            tok->value = strdup(buf);
+            tok->value = css_strdup(buf);
             tok->line = tok_line;
             tok->column = tok_col;
             return tok;
@@ -521,7 +523,7 @@ static css_token *consume_string_token(css_tokenizer *t, uint32_t ending)
 
     buf[len] = '\0';
     css_token *tok = css_token_create(CSS_TOKEN_STRING);
-    tok->value = strdup(buf);
+    tok->value = css_strdup(buf);
     tok->line = tok_line;
     tok->column = tok_col;
     return tok;
@@ -597,7 +599,7 @@ static css_token *consume_url_token(css_tokenizer *t, size_t tok_line, size_t to
 
     buf[len] = '\0';
     css_token *tok = css_token_create(CSS_TOKEN_URL);
-    tok->value = strdup(buf);
+    tok->value = css_strdup(buf);
     tok->line = tok_line;
     tok->column = tok_col;
     return tok;
@@ -625,7 +627,7 @@ static css_token *consume_ident_like_token(css_tokenizer *t)
             return tok;
         }
         /* Unquoted URL */
-        free(name);
+        css_free(name);
         return consume_url_token(t, tok_line, tok_col);
     }
 
@@ -702,26 +704,51 @@ static css_token *make_token(css_token_type type, size_t line, size_t col)
 
 css_tokenizer *css_tokenizer_create(const char *input, size_t length)
 {
-    css_tokenizer *t = calloc(1, sizeof(css_tokenizer));
+    css_tokenizer *t = css_calloc(1, sizeof(css_tokenizer));
     if (!t) return NULL;
+    t->allocator = css_allocator_current();
 
-    size_t pp_len = 0;
-    t->input = preprocess(input, length, &pp_len);
-    if (!t->input) {
-        free(t);
+    if (!css_tokenizer_reset(t, input, length)) {
+        css_free(t);
         return NULL;
     }
-    t->length = pp_len;
+    return t;
+}
 
-    t->pos       = 0;
-    t->line      = 1;
-    t->column    = 1;
-    t->reconsume = false;
+/*
+ * Restart tokenization on new input, reusing the preprocess buffer when
+ * it is large enough.  Returns false if the buffer could not be grown
+ * (the tokenizer is then left empty but still valid to free).
+ */
+bool css_tokenizer_reset(css_tokenizer *t, const char *input, size_t length)
+{
+    size_t needed = preprocess_size(length);
+    if (needed > t->input_cap) {
+        const css_allocator *prev = css_allocator_use(t->allocator);
+        char *buf = css_realloc(t->input, needed);
+        css_allocator_use(prev);
+        if (!buf) {
+            t->length = 0;
+            t->pos = 0;
+            fill_lookahead(t);
+            return false;
+        }
+        t->input = buf;
+        t->input_cap = needed;
+    }
+    t->length = preprocess(input, length, t->input);
+
+    t->pos         = 0;
+    t->token_start = 0;
+    t->line        = 1;
+    t->column      = 1;
+    t->reconsume   = false;
+    t->error_count = 0;
 
     /* Fill the 4-slot lookahead pipeline */
     fill_lookahead(t);
 
-    return t;
+    return true;
 }
 
 css_token *css_tokenizer_next(css_tokenizer *t)
@@ -729,6 +756,7 @@ css_token *css_tokenizer_next(css_tokenizer *t)
     /* Consume comments first (CSS Syntax §4.3.2) */
     consume_comments(t);
 
+    t->token_start = t->pos;
     uint32_t c = t->current;
     size_t tok_line = t->line;
     size_t tok_col  = t->column;
@@ -879,6 +907,8 @@ css_token *css_tokenizer_next(css_tokenizer *t)
 void css_tokenizer_free(css_tokenizer *t)
 {
     if (!t) return;
-    free(t->input);
-    free(t);
+    const css_allocator *prev = css_allocator_use(t->allocator);
+    css_free(t->input);
+    css_free(t);
+    css_allocator_use(prev);
 }
@@ -0,0 +1,1584 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "css_parser.h"
+#include "css_selector.h"
+#include "css_match.h"
+#include "css_rule_index.h"
+#include "css_bloom.h"
+#include "css_selector_program.h"
+#include "css_invalidation.h"
+#include "css_style_sharing.h"
+#include "css_parallel.h"
+#include "css_serialize.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+/* ================================================================
+ * A tiny document for the element adapter
+ * ================================================================ */
+
+typedef struct node node;
+struct node {
+    const char *tag;
+    const char *id;
+    const char *classes[4];
+    size_t class_count;
+    const char *attrs[4][2];    /* name, value */
+    size_t attr_count;
+    bool hover;
+    node *parent, *prev, *next;
+};
+
+static const char *node_tag(void *ctx, const void *el)
+{
+    (void)ctx;
+    return ((const node *)el)->tag;
+}
+
+static const char *node_id(void *ctx, const void *el)
+{
+    (void)ctx;
+    return ((const node *)el)->id;
+}
+
+static size_t node_classes(void *ctx, const void *el,
+                           const char *const **classes)
+{
+    (void)ctx;
+    *classes = ((const node *)el)->classes;
+    return ((const node *)el)->class_count;
+}
+
+static const char *node_attribute(void *ctx, const void *el,
+                                  const char *name)
+{
+    (void)ctx;
+    const node *n = el;
+    for (size_t i = 0; i < n->attr_count; i++) {
+        if (strcasecmp(n->attrs[i][0], name) == 0) return n->attrs[i][1];
+    }
+    return NULL;
+}
+
+static const void *node_parent(void *ctx, const void *el)
+{
+    (void)ctx;
+    return ((const node *)el)->parent;
+}
+
+static const void *node_prev(void *ctx, const void *el)
+{
+    (void)ctx;
+    return ((const node *)el)->prev;
+}
+
+static const void *node_next(void *ctx, const void *el)
+{
+    (void)ctx;
+    return ((const node *)el)->next;
+}
+
+static bool node_pseudo(void *ctx, const void *el, const char *name)
+{
+    (void)ctx;
+    return strcmp(name, "hover") == 0 && ((const node *)el)->hover;
+}
+
+static const css_element_adapter adapter = {
+    node_tag, node_id, node_classes, node_attribute,
+    node_parent, node_prev, node_next, node_pseudo, NULL, NULL
+};
+
+/* Make nodes the children of parent, in order */
+static void set_children(node *parent, node **nodes, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        nodes[i]->parent = parent;
+        nodes[i]->prev = i > 0 ? nodes[i - 1] : NULL;
+        nodes[i]->next = i + 1 < count ? nodes[i + 1] : NULL;
+    }
+}
+
+/*
+ * <html>
+ *   <body class="page">
+ *     <div id="main" class="sidebar wide" data-role="nav menu" lang="en-US">
+ *       <ul class="nav">
+ *         <li class="item first"><a class="link" href="https://example.com/x.PDF"></a></li>
+ *         <li class="item"></li>
+ *         <li class="item last" title="Hello World"></li>
+ *       </ul>
+ *     </div>
+ *     <p class="note"></p>
+ *     <p></p>
+ *   </body>
+ * </html>
+ */
+static node html = { "html", NULL, {0}, 0, {{0}}, 0, false, 0, 0, 0 };
+static node body = { "body", NULL, {"page"}, 1, {{0}}, 0, false, 0, 0, 0 };
+static node div_ = { "div", "main", {"sidebar", "wide"}, 2,
+                     {{"data-role", "nav menu"}, {"lang", "en-US"}}, 2,
+                     false, 0, 0, 0 };
+static node ul = { "ul", NULL, {"nav"}, 1, {{0}}, 0, false, 0, 0, 0 };
+static node li1 = { "li", NULL, {"item", "first"}, 2, {{0}}, 0, false, 0, 0, 0 };
+static node li2 = { "li", NULL, {"item"}, 1, {{0}}, 0, false, 0, 0, 0 };
+static node li3 = { "li", NULL, {"item", "last"}, 2,
+                    {{"title", "Hello World"}}, 1, false, 0, 0, 0 };
+static node a = { "a", NULL, {"link"}, 1,
+                  {{"href", "https://example.com/x.PDF"}}, 1, true, 0, 0, 0 };
+static node p1 = { "p", NULL, {"note"}, 1, {{0}}, 0, false, 0, 0, 0 };
+static node p2 = { "p", NULL, {0}, 0, {{0}}, 0, false, 0, 0, 0 };
+
+static void build_document(void)
+{
+    node *html_children[] = { &body };
+    node *body_children[] = { &div_, &p1, &p2 };
+    node *div_children[] = { &ul };
+    node *ul_children[] = { &li1, &li2, &li3 };
+    node *li1_children[] = { &a };
+    set_children(&html, html_children, 1);
+    set_children(&body, body_children, 3);
+    set_children(&div_, div_children, 1);
+    set_children(&ul, ul_children, 3);
+    set_children(&li1, li1_children, 1);
+}
+
+/* Selector list of qualified rule i */
+static css_selector_list *rule_selectors(css_stylesheet *sheet, size_t i)
+{
+    return css_qualified_rule_selectors(sheet->rules[i]->u.qualified_rule);
+}
+
+/* Parse "selector {}" and match its selector list against el */
+static bool matches(const char *selector, const node *el)
+{
+    char src[256];
+    snprintf(src, sizeof(src), "%s {}", selector);
+    css_stylesheet *sheet = css_parse_stylesheet(src, strlen(src));
+    assert(sheet && sheet->rule_count == 1);
+    css_selector_list *list = rule_selectors(sheet, 0);
+    if (!list) {
+        fprintf(stderr, "selector did not parse: %s\n", selector);
+        abort();
+    }
+    bool result = css_match_selector_list(list, &adapter, el);
+
+    /* The compiled form must agree */
+    css_selector_program *prog = css_selector_program_compile_list(list);
+    assert(prog);
+    assert(css_selector_program_match_any(prog, &adapter, el) == result);
+    css_selector_program_free(prog);
+
+    css_stylesheet_free(sheet);
+    return result;
+}
+
+/* ================================================================
+ * Tests
+ * ================================================================ */
+
+static void test_simple(void)
+{
+    printf("  test_simple...");
+    assert(matches("div", &div_));
+    assert(matches("DIV", &div_));
+    assert(!matches("span", &div_));
+    assert(matches("*", &p2));
+    assert(matches("#main", &div_));
+    assert(!matches("#MAIN", &div_));
+    assert(matches(".sidebar.wide", &div_));
+    assert(!matches(".sidebar.narrow", &div_));
+    assert(matches("div#main.wide", &div_));
+    assert(!matches("p#main", &div_));
+
+    /* Source order is kept; matching uses the prepared order */
+    const char *src = "*:hover[x].b#i.c div {}";
+    css_stylesheet *sheet = css_parse_stylesheet(src, strlen(src));
+    const css_compound_selector *comp =
+        rule_selectors(sheet, 0)->selectors[0]->compounds[0];
+    assert(comp->count == 6 && comp->selectors[0]->type == SEL_UNIVERSAL);
+    static const css_simple_selector_type order[] = {
+        SEL_ID, SEL_CLASS, SEL_CLASS, SEL_ATTRIBUTE, SEL_PSEUDO_CLASS
+    };
+    assert(comp->match_count == 5);
+    for (size_t i = 0; i < comp->match_count; i++) {
+        assert(comp->match_order[i]->type == order[i]);
+    }
+    assert(strcmp(comp->match_order[1]->name, "b") == 0);
+    css_stylesheet_free(sheet);
+    printf(" OK\n");
+}
+
+static void test_combinators(void)
+{
+    printf("  test_combinators...");
+    assert(matches("body > div", &div_));
+    assert(!matches("html > div", &div_));
+    assert(matches("html div", &div_));
+    assert(matches(".sidebar .nav a", &a));
+    assert(!matches(".sidebar > a", &a));
+    assert(matches("div.sidebar > ul li > a", &a));
+    assert(matches(".page .sidebar li", &li2));
+    assert(!matches("p li", &li2));
+    assert(matches("li + li", &li2));
+    assert(!matches("li + li", &li1));
+    assert(matches("li.first + li", &li2));
+    assert(!matches("li.first + li", &li3));
+    assert(matches("li.first ~ li.last", &li3));
+    assert(!matches("li.last ~ li", &li2));
+    assert(matches("div + p", &p1));
+    assert(!matches("div + p", &p2));
+    assert(matches("div ~ p", &p2));
+    /* needs backtracking: the first ancestor li fails the + test */
+    assert(matches("li.first ~ li a, .first > a", &a));
+    assert(matches("body > div li", &li3));
+    printf(" OK\n");
+}
+
+static void test_attributes(void)
+{
+    printf("  test_attributes...");
+    assert(matches("[data-role]", &div_));
+    assert(!matches("[data-role]", &ul));
+    assert(matches("[data-role=\"nav menu\"]", &div_));
+    assert(matches("[data-role~=menu]", &div_));
+    assert(!matches("[data-role~=\"nav menu\"]", &div_));
+    assert(!matches("[data-role~=men]", &div_));
+    assert(matches("[lang|=en]", &div_));
+    assert(matches("[lang|=en-US]", &div_));
+    assert(!matches("[lang|=e]", &div_));
+    assert(matches("[href^=https]", &a));
+    assert(!matches("[href^=\"\"]", &a));
+    assert(!matches("[href$=\".pdf\"]", &a));
+    assert(matches("[href$=\".pdf\" i]", &a));
+    assert(matches("[href*=example]", &a));
+    assert(!matches("[href*=EXAMPLE]", &a));
+    assert(matches("[href*=EXAMPLE i]", &a));
+    assert(matches("[title=\"hello world\" i]", &li3));
+    assert(!matches("[title=\"hello world\"]", &li3));
+    assert(matches("[title*=\"O W\" i]", &li3));
+    assert(matches("[title*=WORLD i]", &li3));
+    assert(!matches("[title*=WORLDS i]", &li3));
+    assert(matches("[title~=world i]", &li3));
+    assert(!matches("[title~=\"\"]", &li3));
+    assert(!matches("[title*=\"\" i]", &li3));
+    assert(matches("[lang|=EN i]", &div_));
+    assert(!matches("[lang|=EN]", &div_));
+    assert(matches("[href*=\"e.c\"]", &a));
+    assert(matches("[href$=\"x.pdf\" i]", &a));
+
+    /* Prepared matchers: needle lowered once, impossible tests flagged */
+    const char *src = "[title^=HeLLo i] {}";
+    css_stylesheet *sheet = css_parse_stylesheet(src, strlen(src));
+    const css_simple_selector *sel =
+        rule_selectors(sheet, 0)->selectors[0]->compounds[0]->selectors[0];
+    assert(strcmp(sel->attr_value, "HeLLo") == 0);
+    assert(strcmp(sel->attr_matcher.needle, "hello") == 0);
+    assert(sel->attr_matcher.length == 5 && !sel->attr_matcher.never);
+    assert(css_attr_matcher_match(&sel->attr_matcher, "HELLO there"));
+    css_stylesheet_free(sheet);
+    src = "[title~=\"a b\"] {}";
+    sheet = css_parse_stylesheet(src, strlen(src));
+    sel = rule_selectors(sheet, 0)->selectors[0]->compounds[0]->selectors[0];
+    assert(sel->attr_matcher.never);
+    css_stylesheet_free(sheet);
+    printf(" OK\n");
+}
+
+static void test_pseudo(void)
+{
+    printf("  test_pseudo...");
+    assert(matches(":root", &html));
+    assert(!matches(":root", &body));
+    assert(matches("li:first-child", &li1));
+    assert(!matches("li:first-child", &li2));
+    assert(matches("li:last-child", &li3));
+    assert(matches("ul:only-child", &ul));
+    assert(!matches("li:only-child", &li1));
+    assert(matches("a:hover", &a));
+    assert(!matches("li:hover", &li1));
+    assert(!matches("p::before", &p1));
+    printf(" OK\n");
+}
+
+/* Does "selector {}" parse to a selector list? */
+static bool parses(const char *selector)
+{
+    char src[256];
+    snprintf(src, sizeof(src), "%s {}", selector);
+    css_stylesheet *sheet = css_parse_stylesheet(src, strlen(src));
+    assert(sheet && sheet->rule_count == 1);
+    bool result = rule_selectors(sheet, 0) != NULL;
+    css_stylesheet_free(sheet);
+    return result;
+}
+
+/* An+B of ":nth-child(arg)" */
+static bool nth_of(const char *arg, int a_, int b_)
+{
+    char src[128];
+    snprintf(src, sizeof(src), ":nth-child(%s) {}", arg);
+    css_stylesheet *sheet = css_parse_stylesheet(src, strlen(src));
+    css_selector_list *list = rule_selectors(sheet, 0);
+    bool result = false;
+    if (list) {
+        const css_simple_selector *sel =
+            list->selectors[0]->compounds[0]->selectors[0];
+        result = sel->pseudo == PSEUDO_NTH_CHILD &&
+                 sel->nth.a == a_ && sel->nth.b == b_;
+    }
+    css_stylesheet_free(sheet);
+    return result;
+}
+
+static void test_nth(void)
+{
+    printf("  test_nth...");
+    assert(nth_of("2n+1", 2, 1));
+    assert(nth_of("2N+1", 2, 1));
+    assert(nth_of("-n+3", -1, 3));
+    assert(nth_of(" -n + 3 ", -1, 3));
+    assert(nth_of("+n-2", 1, -2));
+    assert(nth_of("odd", 2, 1));
+    assert(nth_of("EVEN", 2, 0));
+    assert(nth_of("5", 0, 5));
+    assert(nth_of("-5", 0, -5));
+    assert(nth_of("n", 1, 0));
+    assert(nth_of("3n - 2", 3, -2));
+    assert(nth_of("-2n- 1", -2, -1));
+    assert(nth_of("n-7", 1, -7));
+    assert(nth_of("-n-7", -1, -7));
+    assert(nth_of("10n-0", 10, 0));
+    assert(!parses(":nth-child(2.5n)"));
+    assert(!parses(":nth-child(n+)"));
+    assert(!parses(":nth-child(2n + -1)"));
+    assert(!parses(":nth-child(- n)"));
+    assert(!parses(":nth-child(n-x)"));
+    assert(!parses(":nth-child(foo)"));
+    assert(!parses(":nth-child()"));
+    assert(!parses(":nth-child(2n 3n)"));
+    assert(!parses(":nth-of-type(1 of .x)"));
+
+    char buf[32];
+    css_nth n1 = { 2, 1 }, n2 = { -1, 3 }, n3 = { 0, 4 }, n4 = { 3, 0 };
+    css_nth_format(n1, buf, sizeof(buf));
+    assert(strcmp(buf, "2n+1") == 0);
+    css_nth_format(n2, buf, sizeof(buf));
+    assert(strcmp(buf, "-n+3") == 0);
+    css_nth_format(n3, buf, sizeof(buf));
+    assert(strcmp(buf, "4") == 0);
+    css_nth_format(n4, buf, sizeof(buf));
+    assert(strcmp(buf, "3n") == 0);
+
+    /* The arithmetic test */
+    assert(css_nth_matches(n1, 1) && !css_nth_matches(n1, 2) &&
+           css_nth_matches(n1, 7));
+    assert(css_nth_matches(n2, 1) && css_nth_matches(n2, 3) &&
+           !css_nth_matches(n2, 4));
+    assert(css_nth_matches(n3, 4) && !css_nth_matches(n3, 8));
+    assert(!css_nth_matches(n4, 0) && css_nth_matches(n4, 3));
+
+    assert(matches("li:nth-child(2)", &li2));
+    assert(!matches("li:nth-child(2)", &li3));
+    assert(matches("li:nth-child(odd)", &li3));
+    assert(!matches("li:nth-child(odd)", &li2));
+    assert(matches("li:nth-child(-n+2)", &li2));
+    assert(!matches("li:nth-child(-n+2)", &li3));
+    assert(matches("li:nth-last-child(1)", &li3));
+    assert(matches("li:nth-last-child(3)", &li1));
+    assert(matches("p:nth-of-type(1)", &p1));
+    assert(!matches("p:nth-of-type(1)", &p2));
+    assert(matches("p:nth-last-of-type(1)", &p2));
+    assert(matches("div:nth-last-of-type(1)", &div_));
+    assert(!matches(":nth-child(1)", &html));
+    assert(matches("li:nth-child(2 of .item)", &li2));
+    assert(matches("li:nth-child(1 of .last)", &li3));
+    assert(!matches("li:nth-child(1 of .last)", &li1));
+    assert(matches("li:nth-last-child(1 of .first, li:first-child)", &li1));
+    assert(matches(":nth-child(n of p) + p", &p2));
+
+    /* Cached positions agree with walking the siblings, in any order */
+    enum { COUNT = 50 };
+    static const char *const tags[] = { "a", "b", "c" };
+    node parent = { "ol", NULL, {0}, 0, {{0}}, 0, false, 0, 0, 0 };
+    node kids[COUNT];
+    node *ptrs[COUNT];
+    for (size_t i = 0; i < COUNT; i++) {
+        node k = { tags[i * i % 3], NULL, {0}, 0, {{0}}, 0, false, 0, 0, 0 };
+        kids[i] = k;
+        ptrs[i] = &kids[i];
+    }
+    set_children(&parent, ptrs, COUNT);
+    css_sibling_cache *cache = css_sibling_cache_create();
+    assert(cache);
+    css_element_adapter cached = adapter;
+    cached.sibling_cache = cache;
+    for (int pass = 0; pass < 3; pass++) {
+        for (size_t j = 0; j < COUNT; j++) {
+            size_t i = pass == 1 ? COUNT - 1 - j : pass == 2 ? j * 7 % COUNT : j;
+            for (css_pseudo_class_kind kind = PSEUDO_NTH_CHILD;
+                 kind <= PSEUDO_NTH_LAST_OF_TYPE; kind++) {
+                assert(css_nth_index(&cached, &kids[i], kind) ==
+                       css_nth_index(&adapter, &kids[i], kind));
+            }
+            assert(css_nth_index(&cached, &kids[i], PSEUDO_NTH_CHILD) ==
+                   i + 1);
+            assert(css_nth_index(&cached, &kids[i], PSEUDO_NTH_LAST_CHILD) ==
+                   COUNT - i);
+        }
+        css_sibling_cache_clear(cache);
+    }
+    assert(css_nth_index(&cached, &html, PSEUDO_NTH_CHILD) == 0);
+    assert(css_nth_index(&cached, &kids[0], PSEUDO_OTHER) == 0);
+    css_sibling_cache_free(cache);
+    css_sibling_cache_free(NULL);
+    printf(" OK\n");
+}
+
+static void test_functional(void)
+{
+    printf("  test_functional...");
+    assert(matches("li:not(.first)", &li2));
+    assert(!matches("li:not(.first)", &li1));
+    assert(matches("li:not(.first, .last)", &li2));
+    assert(!matches("li:not(.first, .last)", &li3));
+    assert(matches(":is(ul, ol) > li", &li1));
+    assert(!matches(":is(ol, p) > li", &li1));
+    assert(matches(":where(.nav) li.last", &li3));
+    assert(matches("a:is(.sidebar *)", &a));
+    assert(!matches("a:is(p *)", &a));
+    assert(matches("li:not(:nth-child(1))", &li3));
+    assert(matches(":not(:is(p, div))", &ul));
+    assert(matches("p:not(div + p)", &p2));
+    assert(!matches("p:not(div + p)", &p1));
+
+    /* Forgiving :is() / :where(), strict :not() */
+    assert(matches(":is(::before, li.first)", &li1));
+    assert(parses(":is(::before)"));
+    assert(!matches(":where(::before, ..x)", &li1));
+    assert(!parses(":not(::before)"));
+    assert(!parses(":not(.a, ..b)"));
+    assert(!parses(":not()"));
+    assert(!parses("a:lang(en)"));
+    assert(!parses("li:nth-child(1 of ::before)"));
+    printf(" OK\n");
+}
+
+static void test_selector_list(void)
+{
+    printf("  test_selector_list...");
+    assert(matches("p, li.last", &li3));
+    assert(!matches("p, li.first", &li3));
+    assert(!css_match_selector_list(NULL, &adapter, &li3));
+
+    /* An invalid complex selector fails the whole list */
+    assert(parses("[ x ~= y ]"));
+    assert(parses("[x=\"y\" S]"));
+    assert(parses("a::before:hover"));
+    assert(parses("a > b, c"));
+    assert(!parses("a[x~y]"));
+    assert(!parses("a[xlink|href]"));
+    assert(!parses("a[=x]"));
+    assert(!parses("[x=\"y\" z]"));
+    assert(!parses("[x=y i s]"));
+    assert(!parses("div%foo"));
+    assert(!parses("a."));
+    assert(!parses("a:"));
+    assert(!parses("a >"));
+    assert(!parses("a ,"));
+    assert(!parses(", a"));
+    assert(!parses("a,,b"));
+    assert(!parses("a b)"));
+    assert(!parses("#1a"));
+    assert(!parses("p::before span"));
+    assert(!parses("p::before > span"));
+    assert(!parses("p::before.x"));
+    assert(!parses("li, a[x~y]"));
+
+    /* ...except inside a forgiving :is() / :where() */
+    assert(matches(":is(a >, li.first)", &li1));
+    assert(matches(":where(li,, #1a, div%foo) ", &li1));
+    printf(" OK\n");
+}
+
+static node *const all_nodes[] = {
+    &html, &body, &div_, &ul, &li1, &li2, &li3, &a, &p1, &p2
+};
+
+static const char index_sheet[] =
+    "#main { a: 1 }\n"
+    "div#main.wide, .nav > li { a: 2 }\n"
+    "li { a: 3 }\n"
+    "LI.item:first-child, p + p { a: 4 }\n"
+    ".item.last { a: 5 }\n"
+    "* { a: 6 }\n"
+    "[data-role~=menu], :root { a: 7 }\n"
+    ".sidebar .nav a:hover, .missing, #nope { a: 8 }\n"
+    "body > p.note { a: 9 }\n"
+    "li.item ~ li { a: 10 }\n";
+
+/* Selectors that take the parser's odd paths: stray tokens after a
+ * selector, invalid attribute selectors, empty list entries, blocks
+ * inside arguments, invalid functions */
+static const char prelude_sheet[] =
+    ":is(ul, :not(.x)) > li.item { }\n"
+    "li:nth-child(2n+1 of .item), p:nth-last-of-type( -n+ 3) { }\n"
+    "[data-role~=menu i], [title|=\"Hello\" s], a[5], [x=] { }\n"
+    "a., b::5, c:: { }\n"
+    "a, , b,, { }\n"
+    "a .b, a ::c { }\n"
+    ":is(a { b }, [c], d(e)) { }\n"
+    ":nope(a), li { }\n"
+    ":where(::before, p), :not(p::after) { }\n"
+    "ul > { }\n"
+    "div%foo, a b), #1a { }\n"
+    "p::before span, [x=\"y\" z], [xlink|href] { }\n"
+    "{ }\n";
+
+/* Same selector lists, selector by selector, or both invalid */
+static void assert_same_selectors(css_selector_list *a_list,
+                                  css_selector_list *b_list)
+{
+    assert(!a_list == !b_list);
+    if (!a_list) return;
+    assert(a_list->count == b_list->count);
+    for (size_t j = 0; j < a_list->count; j++) {
+        assert(a_list->selectors[j]->count == b_list->selectors[j]->count);
+        assert(a_list->selectors[j]->specificity_key ==
+               b_list->selectors[j]->specificity_key);
+        for (size_t n = 0; n < sizeof(all_nodes) / sizeof(all_nodes[0]);
+             n++) {
+            assert(css_match_complex(a_list->selectors[j],
+                                     &adapter, all_nodes[n]) ==
+                   css_match_complex(b_list->selectors[j],
+                                     &adapter, all_nodes[n]));
+        }
+    }
+}
+
+/* Preludes kept as component values (keep_preludes), as source text
+ * parsed lazily (the default) and parsed from the token stream
+ * (eager_selectors) give the same selectors and print the same */
+static void test_prelude_forms(void)
+{
+    printf("  test_prelude_forms...");
+    static const char *const sheets[] = { index_sheet, prelude_sheet };
+    css_parser_options options;
+    memset(&options, 0, sizeof(options));
+    for (size_t k = 0; k < 2; k++) {
+        size_t length = strlen(sheets[k]);
+        options.keep_preludes = true;
+        options.eager_selectors = false;
+        css_stylesheet *kept =
+            css_parse_stylesheet_with_options(sheets[k], length, &options);
+        options.keep_preludes = false;
+        css_stylesheet *text =
+            css_parse_stylesheet_with_options(sheets[k], length, &options);
+        options.eager_selectors = true;
+        css_stylesheet *eager =
+            css_parse_stylesheet_with_options(sheets[k], length, &options);
+        assert(kept->rule_count == text->rule_count);
+        assert(kept->rule_count == eager->rule_count);
+
+        for (size_t i = 0; i < kept->rule_count; i++) {
+            css_qualified_rule *a = kept->rules[i]->u.qualified_rule;
+            css_qualified_rule *b = text->rules[i]->u.qualified_rule;
+            css_qualified_rule *c = eager->rules[i]->u.qualified_rule;
+            assert(!a->prelude_text && b->prelude_text && c->prelude_text);
+            assert(b->prelude_count == 0 && c->prelude_count == 0);
+            assert(!atomic_load(&b->selectors_cache));
+            assert(atomic_load(&c->selectors_cache) ||
+                   atomic_load(&c->selectors_invalid));
+            css_selector_list *list = css_qualified_rule_selectors(a);
+            assert_same_selectors(list, css_qualified_rule_selectors(b));
+            assert_same_selectors(list, css_qualified_rule_selectors(c));
+
+            /* Printers see the prelude tokenized again, where it was */
+            size_t count;
+            css_component_value **values =
+                css_qualified_rule_prelude(b, &count);
+            assert(count == a->prelude_count);
+            for (size_t j = 0; j < count; j++) {
+                assert(values[j]->type == a->prelude[j]->type);
+                if (values[j]->type != CSS_NODE_COMPONENT_VALUE) continue;
+                assert(values[j]->u.token->type ==
+                       a->prelude[j]->u.token->type);
+                assert(values[j]->u.token->line ==
+                       a->prelude[j]->u.token->line);
+                assert(values[j]->u.token->column ==
+                       a->prelude[j]->u.token->column);
+            }
+            css_qualified_rule_prelude_release(b, values, count);
+        }
+
+        char *kept_css = css_serialize_to_string(kept, CSS_SERIALIZE_PRETTY,
+                                                 NULL);
+        char *text_css = css_serialize_to_string(text, CSS_SERIALIZE_PRETTY,
+                                                 NULL);
+        assert(kept_css && text_css && strcmp(kept_css, text_css) == 0);
+        free(kept_css);
+        free(text_css);
+
+        css_memory_usage kept_usage, text_usage;
+        css_stylesheet_memory_usage(kept, &kept_usage);
+        css_stylesheet_memory_usage(text, &text_usage);
+        assert(text_usage.total < kept_usage.total);
+        css_stylesheet_free(kept);
+        css_stylesheet_free(text);
+        css_stylesheet_free(eager);
+    }
+
+    /* A rule cut off by EOF is dropped with its prelude */
+    const char *src = "a {} b.c > d";
+    css_stylesheet *sheet = css_parse_stylesheet_with_options(
+        src, strlen(src), &options);
+    assert(sheet->rule_count == 1);
+    css_stylesheet_free(sheet);
+    printf(" OK\n");
+}
+
+static void *selectors_thread(void *arg)
+{
+    return css_qualified_rule_selectors(arg);
+}
+
+static void *nested_rules_thread(void *arg)
+{
+    return css_at_rule_rules(arg);
+}
+
+static void test_lazy_selectors(void)
+{
+    printf("  test_lazy_selectors...");
+    const char *src = "a.b, c > d { x: 1 } 1nvalid { y: 2 }";
+    css_stylesheet *sheet = css_parse_stylesheet(src, strlen(src));
+    css_qualified_rule *qr = sheet->rules[0]->u.qualified_rule;
+    css_qualified_rule *bad = sheet->rules[1]->u.qualified_rule;
+    assert(!atomic_load(&qr->selectors_cache));
+
+    /* First access parses, later ones return the cached list */
+    css_selector_list *list = css_qualified_rule_selectors(qr);
+    assert(list && list->count == 2);
+    assert(atomic_load(&qr->selectors_cache) == list);
+    assert(css_qualified_rule_selectors(qr) == list);
+    assert(!css_qualified_rule_selectors(bad));
+    assert(atomic_load(&bad->selectors_invalid));
+    assert(!css_qualified_rule_selectors(bad));
+    css_stylesheet_free(sheet);
+
+    /* Racing first accesses all see one list */
+    sheet = css_parse_stylesheet(src, strlen(src));
+    qr = sheet->rules[0]->u.qualified_rule;
+    pthread_t threads[8];
+    void *results[8];
+    for (size_t i = 0; i < 8; i++) {
+        assert(pthread_create(&threads[i], NULL, selectors_thread, qr) == 0);
+    }
+    for (size_t i = 0; i < 8; i++) {
+        assert(pthread_join(threads[i], &results[i]) == 0);
+        assert(results[i] && results[i] == results[0]);
+    }
+    assert(atomic_load(&qr->selectors_cache) == results[0]);
+    css_stylesheet_free(sheet);
+
+    /* eager_selectors parses during the parse; a lazy parse allocates
+     * from the tree's allocator */
+    css_counting_allocator counting;
+    css_counting_allocator_init(&counting, NULL);
+    css_parser_options options;
+    memset(&options, 0, sizeof(options));
+    options.allocator = &counting.allocator;
+    options.eager_selectors = true;
+    sheet = css_parse_stylesheet_with_options(src, strlen(src), &options);
+    assert(atomic_load(&sheet->rules[0]->u.qualified_rule->selectors_cache));
+    css_stylesheet_free(sheet);
+    options.eager_selectors = false;
+    sheet = css_parse_stylesheet_with_options(src, strlen(src), &options);
+    size_t before = counting.allocations;
+    assert(rule_selectors(sheet, 0));
+    assert(counting.allocations > before);
+    css_stylesheet_free(sheet);
+    printf(" OK\n");
+}
+
+/* A reused context with dedup_blocks: at-rules dropped from a declaration
+ * list must not leave their blocks in the dedup table, within one parse
+ * or across parses */
+static void test_reused_parser_dedup(void)
+{
+    printf("  test_reused_parser_dedup...");
+    css_parser_ctx *p = css_parser_create();
+    assert(p);
+    css_parser_options options;
+    memset(&options, 0, sizeof(options));
+    options.dedup_blocks = true;
+    css_parser_set_options(p, &options);
+
+    const char *decls = "a: 1; @x { y: 2 } b: 3; @x { y: 2 } c: 4";
+    for (int round = 0; round < 2; round++) {
+        css_declaration_list *list =
+            css_parser_parse_declaration_list(p, decls, strlen(decls));
+        assert(list && list->declaration_count == 3);
+        css_declaration_list_free(list);
+    }
+
+    const char *src = "a { y: 2 } @m { y: 2 } b { y: 2 }";
+    for (int round = 0; round < 2; round++) {
+        css_stylesheet *sheet =
+            css_parser_parse_stylesheet(p, src, strlen(src));
+        assert(sheet && sheet->rule_count == 3);
+        css_simple_block *a = sheet->rules[0]->u.qualified_rule->block;
+        assert(sheet->rules[1]->u.at_rule->block == a);
+        assert(sheet->rules[2]->u.qualified_rule->block == a);
+        css_stylesheet_free(sheet);
+
+        css_declaration_list *list =
+            css_parser_parse_declaration_list(p, decls, strlen(decls));
+        assert(list && list->declaration_count == 3);
+        css_declaration_list_free(list);
+    }
+    css_parser_free(p);
+    printf(" OK\n");
+}
+
+/* classes() whose array only lives until the next call, as the adapter
+ * contract allows (ASan catches a caller that keeps it) */
+static const char **volatile_array;
+
+static size_t volatile_classes(void *ctx, const void *el,
+                               const char *const **classes)
+{
+    (void)ctx;
+    const node *n = el;
+    free(volatile_array);
+    volatile_array = malloc((n->class_count + 1) * sizeof(*volatile_array));
+    assert(volatile_array);
+    memcpy(volatile_array, n->classes,
+           n->class_count * sizeof(*volatile_array));
+    *classes = volatile_array;
+    return n->class_count;
+}
+
+/* Condition filter for the rule index: everything but @media */
+static bool skip_media(void *user, const css_at_rule *ar)
+{
+    (void)user;
+    return strcasecmp(ar->name, "media") != 0;
+}
+
+static void test_rule_index(void)
+{
+    printf("  test_rule_index...");
+    css_stylesheet *sheet =
+        css_parse_stylesheet(index_sheet, strlen(index_sheet));
+    css_rule_index *index = css_rule_index_build(sheet);
+    assert(index);
+    assert(css_rule_index_size(index) == 15);
+
+    /* Same entries, same order as testing every selector */
+    css_rule_matches matches = { NULL, 0, 0 };
+    for (size_t n = 0; n < sizeof(all_nodes) / sizeof(all_nodes[0]); n++) {
+        const node *el = all_nodes[n];
+        css_rule_index_match(index, &adapter, el, &matches);
+        size_t k = 0;
+        for (size_t i = 0; i < sheet->rule_count; i++) {
+            css_qualified_rule *qr = sheet->rules[i]->u.qualified_rule;
+            css_selector_list *list = css_qualified_rule_selectors(qr);
+            for (size_t j = 0; j < list->count; j++) {
+                if (!css_match_complex(list->selectors[j], &adapter, el))
+                    continue;
+                assert(k < matches.count);
+                assert(matches.entries[k]->selector == list->selectors[j]);
+                assert(matches.entries[k]->rule == qr);
+                k++;
+            }
+        }
+        assert(k == matches.count);
+    }
+
+    /* li3: .nav > li, li, .item.last, *, li.item ~ li */
+    assert(css_rule_index_match(index, &adapter, &li3, &matches) == 5);
+    assert(matches.entries[0]->rule == sheet->rules[1]->u.qualified_rule);
+
+    /* Cascade order: *, li, .nav > li, li.item ~ li, .item.last */
+    css_rule_matches_sort_cascade(&matches);
+    assert(matches.entries[0]->rule == sheet->rules[5]->u.qualified_rule);
+    assert(matches.entries[1]->rule == sheet->rules[2]->u.qualified_rule);
+    assert(matches.entries[2]->rule == sheet->rules[1]->u.qualified_rule);
+    assert(matches.entries[3]->rule == sheet->rules[9]->u.qualified_rule);
+    assert(matches.entries[4]->rule == sheet->rules[4]->u.qualified_rule);
+
+    css_rule_matches_free(&matches);
+    css_rule_index_free(index);
+    css_stylesheet_free(sheet);
+
+    /* Matching a bucket calls classes() for ancestors, which must not
+     * disturb the element's remaining classes */
+    const char *src = ".page .item {} .sidebar .first {} .first {}";
+    sheet = css_parse_stylesheet(src, strlen(src));
+    index = css_rule_index_build(sheet);
+    css_element_adapter volatile_adapter = adapter;
+    volatile_adapter.classes = volatile_classes;
+    assert(css_rule_index_match(index, &volatile_adapter, &li1,
+                                &matches) == 3);
+    free(volatile_array);
+    volatile_array = NULL;
+    css_rule_index_free(index);
+    css_stylesheet_free(sheet);
+
+    /* Rules nested in grouping at-rules are indexed in source order;
+     * keyframe rules are not style rules */
+    src = "a {} @media screen { .item {} @supports (x) { li.first {} } }"
+          " @keyframes k { from {} to {} } @layer l { #main {} } b {}";
+    sheet = css_parse_stylesheet(src, strlen(src));
+    index = css_rule_index_build(sheet);
+    assert(index && css_rule_index_size(index) == 5);
+    css_at_rule *media = sheet->rules[1]->u.at_rule;
+    css_stylesheet *nested = css_at_rule_rules(media);
+    assert(nested && nested->rule_count == 2);
+    assert(css_at_rule_rules(media) == nested);
+    assert(css_rule_index_match(index, &adapter, &li1, &matches) == 2);
+    assert(matches.entries[0]->rule == nested->rules[0]->u.qualified_rule);
+    assert(matches.entries[1]->rule ==
+           css_at_rule_rules(nested->rules[1]->u.at_rule)
+               ->rules[0]->u.qualified_rule);
+    assert(matches.entries[0]->order < matches.entries[1]->order);
+    assert(css_rule_index_match(index, &adapter, &div_, &matches) == 1);
+    css_rule_index_free(index);
+
+    /* Racing first accesses all see one rule list, and the blocks
+     * shared with the at-rule are released once */
+    css_stylesheet *raced = css_parse_stylesheet(src, strlen(src));
+    pthread_t threads[8];
+    void *results[8];
+    for (size_t i = 0; i < 8; i++) {
+        assert(pthread_create(&threads[i], NULL, nested_rules_thread,
+                              raced->rules[1]->u.at_rule) == 0);
+    }
+    for (size_t i = 0; i < 8; i++) {
+        assert(pthread_join(threads[i], &results[i]) == 0);
+        assert(results[i] && results[i] == results[0]);
+    }
+    css_stylesheet_free(raced);
+
+    css_rule_index_options options = { skip_media, NULL };
+    index = css_rule_index_build_with_options(sheet, &options);
+    assert(index && css_rule_index_size(index) == 3);
+    assert(css_rule_index_match(index, &adapter, &li1, &matches) == 0);
+    assert(css_rule_index_match(index, &adapter, &div_, &matches) == 1);
+    css_rule_index_free(index);
+    css_stylesheet_free(sheet);
+
+    /* Empty index */
+    index = css_rule_index_build(NULL);
+    assert(index && css_rule_index_size(index) == 0);
+    assert(css_rule_index_match(index, &adapter, &li1, &matches) == 0);
+    css_rule_matches_free(&matches);
+    css_rule_index_free(index);
+    printf(" OK\n");
+}
+
+static css_complex_selector *parse_one(css_stylesheet **sheet,
+                                       const char *src)
+{
+    *sheet = css_parse_stylesheet(src, strlen(src));
+    assert(*sheet && (*sheet)->rule_count == 1);
+    return rule_selectors(*sheet, 0)->selectors[0];
+}
+
+static void test_specificity(void)
+{
+    printf("  test_specificity...");
+    css_stylesheet *sheet;
+    css_complex_selector *sel = parse_one(&sheet,
+        "#a .b[c]:hover > d::before {}");
+    css_specificity spec = css_selector_specificity(sel);
+    assert(spec.a == 1 && spec.b == 3 && spec.c == 2);
+    assert(sel->specificity_key == css_specificity_pack(spec));
+    spec = css_specificity_unpack(sel->specificity_key);
+    assert(spec.a == 1 && spec.b == 3 && spec.c == 2);
+    css_stylesheet_free(sheet);
+
+    /* Selectors built by hand are ready once appended:
+     * ul > li[title="HELLO WORLD" i] */
+    css_simple_selector *ss = css_simple_selector_create(SEL_TYPE);
+    ss->name = strdup("ul");
+    css_compound_selector *comp = css_compound_selector_create();
+    css_compound_selector_append(comp, ss);
+    sel = css_complex_selector_create();
+    css_complex_selector_append(sel, comp, COMB_DESCENDANT);
+    comp = css_compound_selector_create();
+    ss = css_simple_selector_create(SEL_ATTRIBUTE);
+    ss->attr_name = strdup("title");
+    ss->attr_value = strdup("HELLO WORLD");
+    ss->attr_match = ATTR_EXACT;
+    ss->attr_case_insensitive = true;
+    css_compound_selector_append(comp, ss);
+    ss = css_simple_selector_create(SEL_TYPE);
+    ss->name = strdup("li");
+    css_compound_selector_append(comp, ss);
+    css_complex_selector_append(sel, comp, COMB_CHILD);
+    spec = css_selector_specificity(sel);
+    assert(spec.a == 0 && spec.b == 1 && spec.c == 2);
+    assert(sel->specificity_key == css_specificity_pack(spec));
+    assert(sel->ancestor_hashes[0] == css_bloom_hash_tag("ul"));
+    assert(css_match_complex(sel, &adapter, &li3));
+    assert(!css_match_complex(sel, &adapter, &li2));
+    css_complex_selector_free(sel);
+
+    /* Packed keys order like (a, b, c) */
+    css_specificity s1 = { 0, 5, 9 }, s2 = { 0, 6, 0 }, s3 = { 1, 0, 0 };
+    assert(css_specificity_pack(s1) < css_specificity_pack(s2));
+    assert(css_specificity_pack(s2) < css_specificity_pack(s3));
+
+    /* Each component saturates without spilling into the next */
+    size_t n = CSS_SPECIFICITY_MAX + 100;
+    char *src = malloc(n * 2 + 4);
+    for (size_t i = 0; i < n; i++) memcpy(src + i * 2, ".x", 2);
+    memcpy(src + n * 2, " {}", 4);
+    sel = parse_one(&sheet, src);
+    assert(sel->specificity.b == n);
+    spec = css_specificity_unpack(sel->specificity_key);
+    assert(spec.a == 0 && spec.b == CSS_SPECIFICITY_MAX && spec.c == 0);
+    assert(sel->specificity_key < css_specificity_pack(s3));
+    css_stylesheet_free(sheet);
+    free(src);
+
+    /* Selectors 4: :is() and :not() count their most specific argument,
+     * :where() nothing, :nth-child(An+B of S) a class plus S */
+    static const struct {
+        const char *src;
+        unsigned a, b, c;
+    } cases[] = {
+        { ":is(#a, .b) .c {}",           1, 1, 0 },
+        { ":where(#a, .b) .c {}",        0, 1, 0 },
+        { "p:not(.a, div#b) {}",         1, 0, 2 },
+        { "li:nth-child(2n) {}",         0, 1, 1 },
+        { "li:nth-child(2n of #y, .x) {}", 1, 1, 1 },
+        { ":is(:where(#a), p) {}",       0, 0, 1 }
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        sel = parse_one(&sheet, cases[i].src);
+        spec = css_selector_specificity(sel);
+        assert(spec.a == cases[i].a && spec.b == cases[i].b &&
+               spec.c == cases[i].c);
+        css_stylesheet_free(sheet);
+    }
+    printf(" OK\n");
+}
+
+static void test_program(void)
+{
+    printf("  test_program...");
+    static const char src[] =
+        "DIV#main.wide, div .nav > LI:First-Child a:hover, p::before, "
+        "[data-role~=menu] li.item ~ li, .item.last[title=\"Hello World\" i]"
+        " {}";
+    css_stylesheet *sheet = css_parse_stylesheet(src, strlen(src));
+    css_selector_list *list = rule_selectors(sheet, 0);
+    css_selector_program *prog = css_selector_program_compile_list(list);
+    assert(prog && css_selector_program_count(prog) == list->count);
+    assert(css_selector_program_size(prog) > 0);
+
+    for (size_t n = 0; n < sizeof(all_nodes) / sizeof(all_nodes[0]); n++) {
+        for (size_t i = 0; i < list->count; i++) {
+            assert(css_selector_program_match(prog, i, &adapter,
+                                              all_nodes[n]) ==
+                   css_match_complex(list->selectors[i], &adapter,
+                                     all_nodes[n]));
+        }
+    }
+    assert(css_selector_program_match(prog, 1, &adapter, &a));
+    assert(!css_selector_program_match(prog, 2, &adapter, &p1));
+    assert(css_selector_program_match(prog, 3, &adapter, &li3));
+    assert(!css_selector_program_match(prog, 5, &adapter, &li3));
+    assert(!css_selector_program_match(NULL, 0, &adapter, &li3));
+    css_selector_program_free(prog);
+
+    /* Pseudo-class names reach the adapter lowercased */
+    static const char hover[] = "a:HOVER {}";
+    css_stylesheet *h_sheet = css_parse_stylesheet(hover, strlen(hover));
+    prog = css_selector_program_compile_list(rule_selectors(h_sheet, 0));
+    assert(css_selector_program_match(prog, 0, &adapter, &a));
+    css_selector_program_free(prog);
+    css_stylesheet_free(h_sheet);
+
+    /* Repeated names share one atom */
+    static const char repeated[] = "div.x, DIV.x, div.x.x {}";
+    static const char single[] = "div.x {}";
+    css_stylesheet *a_sheet = css_parse_stylesheet(repeated,
+                                                   strlen(repeated));
+    css_stylesheet *b_sheet = css_parse_stylesheet(single, strlen(single));
+    css_selector_program *pa =
+        css_selector_program_compile_list(rule_selectors(a_sheet, 0));
+    css_selector_program *pb =
+        css_selector_program_compile_list(rule_selectors(b_sheet, 0));
+    /* 7 more ops and 2 more starts, no more atom bytes */
+    assert(css_selector_program_size(pa) - css_selector_program_size(pb) <=
+           7 * 8 + 2 * 4 + 4);
+    css_selector_program_free(pa);
+    css_selector_program_free(pb);
+    css_stylesheet_free(a_sheet);
+    css_stylesheet_free(b_sheet);
+
+    /* Empty program */
+    prog = css_selector_program_compile(NULL, 0);
+    assert(prog && css_selector_program_count(prog) == 0);
+    assert(!css_selector_program_match_any(prog, &adapter, &li1));
+    css_selector_program_free(prog);
+    css_stylesheet_free(sheet);
+    printf(" OK\n");
+}
+
+/* Push el's ancestors, root first */
+static void push_ancestors(css_bloom_filter *filter, const node *el)
+{
+    if (!el->parent) return;
+    push_ancestors(filter, el->parent);
+    css_bloom_push_element(filter, &adapter, el->parent);
+}
+
+static css_complex_selector *first_selector(css_stylesheet *sheet,
+                                            size_t rule)
+{
+    return rule_selectors(sheet, rule)->selectors[0];
+}
+
+static void test_bloom(void)
+{
+    printf("  test_bloom...");
+    assert(css_bloom_hash_tag("li") == css_bloom_hash_tag("LI"));
+    assert(css_bloom_hash_tag("nav") != css_bloom_hash_class("nav"));
+    assert(css_bloom_hash_id("x") && css_bloom_hash_class("x"));
+
+    static const char sheet_src[] =
+        ".sidebar .nav a { }\n"
+        "#main > ul li { }\n"
+        "li + li ~ li { }\n"
+        ".missing li { }\n";
+    css_stylesheet *sheet = css_parse_stylesheet(sheet_src,
+                                                 strlen(sheet_src));
+    css_complex_selector *nav = first_selector(sheet, 0);
+    css_complex_selector *main_ul = first_selector(sheet, 1);
+    css_complex_selector *siblings = first_selector(sheet, 2);
+    css_complex_selector *missing = first_selector(sheet, 3);
+    assert(nav->ancestor_hashes[0] && nav->ancestor_hashes[1]);
+    assert(!nav->ancestor_hashes[2]);
+    assert(main_ul->ancestor_hashes[0] && main_ul->ancestor_hashes[1]);
+    assert(!siblings->ancestor_hashes[0]);
+
+    css_bloom_filter *filter = malloc(sizeof(*filter));
+    css_bloom_clear(filter);
+    push_ancestors(filter, &a);
+    assert(css_bloom_may_match(filter, nav));
+    assert(css_bloom_may_match(filter, main_ul));
+    assert(css_bloom_may_match(filter, siblings));
+    assert(!css_bloom_may_match(filter, missing));
+
+    /* Popping every push leaves an empty filter */
+    css_bloom_pop_element(filter, &adapter, &li1);
+    css_bloom_pop_element(filter, &adapter, &ul);
+    css_bloom_pop_element(filter, &adapter, &div_);
+    css_bloom_pop_element(filter, &adapter, &body);
+    css_bloom_pop_element(filter, &adapter, &html);
+    for (size_t i = 0; i < CSS_BLOOM_SIZE; i++)
+        assert(filter->counters[i] == 0);
+    css_stylesheet_free(sheet);
+
+    /* Filtered index matching gives the same results */
+    sheet = css_parse_stylesheet(index_sheet, strlen(index_sheet));
+    css_rule_index *index = css_rule_index_build(sheet);
+    css_rule_matches plain = { NULL, 0, 0 }, filtered = { NULL, 0, 0 };
+    for (size_t n = 0; n < sizeof(all_nodes) / sizeof(all_nodes[0]); n++) {
+        const node *el = all_nodes[n];
+        css_bloom_clear(filter);
+        push_ancestors(filter, el);
+        css_rule_index_match(index, &adapter, el, &plain);
+        css_rule_index_match_filtered(index, &adapter, el, filter,
+                                      &filtered);
+        assert(plain.count == filtered.count);
+        for (size_t i = 0; i < plain.count; i++)
+            assert(plain.entries[i] == filtered.entries[i]);
+    }
+    css_rule_matches_free(&plain);
+    css_rule_matches_free(&filtered);
+    css_rule_index_free(index);
+    css_stylesheet_free(sheet);
+    free(filter);
+    printf(" OK\n");
+}
+
+static void test_invalidation(void)
+{
+    printf("  test_invalidation...");
+    static const char src[] =
+        ".a {} .b p {} .c + li {} .d ~ ul li {} #x * {} "
+        "[data-role] > ul {} li:nth-last-child(1 of .e) {} "
+        ":is(.f, .g) .h {} :not(.i) {} .b .item.first {}";
+    css_stylesheet *sheet = css_parse_stylesheet(src, strlen(src));
+    css_invalidation_index *index = css_invalidation_index_build(sheet);
+    assert(index);
+
+    const css_invalidation_set *set = css_invalidation_for_class(index, "a");
+    assert(set && set->flags == CSS_INVALIDATE_SELF && set->key_count == 0);
+    set = css_invalidation_for_class(index, "b");
+    assert(set && set->flags == CSS_INVALIDATE_DESCENDANTS);
+    assert(!set->any_element && set->key_count == 2);
+    assert(set->keys[0].kind == CSS_INVALIDATION_CLASS &&
+           strcmp(set->keys[0].name, "item") == 0);
+    assert(set->keys[1].kind == CSS_INVALIDATION_TAG &&
+           strcmp(set->keys[1].name, "p") == 0);
+    set = css_invalidation_for_class(index, "c");
+    assert(set && set->flags == CSS_INVALIDATE_SIBLINGS);
+    set = css_invalidation_for_class(index, "d");
+    assert(set && set->flags == CSS_INVALIDATE_SIBLING_DESCENDANTS);
+    set = css_invalidation_for_id(index, "x");
+    assert(set && set->flags == CSS_INVALIDATE_DESCENDANTS &&
+           set->any_element);
+    set = css_invalidation_for_attribute(index, "DATA-ROLE");
+    assert(set && set->flags == CSS_INVALIDATE_DESCENDANTS);
+    set = css_invalidation_for_class(index, "e");
+    assert(set && set->flags == (CSS_INVALIDATE_SELF |
+                                 CSS_INVALIDATE_PARENT_SUBTREE));
+    set = css_invalidation_for_class(index, "g");
+    assert(set && set->flags == CSS_INVALIDATE_DESCENDANTS);
+    set = css_invalidation_for_class(index, "i");
+    assert(set && set->flags == CSS_INVALIDATE_SELF);
+    set = css_invalidation_for_class(index, "h");
+    assert(set && set->flags == CSS_INVALIDATE_SELF);
+    assert(!css_invalidation_for_class(index, "zzz"));
+    assert(!css_invalidation_for_id(index, "a"));
+
+    /* Swapping .b for .c: descendants with .item or <p>, later <li>s */
+    css_invalidation inv = { 0 };
+    const char *before[] = { "a", "b" };
+    const char *after[] = { "c", "a" };
+    css_invalidation_add_class_change(index, before, 2, after, 2, &inv);
+    assert(inv.count == 2);
+    assert(inv.flags == (CSS_INVALIDATE_DESCENDANTS |
+                         CSS_INVALIDATE_SIBLINGS));
+    assert(css_invalidation_affects(&inv, &adapter, &li2));
+    assert(css_invalidation_affects(&inv, &adapter, &p1));
+    assert(!css_invalidation_affects(&inv, &adapter, &ul));
+    assert(!css_invalidation_affects(&inv, &adapter, &a));
+
+    /* Unchanged classes touch nothing */
+    css_invalidation_reset(&inv);
+    css_invalidation_add_class_change(index, before, 2, before, 2, &inv);
+    assert(inv.count == 0 && inv.flags == 0);
+
+    css_invalidation_reset(&inv);
+    css_invalidation_add_id_change(index, NULL, "x", &inv);
+    assert(inv.flags == CSS_INVALIDATE_DESCENDANTS);
+    assert(css_invalidation_affects(&inv, &adapter, &a));
+    css_invalidation_reset(&inv);
+    css_invalidation_add_attribute_change(index, "data-role", &inv);
+    assert(css_invalidation_affects(&inv, &adapter, &ul));
+    assert(!css_invalidation_affects(&inv, &adapter, &li1));
+    css_invalidation_free(&inv);
+
+    css_invalidation_index_free(index);
+    css_stylesheet_free(sheet);
+
+    /* Selectors inside @media / @supports / @layer count, whatever the
+     * condition; keyframe rules do not */
+    static const char nested[] =
+        "@media (max-width: 10px) { .m p {} @supports (x) { .s + li {} } }"
+        " @layer base { #l {} } @keyframes k { from {} }";
+    sheet = css_parse_stylesheet(nested, strlen(nested));
+    index = css_invalidation_index_build(sheet);
+    assert(index);
+    set = css_invalidation_for_class(index, "m");
+    assert(set && set->flags == CSS_INVALIDATE_DESCENDANTS &&
+           set->key_count == 1);
+    set = css_invalidation_for_class(index, "s");
+    assert(set && set->flags == CSS_INVALIDATE_SIBLINGS);
+    set = css_invalidation_for_id(index, "l");
+    assert(set && set->flags == CSS_INVALIDATE_SELF);
+
+    css_invalidation_reset(&inv);
+    const char *none[] = { NULL };
+    const char *m[] = { "m" };
+    css_invalidation_add_class_change(index, none, 0, m, 1, &inv);
+    assert(inv.flags == CSS_INVALIDATE_DESCENDANTS);
+    assert(css_invalidation_affects(&inv, &adapter, &p1));
+    assert(!css_invalidation_affects(&inv, &adapter, &li1));
+    css_invalidation_free(&inv);
+    css_invalidation_index_free(index);
+    css_stylesheet_free(sheet);
+    printf(" OK\n");
+}
+
+/* Sharing must give exactly what full matching gives */
+static void check_shared(css_style_sharing_cache *cache,
+                         const css_rule_index *index, const node *n)
+{
+    css_rule_matches shared = { 0 }, full = { 0 };
+    css_style_sharing_match(cache, &adapter, n, NULL, &shared);
+    css_rule_index_match(index, &adapter, n, &full);
+    assert(shared.count == full.count);
+    for (size_t i = 0; i < full.count; i++) {
+        assert(shared.entries[i] == full.entries[i]);
+    }
+    css_rule_matches_free(&shared);
+    css_rule_matches_free(&full);
+}
+
+static void test_style_sharing(void)
+{
+    printf("  test_style_sharing...");
+    /* <ol> of six items: the third has a title, the fourth is hovered,
+     * the fifth lists its classes in another order */
+    node ol = { "ol", NULL, {0}, 0, {{0}}, 0, false, &body, 0, 0 };
+    node items[6];
+    node *children[6];
+    for (size_t i = 0; i < 6; i++) {
+        node item = { "li", NULL, {"item", "row"}, 2, {{0}}, 0, false,
+                      0, 0, 0 };
+        items[i] = item;
+        children[i] = &items[i];
+    }
+    items[2].attrs[0][0] = "title";
+    items[2].attrs[0][1] = "x";
+    items[2].attr_count = 1;
+    items[3].hover = true;
+    items[4].classes[0] = "row";
+    items[4].classes[1] = "item";
+    set_children(&ol, children, 6);
+
+    /* Nothing positional, no attribute or state: every item shares */
+    static const char plain[] = "li {} .item {} ol > .row {} .page li {}";
+    css_stylesheet *sheet = css_parse_stylesheet(plain, strlen(plain));
+    css_rule_index *index = css_rule_index_build(sheet);
+    css_style_sharing_cache *cache = css_style_sharing_cache_create(index);
+    assert(cache);
+    for (size_t i = 0; i < 6; i++) check_shared(cache, index, &items[i]);
+    size_t hits, misses;
+    css_style_sharing_stats(cache, &hits, &misses);
+    assert(hits == 5 && misses == 1);
+
+    /* Other parent, tag or classes: no sharing */
+    check_shared(cache, index, &li2);
+    check_shared(cache, index, &p1);
+    check_shared(cache, index, &p2);
+    css_style_sharing_stats(cache, &hits, &misses);
+    assert(hits == 5 && misses == 4);
+
+    /* Elements with an id are never cached */
+    css_style_sharing_cache_clear(cache);
+    check_shared(cache, index, &div_);
+    check_shared(cache, index, &div_);
+    css_style_sharing_stats(cache, &hits, &misses);
+    assert(hits == 5 && misses == 6);
+    css_style_sharing_cache_free(cache);
+    css_rule_index_free(index);
+    css_stylesheet_free(sheet);
+
+    /* Attributes, states and positions named by the selectors */
+    static const char src[] =
+        "li {} .item {} li:first-child {} li + li.item {} [title] {} "
+        "li:hover {} ol li:nth-child(2n) {} :not(li:first-child) {} "
+        ".page li {}";
+    sheet = css_parse_stylesheet(src, strlen(src));
+    index = css_rule_index_build(sheet);
+    cache = css_style_sharing_cache_create(index);
+    assert(cache);
+    for (size_t i = 0; i < 6; i++) check_shared(cache, index, &items[i]);
+    /* only the sixth item matches like an earlier one (the second) */
+    css_style_sharing_stats(cache, &hits, &misses);
+    assert(hits == 1 && misses == 5);
+
+    /* The explicit interface */
+    css_rule_matches out = { 0 };
+    css_style_sharing_cache_clear(cache);
+    bool found = css_style_sharing_lookup(cache, &adapter, &items[1], &out);
+    assert(!found);
+    css_rule_index_match(index, &adapter, &items[1], &out);
+    size_t count = out.count;
+    css_style_sharing_insert(cache, &adapter, &items[1], &out);
+    out.count = 0;
+    found = css_style_sharing_lookup(cache, &adapter, &items[5], &out);
+    assert(found && out.count == count);
+    found = css_style_sharing_lookup(cache, &adapter, &items[3], &out);
+    assert(!found);
+    css_rule_matches_free(&out);
+    css_style_sharing_cache_free(cache);
+    css_rule_index_free(index);
+    css_stylesheet_free(sheet);
+    printf(" OK\n");
+}
+
+/* A generated document for the parallel driver: nodes[0] is the root,
+ * first[i] the first child of nodes[i] */
+#define PARALLEL_NODES 4000
+
+typedef struct {
+    node *nodes;
+    node **first;
+    size_t *counts;             /* matches seen per node */
+    size_t *sums;               /* sum of matched entry orders */
+    size_t *visits;
+} parallel_doc;
+
+static const void *doc_first_child(void *ctx, const void *el)
+{
+    const parallel_doc *doc = ctx;
+    return doc->first[(const node *)el - doc->nodes];
+}
+
+static void doc_visit(void *user, const void *el,
+                      const css_rule_matches *matches)
+{
+    parallel_doc *doc = user;
+    size_t i = (size_t)((const node *)el - doc->nodes);
+    size_t sum = 0;
+    for (size_t k = 0; k < matches->count; k++) {
+        sum += matches->entries[k]->order + 1;
+    }
+    doc->counts[i] = matches->count;
+    doc->sums[i] = sum;
+    doc->visits[i]++;
+}
+
+static void test_parallel(void)
+{
+    printf("  test_parallel...");
+    static const char *const tags[] = { "div", "ul", "li", "p", "a" };
+    static const char *const names[] = { "item", "row", "nav", "note" };
+    parallel_doc doc;
+    doc.nodes = calloc(PARALLEL_NODES, sizeof(node));
+    doc.first = calloc(PARALLEL_NODES, sizeof(node *));
+    doc.counts = calloc(PARALLEL_NODES, sizeof(size_t));
+    doc.sums = calloc(PARALLEL_NODES, sizeof(size_t));
+    doc.visits = calloc(PARALLEL_NODES, sizeof(size_t));
+    assert(doc.nodes && doc.first && doc.counts && doc.sums && doc.visits);
+
+    /* Node i > 0 hangs under node (i - 1) / 8: wide and a few levels
+     * deep, with runs of similar siblings */
+    node *last[PARALLEL_NODES / 8 + 1] = { 0 };
+    for (size_t i = 0; i < PARALLEL_NODES; i++) {
+        node *n = &doc.nodes[i];
+        n->tag = i == 0 ? "html" : tags[(i / 8) % 5];
+        n->classes[0] = names[(i / 4) % 4];
+        n->class_count = i % 7 == 0 ? 0 : 1;
+        if (i % 11 == 0) {
+            n->attrs[0][0] = "title";
+            n->attrs[0][1] = "t";
+            n->attr_count = 1;
+        }
+        n->hover = i % 13 == 0;
+        if (i == 0) continue;
+        node *parent = &doc.nodes[(i - 1) / 8];
+        n->parent = parent;
+        node *prev = last[(i - 1) / 8];
+        if (prev) {
+            prev->next = n;
+            n->prev = prev;
+        } else {
+            doc.first[(i - 1) / 8] = n;
+        }
+        last[(i - 1) / 8] = n;
+    }
+
+    static const char src[] =
+        "li {} .item {} ul > li.row {} div .nav a {} li:first-child {} "
+        "p + p {} [title] {} a:hover {} li:nth-child(2n+1) {} "
+        ":is(ul, div) > .note {} :not(.row) p {} html li a.item {}";
+    css_stylesheet *sheet = css_parse_stylesheet(src, strlen(src));
+    css_rule_index *index = css_rule_index_build(sheet);
+    assert(index);
+
+    size_t *expected_counts = calloc(PARALLEL_NODES, sizeof(size_t));
+    size_t *expected_sums = calloc(PARALLEL_NODES, sizeof(size_t));
+    assert(expected_counts && expected_sums);
+    css_rule_matches out = { 0 };
+    for (size_t i = 0; i < PARALLEL_NODES; i++) {
+        css_rule_index_match(index, &adapter, &doc.nodes[i], &out);
+        expected_counts[i] = out.count;
+        for (size_t k = 0; k < out.count; k++) {
+            expected_sums[i] += out.entries[k]->order + 1;
+        }
+    }
+    css_rule_matches_free(&out);
+
+    css_element_adapter doc_adapter = adapter;
+    doc_adapter.ctx = &doc;
+    css_parallel_options opts = { 0, doc_first_child, doc_visit, &doc };
+    static const size_t worker_counts[] = { 1, 4, 0 };
+    for (size_t w = 0; w < 3; w++) {
+        memset(doc.visits, 0, PARALLEL_NODES * sizeof(size_t));
+        opts.workers = worker_counts[w];
+        css_parallel_stats stats;
+        bool ok = css_parallel_match(index, &doc_adapter, &doc.nodes[0],
+                                     &opts, &stats);
+        assert(ok);
+        assert(stats.elements == PARALLEL_NODES);
+        assert(stats.workers >= 1);
+        if (worker_counts[w] == 1) assert(stats.steals == 0);
+        assert(stats.shared > 0);
+        for (size_t i = 0; i < PARALLEL_NODES; i++) {
+            assert(doc.visits[i] == 1);
+            assert(doc.counts[i] == expected_counts[i]);
+            assert(doc.sums[i] == expected_sums[i]);
+        }
+    }
+
+    /* Incomplete options are refused */
+    opts.first_child = NULL;
+    bool ok = css_parallel_match(index, &doc_adapter, &doc.nodes[0], &opts,
+                                 NULL);
+    assert(!ok);
+
+    free(expected_counts);
+    free(expected_sums);
+    css_rule_index_free(index);
+    css_stylesheet_free(sheet);
+    free(doc.nodes);
+    free(doc.first);
+    free(doc.counts);
+    free(doc.sums);
+    free(doc.visits);
+    printf(" OK\n");
+}
+
+/* An allocator counting live blocks, shared by all threads */
+static atomic_long live_blocks;
+
+static void *live_malloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    void *p = malloc(size);
+    if (p) atomic_fetch_add(&live_blocks, 1);
+    return p;
+}
+
+static void *live_realloc(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    void *p = realloc(ptr, size);
+    if (p && !ptr) atomic_fetch_add(&live_blocks, 1);
+    return p;
+}
+
+static void live_free(void *ctx, void *ptr)
+{
+    (void)ctx;
+    atomic_fetch_sub(&live_blocks, 1);
+    free(ptr);
+}
+
+/* Indexes, caches and match results live in the allocator current when
+ * they were made, and root objects free themselves through it */
+static void test_derived_allocator(void)
+{
+    printf("  test_derived_allocator...");
+    static const css_allocator live = {
+        live_malloc, live_realloc, live_free, NULL
+    };
+    const char *src =
+        "li { } .item { } ul > li.item { } #main .nav a { } "
+        "li:first-child { } li + li { } [title] { } a:hover { } "
+        "@media print { .note { } }";
+
+    const css_allocator *prev = css_allocator_use(&live);
+    css_stylesheet *sheet = css_parse_stylesheet(src, strlen(src));
+    long parsed = atomic_load(&live_blocks);
+    assert(sheet && parsed > 0);
+    css_rule_index *index = css_rule_index_build(sheet);
+    css_invalidation_index *inv_index = css_invalidation_index_build(sheet);
+    css_style_sharing_cache *sharing = css_style_sharing_cache_create(index);
+    css_sibling_cache *siblings = css_sibling_cache_create();
+    assert(index && inv_index && sharing && siblings);
+    css_element_adapter cached = adapter;
+    cached.sibling_cache = siblings;
+    css_rule_matches out = { NULL, 0, 0 };
+    node *items[] = { &li1, &li2, &li3, &a, &p1 };
+    for (size_t i = 0; i < 5; i++) {
+        css_style_sharing_match(sharing, &cached, items[i], NULL, &out);
+    }
+    css_invalidation inv = { 0 };
+    const char *classes[] = { "item" };
+    css_invalidation_add_class_change(inv_index, NULL, 0, classes, 1, &inv);
+    assert(inv.count > 0);
+    assert(atomic_load(&live_blocks) > parsed);
+
+    css_rule_matches_free(&out);
+    css_invalidation_free(&inv);
+    css_allocator_use(prev);
+
+    /* Root objects go back to their allocator on their own */
+    css_sibling_cache_free(siblings);
+    css_style_sharing_cache_free(sharing);
+    css_invalidation_index_free(inv_index);
+    css_rule_index_free(index);
+    css_stylesheet_free(sheet);
+    assert(atomic_load(&live_blocks) == 0);
+    printf(" OK\n");
+}
+
+/* css_declaration_list_dump() into a stream with a descriptor and
+ * into one without (open_memstream) writes the same text */
+static void test_dump_streams(void)
+{
+    printf("  test_dump_streams...");
+    static const char src[] = "color: red; margin: 0 auto !important";
+    css_declaration_list *list =
+        css_parse_declaration_list(src, strlen(src));
+    FILE *file = tmpfile();
+    assert(file);
+    fputs("before\n", file);
+    css_declaration_list_dump(list, file);
+    long file_size = ftell(file);
+    assert(file_size > 0);
+    char *expected = malloc((size_t)file_size);
+    rewind(file);
+    size_t nread = fread(expected, 1, (size_t)file_size, file);
+    assert(nread == (size_t)file_size);
+    fclose(file);
+
+    char *text = NULL;
+    size_t size = 0;
+    FILE *mem = open_memstream(&text, &size);
+    assert(mem);
+    fputs("before\n", mem);
+    css_declaration_list_dump(list, mem);
+    fclose(mem);
+    assert(size == (size_t)file_size);
+    assert(memcmp(text, expected, size) == 0);
+    free(text);
+    free(expected);
+    css_declaration_list_free(list);
+    printf(" OK\n");
+}
+
+int main(void)
+{
+    printf("=== Selector matching tests ===\n");
+    build_document();
+    test_simple();
+    test_combinators();
+    test_attributes();
+    test_pseudo();
+    test_nth();
+    test_functional();
+    test_selector_list();
+    test_specificity();
+    test_program();
+    test_rule_index();
+    test_prelude_forms();
+    test_lazy_selectors();
+    test_dump_streams();
+    test_reused_parser_dedup();
+    test_bloom();
+    test_invalidation();
+    test_style_sharing();
+    test_parallel();
+    test_derived_allocator();
+    printf("=== All selector matching tests passed ===\n");
+    return 0;
+}